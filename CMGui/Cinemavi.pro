@@ -23,17 +23,27 @@ linux {
 }
 
 SOURCES += \
+    ../ae_controller.c \
     ../auto_exposure.c \
     ../cm_calibrations.c \
     ../cm_camera_helper.c \
+    ../cm_frame_writer.c \
+    ../cm_parallel.c \
     ../cmraw.c \
+    ../cmraw_codec.c \
+    ../cmv.c \
     ../colour_xfrm.c \
     ../convolve.c \
     ../debayer.c \
     ../dng.cpp \
+    ../focus.c \
     ../gamma.c \
+    ../hdr_merge.c \
+    ../lj92.c \
+    ../lut3d.c \
     ../noise_reduction.c \
     ../pipeline.c \
+    ../tone_map.c \
     cmautoexposure.cpp \
     cmcameracontrols.cpp \
     cmcamerainterface.cpp \
@@ -49,19 +59,29 @@ SOURCES += \
     mainwindow.cpp
 
 HEADERS += \
+    ../ae_controller.h \
     ../auto_exposure.h \
     ../cie_xyz.h \
     ../cm_calibrations.h \
     ../cm_camera_helper.h \
+    ../cm_frame_writer.h \
+    ../cm_parallel.h \
     ../cmraw.h \
+    ../cmraw_codec.h \
+    ../cmv.h \
     ../colour_xfrm.h \
     ../convolve.h \
     ../debayer.h \
     ../dng.h \
+    ../focus.h \
     ../gamma.h \
+    ../hdr_merge.h \
+    ../lj92.h \
+    ../lut3d.h \
     ../noise_reduction.h \
     ../pipeline.h \
     ../tiny_dng_writer.h \
+    ../tone_map.h \
     ../ycbcr.h \
     ../ycrcg.h \
     cmautoexposure.h \
@@ -70,6 +90,7 @@ HEADERS += \
     cmcontrolswidget.h \
     cmnumberslider.h \
     cmpicturelabel.h \
+    cmpipelineparams.h \
     cmrawimage.h \
     cmrawinfowidget.h \
     cmrenderqueue.h \
@@ -1,7 +1,11 @@
 #include "cmautoexposure.h"
+#include <QMutexLocker>
 
 CMAutoExposure::CMAutoExposure()
 {
+    // typical frames in flight, until measured
+    ae_controller_init(&this->controller, 2);
+
     // run workLoop in its own thread
     this->moveToThread(&workThread);
     connect(&workThread, &QThread::started, this, &CMAutoExposure::workLoop);
@@ -16,18 +20,35 @@ CMAutoExposure::~CMAutoExposure()
     this->workThread.wait();
 }
 
-void CMAutoExposure::setParams(const ImagePipelineParams &params)
+void CMAutoExposure::setParams(const CMPipelineParams &params)
 {
+    QMutexLocker locker(&this->paramsMutex);
     this->plParams = params;
 }
 
-void CMAutoExposure::setImage(const CMRawImage &img)
+void CMAutoExposure::setMetering(const CMMeteringParams &metering)
+{
+    QMutexLocker locker(&this->paramsMutex);
+    this->meteringParams = metering;
+}
+
+unsigned int CMAutoExposure::latency()
 {
-    this->delayCounter++;
-    if (this->delayCounter >= this->delayFrames && !this->calculating) {
-        this->delayCounter = 0;
+    QMutexLocker locker(&this->controllerMutex);
+    return this->controller.latency;
+}
+
+void CMAutoExposure::setImage(const CMRawImage &img, bool measure)
+{
+    const CMCaptureInfo &cinfo = img.getCaptureInfo();
+    QMutexLocker locker(&this->controllerMutex);
+    uint32_t frame = ae_controller_frame(&this->controller, cinfo.shutter_us, cinfo.gain_dB);
+    locker.unlock();
+
+    if (measure && !this->calculating) {
         this->calculating = true;
         this->rawImg = img;
+        this->rawFrame = frame;
         this->workSem.release();
     }
 }
@@ -37,13 +58,21 @@ void CMAutoExposure::workLoop()
     while (!this->done) {
         this->workSem.acquire();
         if (this->done) break;
+        QMutexLocker paramsLocker(&this->paramsMutex);
+        CMPipelineParams params = this->plParams;
+        CMMeteringParams metering = this->meteringParams;
+        paramsLocker.unlock();
+
         double changeFactor;
         int status = pipeline_auto_exposure(this->rawImg.getRaw(),
-                &this->rawImg.getCaptureInfo(), &this->plParams, &changeFactor);
-        this->calculating = false;
+                &this->rawImg.getCaptureInfo(), &params.params, &metering, &changeFactor);
         if (!status) {
-            changeFactor = (1 - this->filterFactor)*changeFactor + this->filterFactor;
-            emit exposureChangeCalculated(changeFactor);
+            QMutexLocker locker(&this->controllerMutex);
+            double target = ae_controller_measure(&this->controller, this->rawFrame, changeFactor);
+            locker.unlock();
+            if (target > 0)
+                emit exposureTargetCalculated(target);
         }
+        this->calculating = false;
     }
 }
@@ -4,8 +4,10 @@
 #include <QObject>
 #include <QThread>
 #include <QSemaphore>
+#include <QMutex>
 #include "cmrawimage.h"
-#include "../pipeline.h"
+#include "cmpipelineparams.h"
+#include "../ae_controller.h"
 
 typedef enum {
     CMEXP_AUTO,
@@ -20,13 +22,18 @@ class CMAutoExposure : public QObject
 public:
     explicit CMAutoExposure();
     ~CMAutoExposure();
-    void setParams(const ImagePipelineParams &params);
+    void setParams(const CMPipelineParams &params);
+    void setMetering(const CMMeteringParams &metering);
+    // frames captured between requesting an exposure and the first frame with it, as measured
+    unsigned int latency();
 
 public slots:
-    void setImage(const CMRawImage &img);
+    // every captured frame should be given, even when not measured, so latency can be tracked
+    void setImage(const CMRawImage &img, bool measure = true);
 
 signals:
-    void exposureChangeCalculated(double changeFactor);
+    // target is shutter in microseconds times linear gain
+    void exposureTargetCalculated(double target);
 
 private slots:
     void workLoop();
@@ -35,13 +42,15 @@ private:
     QThread workThread;
     QSemaphore workSem;
     CMRawImage rawImg;
-    ImagePipelineParams plParams;
+    uint32_t rawFrame = 0;
+    QMutex controllerMutex;
+    CMAEController controller;
+    // set from the GUI thread, copied by workLoop for each measurement
+    QMutex paramsMutex;
+    CMPipelineParams plParams;
+    CMMeteringParams meteringParams = {CMMETER_AVERAGE, UINT16_MAX, UINT16_MAX};
     volatile bool calculating = false;
     volatile bool done = false;
-    unsigned delayCounter = 0;
-
-    const double delayFrames = 2;
-    const double filterFactor = 0.5;
 };
 
 #endif // CMAUTOEXPOSURE_H
@@ -14,12 +14,20 @@ CMCameraControls::CMCameraControls(QWidget *parent)
     QVBoxLayout *cvl = new QVBoxLayout(this);
 
     QGroupBox *exposureGroup = new QGroupBox(tr("Exposure"), this);
+    QGroupBox *focusGroup = new QGroupBox(tr("Focus"), this);
     QGroupBox *captureGroup = new QGroupBox(tr("Capture"), this);
     this->shootButton = new QPushButton(tr("Shoot"), this);
+    this->recordButton = new QPushButton(tr("Record"), this);
+    this->recordButton->setCheckable(true);
+    this->recordButton->setToolTip(tr("Record raw video to a .cmv file in the capture path"));
 
     cvl->addWidget(exposureGroup);
+    cvl->addWidget(focusGroup);
     cvl->addWidget(captureGroup);
-    cvl->addWidget(shootButton);
+    QHBoxLayout *shootLayout = new QHBoxLayout();
+    shootLayout->addWidget(shootButton, 1);
+    shootLayout->addWidget(recordButton, 1);
+    cvl->addLayout(shootLayout);
 
     QGridLayout *egl = new QGridLayout(exposureGroup);
     egl->setColumnMinimumWidth(0, 60);
@@ -42,6 +50,49 @@ CMCameraControls::CMCameraControls(QWidget *parent)
     this->gainSlider->setMinMax(1, 48);
     egl->addWidget(gainLabel, 2, 0);
     egl->addWidget(gainSlider, 2, 1);
+    QLabel *hdrLabel = new QLabel(tr("HDR"), exposureGroup);
+    this->hdrSelector = new QComboBox(exposureGroup);
+    this->hdrSelector->addItem(tr("Off"));
+    this->hdrSelector->addItem(tr("3 frames, ±1 EV"));
+    this->hdrSelector->addItem(tr("3 frames, ±2 EV"));
+    egl->addWidget(hdrLabel, 3, 0);
+    egl->addWidget(hdrSelector, 3, 1);
+    QLabel *meteringLabel = new QLabel(tr("Metering"), exposureGroup);
+    this->meteringSelector = new QComboBox(exposureGroup);
+    this->meteringSelector->addItem(tr("Average"), CMMETER_AVERAGE);
+    this->meteringSelector->addItem(tr("Centre Weighted"), CMMETER_CENTRE);
+    this->meteringSelector->addItem(tr("Spot"), CMMETER_SPOT);
+    this->meteringSelector->addItem(tr("Matrix"), CMMETER_MATRIX);
+    this->meteringSelector->setToolTip(tr("In spot mode, click the picture to choose the spot"));
+    egl->addWidget(meteringLabel, 4, 0);
+    egl->addWidget(meteringSelector, 4, 1);
+
+    QGridLayout *fgl = new QGridLayout(focusGroup);
+    fgl->setColumnMinimumWidth(0, 60);
+    fgl->setColumnStretch(1, 1);
+    QLabel *sharpnessLabel = new QLabel(tr("Sharpness"), focusGroup);
+    this->focusBar = new QProgressBar(focusGroup);
+    this->focusBar->setRange(0, 100);
+    this->focusBar->setValue(0);
+    this->focusBar->setFormat(tr("%p% of peak"));
+    this->focusValue = new QLabel(focusGroup);
+    this->focusValue->setMinimumWidth(50);
+    this->focusValue->setAlignment(Qt::AlignRight | Qt::AlignVCenter);
+    QPushButton *focusResetButton = new QPushButton(tr("Reset"), focusGroup);
+    focusResetButton->setToolTip(tr("Forget the peak sharpness, e.g. after the scene changes"));
+    QHBoxLayout *focusBarLayout = new QHBoxLayout();
+    focusBarLayout->addWidget(focusBar, 1);
+    focusBarLayout->addWidget(focusValue);
+    focusBarLayout->addWidget(focusResetButton);
+    fgl->addWidget(sharpnessLabel, 0, 0);
+    fgl->addLayout(focusBarLayout, 0, 1);
+    QLabel *focusAreaLabel = new QLabel(tr("Area"), focusGroup);
+    this->focusAreaSelector = new QComboBox(focusGroup);
+    this->focusAreaSelector->addItem(tr("Centre"));
+    this->focusAreaSelector->addItem(tr("Picked Point"));
+    this->focusAreaSelector->setToolTip(tr("With a picked point, click the picture to choose it"));
+    fgl->addWidget(focusAreaLabel, 1, 0);
+    fgl->addWidget(focusAreaSelector, 1, 1);
 
     QGridLayout *cgl = new QGridLayout(captureGroup);
     cgl->setColumnMinimumWidth(0, 60);
@@ -52,6 +103,8 @@ CMCameraControls::CMCameraControls(QWidget *parent)
     this->formatSelector->addItem(tr("DNG"), CMCAP_DNG);
     this->formatSelector->addItem(tr("TIFF"), CMCAP_TIFF);
     this->formatSelector->addItem(tr("JPEG"), CMCAP_JPEG);
+    this->formatSelector->addItem(tr("TIFF (16-bit)"), CMCAP_TIFF16);
+    this->formatSelector->addItem(tr("CMRAW (compressed)"), CMCAP_CMRAW_COMPRESSED);
     cgl->addWidget(formatLabel, 0, 0);
     cgl->addWidget(formatSelector, 0, 1);
     QLabel *pathLabel = new QLabel(tr("Path"), captureGroup);
@@ -66,9 +119,14 @@ CMCameraControls::CMCameraControls(QWidget *parent)
     pathLineLayout->addWidget(pathEditButton);
 
     connect(this->shootButton, &QPushButton::clicked, this, &CMCameraControls::onShoot);
+    connect(this->recordButton, &QPushButton::toggled, this, &CMCameraControls::recordToggled);
     connect(this->shutterSlider, &CMNumberSlider::valueChanged, this, &CMCameraControls::onShutterChanged);
     connect(this->gainSlider, &CMNumberSlider::valueChanged, this, &CMCameraControls::onGainChanged);
     connect(this->expModeSelector, &QComboBox::currentIndexChanged, this, &CMCameraControls::onExpModeChanged);
+    connect(this->hdrSelector, &QComboBox::currentIndexChanged, this, &CMCameraControls::onHDRChanged);
+    connect(this->meteringSelector, &QComboBox::currentIndexChanged, this, &CMCameraControls::onMeteringChanged);
+    connect(this->focusAreaSelector, &QComboBox::currentIndexChanged, this, &CMCameraControls::onFocusAreaChanged);
+    connect(focusResetButton, &QPushButton::clicked, this, &CMCameraControls::resetFocusPeak);
     connect(pathEditButton, &QPushButton::clicked, this, &CMCameraControls::onChoosePath);
 }
 
@@ -134,6 +192,46 @@ void CMCameraControls::onGainChanged(double val)
         emit exposureChanged(expMode, this->shutterSlider->value() * 1000, val);
 }
 
+void CMCameraControls::onHDRChanged(int index)
+{
+    switch (index) {
+    case 1:
+        emit bracketChanged(3, 1);
+        break;
+    case 2:
+        emit bracketChanged(3, 2);
+        break;
+    default:
+        emit bracketChanged(1, 0);
+    }
+}
+
+void CMCameraControls::onMeteringChanged(int index)
+{
+    emit meteringChanged((CMMeteringMode)index);
+}
+
+void CMCameraControls::onFocusAreaChanged(int index)
+{
+    this->resetFocusPeak();
+    emit focusAreaChanged(index == 1);
+}
+
+void CMCameraControls::setFocusMetric(double metric)
+{
+    if (metric > this->focusPeak)
+        this->focusPeak = metric;
+    this->focusBar->setValue(this->focusPeak > 0 ? 100 * metric / this->focusPeak : 0);
+    // scaled to a readable number, only comparisons between frames mean anything
+    this->focusValue->setText(QString::number(metric * 1000, 'f', 1));
+}
+
+void CMCameraControls::resetFocusPeak()
+{
+    this->focusPeak = 0;
+    this->focusBar->setValue(0);
+}
+
 void CMCameraControls::onChoosePath()
 {
     QString dirName = QFileDialog::getExistingDirectory(this, tr("Select Directory"),
@@ -172,3 +270,18 @@ CMExposureMode CMCameraControls::exposureMode()
 {
     return (CMExposureMode)this->expModeSelector->currentIndex();
 }
+
+void CMCameraControls::setRecording(bool recording)
+{
+    this->recordButton->setChecked(recording);
+}
+
+bool CMCameraControls::focusPointPicked()
+{
+    return this->focusAreaSelector->currentIndex() == 1;
+}
+
+CMMeteringMode CMCameraControls::meteringMode()
+{
+    return (CMMeteringMode)this->meteringSelector->currentIndex();
+}
@@ -5,6 +5,8 @@
 #include <QComboBox>
 #include <QPushButton>
 #include <QLineEdit>
+#include <QLabel>
+#include <QProgressBar>
 #include "cmnumberslider.h"
 #include "cmautoexposure.h"
 #include "../auto_exposure.h"
@@ -13,7 +15,9 @@ typedef enum {
     CMCAP_CMRAW,
     CMCAP_DNG,
     CMCAP_TIFF,
-    CMCAP_JPEG
+    CMCAP_JPEG,
+    CMCAP_TIFF16,
+    CMCAP_CMRAW_COMPRESSED
 } CMCaptureFormat;
 
 class CMCameraControls : public QWidget
@@ -28,13 +32,23 @@ public:
     void setGain(double gain_dB);
     void setExposureLimits(ExposureLimits &limits);
     CMExposureMode exposureMode();
+    CMMeteringMode meteringMode();
     double getShutter();
     double getGain();
+    bool focusPointPicked();
+    // unchecking the record button emits recordToggled
+    void setRecording(bool recording);
 
 signals:
     // not emitted in auto modes for automatically controlled parameter changes
     void exposureChanged(CMExposureMode mode, double shutter_us, double gain_dB);
     void shootClicked();
+    void recordToggled(bool record);
+    // numFrames < 2 means no bracketing
+    void bracketChanged(unsigned int numFrames, double evStep);
+    void meteringChanged(CMMeteringMode mode);
+    // picked means the focus area follows clicks on the picture, otherwise it's centred
+    void focusAreaChanged(bool picked);
 
 public slots:
     void onShoot();
@@ -42,14 +56,27 @@ public slots:
     void onChoosePath();
     void onShutterChanged(double val);
     void onGainChanged(double val);
+    void onHDRChanged(int index);
+    void onMeteringChanged(int index);
+    void onFocusAreaChanged(int index);
+    // shows metric relative to the highest since the last reset
+    void setFocusMetric(double metric);
+    void resetFocusPeak();
 
 private:
     QComboBox *expModeSelector;
     CMNumberSlider *shutterSlider;
     CMNumberSlider *gainSlider;
+    QComboBox *hdrSelector;
+    QComboBox *meteringSelector;
+    QProgressBar *focusBar;
+    QLabel *focusValue;
+    QComboBox *focusAreaSelector;
+    double focusPeak = 0;
     QComboBox *formatSelector;
     QLineEdit *pathLine;
     QPushButton *shootButton;
+    QPushButton *recordButton;
 };
 
 #endif // CMCAMERACONTROLS_H
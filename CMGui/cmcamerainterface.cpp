@@ -1,7 +1,15 @@
 #include "cmcamerainterface.h"
 #include "../cm_camera_helper.h"
+#include "../hdr_merge.h"
+#include "../focus.h"
 #include <QMutexLocker>
+#include <cerrno>
 #include <cmath>
+#include <cstring>
+#include <vector>
+
+// frames waiting to be written while recording, enough to ride out a few slow disk writes
+static const size_t recordQueueBytes = 256 << 20;
 
 CMCameraInterface::CMCameraInterface()
 {
@@ -100,7 +108,9 @@ void CMCameraInterface::setExposure(double shutter_us, double gain_dB)
         gain_dB = this->expLimits.gain_min;
 
     GError *error = NULL;
-    cinemavi_camera_configure_exposure(this->camera, shutter_us, gain_dB, &error);
+    // while bracketing, the capture loop sets the exposure of each frame based on these
+    if (!this->bracketActive)
+        cinemavi_camera_configure_exposure(this->camera, shutter_us, gain_dB, &error);
     if (error)
         g_clear_object(&this->camera);
     else {
@@ -109,6 +119,136 @@ void CMCameraInterface::setExposure(double shutter_us, double gain_dB)
     }
 }
 
+void CMCameraInterface::setBracket(unsigned int numFrames, double evStep, unsigned int latency)
+{
+    QMutexLocker locker(&this->bracketMutex);
+    this->bracketFrames = numFrames;
+    this->bracketStep = evStep;
+    this->bracketLatency = latency;
+}
+
+void CMCameraInterface::getBracket(unsigned int *numFrames, double *evStep,
+        unsigned int *latency)
+{
+    QMutexLocker locker(&this->bracketMutex);
+    *numFrames = this->bracketFrames;
+    *evStep = this->bracketStep;
+    *latency = this->bracketLatency;
+}
+
+void CMCameraInterface::setFocusPoint(uint16_t posX, uint16_t posY)
+{
+    QMutexLocker locker(&this->focusMutex);
+    this->focusX = posX;
+    this->focusY = posY;
+}
+
+// cheap enough to run on every frame in the capture thread
+void CMCameraInterface::publishFocus(const CMRawImage &img)
+{
+    if (img.isEmpty())
+        return;
+
+    CMFocusROI roi;
+    {
+        QMutexLocker locker(&this->focusMutex);
+        focus_roi_at(&img.getCaptureInfo(), this->focusX, this->focusY, &roi);
+    }
+
+    double metric;
+    if (focus_metric_raw(img.getRaw(), &img.getCaptureInfo(), &roi, &metric) == 0)
+        emit focusMeasured(metric);
+}
+
+void CMCameraInterface::startRecording(const QString &fileName)
+{
+    QMutexLocker locker(&this->recordMutex);
+    if (this->recorder != NULL)
+        return;
+    this->recordFileName = fileName;
+    this->recordStatus = 0;
+}
+
+int CMCameraInterface::stopRecording(uint32_t *frames, uint32_t *dropped)
+{
+    *frames = 0;
+    *dropped = 0;
+
+    // close outside the lock, so the capture loop doesn't wait for the queue to be written
+    CMVideoWriter *writer;
+    int status;
+    {
+        QMutexLocker locker(&this->recordMutex);
+        writer = this->recorder;
+        status = this->recordStatus;
+        this->recorder = NULL;
+        this->recordFileName.clear();
+    }
+
+    if (writer != NULL) {
+        cmv_writer_stats(writer, frames, dropped);
+        int closeStatus = cmv_writer_close(writer);
+        if (!status)
+            status = closeStatus;
+    }
+    return status;
+}
+
+void CMCameraInterface::recordingStats(uint32_t *dropped, size_t *queuedBytes,
+        size_t *capacityBytes)
+{
+    *dropped = 0;
+    *queuedBytes = 0;
+    *capacityBytes = 0;
+
+    QMutexLocker locker(&this->recordMutex);
+    if (this->recorder != NULL) {
+        uint32_t frames;
+        cmv_writer_stats(this->recorder, &frames, dropped);
+        cmv_writer_queue(this->recorder, queuedBytes, capacityBytes);
+    }
+}
+
+void CMCameraInterface::recordFrame(ArvBuffer *buf, const void *raw, const CMRawHeader &cmrh)
+{
+    QMutexLocker locker(&this->recordMutex);
+    if (this->recordFileName.isEmpty() || this->recordStatus)
+        return;
+
+    if (this->recorder == NULL) {
+        this->recordStatus = cmv_writer_open(&this->recorder,
+                this->recordFileName.toLocal8Bit().constData(), &cmrh, recordQueueBytes);
+        if (this->recordStatus)
+            return;
+    }
+
+    // a full queue drops the frame, which the writer counts
+    int status = cmv_writer_add(this->recorder, raw, arv_buffer_get_system_timestamp(buf),
+            cmrh.cinfo.shutter_us, cmrh.cinfo.gain_dB);
+    if (status && status != -EAGAIN)
+        this->recordStatus = status;
+}
+
+// set the camera exposure for frame pos of a bracket, without changing the base exposure
+void CMCameraInterface::setBracketExposure(unsigned int pos, unsigned int numFrames,
+        double evStep)
+{
+    double ev = (pos - (numFrames - 1) * 0.5) * evStep;
+    double shutter_us = this->shutter * pow(2, ev);
+    if (shutter_us > this->expLimits.shutter_max)
+        shutter_us = this->expLimits.shutter_max;
+    else if (shutter_us < this->expLimits.shutter_min)
+        shutter_us = this->expLimits.shutter_min;
+
+    // errors are left for the next setExposure call to deal with, rather than dropping the
+    // camera from the capture thread
+    GError *error = NULL;
+    cinemavi_camera_configure_exposure(this->camera, shutter_us, this->gain, &error);
+    g_clear_error(&error);
+    this->bracketShutter = shutter_us;
+    this->bracketGain = this->gain;
+}
+
 void CMCameraInterface::getExposure(double *shutter_us, double *gain_dB)
 {
     *shutter_us = this->shutter;
@@ -186,24 +326,100 @@ void CMCameraInterface::stopCapture()
 
 void CMCameraInterface::captureLoop()
 {
+    CMHDRMerge merge;
+    memset(&merge, 0, sizeof(merge));
+    std::vector<uint16_t> merged;
+    unsigned int bracketPos = 0;
+    unsigned int skipFrames = 0;
+    // frames to drop after changing exposure within a bracket, since frames already being exposed
+    // or read out still have the previous exposure
+    unsigned int settleFrames = 0;
+
     while (this->capturing) {
         ArvBuffer *buf = arv_stream_timeout_pop_buffer(this->stream, 300000);
-        if (ARV_IS_BUFFER(buf)) {
-            CMRawHeader cmrh;
-            const void *raw = cinemavi_prepare_header(buf, &cmrh, this->cameraMake.c_str(),
-                    this->cameraModel.c_str(), this->shutter, this->gain);
+        if (!ARV_IS_BUFFER(buf))
+            break;
+
+        unsigned int numFrames;
+        double evStep;
+        unsigned int latency;
+        this->getBracket(&numFrames, &evStep, &latency);
+        if (numFrames < 2 && this->bracketActive) {
+            // back to normal capture at the base exposure
+            GError *error = NULL;
+            this->bracketActive = false;
+            cinemavi_camera_configure_exposure(this->camera, this->shutter, this->gain, &error);
+            g_clear_error(&error);
+            hdr_merge_free(&merge);
+        } else if (numFrames >= 2 && !this->bracketActive) {
+            // kept for the whole bracketing run, since auto exposure only sees merged frames
+            // while bracketing, so its latency then isn't in captured frames
+            this->bracketActive = true;
+            settleFrames = latency;
+            bracketPos = 0;
+            this->setBracketExposure(bracketPos, numFrames, evStep);
+            skipFrames = settleFrames;
+        }
+
+        if (skipFrames > 0) {
+            skipFrames--;
+            arv_stream_push_buffer(this->stream, buf);
+            continue;
+        }
 
+        CMRawHeader cmrh;
+        double frameShutter = this->bracketActive ? this->bracketShutter : this->shutter;
+        double frameGain = this->bracketActive ? this->bracketGain : this->gain;
+        const void *raw = cinemavi_prepare_header(buf, &cmrh, this->cameraMake.c_str(),
+                this->cameraModel.c_str(), frameShutter, frameGain);
+
+        if (!this->bracketActive || raw == NULL) {
             CMRawImage img;
             img.setImage(raw, cmrh);
+            if (raw != NULL)
+                this->recordFrame(buf, raw, cmrh);
 
             // reuse buffer
             arv_stream_push_buffer(this->stream, buf);
 
             // don't emit if capture was stopped while waiting for frame
-            if (this->capturing)
+            if (this->capturing) {
+                this->publishFocus(img);
                 emit imageCaptured(img);
-        } else break;
+            }
+            continue;
+        }
+
+        // accumulate the bracket as it's captured, so only the last frame's merge and the
+        // final scaling happen once the bracket is complete
+        const CMCaptureInfo &cinfo = cmrh.cinfo;
+        if (merge.acc == NULL || merge.width != cinfo.width || merge.height != cinfo.height) {
+            hdr_merge_free(&merge);
+            hdr_merge_init(&merge, cinfo.width, cinfo.height);
+            bracketPos = 0;
+        }
+        if (merge.acc != NULL && hdr_merge_add(&merge, raw, &cinfo) == 0)
+            bracketPos++;
+        arv_stream_push_buffer(this->stream, buf);
+
+        if (bracketPos >= numFrames) {
+            merged.resize(cinfo.width * cinfo.height);
+            hdr_merge_finish(&merge, merged.data(), &cmrh.cinfo);
+            bracketPos = 0;
+
+            CMRawImage img;
+            img.setImage(merged.data(), cmrh);
+            if (this->capturing) {
+                this->publishFocus(img);
+                emit imageCaptured(img);
+            }
+        }
+
+        this->setBracketExposure(bracketPos, numFrames, evStep);
+        skipFrames = settleFrames;
     }
+
+    hdr_merge_free(&merge);
 }
 
 const std::string & CMCameraInterface::getCameraMake()
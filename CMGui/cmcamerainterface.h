@@ -9,6 +9,7 @@
 #include "cmrawimage.h"
 #include "cmautoexposure.h"
 #include "../auto_exposure.h"
+#include "../cmv.h"
 
 class CMCameraInterface : public QObject
 {
@@ -22,6 +23,20 @@ public:
     void setExposure(double shutter_us, double gain_dB);
     void getExposure(double *shutter_us, double *gain_dB);
     void updateExposure(CMExposureMode expMode, double changeFactor);
+    // capture brackets of numFrames exposures evStep stops apart, centred on the set exposure,
+    // and emit them merged into single HDR frames, numFrames < 2 turns bracketing off
+    // latency is the frames captured between setting an exposure and the first frame with it,
+    // dropped after each exposure change in the bracket
+    void setBracket(unsigned int numFrames, double evStep, unsigned int latency);
+    // centre of the area focus is measured in, in binned coordinates, outside the image means
+    // the image centre
+    void setFocusPoint(uint16_t posX, uint16_t posY);
+    // record frames to a .cmv file from the next frame on, bracketed HDR frames aren't recorded
+    void startRecording(const QString &fileName);
+    // returns 0 or the first error writing the recording
+    int stopRecording(uint32_t *frames, uint32_t *dropped);
+    // frames dropped so far and how full the write queue is, all 0 when not recording
+    void recordingStats(uint32_t *dropped, size_t *queuedBytes, size_t *capacityBytes);
     ExposureLimits & getExposureLimits();
     void startCapture();
     void stopCapture();
@@ -31,11 +46,18 @@ public:
 
 signals:
     void imageCaptured(const CMRawImage &img);
+    // emitted before imageCaptured for every frame, see focus_metric_raw
+    void focusMeasured(double metric);
 
 private slots:
     void captureLoop();
 
 private:
+    void getBracket(unsigned int *numFrames, double *evStep, unsigned int *latency);
+    void setBracketExposure(unsigned int pos, unsigned int numFrames, double evStep);
+    void publishFocus(const CMRawImage &img);
+    void recordFrame(ArvBuffer *buf, const void *raw, const CMRawHeader &cmrh);
+
     QThread captureThread;
     ArvCamera *camera = NULL;
     ArvStream *stream;
@@ -47,6 +69,23 @@ private:
     double frameRateMax;
     double shutter = 0;
     double gain = 0;
+
+    QMutex bracketMutex;
+    unsigned int bracketFrames = 1;
+    double bracketStep = 0;
+    unsigned int bracketLatency = 0;
+    volatile bool bracketActive = false;    // capture loop is setting per frame exposures
+    double bracketShutter = 0;              // exposure of frames currently being captured
+    double bracketGain = 0;
+
+    QMutex focusMutex;
+    uint16_t focusX = UINT16_MAX;
+    uint16_t focusY = UINT16_MAX;
+
+    QMutex recordMutex;
+    QString recordFileName;                 // empty when not recording
+    CMVideoWriter *recorder = NULL;         // opened with the first recorded frame
+    int recordStatus = 0;
 };
 
 #endif // CMCAMERAINTERFACE_H
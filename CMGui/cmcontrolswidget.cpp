@@ -5,6 +5,9 @@
 #include <QGridLayout>
 #include <QLabel>
 #include <QPushButton>
+#include <QFileDialog>
+#include <QFileInfo>
+#include <QMessageBox>
 
 CMControlsWidget::CMControlsWidget(QWidget *parent)
     : QWidget{parent}
@@ -57,10 +60,14 @@ CMControlsWidget::CMControlsWidget(QWidget *parent)
     QPushButton *robustWhiteButton = new QPushButton(tr("Robust"), autoButtons);
     spotWhiteButton = new QPushButton(tr("Spot"), autoButtons);
     spotWhiteButton->setCheckable(true);
+    liveWhiteButton = new QPushButton(tr("Live"), autoButtons);
+    liveWhiteButton->setCheckable(true);
+    liveWhiteButton->setToolTip(tr("Robust white balance on every camera frame"));
     autoButtonsLayout->addWidget(brightsWhiteButton);
     autoButtonsLayout->addWidget(greyWhiteButton);
     autoButtonsLayout->addWidget(robustWhiteButton);
     autoButtonsLayout->addWidget(spotWhiteButton);
+    autoButtonsLayout->addWidget(liveWhiteButton);
     wbgl->addWidget(awbLabel, 2, 0);
     wbgl->addWidget(autoButtons, 2, 1);
 
@@ -77,6 +84,18 @@ CMControlsWidget::CMControlsWidget(QWidget *parent)
     satSlider->setMinMax(0.3, 1.3);
     cgl->addWidget(satLabel, 1, 0);
     cgl->addWidget(satSlider, 1, 1);
+    QLabel *lutLabel = new QLabel(tr("3D LUT"), colourGroup);
+    QWidget *lutWidgets = new QWidget(colourGroup);
+    QHBoxLayout *lutLayout = new QHBoxLayout(lutWidgets);
+    lutLayout->setContentsMargins(0, 0, 0, 0);
+    lutNameLabel = new QLabel(tr("None"), lutWidgets);
+    QPushButton *loadLutButton = new QPushButton(tr("Load"), lutWidgets);
+    QPushButton *clearLutButton = new QPushButton(tr("Clear"), lutWidgets);
+    lutLayout->addWidget(lutNameLabel, 1);
+    lutLayout->addWidget(loadLutButton);
+    lutLayout->addWidget(clearLutButton);
+    cgl->addWidget(lutLabel, 2, 0);
+    cgl->addWidget(lutWidgets, 2, 1);
 
     QGridLayout *nrgl = new QGridLayout(nrGroup);
     nrgl->setColumnMinimumWidth(0, 60);
@@ -89,24 +108,32 @@ CMControlsWidget::CMControlsWidget(QWidget *parent)
     debayerModeSelector->addItem(tr("5x5 VNG"), CMBAYER_55_VNG);
     nrgl->addWidget(debayerLabel, 0, 0);
     nrgl->addWidget(debayerModeSelector, 0, 1);
+    QLabel *rawNRModeLabel = new QLabel(tr("Raw NR"), nrGroup);
+    rawNRModeSelector = new QComboBox(nrGroup);
+    rawNRModeSelector->addItem(tr("None"), CMRAWNR_NONE);
+    rawNRModeSelector->addItem(tr("Normal"), CMRAWNR_NORMAL);
+    rawNRModeSelector->addItem(tr("Strong"), CMRAWNR_STRONG);
+    nrgl->addWidget(rawNRModeLabel, 1, 0);
+    nrgl->addWidget(rawNRModeSelector, 1, 1);
     QLabel *nrModeLabel = new QLabel("Mode", nrGroup);
     nrModeSelector = new QComboBox(nrGroup);
     nrModeSelector->addItem(tr("None"), CMNR_NONE);
     nrModeSelector->addItem(tr("Gaussian Blur"), CMNR_GAUSSIAN);
     nrModeSelector->addItem(tr("Median Filter"), CMNR_MEDIAN);
     nrModeSelector->addItem(tr("Strong Median Filter"), CMNR_MEDIAN_STRONG);
-    nrgl->addWidget(nrModeLabel, 1, 0);
-    nrgl->addWidget(nrModeSelector, 1, 1);
+    nrModeSelector->addItem(tr("Wavelet"), CMNR_WAVELET);
+    nrgl->addWidget(nrModeLabel, 2, 0);
+    nrgl->addWidget(nrModeSelector, 2, 1);
     QLabel *lumaLabel = new QLabel(tr("Luma"), nrGroup);
     lumaSlider = new CMNumberSlider(nrGroup);
     lumaSlider->setMinMax(-100, 0);
-    nrgl->addWidget(lumaLabel, 2, 0);
-    nrgl->addWidget(lumaSlider, 2, 1);
+    nrgl->addWidget(lumaLabel, 3, 0);
+    nrgl->addWidget(lumaSlider, 3, 1);
     QLabel *chromaLabel = new QLabel(tr("Chroma"), nrGroup);
     chromaSlider = new CMNumberSlider(nrGroup);
     chromaSlider->setMinMax(-100, 0);
-    nrgl->addWidget(chromaLabel, 3, 0);
-    nrgl->addWidget(chromaSlider, 3, 1);
+    nrgl->addWidget(chromaLabel, 4, 0);
+    nrgl->addWidget(chromaSlider, 4, 1);
 
     QGridLayout *tmgl = new QGridLayout(tmapGroup);
     tmgl->setColumnMinimumWidth(0, 60);
@@ -120,6 +147,7 @@ CMControlsWidget::CMControlsWidget(QWidget *parent)
     tmModeSelector->addItem(tr("HDR Auto"), CMLUT_HDR_AUTO);
     tmModeSelector->addItem(tr("HDR Cubic"), CMLUT_HDR_CUBIC);
     tmModeSelector->addItem(tr("HDR Cubic Auto"), CMLUT_HDR_CUBIC_AUTO);
+    tmModeSelector->addItem(tr("Local"), CMLUT_LOCAL);
     tmgl->addWidget(tmModeLabel, 0, 0);
     tmgl->addWidget(tmModeSelector, 0, 1);
     QLabel *gammaLabel = new QLabel(tr("Gamma"), tmapGroup);
@@ -149,11 +177,14 @@ CMControlsWidget::CMControlsWidget(QWidget *parent)
     connect(this->shadowSlider, &CMNumberSlider::valueChanged, this, &CMControlsWidget::onSliderChanged);
     connect(this->blackSlider, &CMNumberSlider::valueChanged, this, &CMControlsWidget::onSliderChanged);
     connect(this->debayerModeSelector, &QComboBox::currentIndexChanged, this, &CMControlsWidget::onDebayerModeChanged);
+    connect(this->rawNRModeSelector, &QComboBox::currentIndexChanged, this, &CMControlsWidget::onRawNRModeChanged);
     connect(this->nrModeSelector, &QComboBox::currentIndexChanged, this, &CMControlsWidget::onNRModeChanged);
     connect(this->tmModeSelector, &QComboBox::currentIndexChanged, this, &CMControlsWidget::onLUTModeChanged);
     connect(brightsWhiteButton, &QPushButton::clicked, this, &CMControlsWidget::onBrightsWhiteBalance);
     connect(greyWhiteButton, &QPushButton::clicked, this, &CMControlsWidget::onGreyWhiteBalance);
     connect(robustWhiteButton, &QPushButton::clicked, this, &CMControlsWidget::onRobustWhiteBalance);
+    connect(loadLutButton, &QPushButton::clicked, this, &CMControlsWidget::onLoadLut);
+    connect(clearLutButton, &QPushButton::clicked, this, &CMControlsWidget::onClearLut);
     connect(resetButton, &QPushButton::clicked, this, &CMControlsWidget::onReset);
 
     this->onReset();
@@ -172,8 +203,10 @@ void CMControlsWidget::onReset(void)
     shadowSlider->setValue(1);
     blackSlider->setValue(0.25);
     debayerModeSelector->setCurrentIndex(CMBAYER_33);
+    rawNRModeSelector->setCurrentIndex(CMRAWNR_NONE);
     nrModeSelector->setCurrentIndex(CMNR_MEDIAN);
     tmModeSelector->setCurrentIndex(CMLUT_HDR_CUBIC_AUTO);
+    this->onClearLut();
 }
 
 void CMControlsWidget::onDebayerModeChanged(int index)
@@ -182,6 +215,12 @@ void CMControlsWidget::onDebayerModeChanged(int index)
     emit paramsChanged();
 }
 
+void CMControlsWidget::onRawNRModeChanged(int index)
+{
+    (void)index; // use unused argument
+    emit paramsChanged();
+}
+
 void CMControlsWidget::onNRModeChanged(int index)
 {
     CMNoiseReductionMode nrm = (CMNoiseReductionMode)index;
@@ -239,6 +278,11 @@ void CMControlsWidget::onLUTModeChanged(int index)
         shadowSlider->setEnabled(false);
         blackSlider->setEnabled(false);
         break;
+    case CMLUT_LOCAL:
+        gammaSlider->setEnabled(true);
+        shadowSlider->setEnabled(true);
+        blackSlider->setEnabled(true);
+        break;
     }
 
     emit paramsChanged();
@@ -250,8 +294,9 @@ void CMControlsWidget::onSliderChanged(double val)
     emit paramsChanged();
 }
 
-void CMControlsWidget::getParams(ImagePipelineParams *params)
+void CMControlsWidget::getParams(CMPipelineParams *pipelineParams)
 {
+    ImagePipelineParams *params = &pipelineParams->params;
     params->exposure = this->expSlider->value();
     params->temp_K = this->warmthSlider->value();
     params->tint = this->tintSlider->value();
@@ -264,7 +309,39 @@ void CMControlsWidget::getParams(ImagePipelineParams *params)
     params->black = this->blackSlider->value();
     params->lut_mode = (CMLUTMode)this->tmModeSelector->currentIndex();
     params->nr_mode = (CMNoiseReductionMode)this->nrModeSelector->currentIndex();
+    params->raw_nr_mode = (CMRawNoiseReductionMode)this->rawNRModeSelector->currentIndex();
     params->debayer_mode = (CMDebayerMode)this->debayerModeSelector->currentIndex();
+    pipelineParams->lut3d = this->currentLut;
+    params->lut3d = this->currentLut.get();
+    // with a creative LUT the preview is cheaper as a single baked lookup
+    params->bake_lut_size = this->currentLut ? 33 : 0;
+}
+
+void CMControlsWidget::onLoadLut()
+{
+    QString fileName = QFileDialog::getOpenFileName(this, tr("Load 3D LUT"), "",
+            tr("Cube LUT Files (*.cube)"));
+    if (fileName.isNull())
+        return;
+
+    // freed once neither the controls nor any render, save or meter still uses it
+    std::shared_ptr<CMLut3D> lut(new CMLut3D, [](CMLut3D *l) { lut3d_free(l); delete l; });
+    int status = lut3d_load(lut.get(), fileName.toStdString().c_str());
+    if (status != 0) {
+        QMessageBox::critical(this, "", tr("Error %1 loading 3D LUT").arg(status));
+        return;
+    }
+
+    this->currentLut = lut;
+    this->lutNameLabel->setText(QFileInfo(fileName).completeBaseName());
+    emit paramsChanged();
+}
+
+void CMControlsWidget::onClearLut()
+{
+    this->currentLut.reset();
+    this->lutNameLabel->setText(tr("None"));
+    emit paramsChanged();
 }
 
 void CMControlsWidget::onBrightsWhiteBalance()
@@ -299,3 +376,8 @@ bool CMControlsWidget::spotWhiteChecked()
 {
     return this->spotWhiteButton->isChecked();
 }
+
+bool CMControlsWidget::liveWhiteChecked()
+{
+    return this->liveWhiteButton->isChecked();
+}
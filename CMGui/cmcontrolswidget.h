@@ -4,18 +4,21 @@
 #include <QWidget>
 #include <QComboBox>
 #include <QPushButton>
+#include <QLabel>
+#include <memory>
 #include "cmnumberslider.h"
-#include "../pipeline.h"
+#include "cmpipelineparams.h"
 
 class CMControlsWidget : public QWidget
 {
     Q_OBJECT
 public:
     explicit CMControlsWidget(QWidget *parent = nullptr);
-    void getParams(ImagePipelineParams *params);
+    void getParams(CMPipelineParams *params);
     void setWhiteBalance(double temp_K, double tint);
     void setShotWhiteBalance(double temp_K = 5000, double tint = 0);
     bool spotWhiteChecked();
+    bool liveWhiteChecked();
 
 signals:
     void paramsChanged();
@@ -23,12 +26,15 @@ signals:
 
 public slots:
     void onDebayerModeChanged(int index);
+    void onRawNRModeChanged(int index);
     void onNRModeChanged(int index);
     void onLUTModeChanged(int index);
     void onSliderChanged(double val);
     void onBrightsWhiteBalance();
     void onGreyWhiteBalance();
     void onRobustWhiteBalance();
+    void onLoadLut();
+    void onClearLut();
     void onReset();
 
 private:
@@ -38,6 +44,7 @@ private:
     CMNumberSlider *hueSlider;
     CMNumberSlider *satSlider;
     QComboBox *debayerModeSelector;
+    QComboBox *rawNRModeSelector;
     QComboBox *nrModeSelector;
     CMNumberSlider *lumaSlider;
     CMNumberSlider *chromaSlider;
@@ -46,6 +53,10 @@ private:
     CMNumberSlider *shadowSlider;
     CMNumberSlider *blackSlider;
     QPushButton *spotWhiteButton;
+    QPushButton *liveWhiteButton;
+    QLabel *lutNameLabel;
+
+    std::shared_ptr<const CMLut3D> currentLut;
     double shotTempK = 5000;
     double shotTint = 0;
 };
@@ -0,0 +1,15 @@
+#ifndef CMPIPELINEPARAMS_H
+#define CMPIPELINEPARAMS_H
+
+#include <memory>
+#include "../pipeline.h"
+
+/* Pipeline parameters along with a reference to the creative LUT params.lut3d points at. Every
+ * render, save and meter holds a copy, so a LUT is freed once the last one using it is done.
+ */
+struct CMPipelineParams {
+    ImagePipelineParams params;
+    std::shared_ptr<const CMLut3D> lut3d;
+};
+
+#endif // CMPIPELINEPARAMS_H
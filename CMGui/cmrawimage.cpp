@@ -1,5 +1,7 @@
 #include "cmrawimage.h"
 #include <cstring>
+#include <cstdlib>
+#include <cerrno>
 
 CMRawImage::CMRawImage()
 {
@@ -19,14 +21,48 @@ void CMRawImage::setImage(const void *raw, const CMRawHeader &cmrh)
         imgSz = cmrh.cinfo.width * cmrh.cinfo.height * 2;
     else
         imgSz = 0; // unsupported for now
-    this->rawData.resize(imgSz);
-    memcpy(this->rawData.data(), raw, imgSz);
+    uint8_t *data = new uint8_t[imgSz];
+    memcpy(data, raw, imgSz);
+    this->rawData.reset(data, [](const uint8_t *p) { delete[] p; });
     this->cmrh = cmrh;
 }
 
+int CMRawImage::load(const std::string &fileName)
+{
+    CMRawMapping *mapping = new CMRawMapping;
+    const void *raw;
+    CMRawHeader header;
+    int status = cmraw_map(mapping, &raw, &header, fileName.c_str());
+    if (status == -ENOTSUP) {
+        // compressed, so it has to be decoded into memory
+        delete mapping;
+        void *decoded;
+        status = cmraw_load(&decoded, &header, fileName.c_str());
+        if (status)
+            return status;
+        this->rawData.reset((const uint8_t *)decoded, [](const uint8_t *p) { free((void *)p); });
+        header.compression = CMRAW_COMPRESSION_NONE;
+        header.data_size = 0;
+        this->cmrh = header;
+        return 0;
+    }
+    if (status) {
+        delete mapping;
+        return status;
+    }
+
+    // the mapping is released along with the last copy of the image
+    this->rawData.reset((const uint8_t *)raw, [mapping](const uint8_t *) {
+        cmraw_unmap(mapping);
+        delete mapping;
+    });
+    this->cmrh = header;
+    return 0;
+}
+
 const void * CMRawImage::getRaw() const
 {
-    return this->rawData.data();
+    return this->rawData.get();
 }
 
 const CMCaptureInfo & CMRawImage::getCaptureInfo() const
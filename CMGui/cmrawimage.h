@@ -2,22 +2,26 @@
 #define CMRAWIMAGE_H
 
 #include <cstdint>
-#include <vector>
+#include <memory>
 #include <string>
 #include "../cmraw.h"
 
+// raw data is never modified once set, so copies share it rather than copying the pixels
 class CMRawImage
 {
 public:
     CMRawImage();
     void setImage(const void *raw, const CMRawHeader &cmrh);
+    // maps a .cmr file rather than reading it, compressed files are decoded into memory
+    // returns 0 or a negative error code
+    int load(const std::string &fileName);
     const void *getRaw() const;
     const CMCaptureInfo &getCaptureInfo() const;
     const CMRawHeader &getRawHeader() const;
     bool isEmpty() const;
 
 private:
-    std::vector<uint8_t> rawData;
+    std::shared_ptr<const uint8_t> rawData;
     CMRawHeader cmrh;
     std::string cameraMake;
     std::string cameraModel;
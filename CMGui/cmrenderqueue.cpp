@@ -1,7 +1,14 @@
 #include "cmrenderqueue.h"
 #include "cmrenderworker.h"
 #include <cstring>
+#include <cerrno>
 #include <QThread>
+#include "../colour_xfrm.h"
+
+// raw frames waiting to be written, enough for a burst of shots to a slow disk
+static const size_t saveQueueBytes = 256 << 20;
+// processed images waiting to be rendered and saved, each holds a raw frame
+static const size_t maxPendingSaves = 4;
 
 CMRenderQueue::CMRenderQueue(QObject *parent)
     : QObject{parent}
@@ -16,6 +23,9 @@ CMRenderQueue::CMRenderQueue(QObject *parent)
     connect(&saveWorker, &CMSaveWorker::imageSaved, this, &CMRenderQueue::saveDone);
 
     qRegisterMetaType<CMRawImage>("CMRawImage");
+
+    // without a writer raw saves fail with the error opening it
+    this->frameWriterStatus = cm_frame_writer_open(&this->frameWriter, saveQueueBytes);
 }
 
 CMRenderQueue::~CMRenderQueue() {
@@ -23,6 +33,10 @@ CMRenderQueue::~CMRenderQueue() {
     renderThread.wait();
     saveThread.quit();
     saveThread.wait();
+
+    // finishes writing the queued frames
+    if (this->frameWriter != NULL)
+        cm_frame_writer_close(this->frameWriter);
 }
 
 void CMRenderQueue::setImage(const CMRawImage &img)
@@ -37,7 +51,7 @@ void CMRenderQueue::setImage(const CMRawImage &img)
     }
 }
 
-void  CMRenderQueue::setParams(const ImagePipelineParams &params)
+void  CMRenderQueue::setParams(const CMPipelineParams &params)
 {
     this->plParams = params;
     this->paramsSet = true;
@@ -61,6 +75,7 @@ void CMRenderQueue::startRender()
 
 void CMRenderQueue::renderDone(const QImage &img)
 {
+    lastRendered = img;
     emit imageRendered(img);
     renderThread.quit();
     renderThread.wait();
@@ -88,30 +103,86 @@ bool CMRenderQueue::autoWhiteBalance(const CMAutoWhiteParams &params, double *te
     return true;
 }
 
-bool CMRenderQueue::saveImage(const QString &fileName)
+int CMRenderQueue::saveImage(const QString &fileName, bool tiff16, bool compress)
 {
-    if (this->currentRaw.isEmpty() || !paramsSet || saving)
-        return false;
-
-    saving = true;
+    if (this->currentRaw.isEmpty() || !paramsSet)
+        return -ENODATA;
+
+    const CMRawImage &img = imageQueued ? this->nextRaw : this->currentRaw;
+    if (fileName.endsWith(".cmr") || fileName.endsWith(".dng")) {
+        if (this->frameWriter == NULL)
+            return this->frameWriterStatus;
+
+        // make capture info match "as shot" white balance
+        CMRawHeader cmrh = img.getRawHeader();
+        double white_x, white_y;
+        colour_temp_tint_to_xy(this->plParams.params.temp_K, this->plParams.params.tint, &white_x,
+                               &white_y);
+        cmrh.cinfo.white_x = white_x;
+        cmrh.cinfo.white_y = white_y;
+        cmrh.compression = compress ? CMRAW_COMPRESSION_RICE : CMRAW_COMPRESSION_NONE;
+
+        // the preview shown is the thumbnail, a queued image's is at most a frame behind
+        CMRawThumbnail thumb = {0, 0, NULL};
+        if (!lastRendered.isNull())
+            cmraw_make_thumbnail(lastRendered.constBits(), lastRendered.width(),
+                                 lastRendered.height(), lastRendered.bytesPerLine(), &thumb);
+
+        CMFrameFormat format = fileName.endsWith(".dng") ? CMFRAME_FORMAT_DNG
+                                                          : CMFRAME_FORMAT_CMRAW;
+        int status = cm_frame_writer_add(this->frameWriter, img.getRaw(), &cmrh, &thumb,
+                                         fileName.toLocal8Bit().constData(), format);
+        cmraw_free_thumbnail(&thumb);
+        return status;
+    }
 
-    if (imageQueued)
-        saveWorker.setParams(fileName.toStdString(), this->nextRaw, this->plParams);
-    else
-        saveWorker.setParams(fileName.toStdString(), this->currentRaw, this->plParams);
+    if (pendingSaves.size() >= maxPendingSaves) {
+        droppedSaves++;
+        return -EAGAIN;
+    }
+    pendingSaves.push_back({fileName, img, this->plParams, tiff16});
+    if (!saving)
+        startSave();
+    return 0;
+}
 
+void CMRenderQueue::startSave()
+{
+    saving = true;
+    SaveRequest &request = pendingSaves.front();
+    saveWorker.setParams(request.fileName.toStdString(), request.img, request.params,
+                         request.tiff16);
+    pendingSaves.pop_front();
     saveThread.start();
-    return true;
 }
 
 void CMRenderQueue::saveDone(bool success)
 {
     saveThread.quit();
     saveThread.wait();
-    saving = false;
+    if (pendingSaves.empty())
+        saving = false;
+    else
+        startSave();
     emit imageSaved(success);
 }
 
+void CMRenderQueue::saveStats(CMFrameWriterStats *stats)
+{
+    if (this->frameWriter != NULL)
+        cm_frame_writer_stats(this->frameWriter, stats);
+    else
+        memset(stats, 0, sizeof(CMFrameWriterStats));
+    stats->queued += pendingSaves.size() + (saving ? 1 : 0);
+    stats->dropped += droppedSaves;
+}
+
+void CMRenderQueue::clearSaveError(int status)
+{
+    if (this->frameWriter != NULL)
+        cm_frame_writer_clear_error(this->frameWriter, status);
+}
+
 // Enqueues set image operation at end of signal queue
 void CMRenderQueue::setImageLater(const CMRawImage &img)
 {
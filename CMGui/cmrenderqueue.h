@@ -5,9 +5,11 @@
 #include <QImage>
 #include <QThread>
 #include <QString>
+#include <deque>
 #include "cmrenderworker.h"
 #include "cmsaveworker.h"
 #include "cmrawimage.h"
+#include "../cm_frame_writer.h"
 
 class CMRenderQueue : public QObject
 {
@@ -17,9 +19,17 @@ public:
     ~CMRenderQueue();
 
     // always call from a single thread
-    void setParams(const ImagePipelineParams &params);
+    void setParams(const CMPipelineParams &params);
     bool autoWhiteBalance(const CMAutoWhiteParams &params, double *temp_K, double *tint);
-    bool saveImage(const QString &fileName);
+    /* Raw files are queued to be written on the frame writer's thread, processed ones are
+     * rendered and saved one after another. Returns 0 if the image is queued, -EAGAIN if the
+     * queue is full, in which case it's counted as dropped, or another negative error code.
+     */
+    int saveImage(const QString &fileName, bool tiff16 = false, bool compress = false);
+    // frames waiting to be written, dropped and written, and the first error writing raw files
+    void saveStats(CMFrameWriterStats *stats);
+    // forgets the error from saveStats once it's been reported, so the next one is
+    void clearSaveError(int status);
     void setImageLater(const CMRawImage &img);
     bool hasImage();
 
@@ -33,22 +43,35 @@ signals:
     void imageSaved(bool success);
 
 private:
+    struct SaveRequest {
+        QString fileName;
+        CMRawImage img;
+        CMPipelineParams params;
+        bool tiff16;
+    };
+
     QThread renderThread;
     CMRenderWorker worker;
     QThread saveThread;
     CMSaveWorker saveWorker;
+    CMFrameWriter *frameWriter = NULL;
+    int frameWriterStatus = 0;  // error opening frameWriter
 
     bool paramsSet = false;
 
     bool saving = false;        // indicates a save is in progress
+    std::deque<SaveRequest> pendingSaves;   // processed saves waiting for the one in progress
+    uint32_t droppedSaves = 0;              // processed saves refused with the queue full
     bool rendering = false;     // indicates a render is in progress
     bool imageQueued = false;   // indicates if next image needs to be made current
     bool renderQueued = false;  // indicates if a new render should be done after last finishes
     CMRawImage currentRaw;
     CMRawImage nextRaw;
-    ImagePipelineParams plParams;
+    QImage lastRendered;        // embedded as a thumbnail in saved raw files
+    CMPipelineParams plParams;
 
     void startRender();
+    void startSave();
 };
 
 #endif // CMRENDERQUEUE_H
@@ -1,6 +1,7 @@
 #include "cmrenderworker.h"
 #include <QImage>
 #include <cassert>
+#include <vector>
 
 CMRenderWorker::CMRenderWorker(QObject *parent)
     : QObject{parent}
@@ -12,7 +13,7 @@ void CMRenderWorker::setImage(const CMRawImage *img) {
     this->imgRaw = img;
 }
 
-void CMRenderWorker::setParams(const ImagePipelineParams &params) {
+void CMRenderWorker::setParams(const CMPipelineParams &params) {
     this->plParams = params;
     this->paramsSet = true;
 }
@@ -32,7 +33,8 @@ void CMRenderWorker::render() {
     std::vector<uint8_t> imgRgb8;
     imgRgb8.resize(width_out * height_out * 3);
     pipeline_process_image_bin22(this->imgRaw->getRaw(), imgRgb8.data(),
-                                 &this->imgRaw->getCaptureInfo(), &this->plParams);
+                                 &this->imgRaw->getCaptureInfo(), &this->plParams.params);
     QImage img(imgRgb8.data(), width_out, height_out, width_out*3, QImage::Format_RGB888);
-    emit imageRendered(img);
+    // deep copy, the image outlives imgRgb8 once it's queued to the render queue's thread
+    emit imageRendered(img.copy());
 }
@@ -4,7 +4,7 @@
 #include <QObject>
 #include <QImage>
 #include "cmrawimage.h"
-#include "../pipeline.h"
+#include "cmpipelineparams.h"
 
 class CMRenderWorker : public QObject
 {
@@ -12,7 +12,7 @@ class CMRenderWorker : public QObject
 public:
     explicit CMRenderWorker(QObject *parent = nullptr);
     void setImage(const CMRawImage *img);
-    void setParams(const ImagePipelineParams &params);
+    void setParams(const CMPipelineParams &params);
 
 public slots:
     void render();
@@ -21,7 +21,7 @@ signals:
     void imageRendered(const QImage &img);
 
 private:
-    ImagePipelineParams plParams;
+    CMPipelineParams plParams;
     const CMRawImage *imgRaw = NULL;
     bool paramsSet = false;
 };
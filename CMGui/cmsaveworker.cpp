@@ -1,5 +1,6 @@
 #include "cmsaveworker.h"
 #include <cstring>
+#include <vector>
 #include <QImage>
 #include "../dng.h"
 #include "../colour_xfrm.h"
@@ -11,9 +12,10 @@ CMSaveWorker::CMSaveWorker(QObject *parent)
 }
 
 void CMSaveWorker::setParams(const std::string &fileName, const CMRawImage &img,
-                             const ImagePipelineParams &params)
+                             const CMPipelineParams &params, bool tiff16)
 {
     this->fileName = fileName;
+    this->tiff16 = tiff16;
     this->imgRaw = img;
     this->plParams = params;
     this->paramsSet = true;
@@ -36,24 +38,26 @@ void CMSaveWorker::save()
     // make capture info match "as shot" white balance
     CMRawHeader cmrh = this->imgRaw.getRawHeader();
     double white_x, white_y;
-    colour_temp_tint_to_xy(this->plParams.temp_K, this->plParams.tint, &white_x, &white_y);
+    colour_temp_tint_to_xy(this->plParams.params.temp_K, this->plParams.params.tint, &white_x, &white_y);
     cmrh.cinfo.white_x = white_x;
     cmrh.cinfo.white_y = white_y;
 
-    if (endsWith(this->fileName, ".cmr")) {
-        status = cmraw_save(this->imgRaw.getRaw(), &cmrh, this->fileName.c_str());
-    } else if (endsWith(this->fileName, ".dng")) {
-        status = bayer_rg12p_to_dng(this->imgRaw.getRaw(), &cmrh, this->fileName.c_str());
+    if ((endsWith(this->fileName, ".tiff") || endsWith(this->fileName, ".tif")) && this->tiff16) {
+        std::vector<uint16_t> imgRgb16;
+        imgRgb16.resize(cmrh.cinfo.width * cmrh.cinfo.height * 3);
+        status = pipeline_process_image16(this->imgRaw.getRaw(), imgRgb16.data(), NULL, &cmrh.cinfo, &this->plParams.params);
+        if (status == 0)
+            status = rgb16_to_tiff(imgRgb16.data(), cmrh.cinfo.width, cmrh.cinfo.height, this->fileName.c_str());
     } else if (endsWith(this->fileName, ".tiff") || endsWith(this->fileName, ".tif")) {
         std::vector<uint8_t> imgRgb8;
         imgRgb8.resize(cmrh.cinfo.width * cmrh.cinfo.height * 3);
-        status = pipeline_process_image(this->imgRaw.getRaw(), imgRgb8.data(), &cmrh.cinfo, &this->plParams);
+        status = pipeline_process_image(this->imgRaw.getRaw(), imgRgb8.data(), &cmrh.cinfo, &this->plParams.params);
         if (status == 0)
             status = rgb8_to_tiff(imgRgb8.data(), cmrh.cinfo.width, cmrh.cinfo.height, this->fileName.c_str());
     } else if (endsWith(this->fileName, ".jpg") || endsWith(this->fileName, ".jpeg")) {
         std::vector<uint8_t> imgRgb8;
         imgRgb8.resize(cmrh.cinfo.width * cmrh.cinfo.height * 3);
-        status = pipeline_process_image(this->imgRaw.getRaw(), imgRgb8.data(), &cmrh.cinfo, &this->plParams);
+        status = pipeline_process_image(this->imgRaw.getRaw(), imgRgb8.data(), &cmrh.cinfo, &this->plParams.params);
         if (status == 0) {
             QImage img(imgRgb8.data(), cmrh.cinfo.width, cmrh.cinfo.height, cmrh.cinfo.width*3, QImage::Format_RGB888);
             if (img.save(QString::fromStdString(this->fileName)) != true)
@@ -3,15 +3,16 @@
 
 #include <QObject>
 #include "cmrawimage.h"
-#include "../pipeline.h"
+#include "cmpipelineparams.h"
 
 class CMSaveWorker : public QObject
 {
     Q_OBJECT
 public:
     explicit CMSaveWorker(QObject *parent = nullptr);
+    // processes and saves a TIFF or JPEG, tiff16 selects 16 bit output when saving a TIFF
     void setParams(const std::string &fileName, const CMRawImage &img,
-                  const ImagePipelineParams &params);
+                  const CMPipelineParams &params, bool tiff16 = false);
 
 public slots:
     void save();
@@ -20,9 +21,10 @@ signals:
     void imageSaved(bool success);
 
 private:
-    ImagePipelineParams plParams;
+    CMPipelineParams plParams;
     CMRawImage imgRaw;
     std::string fileName;
+    bool tiff16 = false;
     bool paramsSet = false;
 };
 
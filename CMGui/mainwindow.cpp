@@ -13,7 +13,11 @@
 #include <QMessageBox>
 #include <QDateTime>
 #include <QDir>
+#include <QStatusBar>
+#include <algorithm>
 #include <cstdlib>
+#include <cerrno>
+#include <cmath>
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
@@ -52,8 +56,16 @@ MainWindow::MainWindow(QWidget *parent)
     this->camControls->setFixedWidth(400);
     this->camControls->setHidden(true); // only visible when camera is running
     connect(this->camControls, &CMCameraControls::shootClicked, this, &MainWindow::onShoot);
+    connect(this->camControls, &CMCameraControls::recordToggled,
+            this, &MainWindow::onRecordToggled);
     connect(this->camControls, &CMCameraControls::exposureChanged,
             this, &MainWindow::onExposureChanged);
+    connect(this->camControls, &CMCameraControls::bracketChanged,
+            this, &MainWindow::onBracketChanged);
+    connect(this->camControls, &CMCameraControls::meteringChanged,
+            this, &MainWindow::onMeteringChanged);
+    connect(this->camControls, &CMCameraControls::focusAreaChanged,
+            this, &MainWindow::onFocusAreaChanged);
 
     this->rawInfoWidget->setHidden(true); // only visible when cmraw file open
 
@@ -66,9 +78,11 @@ MainWindow::MainWindow(QWidget *parent)
     this->cameraInterface = new CMCameraInterface();
     connect(this->cameraInterface, &CMCameraInterface::imageCaptured,
             this, &MainWindow::onImageCaptured);
+    connect(this->cameraInterface, &CMCameraInterface::focusMeasured,
+            this->camControls, &CMCameraControls::setFocusMetric);
 
     this->autoExposure = new CMAutoExposure();
-    connect(this->autoExposure, &CMAutoExposure::exposureChangeCalculated,
+    connect(this->autoExposure, &CMAutoExposure::exposureTargetCalculated,
             this, &MainWindow::onExposureUpdate);
 
     QMenu *fileMenu = menuBar()->addMenu(tr("&File"));
@@ -85,6 +99,20 @@ MainWindow::MainWindow(QWidget *parent)
     fileMenu->addAction(closeAction);
     connect(closeAction, &QAction::triggered, this, &MainWindow::onClose);
 
+    // how full the queues of images waiting to be written are, and how many were dropped
+    this->droppedLabel = new QLabel(this);
+    this->droppedLabel->setToolTip(tr("Images and frames dropped because the disk couldn't "
+                                      "keep up"));
+    this->writeBufferBar = new QProgressBar(this);
+    this->writeBufferBar->setRange(0, 100);
+    this->writeBufferBar->setFormat(tr("Write buffer %p%"));
+    this->writeBufferBar->setMaximumWidth(200);
+    statusBar()->addPermanentWidget(this->droppedLabel);
+    statusBar()->addPermanentWidget(this->writeBufferBar);
+    this->writeStatsTimer = new QTimer(this);
+    connect(this->writeStatsTimer, &QTimer::timeout, this, &MainWindow::onUpdateWriteStats);
+    this->writeStatsTimer->start(250);
+
     this->setWindowTitle(tr("Cinemavi"));
 
     this->onParamsChanged(); // force a render
@@ -92,13 +120,15 @@ MainWindow::MainWindow(QWidget *parent)
 
 MainWindow::~MainWindow()
 {
+    uint32_t frames, dropped;
+    this->cameraInterface->stopRecording(&frames, &dropped);
     delete this->cameraInterface;
     delete this->autoExposure;
 }
 
 void MainWindow::onParamsChanged()
 {
-    ImagePipelineParams params;
+    CMPipelineParams params;
     this->controls->getParams(&params);
     this->renderQueue->setParams(params);
     this->autoExposure->setParams(params);
@@ -112,18 +142,15 @@ void MainWindow::onOpenRaw()
         return;
     std::string cmrFileName = fileName.toStdString();
 
-    void *raw;
-    CMRawHeader cmrh;
-    int rawStat = cmraw_load(&raw, &cmrh, cmrFileName.c_str());
+    CMRawImage img;
+    int rawStat = img.load(cmrFileName);
     if (rawStat == 0) {
-        CMRawImage img;
+        const CMRawHeader &cmrh = img.getRawHeader();
         this->cameraInterface->stopCapture();
         this->camControls->setHidden(true);
         this->rawInfoWidget->setRawHeader(cmrh);
         this->rawInfoWidget->setHidden(false);
-        img.setImage(raw, cmrh);
         this->renderQueue->setImageLater(img);
-        free(raw);
 
         if (cmrh.cinfo.white_x > 0 || cmrh.cinfo.white_y > 0) {
             double temp_K, tint;
@@ -179,9 +206,26 @@ void MainWindow::onSaveImage()
             baseName + ".tiff", tr("Image Files (*.cmr *.dng *.tiff *.jpg)"));
     if (fileName.isNull())
         return;
-    this->saveAction->setEnabled(false);
-    this->camControls->setShootEnabled(false);
-    this->renderQueue->saveImage(fileName);
+    int status = this->renderQueue->saveImage(fileName);
+    switch (status) {
+    case 0:
+        break;
+    case -EAGAIN:
+        QMessageBox::warning(this, "", tr("Too many images waiting to be saved, try again "
+                "once they're written"));
+        break;
+    case -ENODATA:
+        QMessageBox::warning(this, "", tr("No image to save"));
+        break;
+    case -EINVAL:
+        QMessageBox::critical(this, "", tr("The image can't be saved in this format"));
+        break;
+    case -ENOMEM:
+        QMessageBox::critical(this, "", tr("Not enough memory to save the image"));
+        break;
+    default:
+        QMessageBox::critical(this, "", tr("Error %1 saving image").arg(status));
+    }
 }
 
 void MainWindow::onShoot()
@@ -193,6 +237,8 @@ void MainWindow::onShoot()
     }
 
     QString suffix;
+    bool tiff16 = false;
+    bool compress = false;
     switch(this->camControls->captureFormat()) {
     case CMCAP_CMRAW:
         suffix = ".cmr";
@@ -206,25 +252,87 @@ void MainWindow::onShoot()
     case CMCAP_JPEG:
         suffix = ".jpg";
         break;
+    case CMCAP_TIFF16:
+        suffix = ".tiff";
+        tiff16 = true;
+        break;
+    case CMCAP_CMRAW_COMPRESSED:
+        suffix = ".cmr";
+        compress = true;
+        break;
     }
 
     QDateTime t = QDateTime::currentDateTime();
     QString baseName = "CMIMG_" + t.toString("yyyy-MM-dd_hh-mm-ss");
     QString fileName = saveDir + "/" + baseName + suffix;
-    this->saveAction->setEnabled(false);
-    this->camControls->setShootEnabled(false);
-    this->renderQueue->saveImage(fileName);
+    // a shot that can't be queued is counted as dropped, other errors are shown
+    int status = this->renderQueue->saveImage(fileName, tiff16, compress);
+    if (status && status != -EAGAIN)
+        QMessageBox::critical(this, "", tr("Error %1 saving image").arg(status));
 }
 
-void MainWindow::onSaveDone(bool success)
+void MainWindow::onRecordToggled(bool record)
 {
-    this->saveAction->setEnabled(true);
-    this->camControls->setShootEnabled(true);
+    if (!record) {
+        uint32_t frames, dropped;
+        int status = this->cameraInterface->stopRecording(&frames, &dropped);
+        if (status)
+            QMessageBox::critical(this, "", tr("Error %1 writing recording").arg(status));
+        else if (dropped > 0)
+            QMessageBox::warning(this, "", tr("%1 frames recorded, %2 dropped because the disk "
+                    "couldn't keep up").arg(frames).arg(dropped));
+        return;
+    }
+
+    QString saveDir = this->camControls->saveDir();
+    if (!QDir().mkpath(saveDir)) {
+        QMessageBox::critical(this, "", tr("Error creating save directory"));
+        this->camControls->setRecording(false);
+        return;
+    }
 
+    QDateTime t = QDateTime::currentDateTime();
+    QString fileName = saveDir + "/CMVID_" + t.toString("yyyy-MM-dd_hh-mm-ss") + ".cmv";
+    this->cameraInterface->startRecording(fileName);
+}
+
+void MainWindow::onSaveDone(bool success)
+{
     if (!success)
         QMessageBox::critical(this, "", tr("Error saving image"));
 }
 
+void MainWindow::onUpdateWriteStats()
+{
+    CMFrameWriterStats stats;
+    this->renderQueue->saveStats(&stats);
+    uint32_t recordDropped;
+    size_t recordQueued, recordCapacity;
+    this->cameraInterface->recordingStats(&recordDropped, &recordQueued, &recordCapacity);
+
+    // the fuller of the two queues, since either filling up drops frames
+    double fill = 0;
+    if (stats.capacity_bytes > 0)
+        fill = (double)stats.queued_bytes / stats.capacity_bytes;
+    if (recordCapacity > 0)
+        fill = std::max(fill, (double)recordQueued / recordCapacity);
+    this->writeBufferBar->setValue(std::lround(fill * 100));
+    this->writeBufferBar->setToolTip(tr("%1 images waiting to be saved").arg(stats.queued));
+
+    uint32_t dropped = stats.dropped + recordDropped;
+    this->droppedLabel->setText(dropped > 0 ? tr("%1 dropped").arg(dropped) : QString());
+
+    /* raw images are written in the background, so errors are only found here. The timer keeps
+     * running while the message is shown, so it's shown once, then cleared so the next error is
+     */
+    if (stats.status && !this->writeErrorShown) {
+        this->writeErrorShown = true;
+        QMessageBox::critical(this, "", tr("Error %1 saving image").arg(stats.status));
+        this->renderQueue->clearSaveError(stats.status);
+        this->writeErrorShown = false;
+    }
+}
+
 void MainWindow::onAutoWhiteBalance(CMAutoWhiteMode mode)
 {
     CMAutoWhiteParams params = {.awb_mode=mode};
@@ -235,6 +343,18 @@ void MainWindow::onAutoWhiteBalance(CMAutoWhiteMode mode)
 
 void MainWindow::onPicturePressed(uint16_t posX, uint16_t posY)
 {
+    // the preview is rendered binned, so these are the coordinates spot metering expects
+    if (this->camControls->meteringMode() == CMMETER_SPOT) {
+        this->metering.spot_x = posX;
+        this->metering.spot_y = posY;
+        this->autoExposure->setMetering(this->metering);
+    }
+
+    if (this->camControls->focusPointPicked()) {
+        this->cameraInterface->setFocusPoint(posX, posY);
+        this->camControls->resetFocusPeak();
+    }
+
     if (this->controls->spotWhiteChecked()) {
         CMAutoWhiteParams params = {.awb_mode=CMWHITE_SPOT, .pos_x=posX, .pos_y=posY};
         double temp_K, tint;
@@ -247,13 +367,40 @@ void MainWindow::onImageCaptured(const CMRawImage &img)
 {
     this->renderQueue->setImage(img);
 
-    if (this->camControls->exposureMode() != CMEXP_MANUAL)
-        this->autoExposure->setImage(img);
+    if (this->controls->liveWhiteChecked()) {
+        CMAutoWhiteParams params = {.awb_mode=CMWHITE_ROBUST};
+        double temp_K, tint;
+        if (pipeline_auto_white_balance(img.getRaw(), &img.getCaptureInfo(), &params,
+                    &temp_K, &tint) == 0) {
+            // move part way each frame so the preview doesn't flicker, in mireds since that's
+            // closer to perceptually even than kelvin
+            const double rate = 0.25;
+            if (this->liveTempK > 0) {
+                double mired = 1e6 / this->liveTempK;
+                temp_K = 1e6 / (mired + (1e6 / temp_K - mired) * rate);
+                tint = this->liveTint + (tint - this->liveTint) * rate;
+            }
+            this->liveTempK = temp_K;
+            this->liveTint = tint;
+            this->controls->setWhiteBalance(temp_K, tint);
+        }
+    } else {
+        this->liveTempK = 0;
+    }
+
+    this->autoExposure->setImage(img, this->camControls->exposureMode() != CMEXP_MANUAL);
 }
 
-void MainWindow::onExposureUpdate(double changeFactor)
+void MainWindow::onExposureUpdate(double target)
 {
+    // the target already accounts for frames in flight, so step straight to it unless it's
+    // within noise of the current exposure
     double shutter_us, gain_dB;
+    this->cameraInterface->getExposure(&shutter_us, &gain_dB);
+    double changeFactor = target / (shutter_us * pow(10, gain_dB / 20));
+    if (fabs(log(changeFactor)) < 0.02)
+        return;
+
     this->cameraInterface->updateExposure(this->camControls->exposureMode(), changeFactor);
     this->cameraInterface->getExposure(&shutter_us, &gain_dB);
     this->camControls->setShutter(shutter_us);
@@ -266,9 +413,29 @@ void MainWindow::onExposureChanged(CMExposureMode mode, double shutter_us, doubl
         this->cameraInterface->setExposure(shutter_us, gain_dB);
 }
 
+void MainWindow::onBracketChanged(unsigned int numFrames, double evStep)
+{
+    // frames in flight as measured by auto exposure, used from when bracketing starts
+    this->cameraInterface->setBracket(numFrames, evStep, this->autoExposure->latency());
+}
+
+void MainWindow::onMeteringChanged(CMMeteringMode mode)
+{
+    this->metering.mode = mode;
+    this->autoExposure->setMetering(this->metering);
+}
+
+void MainWindow::onFocusAreaChanged(bool picked)
+{
+    // a picked point only takes effect once the picture is clicked
+    if (!picked)
+        this->cameraInterface->setFocusPoint(UINT16_MAX, UINT16_MAX);
+}
+
 void MainWindow::onClose()
 {
     CMRawImage emptyImg;
+    this->camControls->setRecording(false);
     this->cameraInterface->stopCapture();
     this->camControls->setHidden(true);
     this->rawInfoWidget->setHidden(true);
@@ -9,6 +9,8 @@
 #include <QScrollArea>
 #include <QFileInfo>
 #include <QAction>
+#include <QProgressBar>
+#include <QTimer>
 #include "cmpicturelabel.h"
 #include "cmcontrolswidget.h"
 #include "cmcameracontrols.h"
@@ -34,12 +36,17 @@ public slots:
     void onOpenCamera();
     void onSaveImage();
     void onShoot();
+    void onRecordToggled(bool record);
     void onSaveDone(bool success);
+    void onUpdateWriteStats();
     void onAutoWhiteBalance(CMAutoWhiteMode mode);
     void onPicturePressed(uint16_t posX, uint16_t posY);
     void onImageCaptured(const CMRawImage &img);
-    void onExposureUpdate(double changeFactor);
+    void onExposureUpdate(double target);
     void onExposureChanged(CMExposureMode mode, double shutter_us, double gain_dB);
+    void onBracketChanged(unsigned int numFrames, double evStep);
+    void onMeteringChanged(CMMeteringMode mode);
+    void onFocusAreaChanged(bool picked);
     void onClose();
 
 private:
@@ -49,9 +56,19 @@ private:
     CMCameraControls *camControls;
     CMRawInfoWidget *rawInfoWidget;
     QAction *saveAction;
+    QProgressBar *writeBufferBar;
+    QLabel *droppedLabel;
+    QTimer *writeStatsTimer;
+    bool writeErrorShown = false;
     CMRenderQueue *renderQueue;
     CMCameraInterface *cameraInterface;
     CMAutoExposure *autoExposure;
     QFileInfo rawFileInfo;
+
+    CMMeteringParams metering = {CMMETER_AVERAGE, UINT16_MAX, UINT16_MAX};
+
+    // smoothed live white balance, temperature of 0 when not started
+    double liveTempK = 0;
+    double liveTint = 0;
 };
 #endif // MAINWINDOW_H
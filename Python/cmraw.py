@@ -19,7 +19,11 @@ def cmraw_load(fname):
     if hdr[4] != 9:
         raise ValueError("Unsupported pixel format")
     width, height = struct.unpack("<HH", hdr[8:12])
-    bayer = unpack12_16(data[164:])
+    if hdr[44] != 0:
+        raise ValueError("Compressed .cmr files aren't supported")
+    # the thumbnail block, padding included, sits between the header and the pixels
+    thumb_size, = struct.unpack("<I", hdr[52:56])
+    bayer = unpack12_16(data[164 + thumb_size:])
     img12 = cv2.cvtColor(bayer.reshape((height, width)), cv2.COLOR_BayerBG2RGB)
     return img12 / 4095.0
 
@@ -0,0 +1,100 @@
+#include <string.h>
+#include <math.h>
+
+#include "ae_controller.h"
+#include "auto_exposure.h"
+
+// exposure steps smaller than this (as a log ratio) are too close to noise to time
+#define AE_MIN_STEP 0.1
+
+void ae_controller_init(CMAEController *ctl, unsigned int latency)
+{
+    memset(ctl, 0, sizeof(CMAEController));
+    ctl->latency = latency < AE_MAX_LATENCY ? latency : AE_MAX_LATENCY;
+}
+
+uint32_t ae_controller_frame(CMAEController *ctl, double shutter_us, double gain_dB)
+{
+    uint32_t frame = ctl->num_frames++;
+    double exposure = shutter_us * pow(10, gain_dB / 20);
+    ctl->exposure[frame % AE_HISTORY] = exposure;
+
+    // time the response to a step if the change factor before it is known
+    if (frame > 0 && !ctl->step_pending && ctl->have_meas) {
+        double step = log(exposure / ctl->exposure[(frame - 1) % AE_HISTORY]);
+        if (fabs(step) >= AE_MIN_STEP) {
+            ctl->step_frame = frame;
+            ctl->step_log_size = step;
+            ctl->step_log_factor = ctl->last_log_factor;
+            ctl->step_pending = 1;
+        }
+    }
+
+    return frame;
+}
+
+// actual exposure of a frame, frames before the first take its exposure
+static double actual_exposure(const CMAEController *ctl, uint32_t frame)
+{
+    uint32_t tagged = frame >= ctl->latency ? frame - ctl->latency : 0;
+    return ctl->exposure[tagged % AE_HISTORY];
+}
+
+/* After a step of size s at frame r, measured change factors are unchanged until frame
+ * r + latency, then change by 1 / s. The first measured frame that's closer to the new level
+ * than the old one bounds the latency from above, and the last one at the old level bounds it
+ * from below, so the estimate only moves when it's outside those bounds.
+ */
+static void time_step(CMAEController *ctl, uint32_t frame, double log_factor)
+{
+    if (frame < ctl->step_frame)
+        return;
+
+    uint32_t delay = frame - ctl->step_frame;
+    if (delay > AE_MAX_LATENCY) {
+        ctl->step_pending = 0;  // no response, e.g. the step was clamped by the camera
+        return;
+    }
+
+    double d = log_factor - ctl->step_log_factor;
+    if (fabs(d + ctl->step_log_size) < fabs(d)) {
+        uint32_t min_latency = 0;
+        if (ctl->have_meas && ctl->last_meas_frame >= ctl->step_frame)
+            min_latency = ctl->last_meas_frame - ctl->step_frame + 1;
+        if (ctl->latency < min_latency || ctl->latency > delay)
+            ctl->latency = delay;
+        ctl->step_pending = 0;
+    }
+}
+
+double ae_controller_measure(CMAEController *ctl, uint32_t frame, double change_factor)
+{
+    if (!(change_factor > 0) || frame >= ctl->num_frames
+            || ctl->num_frames - frame > AE_HISTORY - AE_MAX_LATENCY)
+        return 0;
+
+    // a clipped frame doesn't respond to a step until it's no longer clipped, so it can't time
+    // one, or be assumed to be from before one without stalling on each step
+    if (change_factor == AE_CLIPPED_FACTOR) {
+        ctl->step_pending = 0;
+        ctl->have_meas = 0;
+        return change_factor * actual_exposure(ctl, frame);
+    }
+
+    double log_factor = log(change_factor);
+    double exposure = actual_exposure(ctl, frame);
+    if (ctl->step_pending) {
+        time_step(ctl, frame, log_factor);
+
+        // still at the old level, so captured before the step whatever the latency estimate
+        if (ctl->step_pending && frame >= ctl->step_frame)
+            exposure = ctl->exposure[(ctl->step_frame - 1) % AE_HISTORY];
+        else
+            exposure = actual_exposure(ctl, frame);
+    }
+    ctl->last_meas_frame = frame;
+    ctl->last_log_factor = log_factor;
+    ctl->have_meas = 1;
+
+    return change_factor * exposure;
+}
@@ -0,0 +1,63 @@
+#ifndef AE_CONTROLLER_H
+#define AE_CONTROLLER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// frames of exposure history kept, must be a power of 2
+#define AE_HISTORY 32
+// longest latency considered, in frames
+#define AE_MAX_LATENCY 8
+
+/* Auto exposure controller that accounts for the frames in flight between requesting an
+ * exposure and the first frame captured with it.
+ *
+ * Each frame is tagged with the exposure that was requested when it arrived. A frame's actual
+ * exposure is the tag from latency frames earlier, so an auto exposure change factor measured
+ * on it gives an absolute target exposure rather than a change relative to the latest request.
+ * Frames still in flight at the old exposure then ask for the same target instead of
+ * compounding the change, so the controller can step straight to the target.
+ *
+ * The latency is measured from the response to each exposure step: change factors stay put
+ * until the first frame captured with the new exposure, where they change by the inverse of
+ * the step.
+ */
+typedef struct {
+    double exposure[AE_HISTORY];    // tagged exposure of recent frames, by frame number
+    uint32_t num_frames;
+
+    // last measurement, log of its change factor
+    uint32_t last_meas_frame;
+    double last_log_factor;
+    int have_meas;
+
+    // exposure step waiting for its response, log of its size
+    uint32_t step_frame;
+    double step_log_size;
+    double step_log_factor;     // log change factor before the step
+    int step_pending;
+
+    unsigned int latency;
+} CMAEController;
+
+// latency is the initial estimate, in frames
+void ae_controller_init(CMAEController *ctl, unsigned int latency);
+
+// record a frame tagged with the exposure requested when it arrived
+// returns the frame number to give ae_controller_measure with its change factor
+uint32_t ae_controller_frame(CMAEController *ctl, double shutter_us, double gain_dB);
+
+/* Takes the auto exposure change factor measured on a frame and returns the exposure to aim
+ * for, as shutter in microseconds times linear gain. Returns 0 if the frame is too old or the
+ * change factor invalid.
+ */
+double ae_controller_measure(CMAEController *ctl, uint32_t frame, double change_factor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // AE_CONTROLLER_H
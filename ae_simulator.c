@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+
+#include "cm_cli_helper.h"
+#include "cmraw.h"
+#include "pipeline.h"
+#include "auto_exposure.h"
+#include "ae_controller.h"
+#include "debayer.h"
+
+/* Closed loop auto exposure simulator
+ *
+ * A scene (from a .cmr file, or a synthetic high dynamic range one) is lit by a light level that
+ * steps between segments. Every frame is rendered with the actual exposure of the simulated
+ * sensor (shutter times gain, shot and read noise, 12 bit clipping), packed as BayerRG12p, and
+ * measured with pipeline_auto_exposure. Exposure requests reach the sensor after a number of
+ * frames in flight, like a real camera stream.
+ *
+ * The step scenario leaves out the scene and noise, an ideal meter reports exactly the change to
+ * the target exposure, so ae_controller's latency estimate and step response can be checked
+ * deterministically for every latency.
+ */
+
+#define SIM_SEGMENT_FRAMES 60
+#define SIM_SYNTH_WIDTH 2048
+#define SIM_SYNTH_HEIGHT 1536
+#define SIM_WHITE 4095
+#define SIM_READ_NOISE 2.0      // DN at 0 dB
+#define SIM_CONVERGED 0.05      // log exposure error counted as converged
+#define SIM_SETTLED_FRAMES 10   // the settled exposure is the mean of a segment's last frames
+#define SIM_DEADBAND 0.02       // log change the latency controller doesn't act on
+#define SIM_STEP_TARGET 20000   // exposure the ideal meter aims for at light level 1
+
+// light level of each segment, relative to the scene as loaded
+static const double light_levels[] = {1.0, 0.125, 4.0, 1.0};
+#define SIM_SEGMENTS (sizeof(light_levels) / sizeof(light_levels[0]))
+
+// same limits and targets as the GUI in auto mode
+static const ExposureLimits limits = {.shutter_min = 20, .shutter_max = 250000,
+                                      .gain_min = 0, .gain_max = 48};
+static const ExposureLimits targets = {.shutter_min = 8000, .shutter_max = 30000,
+                                       .gain_min = 5, .gain_max = 15};
+
+typedef enum {
+    SIM_CTRL_LATENCY,   // ae_controller, as CMAutoExposure
+    SIM_CTRL_BLEND      // measure every other frame, blend half way, relative to the latest request
+} SimController;
+
+// xorshift, so runs are reproducible across platforms
+static uint32_t rng_state = 2463534242u;
+
+static inline uint32_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// approximately normal with unit variance, from the sum of 4 uniforms
+static inline float rng_normal(void)
+{
+    uint32_t sum = (rng_next() >> 8) + (rng_next() >> 8) + (rng_next() >> 8) + (rng_next() >> 8);
+    return (sum * (1.0f / (1 << 24)) - 2.0f) * 1.7320508f;
+}
+
+/* scene radiance in DN per microsecond at 0 dB, from a raw frame and the exposure it was taken
+ * with, clipped pixels stay at the clipping point
+ */
+// cinfo is set to the capture info of the simulated frames, at the exposure of the loaded one
+static int scene_from_cmr(const char *fname, float **scene, CMCaptureInfo *sim_cinfo)
+{
+    CMRawHeader cmrh;
+    void *raw = NULL;
+    int status = cmraw_load(&raw, &cmrh, fname);
+    if (status)
+        return status;
+
+    const CMCaptureInfo *cinfo = &cmrh.cinfo;
+    size_t num_pixels = (size_t)cinfo->width * cinfo->height;
+    uint16_t *bayer = (uint16_t *)malloc(num_pixels * sizeof(uint16_t));
+    *scene = (float *)malloc(num_pixels * sizeof(float));
+    if (bayer == NULL || *scene == NULL) {
+        status = -ENOMEM;
+        goto cleanup;
+    }
+
+    if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P) {
+        unpack12_16(bayer, raw, num_pixels, false);
+    } else if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12
+            || cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG16) {
+        memcpy(bayer, raw, num_pixels * sizeof(uint16_t));
+    } else {
+        status = -EINVAL;
+        goto cleanup;
+    }
+
+    // rescale to 12 bit, the sensor being simulated
+    double exposure = cinfo->shutter_us * pow(10, cinfo->gain_dB / 20);
+    double scale = (double)SIM_WHITE / cmraw_white_level(cinfo) / exposure;
+    for (size_t i = 0; i < num_pixels; i++)
+        (*scene)[i] = bayer[i] * scale;
+
+    *sim_cinfo = *cinfo;
+    sim_cinfo->pixel_fmt = CM_PIXEL_FMT_BAYER_RG12P;
+    sim_cinfo->white_level = 0;
+
+cleanup:
+    if (status) {
+        free(*scene);
+        *scene = NULL;
+    }
+    free(bayer);
+    free(raw);
+    return status;
+}
+
+/* synthetic scene spanning about 14 stops: a horizontal log gradient over 12 stops with coloured
+ * bands, and a small light source 4 stops above the top of the gradient
+ */
+static int scene_synthetic(float **scene, CMCaptureInfo *cinfo)
+{
+    const uint16_t w = SIM_SYNTH_WIDTH;
+    const uint16_t h = SIM_SYNTH_HEIGHT;
+    *scene = (float *)malloc((size_t)w * h * sizeof(float));
+    if (*scene == NULL)
+        return -ENOMEM;
+
+    // camera RGB response of each band, RGGB layout
+    static const float bands[4][3] = {
+        {0.5f, 1.0f, 0.7f},     // neutral under daylight
+        {0.9f, 0.6f, 0.2f},     // warm
+        {0.2f, 0.8f, 0.4f},     // green
+        {0.3f, 0.5f, 1.0f}      // blue
+    };
+
+    // at 10 ms and 0 dB, the top of the gradient sits just below white
+    const double top = SIM_WHITE * 0.9 / 10000;
+    for (unsigned y = 0; y < h; y++) {
+        const float *band = bands[y * 4 / h];
+        for (unsigned x = 0; x < w; x++) {
+            double v = top * pow(2, -12.0 * (w - 1 - x) / (w - 1));
+            if (x >= w * 3 / 4 && x < w * 3 / 4 + w / 32 && y >= h / 8 && y < h / 8 + h / 24)
+                v = top * 16;
+            int chan = (y & 1) + (x & 1);
+            (*scene)[(size_t)y * w + x] = v * band[chan];
+        }
+    }
+
+    memset(cinfo, 0, sizeof(CMCaptureInfo));
+    cinfo->pixel_fmt = CM_PIXEL_FMT_BAYER_RG12P;
+    cinfo->width = w;
+    cinfo->height = h;
+    cinfo->shutter_us = 1000;
+    cinfo->gain_dB = 5;
+    return 0;
+}
+
+// sensor response for one frame, packed as BayerRG12p
+static void render_frame(const float *scene, uint8_t *packed, uint16_t width, uint16_t height,
+        double light, double shutter_us, double gain_dB)
+{
+    const double gain = pow(10, gain_dB / 20);
+    const float scale = light * shutter_us * gain;
+    const float read_noise = SIM_READ_NOISE * gain;
+    size_t num_pixels = (size_t)width * height;
+
+    for (size_t i = 0; i < num_pixels; i += 2) {
+        uint16_t v[2];
+        for (int k = 0; k < 2; k++) {
+            // shot noise variance is the signal in electrons, which is DN / gain at 0 dB = 1 e-
+            float s = scene[i + k] * scale;
+            float noise = sqrtf(s * gain + read_noise * read_noise) * rng_normal();
+            float dn = s + noise + 0.5f;
+            v[k] = dn < 0 ? 0 : (dn > SIM_WHITE ? SIM_WHITE : dn);
+        }
+        uint8_t *p = packed + i / 2 * 3;
+        p[0] = v[0] & 0xFF;
+        p[1] = (v[0] >> 8) | ((v[1] & 0x0F) << 4);
+        p[2] = v[1] >> 4;
+    }
+}
+
+static double thread_cpu_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+// frames until the exposure stays within SIM_CONVERGED of the segment's settled exposure, and
+// the largest excursion past it in the direction of the change
+static void segment_stats(const double *exposure, unsigned start, double *frames,
+        double *overshoot)
+{
+    const unsigned end = start + SIM_SEGMENT_FRAMES;
+    double log_settled = 0;
+    for (unsigned i = end - SIM_SETTLED_FRAMES; i < end; i++)
+        log_settled += log(exposure[i]);
+    const double final = exp(log_settled / SIM_SETTLED_FRAMES);
+    const bool rising = final > exposure[start];
+    unsigned converged = start;
+    *overshoot = 0;
+    for (unsigned i = start; i < end; i++) {
+        double err = log(exposure[i] / final);
+        if (fabs(err) >= SIM_CONVERGED)
+            converged = i + 1;
+        double over = rising ? err : -err;
+        if (over > *overshoot)
+            *overshoot = over;
+    }
+    *frames = converged - start;
+}
+
+// request the exposure ae_controller aims for from a measured change factor, as CMAutoExposure
+static void latency_controller_update(CMAEController *ctl, uint32_t frame, double change_factor,
+        ExposureParams *current)
+{
+    double target = ae_controller_measure(ctl, frame, change_factor);
+    double request = current->shutter_us * pow(10, current->gain_dB / 20);
+    if (!(target > 0) || fabs(log(target / request)) < SIM_DEADBAND)
+        return;
+
+    ExposureParams next;
+    calculate_exposure(current, &next, &limits, &targets, target / request);
+    *current = next;
+}
+
+/* Runs ae_controller with an ideal meter for each latency, measuring every frame and every other
+ * frame, starting from a latency estimate of 2. Measuring every frame must find the exact latency.
+ * Either way a lighting change must be corrected without overshoot by a request that reaches the
+ * sensor latency + 1 frames later, or one frame more when the changed frame isn't measured.
+ * Returns the number of failed runs.
+ */
+static int step_scenario(void)
+{
+    const unsigned num_frames = SIM_SEGMENTS * SIM_SEGMENT_FRAMES;
+    ExposureParams requests[SIM_SEGMENTS * SIM_SEGMENT_FRAMES];
+    double exposure[SIM_SEGMENTS * SIM_SEGMENT_FRAMES];
+    int failures = 0;
+
+    printf("latency  measured  estimate  frames to %.0f%%  overshoot\n",
+            (exp(SIM_CONVERGED) - 1) * 100);
+    for (unsigned latency = 0; latency <= AE_MAX_LATENCY; latency++) {
+        for (unsigned stride = 1; stride <= 2; stride++) {
+            CMAEController ctl;
+            ae_controller_init(&ctl, 2);
+            ExposureParams current = {.shutter_us = 10000, .gain_dB = 5};
+
+            for (unsigned n = 0; n < num_frames; n++) {
+                requests[n] = current;
+                ExposureParams actual = requests[n > latency ? n - latency : 0];
+                double light = light_levels[n / SIM_SEGMENT_FRAMES];
+                exposure[n] = actual.shutter_us * pow(10, actual.gain_dB / 20) * light;
+
+                uint32_t frame = ae_controller_frame(&ctl, current.shutter_us, current.gain_dB);
+                if (n % stride == 0)
+                    latency_controller_update(&ctl, frame, SIM_STEP_TARGET / exposure[n],
+                            &current);
+            }
+
+            // the first segment times the latency, the lighting changes come after it
+            double worst_frames = 0;
+            double worst_overshoot = 0;
+            for (unsigned s = 1; s < SIM_SEGMENTS; s++) {
+                double frames, overshoot;
+                segment_stats(exposure, s * SIM_SEGMENT_FRAMES, &frames, &overshoot);
+                if (frames > worst_frames) worst_frames = frames;
+                if (overshoot > worst_overshoot) worst_overshoot = overshoot;
+            }
+
+            // every other frame only bounds the latency to two frames, or none past the maximum
+            bool pass = (stride > 1 || ctl.latency == latency) && worst_frames <= latency + stride
+                    && worst_overshoot < SIM_CONVERGED;
+            printf("%7u  %8s  %8u  %15.0f  %8.1f%%  %s\n", latency,
+                    stride == 1 ? "all" : "alternate", ctl.latency, worst_frames,
+                    (exp(worst_overshoot) - 1) * 100, pass ? "ok" : "FAIL");
+            if (!pass)
+                failures++;
+        }
+    }
+
+    printf("%d of %d runs failed\n", failures, 2 * (AE_MAX_LATENCY + 1));
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 5) {
+        printf("Usage: %s [cmr_name, synthetic or step] [latency frames (default 2)] "
+               "[controller (latency or blend, default latency)] "
+               "[metering (average, centre, spot or matrix, default average)]\n", argv[0]);
+        return -1;
+    }
+
+    unsigned latency = 2;
+    if (argc >= 3) {
+        latency = atoi(argv[2]);
+        if (latency > AE_MAX_LATENCY) {
+            printf("Invalid latency: %s\n", argv[2]);
+            return -1;
+        }
+    }
+
+    // the step scenario runs every latency with the latency controller and an ideal meter
+    if (strcmp(argv[1], "step") == 0)
+        return step_scenario() ? 1 : 0;
+
+    SimController controller_type = SIM_CTRL_LATENCY;
+    if (argc >= 4) {
+        if (strcmp(argv[3], "latency") == 0) {
+            controller_type = SIM_CTRL_LATENCY;
+        } else if (strcmp(argv[3], "blend") == 0) {
+            controller_type = SIM_CTRL_BLEND;
+        } else {
+            printf("Invalid controller: %s\n", argv[3]);
+            return -1;
+        }
+    }
+
+    CMMeteringParams metering = {.mode = CMMETER_AVERAGE, .spot_x = UINT16_MAX,
+                                 .spot_y = UINT16_MAX};
+    if (argc >= 5) {
+        static const char *modes[] = {"average", "centre", "spot", "matrix"};
+        unsigned m = 0;
+        while (m < 4 && strcmp(argv[4], modes[m]) != 0)
+            m++;
+        if (m == 4) {
+            printf("Invalid metering mode: %s\n", argv[4]);
+            return -1;
+        }
+        metering.mode = (CMMeteringMode)m;
+    }
+
+    float *scene = NULL;
+    CMCaptureInfo cinfo;
+    int status;
+    if (strcmp(argv[1], "synthetic") == 0) {
+        status = scene_synthetic(&scene, &cinfo);
+    } else if (endswith(argv[1], ".cmr")) {
+        status = scene_from_cmr(argv[1], &scene, &cinfo);
+    } else {
+        printf("Invalid input extension: %s\n", argv[1]);
+        return -1;
+    }
+    if (status) {
+        printf("Error %d loading scene.\n", status);
+        return status;
+    }
+
+    const uint16_t width = cinfo.width;
+    const uint16_t height = cinfo.height;
+    const unsigned num_frames = SIM_SEGMENTS * SIM_SEGMENT_FRAMES;
+    uint8_t *packed = (uint8_t *)malloc((size_t)width * height * 3 / 2);
+    ExposureParams *requests = (ExposureParams *)malloc(num_frames * sizeof(ExposureParams));
+    double *exposure = (double *)malloc(num_frames * sizeof(double));
+    if (packed == NULL || requests == NULL || exposure == NULL) {
+        printf("Out of memory.\n");
+        status = -ENOMEM;
+        goto cleanup;
+    }
+
+    CMAEController ctl;
+    ae_controller_init(&ctl, 2);
+    ExposureParams current = {.shutter_us = cinfo.shutter_us, .gain_dB = cinfo.gain_dB};
+    double cpu_total = 0;
+    double cpu_max = 0;
+    unsigned num_measured = 0;
+
+    for (unsigned n = 0; n < num_frames; n++) {
+        // requests made after frame n - 1 - latency reach the sensor for this frame
+        requests[n] = current;
+        ExposureParams actual = requests[n > latency ? n - latency : 0];
+        double light = light_levels[n / SIM_SEGMENT_FRAMES];
+        exposure[n] = actual.shutter_us * pow(10, actual.gain_dB / 20) * light;
+        render_frame(scene, packed, width, height, light, actual.shutter_us, actual.gain_dB);
+
+        // frames are tagged with the latest request, as when capturing
+        cinfo.shutter_us = current.shutter_us;
+        cinfo.gain_dB = current.gain_dB;
+
+        double start = thread_cpu_us();
+        bool measure = controller_type == SIM_CTRL_LATENCY || n % 2 == 1;
+        uint32_t frame = ae_controller_frame(&ctl, current.shutter_us, current.gain_dB);
+        double change_factor = 0;
+        if (measure) {
+            status = pipeline_auto_exposure(packed, &cinfo, &default_pipeline_params,
+                    &metering, &change_factor);
+            if (status) {
+                printf("Error %d in auto exposure.\n", status);
+                goto cleanup;
+            }
+
+            if (controller_type == SIM_CTRL_LATENCY) {
+                latency_controller_update(&ctl, frame, change_factor, &current);
+            } else {
+                ExposureParams next;
+                calculate_exposure(&current, &next, &limits, &targets,
+                        0.5 * change_factor + 0.5);
+                current = next;
+            }
+        }
+        double cpu = thread_cpu_us() - start;
+
+        if (measure) {
+            cpu_total += cpu;
+            if (cpu > cpu_max) cpu_max = cpu;
+            num_measured++;
+        }
+    }
+
+    printf("Scene %ux%u, latency %u frames, %s controller\n", width, height, latency,
+            controller_type == SIM_CTRL_LATENCY ? "latency" : "blend");
+    printf("segment  light  frames to %.0f%%  overshoot  final shutter (us)  gain (dB)\n",
+            (exp(SIM_CONVERGED) - 1) * 100);
+    double worst_frames = 0;
+    double worst_overshoot = 0;
+    for (unsigned s = 0; s < SIM_SEGMENTS; s++) {
+        unsigned start = s * SIM_SEGMENT_FRAMES;
+        double frames, overshoot;
+        segment_stats(exposure, start, &frames, &overshoot);
+        const ExposureParams *end = &requests[start + SIM_SEGMENT_FRAMES - 1];
+        printf("%7u  %5.3f  %15.0f  %8.1f%%  %18.0f  %9.2f\n", s, light_levels[s], frames,
+                (exp(overshoot) - 1) * 100, end->shutter_us, end->gain_dB);
+        // the first segment starts from an arbitrary exposure rather than a lighting change
+        if (s > 0 && frames > worst_frames) worst_frames = frames;
+        if (s > 0 && overshoot > worst_overshoot) worst_overshoot = overshoot;
+    }
+    printf("Worst after a lighting change: %.0f frames, %.1f%% overshoot\n", worst_frames,
+            (exp(worst_overshoot) - 1) * 100);
+    printf("CPU per measured frame: %.1f us mean, %.1f us max (%u frames)\n",
+            cpu_total / num_measured, cpu_max, num_measured);
+    status = 0;
+
+cleanup:
+    free(scene);
+    free(packed);
+    free(requests);
+    free(exposure);
+    return status;
+}
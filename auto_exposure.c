@@ -6,6 +6,38 @@
 #include "auto_exposure.h"
 #include "colour_xfrm.h"
 #include "ycrcg.h"
+#include "debayer.h"
+
+// histograms of samples from raw data have at most this many bins, wider data is shifted down
+#define RAW_HIST_BITS 12
+
+// metering luminance grid is at most this many samples wide or high
+#define METER_GRID 128
+// spot size as a fraction of the image height
+#define METER_SPOT_SIZE 0.08
+// matrix metering uses a grid of this many zones square, zones brighter than the median by more
+// than METER_ZONE_LIMIT times count as that bright
+#define METER_ZONES 5
+#define METER_ZONE_LIMIT 2.0
+// metered means are aimed at this fraction of the 90th percentile target
+#define METER_MEAN_TARGET 0.4
+// spot metering changes exposure by at most this factor per measurement, which isn't 2 so a
+// step down isn't taken for AE_CLIPPED_FACTOR
+#define METER_SPOT_MAX_STEP 2.5
+
+// chroma histogram for robust white balance, covering normalized Cr and Cg of +/-1.5 which
+// includes every colour without negative components (the primaries are at sqrt(2))
+#define AWB_HIST_BINS 96
+#define AWB_HIST_RANGE 1.5f
+
+typedef struct {
+    ColourPixel_f sum;      // sum of the samples in the bin
+    unsigned count;
+} ChromaBin;
+
+typedef struct {
+    ChromaBin bins[AWB_HIST_BINS * AWB_HIST_BINS];
+} ChromaHist;
 
 static uint16_t pick_samp_pitch(uint16_t width, uint16_t height)
 {
@@ -154,20 +186,12 @@ double auto_hdr_shadow(const uint16_t *img_rgb, uint16_t width, uint16_t height,
     return gain10 > gain90 ? gain10 : gain90;
 }
 
-/* Returns exposure multiplication factor to make the 90th percentile value of the brightest
- * channel equal to percentile90 argument. However, the returned factor would be reduced
- * if needed to ensure the 99.5th percentile of the brightest channel <= percentile99;
- *
- * Note: this assumes green is the brightest channel in camera space
- */
-double auto_exposure(const uint16_t *img_rgb, uint16_t width, uint16_t height,
+// exposure change factor from the percentiles of each channel, see auto_exposure
+// if non-zero, metered_gain replaces the gain to bring the 90th percentile to its target
+static double exposure_factor(uint16_t *p10, uint16_t *p90, uint16_t *p99,
         uint16_t percentile90, uint16_t percentile99, uint16_t white,
-        const ColourPixel *cam_white)
+        const ColourPixel *cam_white, double metered_gain)
 {
-    uint16_t p10[3], p90[3], p99[3];
-    if (exposure_percentiles_rgb(img_rgb, width, height, p10, p90, p99))
-        return 1.0;
-
     double red_factor = cam_white->p[1] / cam_white->p[0];
     double blue_factor = cam_white->p[1] / cam_white->p[2];
     p10[0] *= red_factor;
@@ -187,15 +211,287 @@ double auto_exposure(const uint16_t *img_rgb, uint16_t width, uint16_t height,
     }
 
     // quickly darken if p99 is clipped
-    if (p99_max >= white) return 0.5;
+    if (p99_max >= white) return AE_CLIPPED_FACTOR;
 
     // now calculate the exposure change factor based on our rules
-    double gain90 = (double)percentile90 / p90_max;
+    double gain90 = metered_gain > 0 ? metered_gain : (double)percentile90 / p90_max;
     double gain99 = (double)percentile99 / p99_max;
 
     return gain90 < gain99 ? gain90 : gain99;
 }
 
+/* Returns exposure multiplication factor to make the 90th percentile value of the brightest
+ * channel equal to percentile90 argument. However, the returned factor would be reduced
+ * if needed to ensure the 99.5th percentile of the brightest channel <= percentile99;
+ *
+ * Note: this assumes green is the brightest channel in camera space
+ */
+double auto_exposure(const uint16_t *img_rgb, uint16_t width, uint16_t height,
+        uint16_t percentile90, uint16_t percentile99, uint16_t white,
+        const ColourPixel *cam_white)
+{
+    uint16_t p10[3], p90[3], p99[3];
+    if (exposure_percentiles_rgb(img_rgb, width, height, p10, p90, p99))
+        return 1.0;
+
+    return exposure_factor(p10, p90, p99, percentile90, percentile99, white, cam_white, 0);
+}
+
+// value of the percentile of num_samples samples in hist, as would be found by sorting them
+static uint16_t hist_percentile(const uint32_t *hist, unsigned num_samples, double percentile,
+        unsigned shift)
+{
+    unsigned rank = num_samples * percentile;
+    unsigned count = 0;
+    for (unsigned i = 0; i < (1 << RAW_HIST_BITS); i++) {
+        count += hist[i];
+        if (count > rank)
+            return i << shift;
+    }
+    return ((1 << RAW_HIST_BITS) - 1) << shift;
+}
+
+// sample grid over the 2x2 binned image of raw data, same as used for binned RGB images
+static int raw_samp_grid(const CMCaptureInfo *cinfo, uint16_t *samp_pitch,
+        uint16_t *samp_width, uint16_t *samp_height)
+{
+    if (cinfo->pixel_fmt != CM_PIXEL_FMT_BAYER_RG12P
+            && cinfo->pixel_fmt != CM_PIXEL_FMT_BAYER_RG12
+            && cinfo->pixel_fmt != CM_PIXEL_FMT_BAYER_RG16)
+        return -EINVAL;
+
+    *samp_pitch = pick_samp_pitch(cinfo->width >> 1, cinfo->height >> 1);
+    *samp_width = (cinfo->width >> 1) / *samp_pitch;
+    *samp_height = (cinfo->height >> 1) / *samp_pitch;
+    return 0;
+}
+
+// RGGB pixel layout for each 2x2 square, green is the average of both like debayer22_binned
+// n is the index of the top left pixel of the bin
+static inline void raw_bin(const void *raw, bool packed, uint16_t width, size_t n,
+        uint16_t *rgb)
+{
+    if (packed) {
+        rgb[0] = packed12_pixel(raw, n);
+        rgb[1] = (packed12_pixel(raw, n + 1) + packed12_pixel(raw, n + width)) >> 1;
+        rgb[2] = packed12_pixel(raw, n + width + 1);
+    } else {
+        const uint16_t *raw16 = (const uint16_t *)raw;
+        rgb[0] = raw16[n];
+        rgb[1] = (raw16[n + 1] + raw16[n + width]) >> 1;
+        rgb[2] = raw16[n + width + 1];
+    }
+}
+
+// percentiles of each channel of the 2x2 binned image, sampled like exposure_percentiles_rgb
+static int exposure_percentiles_raw(const void *raw, const CMCaptureInfo *cinfo,
+        uint16_t *percentile10, uint16_t *percentile90, uint16_t *percentile99)
+{
+    const uint16_t width = cinfo->width;
+    const bool packed = cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P;
+    uint16_t samp_pitch, samp_width, samp_height;
+    if (raw_samp_grid(cinfo, &samp_pitch, &samp_width, &samp_height))
+        return -EINVAL;
+
+    unsigned shift = 0;
+    while ((cmraw_white_level(cinfo) >> shift) >= (1 << RAW_HIST_BITS))
+        shift++;
+
+    uint32_t *hist = (uint32_t *)calloc(3 << RAW_HIST_BITS, sizeof(uint32_t));
+    if (hist == NULL)
+        return -ENOMEM;
+
+    for (unsigned y = 0; y < samp_height; y++) {
+        size_t row = (size_t)y * samp_pitch * 2 * width;
+        for (unsigned x = 0; x < samp_width; x++) {
+            uint16_t rgb[3];
+            raw_bin(raw, packed, width, row + x * samp_pitch * 2, rgb);
+            for (int chan = 0; chan < 3; chan++)
+                hist[(chan << RAW_HIST_BITS) + (rgb[chan] >> shift)]++;
+        }
+    }
+
+    unsigned num_samples = samp_width * samp_height;
+    for (int chan = 0; chan < 3; chan++) {
+        const uint32_t *chan_hist = hist + (chan << RAW_HIST_BITS);
+        percentile10[chan] = hist_percentile(chan_hist, num_samples, 0.1, shift);
+        percentile90[chan] = hist_percentile(chan_hist, num_samples, 0.9, shift);
+        percentile99[chan] = hist_percentile(chan_hist, num_samples, 0.995, shift);
+    }
+
+    free(hist);
+    return 0;
+}
+
+// mean of the summed area table's image over [x0, x1) x [y0, y1)
+static inline double sat_mean(const double *sat, unsigned sat_width, unsigned x0, unsigned y0,
+        unsigned x1, unsigned y1)
+{
+    double sum = sat[y1*sat_width + x1] - sat[y0*sat_width + x1]
+               - sat[y1*sat_width + x0] + sat[y0*sat_width + x0];
+    return sum / ((x1 - x0) * (y1 - y0));
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+    double c = *(double *)a - *(double *)b;
+    return (c > 0) - (c < 0);
+}
+
+// metered luminance for the centre, spot and matrix modes, in raw units
+static int metered_level(const void *raw, const CMCaptureInfo *cinfo,
+        const CMMeteringParams *metering, const ColourPixel *cam_white, double *level)
+{
+    const uint16_t width = cinfo->width;
+    const bool packed = cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P;
+    const unsigned bin_width = cinfo->width >> 1;
+    const unsigned bin_height = cinfo->height >> 1;
+
+    // luminance is sampled more densely than for percentiles so small spots have enough samples
+    unsigned pitch = ((bin_width > bin_height ? bin_width : bin_height) + METER_GRID - 1)
+            / METER_GRID;
+    if (pitch == 0) pitch = 1;
+    const unsigned grid_width = bin_width / pitch;
+    const unsigned grid_height = bin_height / pitch;
+    if (grid_width == 0 || grid_height == 0)
+        return -EINVAL;
+
+    // summed area table, with a row and column of zeros at the top and left
+    const unsigned sat_width = grid_width + 1;
+    double *sat = (double *)calloc(sat_width * (grid_height + 1), sizeof(double));
+    if (sat == NULL)
+        return -ENOMEM;
+
+    // luminance as the average of white balanced channels, so grey has the value of green
+    const double red_factor = cam_white->p[1] / cam_white->p[0] / 3;
+    const double blue_factor = cam_white->p[1] / cam_white->p[2] / 3;
+    for (unsigned y = 0; y < grid_height; y++) {
+        size_t row = (size_t)y * pitch * 2 * width;
+        double row_sum = 0;
+        for (unsigned x = 0; x < grid_width; x++) {
+            uint16_t rgb[3];
+            raw_bin(raw, packed, width, row + x * pitch * 2, rgb);
+            row_sum += rgb[0] * red_factor + rgb[1] * (1.0 / 3) + rgb[2] * blue_factor;
+            sat[(y + 1)*sat_width + x + 1] = sat[y*sat_width + x + 1] + row_sum;
+        }
+    }
+
+    switch (metering->mode) {
+    case CMMETER_CENTRE: {
+        /* nested rectangles around the centre, half and a quarter of each dimension, so the
+         * weight of each pixel is 1 outside, 3 in the middle and 6 in the centre:
+         *  level = sum(weight_i * sum_i) / sum(weight_i * area_i)
+         */
+        const double weights[3] = {1, 2, 3};
+        const unsigned border_eighths[3] = {0, 2, 3};
+        double sum = 0;
+        double area = 0;
+        for (unsigned i = 0; i < 3; i++) {
+            unsigned bx = grid_width * border_eighths[i] / 8;
+            unsigned by = grid_height * border_eighths[i] / 8;
+            double rect_area = (double)(grid_width - 2*bx) * (grid_height - 2*by);
+            sum += weights[i] * rect_area * sat_mean(sat, sat_width, bx, by,
+                    grid_width - bx, grid_height - by);
+            area += weights[i] * rect_area;
+        }
+        *level = sum / area;
+        break;
+    }
+    case CMMETER_SPOT: {
+        unsigned size = grid_height * METER_SPOT_SIZE;
+        if (size < 1) size = 1;
+        unsigned cx = metering->spot_x / pitch;
+        unsigned cy = metering->spot_y / pitch;
+        if (cx >= grid_width || cy >= grid_height) {
+            cx = grid_width / 2;
+            cy = grid_height / 2;
+        }
+        unsigned x0 = cx > size / 2 ? cx - size / 2 : 0;
+        unsigned y0 = cy > size / 2 ? cy - size / 2 : 0;
+        unsigned x1 = x0 + size < grid_width ? x0 + size : grid_width;
+        unsigned y1 = y0 + size < grid_height ? y0 + size : grid_height;
+        *level = sat_mean(sat, sat_width, x0, y0, x1, y1);
+        break;
+    }
+    case CMMETER_MATRIX: {
+        // zones are weighted towards the centre, and bright zones (sky, lights) are limited to
+        // a multiple of the median zone so they can't dominate the result
+        double zones[METER_ZONES * METER_ZONES];
+        double sorted[METER_ZONES * METER_ZONES];
+        for (unsigned zy = 0; zy < METER_ZONES; zy++) {
+            for (unsigned zx = 0; zx < METER_ZONES; zx++) {
+                unsigned x0 = grid_width * zx / METER_ZONES;
+                unsigned y0 = grid_height * zy / METER_ZONES;
+                unsigned x1 = grid_width * (zx + 1) / METER_ZONES;
+                unsigned y1 = grid_height * (zy + 1) / METER_ZONES;
+                double mean = x1 > x0 && y1 > y0 ? sat_mean(sat, sat_width, x0, y0, x1, y1) : 0;
+                zones[zy*METER_ZONES + zx] = mean;
+                sorted[zy*METER_ZONES + zx] = mean;
+            }
+        }
+        qsort(sorted, METER_ZONES * METER_ZONES, sizeof(double), double_cmp);
+        double limit = sorted[METER_ZONES * METER_ZONES / 2] * METER_ZONE_LIMIT;
+
+        double sum = 0;
+        double weight_sum = 0;
+        for (int zy = 0; zy < METER_ZONES; zy++) {
+            for (int zx = 0; zx < METER_ZONES; zx++) {
+                int dx = abs(2*zx - (METER_ZONES - 1)) / 2;
+                int dy = abs(2*zy - (METER_ZONES - 1)) / 2;
+                int ring = dx > dy ? dx : dy;
+                double weight = ring == 0 ? 4 : (ring == 1 ? 2 : 1);
+                double z = zones[zy*METER_ZONES + zx];
+                sum += weight * (z < limit ? z : limit);
+                weight_sum += weight;
+            }
+        }
+        *level = sum / weight_sum;
+        break;
+    }
+    default:
+        *level = sat_mean(sat, sat_width, 0, 0, grid_width, grid_height);
+    }
+
+    free(sat);
+    return 0;
+}
+
+int auto_exposure_raw(const void *raw, const CMCaptureInfo *cinfo,
+        const CMMeteringParams *metering, uint16_t percentile90, uint16_t percentile99,
+        uint16_t white, const ColourPixel *cam_white, double *change_factor)
+{
+    uint16_t p10[3], p90[3], p99[3];
+    int status = exposure_percentiles_raw(raw, cinfo, p10, p90, p99);
+    if (status)
+        return status;
+
+    double metered_gain = 0;
+    if (metering->mode != CMMETER_AVERAGE) {
+        double level;
+        status = metered_level(raw, cinfo, metering, cam_white, &level);
+        if (status)
+            return status;
+        if (level < 1) level = 1;
+        metered_gain = percentile90 * METER_MEAN_TARGET / level;
+
+        /* spot metering exposes for the spot regardless of the rest of the frame, a spot far off
+         * its target is likely clipped or in noise so it's measured again after a limited step
+         */
+        if (metering->mode == CMMETER_SPOT) {
+            if (metered_gain < 1 / METER_SPOT_MAX_STEP)
+                metered_gain = 1 / METER_SPOT_MAX_STEP;
+            else if (metered_gain > METER_SPOT_MAX_STEP)
+                metered_gain = METER_SPOT_MAX_STEP;
+            *change_factor = metered_gain;
+            return 0;
+        }
+    }
+
+    *change_factor = exposure_factor(p10, p90, p99, percentile90, percentile99, white,
+            cam_white, metered_gain);
+    return 0;
+}
+
 // Returns darkest pixel value in green channel or 0.02, whichever is lower
 float auto_black_point(const float *img_rgb, uint16_t width, uint16_t height)
 {
@@ -303,6 +599,87 @@ cleanup:
     free(samp_buf);
 }
 
+static void chroma_hist_add(ChromaHist *hist, const ColourPixel_f *rgb)
+{
+    ColourPixel_f ycrcg;
+    pixel_xfrm_f(rgb, &ycrcg, &CMf_RGB2YCrCg);
+
+    // black or below has no meaningful chroma, and would never pass the threshold anyway
+    if (!(ycrcg.p[0] > 0))
+        return;
+
+    const float scale = AWB_HIST_BINS / (2 * AWB_HIST_RANGE);
+    int u = (ycrcg.p[1] / ycrcg.p[0] + AWB_HIST_RANGE) * scale;
+    int v = (ycrcg.p[2] / ycrcg.p[0] + AWB_HIST_RANGE) * scale;
+    u = u < 0 ? 0 : (u >= AWB_HIST_BINS ? AWB_HIST_BINS - 1 : u);
+    v = v < 0 ? 0 : (v >= AWB_HIST_BINS ? AWB_HIST_BINS - 1 : v);
+
+    ChromaBin *bin = &hist->bins[v * AWB_HIST_BINS + u];
+    for (unsigned chan = 0; chan < 3; chan++)
+        bin->sum.p[chan] += rgb->p[chan];
+    bin->count++;
+}
+
+// grey_sum over histogram bins, for the samples with red and blue multiplied by the given gains
+static unsigned grey_sum_hist(const ChromaBin *bins, unsigned num_bins, double red, double blue,
+        double chroma_thresh, ColourPixel_f *colour_sum)
+{
+    double thresh = chroma_thresh * chroma_thresh;
+    unsigned num_pixels = 0;
+    memset(colour_sum, 0, sizeof(ColourPixel_f));
+
+    for (unsigned i = 0; i < num_bins; i++) {
+        // chroma doesn't depend on brightness, so the bin's sum stands in for its samples
+        ColourPixel_f sum = {.p={bins[i].sum.p[0] * red, bins[i].sum.p[1],
+                                 bins[i].sum.p[2] * blue}};
+        if (chroma_square(&sum) < thresh) {
+            num_pixels += bins[i].count;
+            for (unsigned chan = 0; chan < 3; chan++)
+                colour_sum->p[chan] += sum.p[chan];
+        }
+    }
+
+    return num_pixels;
+}
+
+/* Solves robust white balance from the chroma histogram of num_samples samples
+ *
+ * White balance only scales red and blue, and chroma is independent of brightness, so samples
+ * with the same chroma stay together as the gains change. Each iteration then only needs to
+ * look at the occupied bins rather than transforming and testing every sample again.
+ */
+static void robust_white_hist(ChromaHist *hist, unsigned num_samples, double *red,
+        double *blue)
+{
+    *red = 1;
+    *blue = 1;
+
+    // gather the occupied bins at the start
+    unsigned num_bins = 0;
+    for (unsigned i = 0; i < AWB_HIST_BINS * AWB_HIST_BINS; i++) {
+        if (hist->bins[i].count)
+            hist->bins[num_bins++] = hist->bins[i];
+    }
+
+    // Start with grey-ish world, then iteratively tighten the chroma threshold
+    ColourPixel_f colour_sum;
+    unsigned pixel_thresh = num_samples * 0.05;
+    double chroma_thresh = 0.8;
+    unsigned num_pixels = grey_sum_hist(hist->bins, num_bins, *red, *blue, chroma_thresh,
+            &colour_sum);
+
+    while (num_pixels > pixel_thresh) {
+        *red *= colour_sum.p[1] / colour_sum.p[0];
+        *blue *= colour_sum.p[1] / colour_sum.p[2];
+
+        chroma_thresh *= 0.6;
+        if (chroma_thresh < 0.1) break;
+
+        num_pixels = grey_sum_hist(hist->bins, num_bins, *red, *blue, chroma_thresh,
+                &colour_sum);
+    }
+}
+
 // Huo's Robust Automatic White Balance
 // https://web.stanford.edu/~sujason/ColorBalancing/robustawb.html
 // outputs: red is ratio to multiply red by, blue is ratio to multiply blue by
@@ -316,48 +693,54 @@ void auto_white_balance_robust(const float *img_rgb, uint16_t width, uint16_t he
     *red = 1;
     *blue = 1;
 
-    const size_t samp_buf_size = samp_width * samp_height * sizeof(ColourPixel_f);
-    ColourPixel_f *samp_buf = (ColourPixel_f *)malloc(samp_buf_size);
-    ColourPixel_f *samp_buf2 = (ColourPixel_f *)malloc(samp_buf_size);
-    if (samp_buf == NULL || samp_buf2 == NULL) {
-        goto cleanup;
-    }
+    ChromaHist *hist = (ChromaHist *)calloc(1, sizeof(ChromaHist));
+    if (hist == NULL)
+        return;
 
-    // populate samp_buf with downsampled image
     for (unsigned y = 0; y < samp_height; y++) {
         for (unsigned x = 0; x < samp_width; x++) {
-            memcpy(&samp_buf[y*samp_width + x], &img_rgb[(y*samp_pitch*width + x*samp_pitch)*3],
-                    sizeof(ColourPixel_f));
+            const float *rgb = &img_rgb[(y*samp_pitch*width + x*samp_pitch)*3];
+            chroma_hist_add(hist, (const ColourPixel_f *)rgb);
         }
     }
+    robust_white_hist(hist, samp_width * samp_height, red, blue);
 
-    // Start with grey-ish world, then iteratively tighten the chroma threshold
-    ColourPixel_f colour_sum;
-    unsigned pixel_thresh = samp_width * samp_height * 0.05;
-    double chroma_thresh = 0.8;
-    unsigned num_pixels = grey_sum(samp_buf, samp_width, samp_height, chroma_thresh, &colour_sum);
+    free(hist);
+}
 
-    while (num_pixels > pixel_thresh) {
-        *red *= colour_sum.p[1] / colour_sum.p[0];
-        *blue *= colour_sum.p[1] / colour_sum.p[2];
+int auto_white_balance_robust_raw(const void *raw, const CMCaptureInfo *cinfo,
+        const ColourMatrix_f *cmat, double *red, double *blue)
+{
+    const uint16_t width = cinfo->width;
+    const bool packed = cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P;
+    uint16_t samp_pitch, samp_width, samp_height;
+    if (raw_samp_grid(cinfo, &samp_pitch, &samp_width, &samp_height))
+        return -EINVAL;
 
-        chroma_thresh *= 0.6;
-        if (chroma_thresh < 0.1) break;
+    *red = 1;
+    *blue = 1;
 
-        // transform image based on this iteration
-        ColourMatrix cmat;
-        ColourMatrix_f cmat_f;
-        colour_matrix(&cmat, *red, *blue, 0, 1);
-        cmat_d2f(&cmat, &cmat_f);
-        colour_xfrm((float *)samp_buf, (float *)samp_buf2, samp_width, samp_height, &cmat_f);
+    ChromaHist *hist = (ChromaHist *)calloc(1, sizeof(ChromaHist));
+    if (hist == NULL)
+        return -ENOMEM;
 
-        // now perform grey colour calculation with current threshold
-        num_pixels = grey_sum(samp_buf2, samp_width, samp_height, chroma_thresh, &colour_sum);
+    const float inv_white = 1.0f / cmraw_white_level(cinfo);
+    for (unsigned y = 0; y < samp_height; y++) {
+        size_t row = (size_t)y * samp_pitch * 2 * width;
+        for (unsigned x = 0; x < samp_width; x++) {
+            uint16_t rgb[3];
+            raw_bin(raw, packed, width, row + x * samp_pitch * 2, rgb);
+            ColourPixel_f cam = {.p={rgb[0] * inv_white, rgb[1] * inv_white,
+                                     rgb[2] * inv_white}};
+            ColourPixel_f out;
+            pixel_xfrm_f(&cam, &out, cmat);
+            chroma_hist_add(hist, &out);
+        }
     }
+    robust_white_hist(hist, samp_width * samp_height, red, blue);
 
-cleanup:
-    free(samp_buf);
-    free(samp_buf2);
+    free(hist);
+    return 0;
 }
 
 // spot white balance at specified coordinates (relative to top left)
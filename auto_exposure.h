@@ -7,6 +7,7 @@ extern "C" {
 
 #include <stdint.h>
 #include "colour_xfrm.h"
+#include "cmraw.h"
 
 // find the 10th, 90th, and 99.5th percentile exposure values of the brightest channels
 int exposure_percentiles(const uint16_t *img_rgb, uint16_t width, uint16_t height,
@@ -16,6 +17,10 @@ int exposure_percentiles(const uint16_t *img_rgb, uint16_t width, uint16_t heigh
 double auto_hdr_shadow(const uint16_t *img_rgb, uint16_t width, uint16_t height,
         uint16_t percentile10, uint16_t percentile90);
 
+// factor returned when the 99.5th percentile is clipped, the exposure is too high by an
+// unknown amount
+#define AE_CLIPPED_FACTOR 0.5
+
 /* Returns exposure multiplication factor to make the 90th percentile value of the brightest
  * channel equal to percentile90 argument. However, the returned factor would be reduced
  * if needed to ensure the 99.5th percentile of the brightest channel <= percentile99;
@@ -24,6 +29,36 @@ double auto_exposure(const uint16_t *img_rgb, uint16_t width, uint16_t height,
         uint16_t percentile90, uint16_t percentile99, uint16_t white,
         const ColourPixel *cam_white);
 
+typedef enum {
+    CMMETER_AVERAGE,    // whole frame percentiles, as auto_exposure
+    CMMETER_CENTRE,     // centre weighted mean
+    CMMETER_SPOT,       // mean of a small area, highlights elsewhere are ignored
+    CMMETER_MATRIX      // weighted mean of a grid of zones, bright zones are discounted
+} CMMeteringMode;
+
+typedef struct {
+    CMMeteringMode mode;
+
+    // for spot mode, centre in 2x2 binned image coordinates (as for spot white balance)
+    // coordinates outside the image meter the centre
+    uint16_t spot_x;
+    uint16_t spot_y;
+} CMMeteringParams;
+
+/* Same as auto_exposure, but takes raw Bayer data (RG12P, RG12 or RG16) and only decodes the
+ * 2x2 pixel bins it samples, so the cost depends on the number of samples, not the frame size.
+ * With CMMETER_AVERAGE the result matches auto_exposure on the debayer22_binned image.
+ *
+ * The other metering modes aim the metered mean at a fixed fraction of percentile90, from a
+ * summed area table of a sampled luminance image, and apart from spot metering still limit
+ * the 99.5th percentile of the whole frame.
+ *
+ * Returns 0 on success or a negative error code
+ */
+int auto_exposure_raw(const void *raw, const CMCaptureInfo *cinfo,
+        const CMMeteringParams *metering, uint16_t percentile90, uint16_t percentile99,
+        uint16_t white, const ColourPixel *cam_white, double *change_factor);
+
 // Returns darkest pixel value in green channel or 0.02, whichever is lower
 float auto_black_point(const float *img_rgb, uint16_t width, uint16_t height);
 
@@ -41,6 +76,15 @@ void auto_white_balance_grey_world(const float *img_rgb, uint16_t width, uint16_
 void auto_white_balance_robust(const float *img_rgb, uint16_t width, uint16_t height,
         double *red, double *blue);
 
+/* Same as auto_white_balance_robust, but takes raw Bayer data (RG12P, RG12 or RG16) and only
+ * decodes the 2x2 pixel bins it samples. cmat converts camera RGB to the colour space to
+ * balance in. Cheap enough to run on every preview frame.
+ *
+ * Returns 0 on success or a negative error code
+ */
+int auto_white_balance_robust_raw(const void *raw, const CMCaptureInfo *cinfo,
+        const ColourMatrix_f *cmat, double *red, double *blue);
+
 // spot white balance at specified coordinates (relative to top left)
 // outputs: red is ratio to multiply red by, blue is ratio to multiply blue by
 void auto_white_balance_spot(const float *img_rgb, uint16_t width, uint16_t height,
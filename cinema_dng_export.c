@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cm_cli_helper.h"
+#include "cm_parallel.h"
+#include "cmraw.h"
+#include "cmv.h"
+#include "dng.h"
+
+// frames are exported from a recording or a directory of .cmr files
+typedef struct {
+    CMVideoReader *video;
+    const char *dir;
+    char **files;               // sorted
+    uint32_t num_frames;
+    uint32_t *positions;        // in the sequence, with gaps where frames were dropped
+
+    const char *out_dir;
+    const char *reel_name;
+    CMDNGCompression compression;
+    CMDNGFrameInfo frame;       // timecode of the first frame
+    float white_x;              // of the first frame, so the sequence grades the same
+    float white_y;
+
+    /* Each worker converts one frame at a time into a frame buffer of its own, which bounds
+     * the memory used. Frames are written under a temporary name and only renamed once every
+     * frame before them has been, so finished files always form an unbroken sequence.
+     */
+    pthread_mutex_t lock;
+    uint32_t next;              // next frame to convert
+    uint32_t next_publish;      // frames before this have their final names
+    uint8_t *done;
+    uint64_t bytes_written;
+    int status;
+} ExportJob;
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int list_cmr_files(const char *dir, char ***files, uint32_t *num_files)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return -errno;
+
+    uint32_t num = 0;
+    uint32_t cap = 0;
+    char **names = NULL;
+    struct dirent *ent;
+    int status = 0;
+    while ((ent = readdir(d)) != NULL) {
+        if (!endswith(ent->d_name, ".cmr"))
+            continue;
+        if (num == cap) {
+            cap = cap ? cap * 2 : 256;
+            char **grown = (char **)realloc(names, cap * sizeof(char *));
+            if (grown == NULL) {
+                status = -ENOMEM;
+                break;
+            }
+            names = grown;
+        }
+        names[num] = strdup(ent->d_name);
+        if (names[num] == NULL) {
+            status = -ENOMEM;
+            break;
+        }
+        num++;
+    }
+    closedir(d);
+
+    if (status) {
+        for (uint32_t i = 0; i < num; i++)
+            free(names[i]);
+        free(names);
+        return status;
+    }
+    qsort(names, num, sizeof(char *), compare_names);
+    *files = names;
+    *num_files = num;
+    return 0;
+}
+
+/* frame rate as a fraction, rates within 0.05% of a whole number or of 1000/1001 of one (the
+ * NTSC rates, e.g. 29.97) are taken to be exactly that
+ */
+static void frame_rate_fraction(double fps, uint32_t *num, uint32_t *den)
+{
+    double whole = round(fps);
+    double ntsc = round(fps * 1001 / 1000);
+    if (fabs(fps - whole) <= 0.0005 * fps) {
+        *num = whole;
+        *den = 1;
+    } else if (fabs(fps - ntsc * 1000 / 1001) <= 0.0005 * fps) {
+        *num = ntsc * 1000;
+        *den = 1001;
+    } else {
+        *num = round(fps * 1000);
+        *den = 1000;
+    }
+}
+
+static int compare_deltas(const void *a, const void *b)
+{
+    uint64_t da = *(const uint64_t *)a;
+    uint64_t db = *(const uint64_t *)b;
+    return (da > db) - (da < db);
+}
+
+/* frame rate of a recording: the median time between frames, which drops don't affect, gives
+ * how many frame periods each gap is, then their total over the whole recording averages out
+ * the jitter in the timestamps
+ */
+static double measure_frame_rate(const CMVideoReader *video)
+{
+    if (video->num_frames < 2)
+        return 0;
+    uint32_t n = video->num_frames - 1;
+    uint64_t *deltas = (uint64_t *)malloc(n * sizeof(uint64_t));
+    uint64_t *sorted = (uint64_t *)malloc(n * sizeof(uint64_t));
+    if (deltas == NULL || sorted == NULL) {
+        free(deltas);
+        free(sorted);
+        return 0;
+    }
+    for (uint32_t i = 0; i < n; i++)
+        deltas[i] = sorted[i] = video->index[i + 1].ts_ns - video->index[i].ts_ns;
+
+    qsort(sorted, n, sizeof(uint64_t), compare_deltas);
+    double median = sorted[n / 2];
+
+    double periods = 0;
+    for (uint32_t i = 0; median > 0 && i < n; i++)
+        periods += fmax(1, round(deltas[i] / median));
+    double span = video->index[n].ts_ns - video->index[0].ts_ns;
+    free(deltas);
+    free(sorted);
+    return median > 0 ? periods * 1e9 / span : 0;
+}
+
+// frames since local midnight at time ts_ns, counting whole frames per second
+static uint32_t time_of_day_frames(uint64_t ts_ns, const CMDNGFrameInfo *frame)
+{
+    time_t t = ts_ns / 1000000000;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    unsigned fps = (frame->fps_num + frame->fps_den - 1) / frame->fps_den;
+    uint32_t seconds = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+    return seconds * fps + (ts_ns % 1000000000) * fps / 1000000000;
+}
+
+static void frame_name(const ExportJob *job, uint32_t n, const char *suffix, char *name,
+        size_t len)
+{
+    snprintf(name, len, "%s/%s_%06u.dng%s", job->out_dir, job->reel_name, job->positions[n],
+            suffix);
+}
+
+// with job->lock held
+static void publish_frames(ExportJob *job)
+{
+    while (job->next_publish < job->num_frames && job->done[job->next_publish]) {
+        char part[4096], final[4096];
+        frame_name(job, job->next_publish, ".part", part, sizeof(part));
+        frame_name(job, job->next_publish, "", final, sizeof(final));
+        if (rename(part, final)) {
+            job->status = -errno;
+            return;
+        }
+        job->next_publish++;
+    }
+}
+
+static int export_frame(ExportJob *job, uint32_t n, void *buffer)
+{
+    CMRawHeader cmrh;
+    const void *raw = buffer;
+    void *loaded = NULL;
+    CMRawMapping mapping = {NULL, 0};
+    int status;
+    if (job->video != NULL) {
+        status = cmv_read_frame(job->video, n, buffer, &cmrh);
+    } else {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", job->dir, job->files[n]);
+        status = cmraw_map(&mapping, &raw, &cmrh, path);
+        if (status == -ENOTSUP) {
+            status = cmraw_load(&loaded, &cmrh, path);
+            raw = loaded;
+        }
+    }
+    if (status)
+        return status;
+
+    cmrh.cinfo.white_x = job->white_x;
+    cmrh.cinfo.white_y = job->white_y;
+    CMDNGFrameInfo frame = job->frame;
+    unsigned fps = (frame.fps_num + frame.fps_den - 1) / frame.fps_den;
+    frame.timecode = (frame.timecode + job->positions[n]) % (fps * 86400);
+
+    char part[4096];
+    frame_name(job, n, ".part", part, sizeof(part));
+    status = bayer_to_cinema_dng(raw, &cmrh, part, job->compression, &frame);
+
+    struct stat st;
+    if (status) {
+        unlink(part);
+    } else if (stat(part, &st) == 0) {
+        pthread_mutex_lock(&job->lock);
+        job->bytes_written += st.st_size;
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    if (mapping.addr != NULL)
+        cmraw_unmap(&mapping);
+    free(loaded);
+    return status;
+}
+
+static void *export_worker(void *arg)
+{
+    ExportJob *job = (ExportJob *)arg;
+    void *buffer = NULL;
+    if (job->video != NULL) {
+        buffer = malloc(job->video->header.frame_size);
+        if (buffer == NULL) {
+            pthread_mutex_lock(&job->lock);
+            job->status = -ENOMEM;
+            pthread_mutex_unlock(&job->lock);
+            return NULL;
+        }
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        if (job->status || job->next >= job->num_frames) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        uint32_t n = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        int status = export_frame(job, n, buffer);
+
+        pthread_mutex_lock(&job->lock);
+        if (status) {
+            if (!job->status)
+                job->status = status;
+        } else {
+            job->done[n] = 1;
+            publish_frames(job);
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+    free(buffer);
+    return NULL;
+}
+
+// name of the input without its directory or extension
+static void reel_name_of(const char *input, char *name, size_t len)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s", input);
+    size_t l = strlen(path);
+    while (l > 1 && path[l - 1] == '/')
+        path[--l] = '\0';
+    const char *base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+    snprintf(name, len, "%s", base);
+    char *ext = strrchr(name, '.');
+    if (ext != NULL && ext != name)
+        *ext = '\0';
+}
+
+static double now_s(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || argc > 5) {
+        printf("Usage: %s [cmv_name or cmr_dir] [out_dir] "
+               "[frame rate or auto (default, measured from a .cmv)] "
+               "[compression (lj92, 16 or 12, default lj92)]\n", argv[0]);
+        return -1;
+    }
+
+    double fps = 0;
+    if (argc >= 4 && strcmp(argv[3], "auto") != 0) {
+        fps = atof(argv[3]);
+        if (fps <= 0) {
+            printf("Invalid frame rate: %s\n", argv[3]);
+            return -1;
+        }
+    }
+
+    CMDNGCompression compression = CMDNG_COMPRESSION_LJ92;
+    if (argc >= 5) {
+        if (strcmp(argv[4], "16") == 0) {
+            compression = CMDNG_COMPRESSION_NONE;
+        } else if (strcmp(argv[4], "12") == 0) {
+            compression = CMDNG_COMPRESSION_NONE_12BIT;
+        } else if (strcmp(argv[4], "lj92") != 0) {
+            printf("Invalid compression: %s\n", argv[4]);
+            return -1;
+        }
+    }
+
+    char reel_name[256];
+    reel_name_of(argv[1], reel_name, sizeof(reel_name));
+    ExportJob job;
+    memset(&job, 0, sizeof(job));
+    job.out_dir = argv[2];
+    job.reel_name = reel_name;
+    job.compression = compression;
+    job.frame.reel_name = reel_name;
+
+    // the first frame gives the start time and the white balance of the whole sequence
+    CMVideoReader video;
+    CMRawHeader first;
+    uint64_t start_ns = 0;
+    int status = 0;
+    if (endswith(argv[1], ".cmv")) {
+        status = cmv_open(&video, argv[1]);
+        if (status) {
+            printf("Error %d opening recording.\n", status);
+            return status;
+        }
+        if (video.index_rebuilt)
+            printf("Recording has no index, it was rebuilt from the frames.\n");
+        job.video = &video;
+        job.num_frames = video.num_frames;
+        first = video.header.cmrh;
+        if (job.num_frames > 0)
+            start_ns = video.index[0].ts_ns;
+        if (fps == 0)
+            fps = measure_frame_rate(&video);
+        if (fps == 0) {
+            printf("Can't measure the frame rate, give it instead.\n");
+            cmv_close(&video);
+            return -1;
+        }
+    } else {
+        if (fps == 0) {
+            printf("The frame rate must be given for a directory of .cmr files.\n");
+            return -1;
+        }
+        job.dir = argv[1];
+        status = list_cmr_files(argv[1], &job.files, &job.num_frames);
+        if (status) {
+            printf("Error %d reading directory %s.\n", status, argv[1]);
+            return status;
+        }
+        if (job.num_frames > 0) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", argv[1], job.files[0]);
+            status = cmraw_load_header(&first, path);
+            if (status) {
+                printf("Error %d reading %s.\n", status, path);
+                return status;
+            }
+            start_ns = first.cinfo.ts_epoch * 1000000000ull;
+        }
+    }
+    if (job.num_frames == 0) {
+        printf("No frames to export.\n");
+        return -1;
+    }
+
+    frame_rate_fraction(fps, &job.frame.fps_num, &job.frame.fps_den);
+    fps = (double)job.frame.fps_num / job.frame.fps_den;
+    job.frame.timecode = time_of_day_frames(start_ns, &job.frame);
+    job.white_x = first.cinfo.white_x;
+    job.white_y = first.cinfo.white_y;
+
+    /* Frames of a recording are placed by their timestamps, so dropped frames leave gaps in the
+     * numbering and timecode rather than shifting the frames after them.
+     */
+    job.positions = (uint32_t *)malloc(job.num_frames * sizeof(uint32_t));
+    job.done = (uint8_t *)calloc(job.num_frames, 1);
+    if (job.positions == NULL || job.done == NULL) {
+        printf("Out of memory.\n");
+        return -ENOMEM;
+    }
+    uint32_t dropped = 0;
+    for (uint32_t i = 0; i < job.num_frames; i++) {
+        uint32_t pos = i;
+        if (job.video != NULL) {
+            double t = (video.index[i].ts_ns - start_ns) / 1e9;
+            pos = lround(t * fps);
+            if (i > 0 && pos <= job.positions[i - 1])
+                pos = job.positions[i - 1] + 1;
+            if (i > 0)
+                dropped += pos - job.positions[i - 1] - 1;
+        }
+        job.positions[i] = pos;
+    }
+
+    if (mkdir(job.out_dir, 0755) && errno != EEXIST) {
+        printf("Error creating %s: %s\n", job.out_dir, strerror(errno));
+        return -errno;
+    }
+
+    unsigned num_threads = parallel_num_threads();
+    if (num_threads > job.num_frames)
+        num_threads = job.num_frames;
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    if (threads == NULL)
+        return -ENOMEM;
+    pthread_mutex_init(&job.lock, NULL);
+
+    double start = now_s();
+    unsigned started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, export_worker, &job))
+            break;
+    }
+    if (started == 0)
+        export_worker(&job);
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = now_s() - start;
+
+    if (job.status) {
+        // frames finished after the failed one were never renamed, don't leave them behind
+        for (uint32_t n = job.next_publish; n < job.num_frames; n++) {
+            char part[4096];
+            frame_name(&job, n, ".part", part, sizeof(part));
+            if (job.done[n])
+                unlink(part);
+        }
+        printf("Error %d after exporting %u of %u frames.\n", job.status, job.next_publish,
+                job.num_frames);
+    } else {
+        printf("Exported %u frames at %u/%u fps (%u dropped) in %.2f s, "
+                "%.1f frames/s, %.1f MB/s\n", job.num_frames, job.frame.fps_num,
+                job.frame.fps_den, dropped, elapsed, job.num_frames / elapsed,
+                job.bytes_written / elapsed / 1e6);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    free(threads);
+    free(job.positions);
+    free(job.done);
+    if (job.video != NULL)
+        cmv_close(&video);
+    for (uint32_t i = 0; job.files != NULL && i < job.num_frames; i++)
+        free(job.files[i]);
+    free(job.files);
+    return job.status;
+}
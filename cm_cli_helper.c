@@ -23,13 +23,16 @@ const ImagePipelineParams default_pipeline_params = {
     .black = 0.25,
     .lut_mode = CMLUT_HDR_CUBIC_AUTO,
     .nr_mode = CMNR_MEDIAN,
-    .debayer_mode = CMBAYER_33
+    .raw_nr_mode = CMRAWNR_NONE,
+    .debayer_mode = CMBAYER_33,
+    .lut3d = NULL,
+    .bake_lut_size = 0
 };
 
 void cinemavi_generate_dng(const void *raw, const CMRawHeader *cmrh,
-        const char *fname)
+        const CMRawThumbnail *thumb, const char *fname, CMDNGCompression compression)
 {
-    int dng_stat = bayer_rg12p_to_dng(raw, cmrh, fname);
+    int dng_stat = bayer_to_dng_with_thumbnail(raw, cmrh, thumb, fname, compression);
     if (dng_stat != 0) printf("Error %d writing DNG.\n", dng_stat);
     else printf("DNG written to: %s\n", fname);
 }
@@ -56,14 +59,27 @@ void cinemavi_generate_tiff(const void *raw, const CMRawHeader *cmrh,
     free(rgb8);
 }
 
-void cinemavi_generate_cmr(const void *raw, const CMRawHeader *cmrh,
+void cinemavi_generate_tiff16(const void *raw, const CMRawHeader *cmrh,
         const char *fname)
 {
-    int cmr_stat = cmraw_save(raw, cmrh, fname);
-    if (cmr_stat != 0)
-        printf("Error %d writing CMR.\n", cmr_stat);
-    else
-        printf("CMR written to: %s\n", fname);
+    uint16_t *rgb16 = (uint16_t *)malloc(cmrh->cinfo.width * cmrh->cinfo.height * 3
+            * sizeof(uint16_t));
+    if (rgb16 != NULL) {
+        // use as-shot white balance if specified
+        ImagePipelineParams pipeline_params = default_pipeline_params;
+        if (cmrh->cinfo.white_x > 0 || cmrh->cinfo.white_y > 0)
+            colour_xy_to_temp_tint(cmrh->cinfo.white_x, cmrh->cinfo.white_y,
+                    &pipeline_params.temp_K, &pipeline_params.tint);
+
+        printf("Processing image...\n");
+        pipeline_process_image16(raw, rgb16, NULL, &cmrh->cinfo, &pipeline_params);
+        printf("Image processed.\n");
+
+        int tiff_stat = rgb16_to_tiff(rgb16, cmrh->cinfo.width, cmrh->cinfo.height, fname);
+        if (tiff_stat != 0) printf("Error %d writing TIFF.\n", tiff_stat);
+        else printf("TIFF written to: %s\n", fname);
+    }
+    free(rgb16);
 }
 
 bool endswith(const char *s, const char *suffix)
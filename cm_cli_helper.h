@@ -8,16 +8,18 @@ extern "C" {
 #include <stdbool.h>
 #include "cmraw.h"
 #include "pipeline.h"
+#include "dng.h"
 
 extern const ImagePipelineParams default_pipeline_params;
 
+// thumb may be NULL for no preview
 void cinemavi_generate_dng(const void *raw, const CMRawHeader *cmrh,
-        const char *fname);
+        const CMRawThumbnail *thumb, const char *fname, CMDNGCompression compression);
 
 void cinemavi_generate_tiff(const void *raw, const CMRawHeader *cmrh,
         const char *fname);
 
-void cinemavi_generate_cmr(const void *raw, const CMRawHeader *cmrh,
+void cinemavi_generate_tiff16(const void *raw, const CMRawHeader *cmrh,
         const char *fname);
 
 bool endswith(const char *s, const char *suffix);
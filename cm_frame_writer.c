@@ -0,0 +1,340 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "cm_frame_writer.h"
+#include "cmraw_codec.h"
+#include "dng.h"
+
+// alignment of buffers, file offsets and lengths for O_DIRECT
+#define CM_FRAME_WRITER_ALIGN 4096
+
+typedef struct {
+    uint8_t *buf;               // CMRawHeader, thumbnail then raw data, as in a .cmr file
+    size_t capacity;
+    size_t len;
+    CMFrameFormat format;
+    char fname[PATH_MAX];
+} FrameSlot;
+
+struct CMFrameWriter {
+    pthread_t thread;
+    FrameSlot slots[CM_FRAME_WRITER_SLOTS];
+    size_t capacity_bytes;
+    size_t allocated;           // by slot buffers, only touched by the adding thread
+
+    /* slots [tail, head) are queued, the counts only ever increase and index slots modulo
+     * CM_FRAME_WRITER_SLOTS. Only the adding thread stores head and fills the slot at head,
+     * only the writer thread stores tail and reads the slot at tail.
+     */
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_size_t queued_bytes;
+    atomic_uint written;
+    atomic_uint dropped;
+    atomic_int status;
+    atomic_int closing;
+
+    // only used to wake the writer thread when the queue was empty, adding never waits on it
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    atomic_int sleeping;
+
+    // compressed .cmr files are encoded here, only touched by the writer thread
+    uint8_t *scratch;
+    size_t scratch_capacity;
+};
+
+static inline size_t align_up(size_t len)
+{
+    return (len + CM_FRAME_WRITER_ALIGN - 1) / CM_FRAME_WRITER_ALIGN * CM_FRAME_WRITER_ALIGN;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Writes len bytes of an aligned buffer to fname. The whole blocks are written with O_DIRECT,
+ * which needs aligned lengths, then the rest of the last block through the page cache.
+ */
+static int write_file(const char *fname, const uint8_t *buf, size_t len)
+{
+    size_t direct_len = len / CM_FRAME_WRITER_ALIGN * CM_FRAME_WRITER_ALIGN;
+    int fd = -1;
+#ifdef O_DIRECT
+    if (direct_len > 0)
+        fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+#endif
+    if (fd < 0) {
+        // O_DIRECT isn't available, or the file system doesn't support it
+        direct_len = 0;
+        fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return -errno;
+#ifdef F_NOCACHE
+        fcntl(fd, F_NOCACHE, 1);
+#endif
+    }
+
+    int status = write_all(fd, buf, direct_len);
+#ifdef O_DIRECT
+    if (!status && direct_len > 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT))
+        status = -errno;
+#endif
+    if (!status)
+        status = write_all(fd, buf + direct_len, len - direct_len);
+    if (close(fd) && !status)
+        status = -errno;
+    return status;
+}
+
+static int write_frame(CMFrameWriter *w, const FrameSlot *slot)
+{
+    const CMRawHeader *cmrh = (const CMRawHeader *)slot->buf;
+    const uint8_t *thumb_block = slot->buf + sizeof(CMRawHeader);
+    const uint8_t *raw = thumb_block + cmrh->thumb_size;
+    if (slot->format == CMFRAME_FORMAT_DNG) {
+        CMRawThumbnail thumb = {0, 0, NULL};
+        if (cmrh->thumb_size > 0) {
+            memcpy(&thumb.width, thumb_block, 2);
+            memcpy(&thumb.height, thumb_block + 2, 2);
+            thumb.rgb8 = (uint8_t *)thumb_block + 4;
+        }
+        return bayer_to_dng_with_thumbnail(raw, cmrh, &thumb, slot->fname,
+                CMDNG_COMPRESSION_LJ92);
+    }
+    if (cmrh->compression == CMRAW_COMPRESSION_NONE)
+        return write_file(slot->fname, slot->buf, slot->len);
+
+    // a compressed file is the header, thumbnail then encoded data, put together in scratch
+    size_t head_len = sizeof(CMRawHeader) + cmrh->thumb_size;
+    size_t len = align_up(head_len + cmraw_encode_bound(&cmrh->cinfo));
+    if (len > w->scratch_capacity) {
+        void *scratch = NULL;
+        if (posix_memalign(&scratch, CM_FRAME_WRITER_ALIGN, len))
+            return -ENOMEM;
+        free(w->scratch);
+        w->scratch = (uint8_t *)scratch;
+        w->scratch_capacity = len;
+    }
+
+    CMRawHeader *header = (CMRawHeader *)w->scratch;
+    size_t data_len;
+    memcpy(w->scratch, slot->buf, head_len);
+    int status = cmraw_encode(raw, &cmrh->cinfo, w->scratch + head_len, &data_len);
+    if (status)
+        return status;
+
+    // the slice table can outweigh what noisy data saves, never write a bigger file
+    size_t raw_len = cmraw_data_size(&cmrh->cinfo);
+    if (data_len >= raw_len) {
+        header->compression = CMRAW_COMPRESSION_NONE;
+        memcpy(w->scratch + head_len, raw, raw_len);
+        data_len = raw_len;
+    } else {
+        header->data_size = data_len;
+    }
+    return write_file(slot->fname, w->scratch, head_len + data_len);
+}
+
+static void *writer_thread(void *arg)
+{
+    CMFrameWriter *w = (CMFrameWriter *)arg;
+
+    for (;;) {
+        unsigned int tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+        if (atomic_load(&w->head) == tail) {
+            if (atomic_load(&w->closing))
+                break;
+
+            /* sleeping is set before checking head again, and head is stored before checking
+             * sleeping, so either this sees the new frame or the adding thread sees it has to
+             * signal, which it can only do once this is waiting
+             */
+            pthread_mutex_lock(&w->mutex);
+            atomic_store(&w->sleeping, 1);
+            while (atomic_load(&w->head) == tail && !atomic_load(&w->closing))
+                pthread_cond_wait(&w->cond, &w->mutex);
+            atomic_store(&w->sleeping, 0);
+            pthread_mutex_unlock(&w->mutex);
+            continue;
+        }
+
+        const FrameSlot *slot = &w->slots[tail % CM_FRAME_WRITER_SLOTS];
+        int status = write_frame(w, slot);
+        if (status) {
+            int no_error = 0;
+            atomic_compare_exchange_strong(&w->status, &no_error, status);
+        } else {
+            atomic_fetch_add(&w->written, 1);
+        }
+        atomic_fetch_sub(&w->queued_bytes, slot->len);
+        atomic_store_explicit(&w->tail, tail + 1, memory_order_release);
+    }
+
+    return NULL;
+}
+
+int cm_frame_writer_open(CMFrameWriter **writer, size_t queue_bytes)
+{
+    *writer = NULL;
+    CMFrameWriter *w = (CMFrameWriter *)calloc(1, sizeof(CMFrameWriter));
+    if (w == NULL)
+        return -ENOMEM;
+
+    w->capacity_bytes = queue_bytes;
+    atomic_init(&w->head, 0);
+    atomic_init(&w->tail, 0);
+    atomic_init(&w->queued_bytes, 0);
+    atomic_init(&w->written, 0);
+    atomic_init(&w->dropped, 0);
+    atomic_init(&w->status, 0);
+    atomic_init(&w->closing, 0);
+    atomic_init(&w->sleeping, 0);
+
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, writer_thread, w)) {
+        pthread_mutex_destroy(&w->mutex);
+        pthread_cond_destroy(&w->cond);
+        free(w);
+        return -EAGAIN;
+    }
+
+    *writer = w;
+    return 0;
+}
+
+static void free_slot(CMFrameWriter *w, FrameSlot *slot)
+{
+    free(slot->buf);
+    w->allocated -= slot->capacity;
+    slot->buf = NULL;
+    slot->capacity = 0;
+}
+
+/* Makes sure the slot at head can hold len bytes, within the queue size unless the queue is
+ * empty. Buffers of slots that aren't queued may be freed to make room.
+ */
+static int reserve_slot(CMFrameWriter *w, unsigned int head, unsigned int tail, size_t len)
+{
+    FrameSlot *slot = &w->slots[head % CM_FRAME_WRITER_SLOTS];
+    if (slot->capacity >= len)
+        return 0;
+
+    free_slot(w, slot);
+    for (unsigned int i = head + 1; i != tail + CM_FRAME_WRITER_SLOTS; i++) {
+        if (w->allocated + len <= w->capacity_bytes)
+            break;
+        free_slot(w, &w->slots[i % CM_FRAME_WRITER_SLOTS]);
+    }
+    if (w->allocated + len > w->capacity_bytes && head != tail)
+        return -EAGAIN;
+
+    void *buf = NULL;
+    if (posix_memalign(&buf, CM_FRAME_WRITER_ALIGN, len))
+        return -ENOMEM;
+    slot->buf = (uint8_t *)buf;
+    slot->capacity = len;
+    w->allocated += len;
+    return 0;
+}
+
+int cm_frame_writer_add(CMFrameWriter *w, const void *raw, const CMRawHeader *cmrh,
+        const CMRawThumbnail *thumb, const char *fname, CMFrameFormat format)
+{
+    size_t raw_len = cmraw_data_size(&cmrh->cinfo);
+    if (raw_len == 0 || strlen(fname) >= PATH_MAX)
+        return -EINVAL;
+    if (format == CMFRAME_FORMAT_CMRAW && cmrh->compression != CMRAW_COMPRESSION_NONE
+            && (cmrh->compression != CMRAW_COMPRESSION_RICE
+                || cmraw_encode_bound(&cmrh->cinfo) == 0))
+        return -EINVAL;
+    if (format == CMFRAME_FORMAT_DNG && cmrh->cinfo.pixel_fmt != CM_PIXEL_FMT_BAYER_RG12P
+            && cmrh->cinfo.pixel_fmt != CM_PIXEL_FMT_BAYER_RG12
+            && cmrh->cinfo.pixel_fmt != CM_PIXEL_FMT_BAYER_RG16)
+        return -EINVAL;
+
+    size_t thumb_size = cmraw_thumbnail_size(thumb);
+    size_t len = sizeof(CMRawHeader) + thumb_size + raw_len;
+    unsigned int head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&w->tail, memory_order_acquire);
+    int status = head - tail == CM_FRAME_WRITER_SLOTS ? -EAGAIN
+            : reserve_slot(w, head, tail, align_up(len));
+    if (status) {
+        if (status == -EAGAIN)
+            atomic_fetch_add(&w->dropped, 1);
+        return status;
+    }
+
+    FrameSlot *slot = &w->slots[head % CM_FRAME_WRITER_SLOTS];
+    CMRawHeader *header = (CMRawHeader *)slot->buf;
+    *header = *cmrh;
+    header->data_size = 0;
+    header->thumb_size = thumb_size;
+    cmraw_pack_thumbnail(thumb, slot->buf + sizeof(CMRawHeader));
+    memcpy(slot->buf + sizeof(CMRawHeader) + thumb_size, raw, raw_len);
+    slot->len = len;
+    slot->format = format;
+    strcpy(slot->fname, fname);
+
+    atomic_fetch_add(&w->queued_bytes, len);
+    atomic_store(&w->head, head + 1);
+    if (atomic_load(&w->sleeping)) {
+        pthread_mutex_lock(&w->mutex);
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+    }
+    return 0;
+}
+
+void cm_frame_writer_stats(CMFrameWriter *w, CMFrameWriterStats *stats)
+{
+    unsigned int tail = atomic_load(&w->tail);
+    stats->queued = atomic_load(&w->head) - tail;
+    stats->queued_bytes = atomic_load(&w->queued_bytes);
+    stats->capacity_bytes = w->capacity_bytes;
+    stats->written = atomic_load(&w->written);
+    stats->dropped = atomic_load(&w->dropped);
+    stats->status = atomic_load(&w->status);
+}
+
+void cm_frame_writer_clear_error(CMFrameWriter *w, int status)
+{
+    atomic_compare_exchange_strong(&w->status, &status, 0);
+}
+
+int cm_frame_writer_close(CMFrameWriter *w)
+{
+    pthread_mutex_lock(&w->mutex);
+    atomic_store(&w->closing, 1);
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, NULL);
+
+    int status = atomic_load(&w->status);
+    for (unsigned int i = 0; i < CM_FRAME_WRITER_SLOTS; i++)
+        free(w->slots[i].buf);
+    free(w->scratch);
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+    free(w);
+    return status;
+}
@@ -0,0 +1,73 @@
+#ifndef CM_FRAME_WRITER_H
+#define CM_FRAME_WRITER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cmraw.h"
+
+/* Asynchronous writer for still raw frames, so capture and rendering never wait on the disk.
+ *
+ * Frames are copied into a bounded ring of buffers, which a thread of its own encodes and writes
+ * to their files. Adding a frame never blocks: the ring is lock free for the one thread adding
+ * frames and the writer thread, and a frame that doesn't fit is dropped and counted instead.
+ * Buffers are reused from frame to frame, and freed only to make room for a larger frame within
+ * the queue size.
+ *
+ * .cmr files are written straight from the ring with large aligned writes, bypassing the page
+ * cache (O_DIRECT) where the file system supports it.
+ */
+
+// at most this many frames are queued, however small
+#define CM_FRAME_WRITER_SLOTS 64
+
+typedef enum {
+    CMFRAME_FORMAT_CMRAW,       // compressed if the header's compression is set
+    CMFRAME_FORMAT_DNG          // lossless JPEG
+} CMFrameFormat;
+
+typedef struct {
+    size_t queued_bytes;        // of frames waiting to be written
+    size_t capacity_bytes;
+    uint32_t queued;            // frames waiting to be written
+    uint32_t written;
+    uint32_t dropped;           // because the queue was full
+    int status;                 // first error writing a file, 0 if none
+} CMFrameWriterStats;
+
+typedef struct CMFrameWriter CMFrameWriter;
+
+/* Starts the writer thread, queue_bytes bounds the memory for frames waiting to be written,
+ * though a single frame is always taken when the queue is empty.
+ * Returns 0 on success or a negative error code, a writer must be closed with
+ * cm_frame_writer_close
+ */
+int cm_frame_writer_open(CMFrameWriter **writer, size_t queue_bytes);
+
+/* Copies a frame and its thumbnail, which may be NULL, into the queue to be written to fname.
+ * Frames must be added from one thread at a time. Returns -EAGAIN if the queue is full, in which
+ * case the frame is dropped and counted, or -EINVAL for an unsupported frame. Errors writing are
+ * reported by cm_frame_writer_stats.
+ */
+int cm_frame_writer_add(CMFrameWriter *writer, const void *raw, const CMRawHeader *cmrh,
+        const CMRawThumbnail *thumb, const char *fname, CMFrameFormat format);
+
+// safe to call from any thread
+void cm_frame_writer_stats(CMFrameWriter *writer, CMFrameWriterStats *stats);
+
+// forgets status, the error reported by cm_frame_writer_stats, so a later error is reported
+// a different error reported since is kept, safe to call from any thread
+void cm_frame_writer_clear_error(CMFrameWriter *writer, int status);
+
+// writes the queued frames then frees the writer
+// returns 0 on success or the first error writing a file
+int cm_frame_writer_close(CMFrameWriter *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CM_FRAME_WRITER_H
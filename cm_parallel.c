@@ -0,0 +1,126 @@
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cm_parallel.h"
+
+#define PARALLEL_MAX_THREADS 16
+
+/* Threads started on first use and kept for the life of the process, so a call costs a wake up
+ * rather than creating threads. A call splits its items into one range per thread, which the
+ * calling thread and the pool take one at a time, under the mutex so a range can't be taken from
+ * the wrong call.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        // a call has ranges left to take
+    pthread_cond_t done;        // every range of the call has been processed
+    unsigned int num_workers;
+
+    // the call in progress, if active
+    bool active;
+    ParallelFn fn;
+    void *arg;
+    unsigned int num;
+    unsigned int num_ranges;
+    unsigned int next_range;
+    unsigned int remaining;     // ranges not yet processed
+} ParallelPool;
+
+static ParallelPool pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// set in pool threads, where a nested call runs in place rather than waiting on the pool
+static _Thread_local bool in_pool = false;
+
+// with pool.mutex held, takes the next range of the call and processes it unlocked
+static void run_range(void)
+{
+    unsigned int r = pool.next_range++;
+    ParallelFn fn = pool.fn;
+    void *arg = pool.arg;
+    unsigned int start = (unsigned long long)pool.num * r / pool.num_ranges;
+    unsigned int end = (unsigned long long)pool.num * (r + 1) / pool.num_ranges;
+
+    pthread_mutex_unlock(&pool.mutex);
+    fn(arg, start, end);
+    pthread_mutex_lock(&pool.mutex);
+
+    if (--pool.remaining == 0)
+        pthread_cond_signal(&pool.done);
+}
+
+static void *pool_worker(void *arg)
+{
+    (void)arg;
+    in_pool = true;
+    pthread_mutex_lock(&pool.mutex);
+    for (;;) {
+        while (!pool.active || pool.next_range == pool.num_ranges)
+            pthread_cond_wait(&pool.work, &pool.mutex);
+        run_range();
+    }
+    return NULL;
+}
+
+static void pool_start(void)
+{
+    // the calling thread takes ranges too
+    unsigned int wanted = parallel_num_threads() - 1;
+    for (unsigned int t = 0; t < wanted; t++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, NULL))
+            break;
+        pthread_detach(thread);
+        pool.num_workers++;
+    }
+}
+
+unsigned int parallel_num_threads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    else if (cpus > PARALLEL_MAX_THREADS) cpus = PARALLEL_MAX_THREADS;
+    return cpus;
+}
+
+void parallel_for(unsigned int num, ParallelFn fn, void *arg)
+{
+    unsigned int num_threads = parallel_num_threads();
+    if (num_threads > num) num_threads = num;
+    if (num_threads <= 1 || in_pool) {
+        if (num > 0) fn(arg, 0, num);
+        return;
+    }
+
+    pthread_once(&pool_once, pool_start);
+    pthread_mutex_lock(&pool.mutex);
+
+    // while another thread's call has the pool, this one runs in place, so callers that are
+    // already parallel, like batch workers, don't multiply the threads
+    if (pool.active || pool.num_workers == 0) {
+        pthread_mutex_unlock(&pool.mutex);
+        fn(arg, 0, num);
+        return;
+    }
+
+    pool.active = true;
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.num = num;
+    pool.num_ranges = num_threads;
+    pool.next_range = 0;
+    pool.remaining = num_threads;
+    pthread_cond_broadcast(&pool.work);
+
+    while (pool.next_range < pool.num_ranges)
+        run_range();
+    while (pool.remaining > 0)
+        pthread_cond_wait(&pool.done, &pool.mutex);
+    pool.active = false;
+    pthread_mutex_unlock(&pool.mutex);
+}
@@ -0,0 +1,25 @@
+#ifndef CM_PARALLEL_H
+#define CM_PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// work function for parallel_for, processes items [start, end)
+typedef void (*ParallelFn)(void *arg, unsigned int start, unsigned int end);
+
+// number of threads parallel_for splits work across
+unsigned int parallel_num_threads(void);
+
+/* Split items [0, num) into contiguous ranges and process them on the calling thread and a pool
+ * of threads started on first use. Returns once every range has been processed.
+ * Calls from inside a work function, or while another thread's call has the pool, process every
+ * item on the calling thread, so nested and concurrent use never adds threads.
+ */
+void parallel_for(unsigned int num, ParallelFn fn, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CM_PARALLEL_H
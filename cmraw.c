@@ -3,8 +3,13 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "cmraw.h"
+#include "cmraw_codec.h"
 
 #define CM_MAGIC 0x69564D43
 
@@ -16,6 +21,25 @@ void cm_raw_header_init(CMRawHeader *cmrh)
     cmrh->cinfo.ts_epoch = time(NULL);
 }
 
+uint16_t cmraw_white_level(const CMCaptureInfo *cinfo)
+{
+    if (cinfo->white_level != 0)
+        return cinfo->white_level;
+
+    switch (cinfo->pixel_fmt) {
+    case CM_PIXEL_FMT_MONO8:
+    case CM_PIXEL_FMT_RGB8:
+    case CM_PIXEL_FMT_BAYER_RG8:
+        return 255;
+    case CM_PIXEL_FMT_MONO16:
+    case CM_PIXEL_FMT_RGB16:
+    case CM_PIXEL_FMT_BAYER_RG16:
+        return 65535;
+    default:
+        return 4095;
+    }
+}
+
 static size_t get_raw_len(CMPixelFormat fmt, uint16_t width, uint16_t height)
 {
     if (fmt == CM_PIXEL_FMT_MONO8 ||
@@ -40,7 +64,93 @@ static size_t get_raw_len(CMPixelFormat fmt, uint16_t width, uint16_t height)
         return 0;
 }
 
+size_t cmraw_data_size(const CMCaptureInfo *cinfo)
+{
+    if (cinfo->width > CM_MAX_WIDTH || cinfo->height > CM_MAX_HEIGHT)
+        return 0;
+    return get_raw_len(cinfo->pixel_fmt, cinfo->width, cinfo->height);
+}
+
+// width and height ahead of the pixels
+#define CMRAW_THUMB_HEADER_SIZE 4
+// the block is padded to this, so 16 bit pixel data after it stays aligned
+#define CMRAW_THUMB_ALIGN 8
+
+int cmraw_make_thumbnail(const uint8_t *rgb8, uint16_t width, uint16_t height, size_t stride,
+        CMRawThumbnail *thumb)
+{
+    thumb->width = 0;
+    thumb->height = 0;
+    thumb->rgb8 = NULL;
+
+    // averages boxes of the smallest whole size that fits, which is sharp enough for a preview
+    unsigned int longest = width > height ? width : height;
+    unsigned int box = (longest + CMRAW_THUMB_MAX_SIZE - 1) / CMRAW_THUMB_MAX_SIZE;
+    if (box == 0 || width < box || height < box)
+        return -EINVAL;
+    unsigned int thumb_width = width / box;
+    unsigned int thumb_height = height / box;
+    thumb->rgb8 = (uint8_t *)malloc(thumb_width * thumb_height * 3);
+    if (thumb->rgb8 == NULL)
+        return -ENOMEM;
+
+    const unsigned int area = box * box;
+    for (unsigned int y = 0; y < thumb_height; y++) {
+        uint8_t *out = thumb->rgb8 + y * thumb_width * 3;
+        for (unsigned int x = 0; x < thumb_width; x++) {
+            unsigned int sum[3] = {0, 0, 0};
+            for (unsigned int by = 0; by < box; by++) {
+                const uint8_t *in = rgb8 + (y * box + by) * stride + x * box * 3;
+                for (unsigned int bx = 0; bx < box * 3; bx += 3) {
+                    sum[0] += in[bx];
+                    sum[1] += in[bx + 1];
+                    sum[2] += in[bx + 2];
+                }
+            }
+            for (unsigned int c = 0; c < 3; c++)
+                out[x * 3 + c] = (sum[c] + area / 2) / area;
+        }
+    }
+    thumb->width = thumb_width;
+    thumb->height = thumb_height;
+    return 0;
+}
+
+void cmraw_free_thumbnail(CMRawThumbnail *thumb)
+{
+    free(thumb->rgb8);
+    thumb->rgb8 = NULL;
+    thumb->width = 0;
+    thumb->height = 0;
+}
+
+size_t cmraw_thumbnail_size(const CMRawThumbnail *thumb)
+{
+    if (thumb == NULL || thumb->rgb8 == NULL)
+        return 0;
+    size_t len = CMRAW_THUMB_HEADER_SIZE + (size_t)thumb->width * thumb->height * 3;
+    return (len + CMRAW_THUMB_ALIGN - 1) & ~(size_t)(CMRAW_THUMB_ALIGN - 1);
+}
+
+void cmraw_pack_thumbnail(const CMRawThumbnail *thumb, uint8_t *out)
+{
+    size_t len = cmraw_thumbnail_size(thumb);
+    if (len == 0)
+        return;
+    size_t rgb_len = (size_t)thumb->width * thumb->height * 3;
+    memcpy(out, &thumb->width, 2);
+    memcpy(out + 2, &thumb->height, 2);
+    memcpy(out + CMRAW_THUMB_HEADER_SIZE, thumb->rgb8, rgb_len);
+    memset(out + CMRAW_THUMB_HEADER_SIZE + rgb_len, 0, len - CMRAW_THUMB_HEADER_SIZE - rgb_len);
+}
+
 int cmraw_save(const void *raw, const CMRawHeader *cmrh, const char *fname)
+{
+    return cmraw_save_with_thumbnail(raw, cmrh, NULL, fname);
+}
+
+int cmraw_save_with_thumbnail(const void *raw, const CMRawHeader *cmrh,
+        const CMRawThumbnail *thumb, const char *fname)
 {
     if (raw == NULL || cmrh == NULL || fname == NULL)
         return -EINVAL;
@@ -55,27 +165,124 @@ int cmraw_save(const void *raw, const CMRawHeader *cmrh, const char *fname)
     if (raw_len == 0)
         return -EINVAL;
 
+    CMRawHeader header = *cmrh;
+    const void *data = raw;
+    uint8_t *encoded = NULL;
+    if (header.compression == CMRAW_COMPRESSION_RICE) {
+        size_t bound = cmraw_encode_bound(&header.cinfo);
+        if (bound == 0)
+            return -EINVAL;
+        encoded = (uint8_t *)malloc(bound);
+        if (encoded == NULL)
+            return -ENOMEM;
+        size_t encoded_len;
+        int err = cmraw_encode(raw, &header.cinfo, encoded, &encoded_len);
+        if (err) {
+            free(encoded);
+            return err;
+        }
+
+        // the slice table can outweigh what noisy data saves, never write a bigger file
+        if (encoded_len < raw_len) {
+            header.data_size = encoded_len;
+            raw_len = encoded_len;
+            data = encoded;
+        } else {
+            header.compression = CMRAW_COMPRESSION_NONE;
+            header.data_size = 0;
+        }
+    } else if (header.compression != CMRAW_COMPRESSION_NONE) {
+        return -EINVAL;
+    } else {
+        header.data_size = 0;
+    }
+
+    header.thumb_size = cmraw_thumbnail_size(thumb);
+    uint8_t *thumb_block = NULL;
+    if (header.thumb_size > 0) {
+        thumb_block = (uint8_t *)malloc(header.thumb_size);
+        if (thumb_block == NULL) {
+            free(encoded);
+            return -ENOMEM;
+        }
+        cmraw_pack_thumbnail(thumb, thumb_block);
+    }
+
     FILE *f = fopen(fname, "wb");
-    if (f == NULL)
+    if (f == NULL) {
+        free(encoded);
+        free(thumb_block);
         return -errno;
+    }
 
     int status = 0;
-    if (fwrite(cmrh, sizeof(CMRawHeader), 1, f) != 1)
+    if (fwrite(&header, sizeof(CMRawHeader), 1, f) != 1)
         status = -EIO;
 
-    if (!status && fwrite(raw, raw_len, 1, f) != 1)
+    if (!status && thumb_block != NULL && fwrite(thumb_block, header.thumb_size, 1, f) != 1)
+        status = -EIO;
+
+    if (!status && fwrite(data, raw_len, 1, f) != 1)
         status = -EIO;
 
     fclose(f);
+    free(encoded);
+    free(thumb_block);
 
     return status;
 }
 
+// reads the thumbnail block of thumb_size bytes at the position of f, thumb is left empty on error
+static int read_thumbnail(FILE *f, uint32_t thumb_size, CMRawThumbnail *thumb)
+{
+    uint16_t size[2] = {0, 0};
+    if (thumb_size < CMRAW_THUMB_HEADER_SIZE)
+        return -ENOENT;
+    if (fread(size, sizeof(size), 1, f) != 1)
+        return -EIO;
+
+    size_t len = (size_t)size[0] * size[1] * 3;
+    if (len == 0 || CMRAW_THUMB_HEADER_SIZE + len > thumb_size)
+        return -EINVAL;
+
+    thumb->rgb8 = (uint8_t *)malloc(len);
+    if (thumb->rgb8 == NULL)
+        return -ENOMEM;
+    if (fread(thumb->rgb8, 1, len, f) != len) {
+        cmraw_free_thumbnail(thumb);
+        return -EIO;
+    }
+    thumb->width = size[0];
+    thumb->height = size[1];
+    return 0;
+}
+
 // sets the raw pointer, caller must free it (with C stdlib free) when done
 int cmraw_load(void **raw, CMRawHeader *cmrh, const char *fname)
 {
-    if (raw == NULL || cmrh == NULL || fname == NULL)
+    if (raw == NULL)
         return -EINVAL;
+    *raw = NULL;
+
+    size_t capacity = 0;
+    int status = cmraw_load_reuse(raw, &capacity, NULL, cmrh, fname);
+    if (status) {
+        free(*raw);
+        *raw = NULL;
+    }
+    return status;
+}
+
+int cmraw_load_reuse(void **raw, size_t *capacity, CMRawThumbnail *thumb, CMRawHeader *cmrh,
+        const char *fname)
+{
+    if (raw == NULL || capacity == NULL || cmrh == NULL || fname == NULL)
+        return -EINVAL;
+    if (thumb != NULL) {
+        thumb->width = 0;
+        thumb->height = 0;
+        thumb->rgb8 = NULL;
+    }
 
     FILE *f = fopen(fname, "rb");
     if (f == NULL)
@@ -99,16 +306,144 @@ int cmraw_load(void **raw, CMRawHeader *cmrh, const char *fname)
     if (!status && raw_len == 0)
         status = -EINVAL;
 
-    if (!status) {
+    // a damaged thumbnail doesn't stop the pixels loading, they're found from thumb_size
+    if (!status && thumb != NULL && cmrh->thumb_size > 0)
+        read_thumbnail(f, cmrh->thumb_size, thumb);
+    if (!status && cmrh->thumb_size > 0
+            && fseek(f, sizeof(CMRawHeader) + cmrh->thumb_size, SEEK_SET))
+        status = -errno;
+
+    if (!status && raw_len > *capacity) {
+        free(*raw);
+        *capacity = 0;
         *raw = malloc(raw_len);
         if (*raw == NULL)
             status = -ENOMEM;
+        else
+            *capacity = raw_len;
+    }
+
+    if (!status && cmrh->compression == CMRAW_COMPRESSION_RICE) {
+        uint8_t *encoded = (uint8_t *)malloc(cmrh->data_size);
+        if (encoded == NULL)
+            status = -ENOMEM;
+        else if (fread(encoded, 1, cmrh->data_size, f) != cmrh->data_size)
+            status = -EIO;
+        else
+            status = cmraw_decode(encoded, cmrh->data_size, &cmrh->cinfo, *raw);
+        free(encoded);
+    } else if (!status && cmrh->compression != CMRAW_COMPRESSION_NONE) {
+        status = -EINVAL;
+    } else if (!status && fread(*raw, 1, raw_len, f) != raw_len) {
+        status = -EIO;
+    }
+
+    fclose(f);
+
+    return status;
+}
+
+int cmraw_map(CMRawMapping *mapping, const void **raw, CMRawHeader *cmrh, const char *fname)
+{
+    mapping->addr = NULL;
+    mapping->len = 0;
+    if (raw == NULL || cmrh == NULL || fname == NULL)
+        return -EINVAL;
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+
+    int status = 0;
+    struct stat st;
+    if (fstat(fd, &st))
+        status = -errno;
+    else if ((size_t)st.st_size < sizeof(CMRawHeader))
+        status = -EIO;
+
+    // the mapping stays valid after the file is closed
+    void *addr = MAP_FAILED;
+    if (!status) {
+        addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+            status = -errno;
     }
+    close(fd);
+    if (status)
+        return status;
 
-    if (!status && fread(*raw, 1, raw_len, f) != raw_len)
+    memcpy(cmrh, addr, sizeof(CMRawHeader));
+    size_t raw_len = 0;
+    if (cmrh->magic != CM_MAGIC)
+        status = -EINVAL;
+    else if (cmrh->cinfo.width > CM_MAX_WIDTH || cmrh->cinfo.height > CM_MAX_HEIGHT)
+        status = -EOVERFLOW;
+    else
+        raw_len = get_raw_len(cmrh->cinfo.pixel_fmt, cmrh->cinfo.width, cmrh->cinfo.height);
+
+    if (!status && raw_len == 0)
+        status = -EINVAL;
+    if (!status && cmrh->compression != CMRAW_COMPRESSION_NONE)
+        status = -ENOTSUP;
+    size_t data_offset = sizeof(CMRawHeader) + cmrh->thumb_size;
+    if (!status && (size_t)st.st_size < data_offset + raw_len)
         status = -EIO;
 
+    if (status) {
+        munmap(addr, st.st_size);
+        return status;
+    }
+
+    mapping->addr = addr;
+    mapping->len = st.st_size;
+    *raw = (const uint8_t *)addr + data_offset;
+    return 0;
+}
+
+void cmraw_unmap(CMRawMapping *mapping)
+{
+    if (mapping->addr != NULL)
+        munmap(mapping->addr, mapping->len);
+    mapping->addr = NULL;
+    mapping->len = 0;
+}
+
+int cmraw_load_header(CMRawHeader *cmrh, const char *fname)
+{
+    FILE *f = fopen(fname, "rb");
+    if (f == NULL)
+        return -errno;
+
+    int status = 0;
+    if (fread(cmrh, sizeof(CMRawHeader), 1, f) != 1)
+        status = -EIO;
+    else if (cmrh->magic != CM_MAGIC)
+        status = -EINVAL;
+    else if (cmrh->cinfo.width > CM_MAX_WIDTH || cmrh->cinfo.height > CM_MAX_HEIGHT)
+        status = -EOVERFLOW;
+    else if (get_raw_len(cmrh->cinfo.pixel_fmt, cmrh->cinfo.width, cmrh->cinfo.height) == 0)
+        status = -EINVAL;
     fclose(f);
+    return status;
+}
+
+int cmraw_load_thumbnail(CMRawThumbnail *thumb, CMRawHeader *cmrh, const char *fname)
+{
+    thumb->width = 0;
+    thumb->height = 0;
+    thumb->rgb8 = NULL;
 
+    FILE *f = fopen(fname, "rb");
+    if (f == NULL)
+        return -errno;
+
+    int status = 0;
+    if (fread(cmrh, sizeof(CMRawHeader), 1, f) != 1)
+        status = -EIO;
+    else if (cmrh->magic != CM_MAGIC)
+        status = -EINVAL;
+    else
+        status = read_thumbnail(f, cmrh->thumb_size, thumb);
+    fclose(f);
     return status;
 }
@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef enum {
     CM_PIXEL_FMT_MONO8,
@@ -30,6 +31,12 @@ typedef enum {
     CM_ORIENTATION_270
 } CMOrientation;
 
+// how the pixel data after the header is stored
+typedef enum {
+    CMRAW_COMPRESSION_NONE,
+    CMRAW_COMPRESSION_RICE      // lossless, see cmraw_codec.h
+} CMRawCompression;
+
 #define CM_MAX_WIDTH 32767
 #define CM_MAX_HEIGHT 32767
 
@@ -44,7 +51,8 @@ typedef struct {
     float shutter_us;
     float gain_dB;
     float focal_len_mm;
-    float reserved;
+    uint16_t white_level;   // 0 means the full range of the pixel format
+    uint16_t reserved;
     float white_x;          // CIE xy chromaticity of white
     float white_y;          // for as-shot white balance
 } CMCaptureInfo;
@@ -52,7 +60,11 @@ typedef struct {
 typedef struct {
     uint32_t magic;         // should be little endian 0x69564D43 (CMVi)
     CMCaptureInfo cinfo;
-    char reserved[24];
+    uint8_t compression;    // CMRawCompression enum member
+    uint8_t reserved1[3];
+    uint32_t data_size;     // bytes of pixel data in the file when compressed
+    uint32_t thumb_size;    // bytes of the thumbnail block between the header and the data
+    char reserved[12];
     char camera_make[32];
     char camera_model[32];
     char capture_software[32];
@@ -62,11 +74,87 @@ typedef struct {
 // Zero the struct, set the magic and timestamp
 void cm_raw_header_init(CMRawHeader *cmrh);
 
+// highest possible pixel value, e.g. 4095 for 12 bit formats
+uint16_t cmraw_white_level(const CMCaptureInfo *cinfo);
+
+// bytes of raw data for the format and size in cinfo, 0 if the format isn't supported
+size_t cmraw_data_size(const CMCaptureInfo *cinfo);
+
+// compresses the data if cmrh->compression is set, data_size is filled in when writing
 int cmraw_save(const void *raw, const CMRawHeader *cmrh, const char *fname);
 
+// longest side of a thumbnail
+#define CMRAW_THUMB_MAX_SIZE 256
+
+/* 8 bit RGB preview, so files can be browsed without processing their raw data. It's stored
+ * between the header and the pixel data as:
+ *  uint16_t width
+ *  uint16_t height
+ *  width * height RGB pixels
+ *  zeros padding the block to a multiple of 8 bytes, included in thumb_size
+ */
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    uint8_t *rgb8;
+} CMRawThumbnail;
+
+/* Scales an 8 bit RGB image, e.g. the binned preview, down to fit CMRAW_THUMB_MAX_SIZE.
+ * stride is the bytes from one row to the next. thumb must be freed with cmraw_free_thumbnail.
+ * Returns 0 on success or a negative error code.
+ */
+int cmraw_make_thumbnail(const uint8_t *rgb8, uint16_t width, uint16_t height, size_t stride,
+        CMRawThumbnail *thumb);
+
+void cmraw_free_thumbnail(CMRawThumbnail *thumb);
+
+// bytes of the thumbnail block in a file, 0 for no thumbnail (NULL)
+size_t cmraw_thumbnail_size(const CMRawThumbnail *thumb);
+
+// writes the thumbnail block, cmraw_thumbnail_size bytes, to out
+void cmraw_pack_thumbnail(const CMRawThumbnail *thumb, uint8_t *out);
+
+// same as cmraw_save with a thumbnail, which may be NULL for none
+int cmraw_save_with_thumbnail(const void *raw, const CMRawHeader *cmrh,
+        const CMRawThumbnail *thumb, const char *fname);
+
+// reads only the header of a file, returns 0 on success or a negative error code
+int cmraw_load_header(CMRawHeader *cmrh, const char *fname);
+
+/* Reads only the header and thumbnail of a file, not its pixel data. thumb must be freed with
+ * cmraw_free_thumbnail. Returns -ENOENT if the file has no thumbnail.
+ */
+int cmraw_load_thumbnail(CMRawThumbnail *thumb, CMRawHeader *cmrh, const char *fname);
+
 // sets the raw pointer, caller must free it (with C stdlib free) when done
+// compressed data is decoded, so *raw is always cmraw_data_size bytes
 int cmraw_load(void **raw, CMRawHeader *cmrh, const char *fname);
 
+/* Same as cmraw_load, but reuses *raw if it holds *capacity bytes, which is enough for the file,
+ * so a series of files can be read into one buffer. Otherwise *raw is freed and replaced with a
+ * larger one and *capacity updated. Start with NULL and 0, the caller frees *raw when done, even
+ * after an error.
+ * If thumb isn't NULL the thumbnail is read in the same pass, left empty if the file has none or
+ * it's damaged, and must be freed with cmraw_free_thumbnail.
+ */
+int cmraw_load_reuse(void **raw, size_t *capacity, CMRawThumbnail *thumb, CMRawHeader *cmrh,
+        const char *fname);
+
+// read only mapping of a whole .cmr file
+typedef struct {
+    void *addr;
+    size_t len;
+} CMRawMapping;
+
+/* Same as cmraw_load, but maps the file instead of reading it, so pixels are only read from
+ * disk as they're touched. raw points into the mapping, which must be released with
+ * cmraw_unmap, and mustn't be written to.
+ * Returns -ENOTSUP for a compressed file, which has to be loaded with cmraw_load instead.
+ */
+int cmraw_map(CMRawMapping *mapping, const void **raw, CMRawHeader *cmrh, const char *fname);
+
+void cmraw_unmap(CMRawMapping *mapping);
+
 #ifdef __cplusplus
 }
 #endif
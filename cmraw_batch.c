@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "cm_cli_helper.h"
+#include "cm_parallel.h"
+#include "cmraw.h"
+#include "dng.h"
+#include "pipeline.h"
+
+typedef enum {
+    BATCH_TIFF,
+    BATCH_TIFF16,
+    BATCH_DNG
+} BatchOutput;
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_LOADING,
+    SLOT_LOADED,                // waiting for a worker
+    SLOT_PROCESSING,
+    SLOT_PROCESSED,             // waiting to be written
+    SLOT_WRITING
+} SlotState;
+
+// a file on its way through the batch, the buffers are reused by the files after it
+typedef struct {
+    SlotState state;
+    uint32_t file;              // index in the file list
+    CMRawHeader cmrh;
+    void *raw;
+    size_t raw_capacity;
+    CMRawThumbnail thumb;       // carried over to DNGs
+    void *rgb;                  // processed image, 8 or 16 bit
+    size_t rgb_capacity;
+} BatchSlot;
+
+typedef struct {
+    glob_t files;
+    const char *out_dir;
+    BatchOutput output;
+    CMDNGCompression compression;
+
+    /* Files move through the slots: the reader thread loads each into a free slot, a worker
+     * processes it and the writer writes it out, so reading and writing overlap processing
+     * other files. A slot is claimed under the lock, then worked on without it by the thread
+     * that claimed it. DNGs are encoded and written by the workers, the writer isn't needed.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // broadcast whenever a slot changes state
+    BatchSlot *slots;
+    unsigned num_slots;
+    bool reading_done;
+    unsigned workers_running;
+
+    uint32_t converted;
+    uint32_t failed;
+    uint64_t pixels;            // of converted files
+} BatchJob;
+
+// must be called with the lock held
+static BatchSlot *find_slot(BatchJob *job, SlotState state)
+{
+    for (unsigned i = 0; i < job->num_slots; i++) {
+        if (job->slots[i].state == state)
+            return &job->slots[i];
+    }
+    return NULL;
+}
+
+// hands a slot on to the next stage, counting the file if it's finished
+static void finish_stage(BatchJob *job, BatchSlot *slot, int status, SlotState next)
+{
+    pthread_mutex_lock(&job->lock);
+    if (status) {
+        job->failed++;
+        next = SLOT_FREE;
+    } else if (next == SLOT_FREE) {
+        job->converted++;
+        job->pixels += (uint64_t)slot->cmrh.cinfo.width * slot->cmrh.cinfo.height;
+    }
+    slot->state = next;
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// name of the file in the output directory, with the input's name and the output's extension
+static void output_name(const BatchJob *job, uint32_t file, char *name, size_t len)
+{
+    const char *path = job->files.gl_pathv[file];
+    const char *base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+    const char *ext = strrchr(base, '.');
+    int base_len = ext != NULL && ext != base ? (int)(ext - base) : (int)strlen(base);
+    snprintf(name, len, "%s/%.*s%s", job->out_dir, base_len, base,
+            job->output == BATCH_DNG ? ".dng" : ".tiff");
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Inputs with the same name in different directories would be written to the same output, one
+ * overwriting the other. Returns -EEXIST after listing any such names.
+ */
+static int check_output_names(const BatchJob *job)
+{
+    size_t num = job->files.gl_pathc;
+    char **names = (char **)malloc(num * sizeof(char *));
+    if (names == NULL)
+        return -ENOMEM;
+
+    int status = 0;
+    size_t made = 0;
+    for (; made < num; made++) {
+        char name[4096];
+        output_name(job, made, name, sizeof(name));
+        names[made] = strdup(name);
+        if (names[made] == NULL) {
+            status = -ENOMEM;
+            break;
+        }
+    }
+
+    if (!status) {
+        qsort(names, num, sizeof(char *), compare_names);
+        for (size_t i = 1; i < num; i++) {
+            if (strcmp(names[i - 1], names[i]) == 0 && (i < 2 || strcmp(names[i - 2], names[i]))) {
+                printf("More than one input would be written to %s\n", names[i]);
+                status = -EEXIST;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < made; i++)
+        free(names[i]);
+    free(names);
+    return status;
+}
+
+static void *reader_thread(void *arg)
+{
+    BatchJob *job = (BatchJob *)arg;
+
+    for (uint32_t n = 0; n < job->files.gl_pathc; n++) {
+        pthread_mutex_lock(&job->lock);
+        BatchSlot *slot;
+        while ((slot = find_slot(job, SLOT_FREE)) == NULL)
+            pthread_cond_wait(&job->changed, &job->lock);
+        slot->state = SLOT_LOADING;
+        pthread_mutex_unlock(&job->lock);
+
+        const char *path = job->files.gl_pathv[n];
+        slot->file = n;
+        // the preview is carried over to a DNG if the file has one
+        cmraw_free_thumbnail(&slot->thumb);
+        int status = cmraw_load_reuse(&slot->raw, &slot->raw_capacity,
+                job->output == BATCH_DNG ? &slot->thumb : NULL, &slot->cmrh, path);
+        if (status)
+            printf("Error %d loading %s.\n", status, path);
+        finish_stage(job, slot, status, SLOT_LOADED);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->reading_done = true;
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static int process_file(BatchJob *job, BatchSlot *slot, ImagePipelineBuffers *buffers)
+{
+    const CMCaptureInfo *cinfo = &slot->cmrh.cinfo;
+    if (job->output == BATCH_DNG) {
+        char name[4096];
+        output_name(job, slot->file, name, sizeof(name));
+        return bayer_to_dng_with_thumbnail(slot->raw, &slot->cmrh, &slot->thumb, name,
+                job->compression);
+    }
+
+    bool rgb16 = job->output == BATCH_TIFF16;
+    size_t len = (size_t)cinfo->width * cinfo->height * 3 * (rgb16 ? sizeof(uint16_t) : 1);
+    if (len > slot->rgb_capacity) {
+        free(slot->rgb);
+        slot->rgb_capacity = 0;
+        slot->rgb = malloc(len);
+        if (slot->rgb == NULL)
+            return -ENOMEM;
+        slot->rgb_capacity = len;
+    }
+
+    // use as-shot white balance if specified
+    ImagePipelineParams params = default_pipeline_params;
+    if (cinfo->white_x > 0 || cinfo->white_y > 0)
+        colour_xy_to_temp_tint(cinfo->white_x, cinfo->white_y, &params.temp_K, &params.tint);
+
+    return pipeline_process_image_buffers(slot->raw, rgb16 ? (uint16_t *)slot->rgb : NULL,
+            rgb16 ? NULL : (uint8_t *)slot->rgb, cinfo, &params, buffers);
+}
+
+// each worker keeps its pipeline's working images from file to file
+static void *batch_worker(void *arg)
+{
+    BatchJob *job = (BatchJob *)arg;
+    ImagePipelineBuffers buffers;
+    memset(&buffers, 0, sizeof(buffers));
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        BatchSlot *slot;
+        while ((slot = find_slot(job, SLOT_LOADED)) == NULL && !job->reading_done)
+            pthread_cond_wait(&job->changed, &job->lock);
+        if (slot == NULL) {
+            job->workers_running--;
+            pthread_cond_broadcast(&job->changed);
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        slot->state = SLOT_PROCESSING;
+        pthread_mutex_unlock(&job->lock);
+
+        int status = process_file(job, slot, &buffers);
+        if (status)
+            printf("Error %d converting %s.\n", status, job->files.gl_pathv[slot->file]);
+        finish_stage(job, slot, status, job->output == BATCH_DNG ? SLOT_FREE : SLOT_PROCESSED);
+    }
+
+    pipeline_free_buffers(&buffers);
+    return NULL;
+}
+
+// runs on the main thread until every worker has finished and their files are written
+static void write_files(BatchJob *job)
+{
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        BatchSlot *slot;
+        while ((slot = find_slot(job, SLOT_PROCESSED)) == NULL && job->workers_running > 0)
+            pthread_cond_wait(&job->changed, &job->lock);
+        if (slot == NULL) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        slot->state = SLOT_WRITING;
+        pthread_mutex_unlock(&job->lock);
+
+        char name[4096];
+        output_name(job, slot->file, name, sizeof(name));
+        uint16_t width = slot->cmrh.cinfo.width;
+        uint16_t height = slot->cmrh.cinfo.height;
+        int status = job->output == BATCH_TIFF16
+                ? rgb16_to_tiff((const uint16_t *)slot->rgb, width, height, name)
+                : rgb8_to_tiff((const uint8_t *)slot->rgb, width, height, name);
+        if (status)
+            printf("Error %d writing %s.\n", status, name);
+        finish_stage(job, slot, status, SLOT_FREE);
+    }
+}
+
+static double now_s(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || argc > 5) {
+        printf("Usage: %s [cmr_dir or quoted glob] [out_dir] "
+               "[output (tiff, tiff16, dng, dng16 or dng12, default tiff)] "
+               "[workers (default auto)]\n", argv[0]);
+        return -1;
+    }
+
+    BatchJob job;
+    memset(&job, 0, sizeof(job));
+    job.out_dir = argv[2];
+    job.output = BATCH_TIFF;
+    if (argc >= 4) {
+        if (strcmp(argv[3], "tiff16") == 0) {
+            job.output = BATCH_TIFF16;
+        } else if (strcmp(argv[3], "dng") == 0) {
+            job.output = BATCH_DNG;
+            job.compression = CMDNG_COMPRESSION_LJ92;
+        } else if (strcmp(argv[3], "dng16") == 0) {
+            job.output = BATCH_DNG;
+            job.compression = CMDNG_COMPRESSION_NONE;
+        } else if (strcmp(argv[3], "dng12") == 0) {
+            job.output = BATCH_DNG;
+            job.compression = CMDNG_COMPRESSION_NONE_12BIT;
+        } else if (strcmp(argv[3], "tiff") != 0) {
+            printf("Invalid output: %s\n", argv[3]);
+            return -1;
+        }
+    }
+
+    /* The pipeline runs on one thread per file, so a worker per core keeps them all busy. Only
+     * the LJ92 encoder splits a file's tiles across the cores, so then a few workers are enough
+     * to cover the serial parts of the pipeline between encodes.
+     */
+    unsigned num_workers = parallel_num_threads();
+    if (job.output == BATCH_DNG && job.compression == CMDNG_COMPRESSION_LJ92) {
+        num_workers /= 4;
+        if (num_workers < 2)
+            num_workers = 2;
+        else if (num_workers > 4)
+            num_workers = 4;
+    }
+    if (argc >= 5 && strcmp(argv[4], "auto") != 0) {
+        int n = atoi(argv[4]);
+        if (n < 1 || n > 64) {
+            printf("Invalid number of workers: %s\n", argv[4]);
+            return -1;
+        }
+        num_workers = n;
+    }
+
+    // a directory converts every .cmr file in it
+    char pattern[4096];
+    struct stat st;
+    if (stat(argv[1], &st) == 0 && S_ISDIR(st.st_mode))
+        snprintf(pattern, sizeof(pattern), "%s/*.cmr", argv[1]);
+    else
+        snprintf(pattern, sizeof(pattern), "%s", argv[1]);
+    int glob_status = glob(pattern, 0, NULL, &job.files);
+    if (glob_status == GLOB_NOMATCH || (glob_status == 0 && job.files.gl_pathc == 0)) {
+        printf("No files match %s\n", pattern);
+        globfree(&job.files);
+        return -1;
+    } else if (glob_status) {
+        printf("Error listing %s\n", pattern);
+        return -1;
+    }
+
+    int name_status = check_output_names(&job);
+    if (name_status) {
+        if (name_status == -ENOMEM)
+            printf("Out of memory.\n");
+        globfree(&job.files);
+        return name_status;
+    }
+
+    if (mkdir(job.out_dir, 0755) && errno != EEXIST) {
+        printf("Error creating %s: %s\n", job.out_dir, strerror(errno));
+        globfree(&job.files);
+        return -errno;
+    }
+
+    // one slot per worker, plus one being read and one being written
+    job.num_slots = num_workers + 2;
+    job.slots = (BatchSlot *)calloc(job.num_slots, sizeof(BatchSlot));
+    pthread_t *workers = (pthread_t *)malloc(num_workers * sizeof(pthread_t));
+    if (job.slots == NULL || workers == NULL) {
+        printf("Out of memory.\n");
+        free(job.slots);
+        free(workers);
+        globfree(&job.files);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+
+    /* Workers only finish once reading is done, so the count can be corrected after starting
+     * them. Without a reader, reading is done before it started.
+     */
+    double start = now_s();
+    job.workers_running = num_workers;
+    unsigned started = 0;
+    for (; started < num_workers; started++) {
+        if (pthread_create(&workers[started], NULL, batch_worker, &job))
+            break;
+    }
+    pthread_t reader;
+    bool reader_started = started > 0
+            && pthread_create(&reader, NULL, reader_thread, &job) == 0;
+    pthread_mutex_lock(&job.lock);
+    job.workers_running = started;
+    if (!reader_started)
+        job.reading_done = true;
+    pthread_mutex_unlock(&job.lock);
+
+    int status = 0;
+    if (!reader_started) {
+        printf("Error starting threads.\n");
+        status = -EAGAIN;
+    }
+    write_files(&job);
+    if (reader_started)
+        pthread_join(reader, NULL);
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    double elapsed = now_s() - start;
+
+    if (!status) {
+        printf("Converted %u of %zu files with %u workers in %.2f s, %.2f files/s, "
+                "%.1f MPix/s\n", job.converted, job.files.gl_pathc, started, elapsed,
+                job.converted / elapsed, job.pixels / elapsed / 1e6);
+        if (job.failed)
+            status = -EIO;
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.changed);
+    for (unsigned i = 0; i < job.num_slots; i++) {
+        free(job.slots[i].raw);
+        free(job.slots[i].rgb);
+        cmraw_free_thumbnail(&job.slots[i].thumb);
+    }
+    free(job.slots);
+    free(workers);
+    globfree(&job.files);
+    return status;
+}
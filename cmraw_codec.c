@@ -0,0 +1,482 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "cmraw_codec.h"
+#include "debayer.h"
+#include "cm_parallel.h"
+
+// unary part of a Rice code longer than this escapes to the residual written in full
+#define RICE_LIMIT 24
+#define RICE_ESCAPE_BITS 17     // a zigzag mapped difference of 16 bit values
+// bits per residual can't exceed RICE_LIMIT + 1 + RICE_ESCAPE_BITS, rounded up to bytes
+#define RICE_MAX_BYTES 6
+
+// contexts: CFA site and local activity, the bit length of the same colour gradients
+#define CTX_ACTIVITY 12
+#define CTX_COUNT (4 * CTX_ACTIVITY)
+// running means are halved after this many residuals, so they follow changes in the image
+#define CTX_RESET 64
+
+typedef struct {
+    uint32_t sum;       // of mapped residuals
+    uint32_t count;
+} RiceContext;
+
+typedef struct {
+    uint64_t acc;
+    unsigned n;         // bits in acc not yet written
+    uint8_t *p;
+} BitWriter;
+
+typedef struct {
+    uint64_t acc;       // next bits to read, MSB first
+    unsigned n;
+    const uint8_t *p;
+    const uint8_t *end;
+} BitReader;
+
+typedef struct {
+    const void *raw;
+    const CMCaptureInfo *cinfo;
+    uint8_t *out;
+    uint32_t *slice_size;
+    size_t slice_stride;    // bytes of out reserved per full slice
+    volatile int status;
+} EncodeJob;
+
+typedef struct {
+    const uint8_t *in;
+    const CMCaptureInfo *cinfo;
+    void *raw;
+    const uint32_t *slice_size;
+    const size_t *slice_offset;
+    volatile int status;
+} DecodeJob;
+
+static bool codec_supported(const CMCaptureInfo *cinfo)
+{
+    switch (cinfo->pixel_fmt) {
+    case CM_PIXEL_FMT_BAYER_RG12P:
+    case CM_PIXEL_FMT_BAYER_RG12:
+    case CM_PIXEL_FMT_BAYER_RG16:
+    case CM_PIXEL_FMT_MONO12P:
+    case CM_PIXEL_FMT_MONO12:
+    case CM_PIXEL_FMT_MONO16:
+        return cinfo->width > 0 && cinfo->height > 0 && !(cinfo->width & 1)
+                && cinfo->width <= CM_MAX_WIDTH && cinfo->height <= CM_MAX_HEIGHT;
+    default:
+        return false;
+    }
+}
+
+static bool codec_packed(const CMCaptureInfo *cinfo)
+{
+    return cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P
+            || cinfo->pixel_fmt == CM_PIXEL_FMT_MONO12P;
+}
+
+static unsigned num_slices(const CMCaptureInfo *cinfo)
+{
+    return (cinfo->height + CMRAW_CODEC_SLICE_ROWS - 1) / CMRAW_CODEC_SLICE_ROWS;
+}
+
+static size_t table_size(const CMCaptureInfo *cinfo)
+{
+    return (2 + num_slices(cinfo)) * sizeof(uint32_t);
+}
+
+// bytes of a row in the frame's own layout, which is how a slice that doesn't compress is stored
+static size_t row_bytes(const CMCaptureInfo *cinfo)
+{
+    return codec_packed(cinfo) ? (size_t)cinfo->width / 2 * 3 : (size_t)cinfo->width * 2;
+}
+
+size_t cmraw_encode_bound(const CMCaptureInfo *cinfo)
+{
+    if (!codec_supported(cinfo))
+        return 0;
+    return table_size(cinfo) + row_bytes(cinfo) * cinfo->height;
+}
+
+static void read_row(const void *raw, const CMCaptureInfo *cinfo, unsigned y, uint16_t *row)
+{
+    size_t offset = (size_t)y * cinfo->width;
+    if (codec_packed(cinfo))
+        unpack12_16(row, (const uint8_t *)raw + offset / 2 * 3, cinfo->width, false);
+    else
+        memcpy(row, (const uint16_t *)raw + offset, cinfo->width * sizeof(uint16_t));
+}
+
+static void write_row(void *raw, const CMCaptureInfo *cinfo, unsigned y, const uint16_t *row)
+{
+    size_t offset = (size_t)y * cinfo->width;
+    if (codec_packed(cinfo)) {
+        uint8_t *p = (uint8_t *)raw + offset / 2 * 3;
+        for (unsigned x = 0; x < cinfo->width; x += 2, p += 3) {
+            p[0] = row[x] & 0xFF;
+            p[1] = (row[x] >> 8) | ((row[x + 1] & 0x0F) << 4);
+            p[2] = row[x + 1] >> 4;
+        }
+    } else {
+        memcpy((uint16_t *)raw + offset, row, cinfo->width * sizeof(uint16_t));
+    }
+}
+
+static inline unsigned bit_length(uint32_t v)
+{
+    return v ? 32 - __builtin_clz(v) : 0;
+}
+
+/* median edge detector, a the same colour neighbour to the left, b above and c above left:
+ *  min(a, b) if c >= max(a, b), max(a, b) if c <= min(a, b), else a + b - c
+ * which is a + b - c clamped to [min(a, b), max(a, b)], without branches that noise would make
+ * unpredictable
+ * the context is the CFA site and the activity around the pixel
+ */
+static inline int predict(int a, int b, int c, unsigned site, unsigned *ctx)
+{
+    int lo = a < b ? a : b;
+    int hi = a < b ? b : a;
+    unsigned act = bit_length(abs(a - c) + abs(b - c));
+    *ctx = site * CTX_ACTIVITY + (act < CTX_ACTIVITY ? act : CTX_ACTIVITY - 1);
+    int pred = a + b - c;
+    pred = pred < lo ? lo : pred;
+    return pred > hi ? hi : pred;
+}
+
+// neighbours outside the slice are replaced by ones inside it, the first pixels predict 0
+static inline int predict_edge(const uint16_t *row, const uint16_t *above, unsigned x,
+        unsigned site, unsigned *ctx)
+{
+    if (above != NULL && x >= 2)
+        return predict(row[x - 2], above[x], above[x - 2], site, ctx);
+    *ctx = site * CTX_ACTIVITY + CTX_ACTIVITY - 1;
+    if (above != NULL)
+        return above[x];
+    if (x >= 2)
+        return row[x - 2];
+    return 0;
+}
+
+// smallest k with count * 2^k >= sum, so 2^k is at least the mean residual
+static inline unsigned rice_k(const RiceContext *rc)
+{
+    unsigned k = 0;
+    while ((rc->count << k) < rc->sum && k < 16)
+        k++;
+    return k;
+}
+
+static inline void rice_update(RiceContext *rc, uint32_t m)
+{
+    rc->sum += m;
+    if (++rc->count == CTX_RESET) {
+        rc->sum >>= 1;
+        rc->count >>= 1;
+    }
+}
+
+static void contexts_init(RiceContext *ctxs)
+{
+    for (int i = 0; i < CTX_COUNT; i++) {
+        ctxs[i].sum = 16;
+        ctxs[i].count = 1;
+    }
+}
+
+static inline void bw_put(BitWriter *bw, uint32_t bits, unsigned len)
+{
+    bw->acc = (bw->acc << len) | bits;
+    bw->n += len;
+    if (bw->n >= 32) {
+        bw->n -= 32;
+        uint32_t w = bw->acc >> bw->n;
+        bw->p[0] = w >> 24;
+        bw->p[1] = w >> 16;
+        bw->p[2] = w >> 8;
+        bw->p[3] = w;
+        bw->p += 4;
+    }
+}
+
+static void bw_flush(BitWriter *bw)
+{
+    while (bw->n >= 8) {
+        bw->n -= 8;
+        *bw->p++ = bw->acc >> bw->n;
+    }
+    if (bw->n > 0)
+        *bw->p++ = bw->acc << (8 - bw->n);
+    bw->n = 0;
+}
+
+static inline void rice_encode(BitWriter *bw, RiceContext *rc, int residual)
+{
+    // zigzag: 0, -1, 1, -2, 2... to 0, 1, 2, 3, 4...
+    uint32_t m = ((uint32_t)residual << 1) ^ (uint32_t)(residual >> 31);
+    unsigned k = rice_k(rc);
+    uint32_t q = m >> k;
+    if (q < RICE_LIMIT) {
+        if (q + 1 + k <= 32) {
+            bw_put(bw, (1u << k) | (m & ((1u << k) - 1)), q + 1 + k);
+        } else {
+            bw_put(bw, 1, q + 1);
+            bw_put(bw, m & ((1u << k) - 1), k);
+        }
+    } else {
+        bw_put(bw, 1, RICE_LIMIT + 1);
+        bw_put(bw, m, RICE_ESCAPE_BITS);
+    }
+    rice_update(rc, m);
+}
+
+static inline void br_refill(BitReader *br)
+{
+    if (br->end - br->p >= 8) {
+        const uint8_t *p = br->p;
+        uint64_t v = (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 | (uint64_t)p[2] << 40
+                | (uint64_t)p[3] << 32 | (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16
+                | (uint64_t)p[6] << 8 | (uint64_t)p[7];
+        br->acc |= v >> br->n;
+        br->p += (63 - br->n) >> 3;
+        br->n |= 56;
+    } else {
+        // past the end reads zeros, which the caller detects by the position
+        while (br->n <= 56) {
+            uint64_t byte = br->p < br->end ? *br->p : 0;
+            br->acc |= byte << (56 - br->n);
+            br->p++;
+            br->n += 8;
+        }
+    }
+}
+
+static inline uint32_t br_take(BitReader *br, unsigned len)
+{
+    uint32_t v = len ? br->acc >> (64 - len) : 0;
+    br->acc <<= len;
+    br->n -= len;
+    return v;
+}
+
+// returns a residual, or INT32_MIN if the data is invalid
+static inline int rice_decode(BitReader *br, RiceContext *rc)
+{
+    br_refill(br);
+    unsigned q = br->acc ? __builtin_clzll(br->acc) : 64;
+    unsigned k = rice_k(rc);
+    uint32_t m;
+    if (q < RICE_LIMIT) {
+        br_take(br, q + 1);
+        m = (q << k) | br_take(br, k);
+    } else if (q == RICE_LIMIT) {
+        br_take(br, RICE_LIMIT + 1);
+        m = br_take(br, RICE_ESCAPE_BITS);
+    } else {
+        return INT32_MIN;
+    }
+    rice_update(rc, m);
+    return (int)(m >> 1) ^ -(int)(m & 1);
+}
+
+// returns the bytes used, or 0 if the slice doesn't fit in capacity
+static size_t encode_slice(const EncodeJob *job, unsigned y0, unsigned y1, uint16_t *rows,
+        uint8_t *out, size_t capacity)
+{
+    const unsigned width = job->cinfo->width;
+    const size_t row_bytes_max = (size_t)width * RICE_MAX_BYTES + 8;
+    RiceContext ctxs[CTX_COUNT];
+    contexts_init(ctxs);
+    BitWriter bw = {.acc = 0, .n = 0, .p = out};
+
+    for (unsigned y = y0; y < y1; y++) {
+        if ((size_t)(bw.p - out) + row_bytes_max > capacity)
+            return 0;
+
+        uint16_t *row = rows + (y % 3) * width;
+        const uint16_t *above = y >= y0 + 2 ? rows + ((y - 2) % 3) * width : NULL;
+        read_row(job->raw, job->cinfo, y, row);
+        const unsigned site_y = (y & 1) << 1;
+        unsigned ctx;
+
+        if (above == NULL) {
+            for (unsigned x = 0; x < width; x++) {
+                int pred = predict_edge(row, NULL, x, site_y | (x & 1), &ctx);
+                rice_encode(&bw, &ctxs[ctx], row[x] - pred);
+            }
+            continue;
+        }
+
+        for (unsigned x = 0; x < 2; x++) {
+            int pred = predict_edge(row, above, x, site_y | x, &ctx);
+            rice_encode(&bw, &ctxs[ctx], row[x] - pred);
+        }
+        for (unsigned x = 2; x < width; x++) {
+            int pred = predict(row[x - 2], above[x], above[x - 2], site_y | (x & 1), &ctx);
+            rice_encode(&bw, &ctxs[ctx], row[x] - pred);
+        }
+    }
+    bw_flush(&bw);
+    return bw.p - out;
+}
+
+static void encode_slices(void *arg, unsigned int start, unsigned int end)
+{
+    EncodeJob *job = (EncodeJob *)arg;
+    const unsigned width = job->cinfo->width;
+    const unsigned height = job->cinfo->height;
+    uint16_t *rows = (uint16_t *)malloc(3 * width * sizeof(uint16_t));
+    if (rows == NULL) {
+        job->status = -ENOMEM;
+        return;
+    }
+
+    for (unsigned s = start; s < end; s++) {
+        unsigned y0 = s * CMRAW_CODEC_SLICE_ROWS;
+        unsigned y1 = y0 + CMRAW_CODEC_SLICE_ROWS < height ? y0 + CMRAW_CODEC_SLICE_ROWS : height;
+        uint8_t *out = job->out + s * job->slice_stride;
+        size_t stored = (y1 - y0) * row_bytes(job->cinfo);
+
+        size_t len = encode_slice(job, y0, y1, rows, out, stored);
+        if (len == 0 || len >= stored) {
+            memcpy(out, (const uint8_t *)job->raw + y0 * row_bytes(job->cinfo), stored);
+            len = stored;
+        }
+        job->slice_size[s] = len;
+    }
+    free(rows);
+}
+
+int cmraw_encode(const void *raw, const CMCaptureInfo *cinfo, uint8_t *out, size_t *out_len)
+{
+    *out_len = 0;
+    if (!codec_supported(cinfo))
+        return -EINVAL;
+
+    // slices are encoded in place at their largest size, then moved up to close the gaps
+    const unsigned ns = num_slices(cinfo);
+    uint32_t *header = (uint32_t *)out;
+    header[0] = CMRAW_CODEC_SLICE_ROWS;
+    header[1] = ns;
+    EncodeJob job = {
+        .raw = raw,
+        .cinfo = cinfo,
+        .out = out + table_size(cinfo),
+        .slice_size = header + 2,
+        .slice_stride = CMRAW_CODEC_SLICE_ROWS * row_bytes(cinfo),
+        .status = 0
+    };
+    parallel_for(ns, encode_slices, &job);
+    if (job.status)
+        return job.status;
+
+    size_t len = table_size(cinfo);
+    for (unsigned s = 0; s < ns; s++) {
+        memmove(out + len, job.out + s * job.slice_stride, job.slice_size[s]);
+        len += job.slice_size[s];
+    }
+    *out_len = len;
+    return 0;
+}
+
+static int decode_slice(const DecodeJob *job, unsigned y0, unsigned y1, uint16_t *rows,
+        const uint8_t *in, size_t len)
+{
+    const unsigned width = job->cinfo->width;
+    if (len == (y1 - y0) * row_bytes(job->cinfo)) {
+        memcpy((uint8_t *)job->raw + y0 * row_bytes(job->cinfo), in, len);
+        return 0;
+    }
+
+    RiceContext ctxs[CTX_COUNT];
+    contexts_init(ctxs);
+    BitReader br = {.acc = 0, .n = 0, .p = in, .end = in + len};
+
+    for (unsigned y = y0; y < y1; y++) {
+        uint16_t *row = rows + (y % 3) * width;
+        const uint16_t *above = y >= y0 + 2 ? rows + ((y - 2) % 3) * width : NULL;
+        const unsigned site_y = (y & 1) << 1;
+        unsigned ctx;
+
+        for (unsigned x = 0; x < width; x++) {
+            int pred;
+            if (above != NULL && x >= 2)
+                pred = predict(row[x - 2], above[x], above[x - 2], site_y | (x & 1), &ctx);
+            else
+                pred = predict_edge(row, above, x, site_y | (x & 1), &ctx);
+            int residual = rice_decode(&br, &ctxs[ctx]);
+            int v = pred + residual;
+            if (residual == INT32_MIN || v < 0 || v > UINT16_MAX)
+                return -EINVAL;
+            row[x] = v;
+        }
+        write_row(job->raw, job->cinfo, y, row);
+    }
+
+    // bits read past the end of the slice were zeros, not data
+    if (br.p - br.n / 8 > br.end)
+        return -EINVAL;
+    return 0;
+}
+
+static void decode_slices(void *arg, unsigned int start, unsigned int end)
+{
+    DecodeJob *job = (DecodeJob *)arg;
+    const unsigned width = job->cinfo->width;
+    const unsigned height = job->cinfo->height;
+    uint16_t *rows = (uint16_t *)malloc(3 * width * sizeof(uint16_t));
+    if (rows == NULL) {
+        job->status = -ENOMEM;
+        return;
+    }
+
+    for (unsigned s = start; s < end; s++) {
+        unsigned y0 = s * CMRAW_CODEC_SLICE_ROWS;
+        unsigned y1 = y0 + CMRAW_CODEC_SLICE_ROWS < height ? y0 + CMRAW_CODEC_SLICE_ROWS : height;
+        int status = decode_slice(job, y0, y1, rows, job->in + job->slice_offset[s],
+                job->slice_size[s]);
+        if (status)
+            job->status = status;
+    }
+    free(rows);
+}
+
+int cmraw_decode(const uint8_t *in, size_t in_len, const CMCaptureInfo *cinfo, void *raw)
+{
+    if (!codec_supported(cinfo))
+        return -EINVAL;
+
+    const unsigned ns = num_slices(cinfo);
+    const uint32_t *header = (const uint32_t *)in;
+    if (in_len < table_size(cinfo) || header[0] != CMRAW_CODEC_SLICE_ROWS || header[1] != ns)
+        return -EINVAL;
+
+    size_t *slice_offset = (size_t *)malloc(ns * sizeof(size_t));
+    if (slice_offset == NULL)
+        return -ENOMEM;
+    size_t offset = table_size(cinfo);
+    for (unsigned s = 0; s < ns; s++) {
+        slice_offset[s] = offset;
+        offset += header[2 + s];
+    }
+
+    int status = 0;
+    if (offset > in_len) {
+        status = -EINVAL;
+    } else {
+        DecodeJob job = {
+            .in = in,
+            .cinfo = cinfo,
+            .raw = raw,
+            .slice_size = header + 2,
+            .slice_offset = slice_offset,
+            .status = 0
+        };
+        parallel_for(ns, decode_slices, &job);
+        status = job.status;
+    }
+
+    free(slice_offset);
+    return status;
+}
@@ -0,0 +1,47 @@
+#ifndef CMRAW_CODEC_H
+#define CMRAW_CODEC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cmraw.h"
+
+// rows in each independently coded slice, a multiple of 2 so slices start on the same CFA row
+#define CMRAW_CODEC_SLICE_ROWS 64
+
+/* Lossless codec for raw frames (CMRAW_COMPRESSION_RICE)
+ *
+ * Each pixel is predicted from its nearest neighbours of the same CFA colour, two pixels left
+ * and up, with the median edge detector of LOCO-I. Residuals are Golomb-Rice coded with the
+ * parameter adapted to the running mean residual of each CFA site and local activity.
+ *
+ * The frame is coded as bands of CMRAW_CODEC_SLICE_ROWS rows that don't depend on each other,
+ * so they're encoded and decoded in parallel. A band that doesn't compress is stored as is, in
+ * the frame's own layout, so no band is bigger than it was.
+ *
+ *  uint32_t slice_rows
+ *  uint32_t num_slices
+ *  uint32_t slice_size[num_slices]     bytes, equal to the band's size in the frame if stored
+ *  slice data
+ *
+ * Supports 12 bit packed, 12 bit and 16 bit Bayer and mono formats, with an even width.
+ */
+
+// largest size cmraw_encode can produce for a frame, 0 if the format isn't supported
+size_t cmraw_encode_bound(const CMCaptureInfo *cinfo);
+
+// out must hold cmraw_encode_bound bytes, *out_len is set to the bytes used
+// returns 0 on success or a negative error code
+int cmraw_encode(const void *raw, const CMCaptureInfo *cinfo, uint8_t *out, size_t *out_len);
+
+// raw must hold cmraw_data_size bytes, returns 0 on success or a negative error code
+int cmraw_decode(const uint8_t *in, size_t in_len, const CMCaptureInfo *cinfo, void *raw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CMRAW_CODEC_H
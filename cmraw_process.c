@@ -6,11 +6,20 @@
 
 int main (int argc, char **argv)
 {
-    if (argc != 3) {
-        printf("Usage: %s [cmr_name] [tiff_name]\n", argv[0]);
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s [cmr_name] [tiff_name] [bit_depth (8 or 16, default 8)]\n", argv[0]);
         return -1;
     }
 
+    int bit_depth = 8;
+    if (argc == 4) {
+        bit_depth = atoi(argv[3]);
+        if (bit_depth != 8 && bit_depth != 16) {
+            printf("Invalid bit depth: %s\n", argv[3]);
+            return -1;
+        }
+    }
+
     if (!endswith(argv[1], ".cmr")) {
         printf("Invalid input extension: %s\n", argv[1]);
         return -1;
@@ -28,7 +37,10 @@ int main (int argc, char **argv)
     if (status != 0) {
         printf("Error %d loading RAW file.\n", status);
     } else {
-        cinemavi_generate_tiff(raw, &cmrh, argv[2]);
+        if (bit_depth == 16)
+            cinemavi_generate_tiff16(raw, &cmrh, argv[2]);
+        else
+            cinemavi_generate_tiff(raw, &cmrh, argv[2]);
     }
 
     free(raw);
@@ -1,16 +1,30 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cm_cli_helper.h"
 #include "cmraw.h"
 
 int main (int argc, char **argv)
 {
-    if (argc != 3) {
-        printf("Usage: %s [cmr_name] [dng_name]\n", argv[0]);
+    if (argc < 3 || argc > 4) {
+        printf("Usage: %s [cmr_name] [dng_name] [lj92|16|12]\n", argv[0]);
         return -1;
     }
 
+    // lossless JPEG unless uncompressed 16 or 12 bit samples are asked for
+    CMDNGCompression compression = CMDNG_COMPRESSION_LJ92;
+    if (argc > 3) {
+        if (strcmp(argv[3], "16") == 0) {
+            compression = CMDNG_COMPRESSION_NONE;
+        } else if (strcmp(argv[3], "12") == 0) {
+            compression = CMDNG_COMPRESSION_NONE_12BIT;
+        } else if (strcmp(argv[3], "lj92") != 0) {
+            printf("Invalid DNG compression: %s\n", argv[3]);
+            return -1;
+        }
+    }
+
     if (!endswith(argv[1], ".cmr")) {
         printf("Invalid input extension: %s\n", argv[1]);
         return -1;
@@ -28,7 +42,12 @@ int main (int argc, char **argv)
     if (status != 0) {
         printf("Error %d loading RAW file.\n", status);
     } else {
-        cinemavi_generate_dng(raw, &cmrh, argv[2]);
+        // the preview is carried over if the file has one
+        CMRawHeader thumb_cmrh;
+        CMRawThumbnail thumb = {0, 0, NULL};
+        cmraw_load_thumbnail(&thumb, &thumb_cmrh, argv[1]);
+        cinemavi_generate_dng(raw, &cmrh, &thumb, argv[2], compression);
+        cmraw_free_thumbnail(&thumb);
     }
 
     free(raw);
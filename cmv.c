@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "cmv.h"
+
+#define CMV_HEADER_SIZE ((sizeof(CMVideoHeader) + CMV_ALIGN - 1) / CMV_ALIGN * CMV_ALIGN)
+
+struct CMVideoWriter {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    uint32_t frame_size;
+    uint32_t record_size;
+
+    // ring of records, [tail, tail + count) are waiting to be written
+    uint8_t *ring;
+    unsigned int ring_frames;
+    unsigned int tail;
+    unsigned int count;
+    int closing;
+    int status;             // first write error
+
+    uint32_t frame_num;
+    uint32_t dropped;
+
+    // only touched by the writer thread until it's joined
+    uint64_t offset;
+    CMVideoIndexEntry *index;
+    uint32_t num_frames;
+    uint32_t index_capacity;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len, uint64_t offset)
+{
+    uint8_t *p = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (n == 0)
+            return -EIO;    // truncated
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// add the index entries of records about to be written, at the current file offset
+static int index_records(CMVideoWriter *w, const uint8_t *records, unsigned int num)
+{
+    if (w->num_frames + num > w->index_capacity) {
+        uint32_t capacity = w->index_capacity ? w->index_capacity * 2 : 1024;
+        while (capacity < w->num_frames + num)
+            capacity *= 2;
+        CMVideoIndexEntry *index = (CMVideoIndexEntry *)realloc(w->index,
+                capacity * sizeof(CMVideoIndexEntry));
+        if (index == NULL)
+            return -ENOMEM;
+        w->index = index;
+        w->index_capacity = capacity;
+    }
+
+    for (unsigned int i = 0; i < num; i++) {
+        const CMVideoFrameHeader *fh = (const CMVideoFrameHeader *)(records
+                + (size_t)i * w->record_size);
+        w->index[w->num_frames].offset = w->offset + (uint64_t)i * w->record_size;
+        w->index[w->num_frames].ts_ns = fh->ts_ns;
+        w->num_frames++;
+    }
+    return 0;
+}
+
+// writes contiguous runs of queued records with one call each, so writes are as large as the
+// backlog allows
+static void *writer_thread(void *arg)
+{
+    CMVideoWriter *w = (CMVideoWriter *)arg;
+
+    pthread_mutex_lock(&w->mutex);
+    for (;;) {
+        while (w->count == 0 && !w->closing)
+            pthread_cond_wait(&w->cond, &w->mutex);
+        if (w->count == 0)
+            break;
+
+        unsigned int tail = w->tail;
+        unsigned int num = w->count;
+        if (tail + num > w->ring_frames)
+            num = w->ring_frames - tail;
+        pthread_mutex_unlock(&w->mutex);
+
+        const uint8_t *records = w->ring + (size_t)tail * w->record_size;
+        size_t len = (size_t)num * w->record_size;
+        int status = index_records(w, records, num);
+        if (!status)
+            status = write_all(w->fd, records, len);
+        w->offset += len;
+
+        pthread_mutex_lock(&w->mutex);
+        if (status && !w->status)
+            w->status = status;
+        w->tail = (w->tail + num) % w->ring_frames;
+        w->count -= num;
+    }
+    pthread_mutex_unlock(&w->mutex);
+
+    return NULL;
+}
+
+int cmv_writer_open(CMVideoWriter **writer, const char *fname, const CMRawHeader *cmrh,
+        size_t queue_bytes)
+{
+    *writer = NULL;
+    size_t frame_size = cmraw_data_size(&cmrh->cinfo);
+    if (frame_size == 0 || frame_size > UINT32_MAX - CMV_ALIGN * 2)
+        return -EINVAL;
+
+    CMVideoWriter *w = (CMVideoWriter *)calloc(1, sizeof(CMVideoWriter));
+    if (w == NULL)
+        return -ENOMEM;
+
+    w->frame_size = frame_size;
+    w->record_size = (sizeof(CMVideoFrameHeader) + frame_size + CMV_ALIGN - 1)
+            / CMV_ALIGN * CMV_ALIGN;
+    w->ring_frames = queue_bytes / w->record_size;
+    if (w->ring_frames < 2)
+        w->ring_frames = 2;
+
+    // aligned so the buffers could be written with O_DIRECT
+    int status = 0;
+    void *ring = NULL;
+    if (posix_memalign(&ring, CMV_ALIGN, (size_t)w->ring_frames * w->record_size)) {
+        free(w);
+        return -ENOMEM;
+    }
+    w->ring = (uint8_t *)ring;
+
+    w->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        status = -errno;
+        free(w->ring);
+        free(w);
+        return status;
+    }
+
+    // the header is written straight away, so even an empty recording is a valid file
+    uint8_t *header_block = (uint8_t *)calloc(1, CMV_HEADER_SIZE);
+    if (header_block == NULL) {
+        status = -ENOMEM;
+        goto cleanup;
+    }
+    CMVideoHeader *header = (CMVideoHeader *)header_block;
+    header->magic = CMV_MAGIC;
+    header->version = CMV_VERSION;
+    header->frame_size = frame_size;
+    header->cmrh = *cmrh;
+    header->cmrh.thumb_size = 0;    // frames are stored without thumbnails
+    status = write_all(w->fd, header_block, CMV_HEADER_SIZE);
+    free(header_block);
+    if (status)
+        goto cleanup;
+    w->offset = CMV_HEADER_SIZE;
+
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, writer_thread, w)) {
+        pthread_mutex_destroy(&w->mutex);
+        pthread_cond_destroy(&w->cond);
+        status = -EAGAIN;
+        goto cleanup;
+    }
+
+cleanup:
+    if (status) {
+        close(w->fd);
+        unlink(fname);
+        free(w->ring);
+        free(w);
+        return status;
+    }
+    *writer = w;
+    return 0;
+}
+
+int cmv_writer_add(CMVideoWriter *w, const void *raw, uint64_t ts_ns, float shutter_us,
+        float gain_dB)
+{
+    pthread_mutex_lock(&w->mutex);
+    uint32_t frame_num = w->frame_num++;
+    int status = w->status;
+    if (!status && w->count == w->ring_frames) {
+        w->dropped++;
+        status = -EAGAIN;
+    }
+    if (status) {
+        pthread_mutex_unlock(&w->mutex);
+        return status;
+    }
+    unsigned int head = (w->tail + w->count) % w->ring_frames;
+    pthread_mutex_unlock(&w->mutex);
+
+    // only this thread fills the head slot, the writer thread doesn't touch it until it's counted
+    uint8_t *record = w->ring + (size_t)head * w->record_size;
+    CMVideoFrameHeader *fh = (CMVideoFrameHeader *)record;
+    fh->magic = CMV_FRAME_MAGIC;
+    fh->frame_num = frame_num;
+    fh->ts_ns = ts_ns;
+    fh->shutter_us = shutter_us;
+    fh->gain_dB = gain_dB;
+    fh->payload_size = w->frame_size;
+    fh->record_size = w->record_size;
+    uint8_t *payload = record + sizeof(CMVideoFrameHeader);
+    memcpy(payload, raw, w->frame_size);
+    memset(payload + w->frame_size, 0,
+            w->record_size - sizeof(CMVideoFrameHeader) - w->frame_size);
+
+    pthread_mutex_lock(&w->mutex);
+    w->count++;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+
+    return 0;
+}
+
+void cmv_writer_stats(CMVideoWriter *w, uint32_t *frames, uint32_t *dropped)
+{
+    pthread_mutex_lock(&w->mutex);
+    *frames = w->frame_num - w->dropped;
+    *dropped = w->dropped;
+    pthread_mutex_unlock(&w->mutex);
+}
+
+void cmv_writer_queue(CMVideoWriter *w, size_t *queued_bytes, size_t *capacity_bytes)
+{
+    pthread_mutex_lock(&w->mutex);
+    *queued_bytes = (size_t)w->count * w->record_size;
+    *capacity_bytes = (size_t)w->ring_frames * w->record_size;
+    pthread_mutex_unlock(&w->mutex);
+}
+
+int cmv_writer_close(CMVideoWriter *w)
+{
+    pthread_mutex_lock(&w->mutex);
+    w->closing = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, NULL);
+
+    int status = w->status;
+    if (!status) {
+        size_t index_len = (size_t)w->num_frames * sizeof(CMVideoIndexEntry);
+        CMVideoTrailer trailer = {
+            .magic = CMV_INDEX_MAGIC,
+            .num_frames = w->num_frames,
+            .index_offset = w->offset
+        };
+        if (index_len > 0)
+            status = write_all(w->fd, w->index, index_len);
+        if (!status)
+            status = write_all(w->fd, &trailer, sizeof(trailer));
+    }
+    if (close(w->fd) && !status)
+        status = -errno;
+
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+    free(w->index);
+    free(w->ring);
+    free(w);
+    return status;
+}
+
+// walk the records from the start of the file, stopping at the first incomplete one
+static int rebuild_index(CMVideoReader *r, uint64_t file_size)
+{
+    uint32_t capacity = 0;
+    uint64_t offset = CMV_HEADER_SIZE;
+    r->num_frames = 0;
+    while (offset + sizeof(CMVideoFrameHeader) <= file_size) {
+        CMVideoFrameHeader fh;
+        if (read_all(r->fd, &fh, sizeof(fh), offset))
+            break;
+        if (fh.magic != CMV_FRAME_MAGIC || fh.payload_size != r->header.frame_size
+                || fh.record_size < sizeof(fh) + fh.payload_size
+                || offset + sizeof(fh) + fh.payload_size > file_size)
+            break;
+
+        if (r->num_frames == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            CMVideoIndexEntry *index = (CMVideoIndexEntry *)realloc(r->index,
+                    capacity * sizeof(CMVideoIndexEntry));
+            if (index == NULL)
+                return -ENOMEM;
+            r->index = index;
+        }
+        r->index[r->num_frames].offset = offset;
+        r->index[r->num_frames].ts_ns = fh.ts_ns;
+        r->num_frames++;
+        offset += fh.record_size;
+    }
+    r->index_rebuilt = 1;
+    return 0;
+}
+
+int cmv_open(CMVideoReader *r, const char *fname)
+{
+    memset(r, 0, sizeof(CMVideoReader));
+    r->fd = open(fname, O_RDONLY);
+    if (r->fd < 0)
+        return -errno;
+
+    struct stat st;
+    int status = fstat(r->fd, &st) ? -errno : 0;
+    uint64_t file_size = status ? 0 : st.st_size;
+
+    if (!status)
+        status = read_all(r->fd, &r->header, sizeof(CMVideoHeader), 0);
+    if (!status && (r->header.magic != CMV_MAGIC || r->header.version != CMV_VERSION
+            || r->header.frame_size != cmraw_data_size(&r->header.cmrh.cinfo)))
+        status = -EINVAL;
+    if (status)
+        goto cleanup;
+
+    // use the index if the trailer is intact and matches the file size
+    CMVideoTrailer trailer;
+    int have_index = file_size >= CMV_HEADER_SIZE + sizeof(trailer)
+            && read_all(r->fd, &trailer, sizeof(trailer), file_size - sizeof(trailer)) == 0
+            && trailer.magic == CMV_INDEX_MAGIC
+            && trailer.index_offset + (uint64_t)trailer.num_frames * sizeof(CMVideoIndexEntry)
+                + sizeof(trailer) == file_size;
+    if (have_index && trailer.num_frames > 0) {
+        r->index = (CMVideoIndexEntry *)malloc(trailer.num_frames * sizeof(CMVideoIndexEntry));
+        if (r->index == NULL) {
+            status = -ENOMEM;
+            goto cleanup;
+        }
+        status = read_all(r->fd, r->index, trailer.num_frames * sizeof(CMVideoIndexEntry),
+                trailer.index_offset);
+        r->num_frames = trailer.num_frames;
+    } else if (!have_index) {
+        status = rebuild_index(r, file_size);
+    }
+
+cleanup:
+    if (status)
+        cmv_close(r);
+    return status;
+}
+
+int cmv_read_frame(const CMVideoReader *r, uint32_t n, void *raw, CMRawHeader *cmrh)
+{
+    if (n >= r->num_frames)
+        return -EINVAL;
+
+    CMVideoFrameHeader fh;
+    uint64_t offset = r->index[n].offset;
+    int status = read_all(r->fd, &fh, sizeof(fh), offset);
+    if (!status && (fh.magic != CMV_FRAME_MAGIC || fh.payload_size != r->header.frame_size))
+        status = -EINVAL;
+    if (!status)
+        status = read_all(r->fd, raw, fh.payload_size, offset + sizeof(fh));
+    if (status)
+        return status;
+
+    *cmrh = r->header.cmrh;
+    cmrh->cinfo.ts_epoch = fh.ts_ns / 1000000000;
+    cmrh->cinfo.shutter_us = fh.shutter_us;
+    cmrh->cinfo.gain_dB = fh.gain_dB;
+    return 0;
+}
+
+void cmv_close(CMVideoReader *r)
+{
+    if (r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+    free(r->index);
+    r->index = NULL;
+    r->num_frames = 0;
+}
@@ -0,0 +1,112 @@
+#ifndef CMV_H
+#define CMV_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cmraw.h"
+
+/* CMV video container: raw frames of one stream in a single file, written append only.
+ *
+ *  CMVideoHeader, padded to CMV_ALIGN bytes
+ *  frame records: CMVideoFrameHeader then the frame payload, padded to a multiple of CMV_ALIGN
+ *  index: a CMVideoIndexEntry per frame
+ *  CMVideoTrailer, the last bytes of the file
+ *
+ * Records are aligned so the writer only ever issues large aligned sequential writes. The index
+ * is written when recording ends, if it's missing (e.g. the recording was cut short by a crash
+ * or full disk) the reader rebuilds it by walking the records.
+ */
+
+#define CMV_MAGIC 0x76564D43            // "CMVv"
+#define CMV_FRAME_MAGIC 0x66564D43      // "CMVf"
+#define CMV_INDEX_MAGIC 0x78564D43      // "CMVx"
+#define CMV_VERSION 1
+#define CMV_ALIGN 4096
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t frame_size;    // payload bytes of each frame
+    uint32_t reserved2;
+    CMRawHeader cmrh;       // shared by every frame, exposure and timestamp are per frame
+} CMVideoHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t frame_num;     // counts dropped frames too, so drops show as gaps
+    uint64_t ts_ns;         // unix time in nanoseconds
+    float shutter_us;
+    float gain_dB;
+    uint32_t payload_size;
+    uint32_t record_size;   // bytes to the next record
+} CMVideoFrameHeader;
+
+typedef struct {
+    uint64_t offset;        // of the frame record
+    uint64_t ts_ns;
+} CMVideoIndexEntry;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_frames;
+    uint64_t index_offset;
+} CMVideoTrailer;
+#pragma pack(pop)
+
+// recording, written from a thread of its own so adding frames never waits for the disk
+typedef struct CMVideoWriter CMVideoWriter;
+
+/* Creates fname and starts the writer thread. Frames must match the format and size in cmrh.
+ * queue_bytes bounds the memory for frames waiting to be written, at least 2 frames are queued.
+ * Returns 0 on success or a negative error code, a writer must be closed with cmv_writer_close
+ */
+int cmv_writer_open(CMVideoWriter **writer, const char *fname, const CMRawHeader *cmrh,
+        size_t queue_bytes);
+
+/* Copies a frame into the queue, frames must be added from one thread at a time. If the queue
+ * is full the frame is dropped and -EAGAIN is returned. Returns the error if writing has failed,
+ * in which case no more frames are taken.
+ */
+int cmv_writer_add(CMVideoWriter *writer, const void *raw, uint64_t ts_ns, float shutter_us,
+        float gain_dB);
+
+// frames written (or queued to be) and dropped so far
+void cmv_writer_stats(CMVideoWriter *writer, uint32_t *frames, uint32_t *dropped);
+
+// bytes of frames waiting to be written and the most the queue holds
+void cmv_writer_queue(CMVideoWriter *writer, size_t *queued_bytes, size_t *capacity_bytes);
+
+// writes the queued frames and the index, then frees the writer
+// returns 0 on success or the first error writing the file
+int cmv_writer_close(CMVideoWriter *writer);
+
+typedef struct {
+    int fd;
+    CMVideoHeader header;
+    uint32_t num_frames;
+    CMVideoIndexEntry *index;
+    int index_rebuilt;      // the file had no valid index
+} CMVideoReader;
+
+// reads the header and index, returns 0 on success or a negative error code
+int cmv_open(CMVideoReader *reader, const char *fname);
+
+/* Reads frame n into raw (header.frame_size bytes), and sets cmrh to the stream's header with
+ * the frame's exposure and timestamp so it can be processed or saved like a .cmr.
+ * Safe to call from several threads at once.
+ */
+int cmv_read_frame(const CMVideoReader *reader, uint32_t n, void *raw, CMRawHeader *cmrh);
+
+void cmv_close(CMVideoReader *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CMV_H
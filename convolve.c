@@ -166,6 +166,122 @@ void convolve_img(const float *img_in, float *img_out, unsigned int width, unsig
     }
 }
 
+static inline void convolve_rect_inside(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, const float *kernel, unsigned int n, unsigned int x_start,
+        unsigned int y_start, unsigned int x_end, unsigned int y_end)
+{
+    for (unsigned int y = y_start; y < y_end; y++) {
+        for (unsigned int x = x_start; x < x_end; x++) {
+            for (unsigned int chan = 0; chan < 3; chan++) {
+                img_out[image_idx(x, y, chan, width)] =
+                    convolve_pixel(img_in, width, height, kernel, n, x, y, chan);
+            }
+        }
+    }
+}
+
+// only pixels in rectangle [x_start, x_end) x [y_start, y_end) of img_out are written
+// kernel is n*n, n being odd
+// pad edges of input image by repeating corners
+void convolve_img_rect(const float *img_in, float *img_out, unsigned int width, unsigned int height,
+        const float *kernel, unsigned int n, unsigned int x_start, unsigned int y_start,
+        unsigned int x_end, unsigned int y_end)
+{
+    unsigned int k = (n-1) >> 1;
+
+    // portion of the rectangle that needs no bounds checking
+    unsigned int xi_start = x_start < k ? k : x_start;
+    unsigned int yi_start = y_start < k ? k : y_start;
+    unsigned int xi_end = x_end + k > width ? width - k : x_end;
+    unsigned int yi_end = y_end + k > height ? height - k : y_end;
+
+    if (width <= 2*k || height <= 2*k) {
+        xi_start = xi_end = x_start;
+        yi_start = yi_end = y_start;
+    }
+
+    for (unsigned int y = y_start; y < y_end; y++) {
+        for (unsigned int x = x_start; x < x_end; x++) {
+            if (y >= yi_start && y < yi_end && x == xi_start && xi_start < xi_end)
+                x = xi_end;
+            if (x >= x_end)
+                break;
+            for (unsigned int chan = 0; chan < 3; chan++) {
+                img_out[image_idx(x, y, chan, width)] =
+                    convolve_pixel_edge(img_in, width, height, kernel, n, x, y, chan);
+            }
+        }
+    }
+
+    if (xi_start >= xi_end || yi_start >= yi_end)
+        return;
+
+    // optimize dedicated code paths for common kernel sizes
+    if (n == 3) {
+        convolve_rect_inside(img_in, img_out, width, height, kernel, 3, xi_start, yi_start, xi_end, yi_end);
+    } else if (n == 5) {
+        convolve_rect_inside(img_in, img_out, width, height, kernel, 5, xi_start, yi_start, xi_end, yi_end);
+    } else if (n == 7) {
+        convolve_rect_inside(img_in, img_out, width, height, kernel, 7, xi_start, yi_start, xi_end, yi_end);
+    } else {
+        convolve_rect_inside(img_in, img_out, width, height, kernel, n, xi_start, yi_start, xi_end, yi_end);
+    }
+}
+
+// separable B3-spline smoothing with kernel [1 4 6 4 1] / 16 applied horizontally then vertically
+// taps are spaced dilation pixels apart ("a trous" algorithm)
+// pad edges of input image by repeating edge pixels
+void convolve_atrous_b3(const float *img_in, float *img_out, float *img_temp, unsigned int width,
+        unsigned int height, unsigned int dilation)
+{
+    const float w0 = 6.0 / 16, w1 = 4.0 / 16, w2 = 1.0 / 16;
+    unsigned int d = dilation;
+    unsigned int d3 = 3 * dilation;
+
+    // horizontal pass into img_temp
+    for (unsigned int y = 0; y < height; y++) {
+        const float *row_in = img_in + image_idx(0, y, 0, width);
+        float *row_out = img_temp + image_idx(0, y, 0, width);
+
+        if (width > 4*d) {
+            for (unsigned int i = 2*d3; i < 3*(width - 2*d); i++) {
+                row_out[i] = w0 * row_in[i] +
+                    w1 * (row_in[i - d3] + row_in[i + d3]) +
+                    w2 * (row_in[i - 2*d3] + row_in[i + 2*d3]);
+            }
+        }
+
+        for (unsigned int x = 0; x < width; x++) {
+            if (x == 2*d && width > 4*d)
+                x = width - 2*d;
+
+            unsigned int xa = bounded_idx((int)x - 2*(int)d, 0, width);
+            unsigned int xb = bounded_idx((int)x - (int)d, 0, width);
+            unsigned int xc = bounded_idx(x + d, 0, width);
+            unsigned int xd = bounded_idx(x + 2*d, 0, width);
+            for (unsigned int chan = 0; chan < 3; chan++) {
+                row_out[3*x + chan] = w0 * row_in[3*x + chan] +
+                    w1 * (row_in[3*xb + chan] + row_in[3*xc + chan]) +
+                    w2 * (row_in[3*xa + chan] + row_in[3*xd + chan]);
+            }
+        }
+    }
+
+    // vertical pass into img_out
+    for (unsigned int y = 0; y < height; y++) {
+        const float *r0 = img_temp + image_idx(0, bounded_idx((int)y - 2*(int)d, 0, height), 0, width);
+        const float *r1 = img_temp + image_idx(0, bounded_idx((int)y - (int)d, 0, height), 0, width);
+        const float *r2 = img_temp + image_idx(0, y, 0, width);
+        const float *r3 = img_temp + image_idx(0, bounded_idx(y + d, 0, height), 0, width);
+        const float *r4 = img_temp + image_idx(0, bounded_idx(y + 2*d, 0, height), 0, width);
+        float *row_out = img_out + image_idx(0, y, 0, width);
+
+        for (unsigned int i = 0; i < 3*width; i++) {
+            row_out[i] = w0 * r2[i] + w1 * (r1[i] + r3[i]) + w2 * (r0[i] + r4[i]);
+        }
+    }
+}
+
 static inline size_t med3_idx(const float *arr, size_t i, size_t j, size_t k)
 {
     float a = arr[i];
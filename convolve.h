@@ -17,6 +17,17 @@ void gaussian_kernel(float *kernel, unsigned int n, float c);
 void convolve_img(const float *img_in, float *img_out, unsigned int width, unsigned int height,
         const float *kernel, unsigned int n);
 
+// same as above, but only pixels in rectangle [x_start, x_end) x [y_start, y_end) are written
+void convolve_img_rect(const float *img_in, float *img_out, unsigned int width, unsigned int height,
+        const float *kernel, unsigned int n, unsigned int x_start, unsigned int y_start,
+        unsigned int x_end, unsigned int y_end);
+
+// separable B3-spline smoothing with kernel [1 4 6 4 1] / 16, taps spaced dilation pixels apart
+// img_temp is scratch space of the same dimensions as img_in and img_out
+// pad edges of input image by repeating edge pixels
+void convolve_atrous_b3(const float *img_in, float *img_out, float *img_temp, unsigned int width,
+        unsigned int height, unsigned int dilation);
+
 static inline unsigned int image_idx(unsigned int x, unsigned int y, unsigned int chan, unsigned int width)
 {
     return 3 * (x + y*width) + chan;
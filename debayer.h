@@ -11,6 +11,13 @@ extern "C" {
 
 void unpack12_16(uint16_t *unpacked, const void *packed12, size_t num_elems, bool scale_up);
 
+// value of element n of 12 bit packed data, for reading sparse pixels without unpacking
+static inline uint16_t packed12_pixel(const void *packed12, size_t n)
+{
+    const uint8_t *r = (const uint8_t *)packed12 + (n >> 1) * 3;
+    return (n & 1) ? (r[1] >> 4) | (r[2] << 4) : r[0] | ((r[1] & 0x0F) << 8);
+}
+
 // assume RGGB pixel layout for each 2x2 square starting at top, and column major image layout
 // output buffer (rgb) should be 3x size of input buffer (bayer)
 void debayer22(const uint16_t *bayer, uint16_t *rgb, uint16_t width, uint16_t height);
@@ -1,13 +1,157 @@
 #include "dng.h"
+#include <cerrno>
+#include <cstring>
 #include "debayer.h"
 #include "cie_xyz.h"
 #include "cm_calibrations.h"
+#include "cm_parallel.h"
+#include "lj92.h"
 
 #define TINY_DNG_WRITER_IMPLEMENTATION
 #include "tiny_dng_writer.h"
 
-int bayer_rg12p_to_dng(const void *raw, const CMRawHeader *cmrh, const char *dng_name)
+// 256 is what Adobe's tools use, small enough to spread a frame across many threads
+#define DNG_TILE_SIZE 256
+// rows converted at a time when streaming uncompressed data
+#define DNG_STRIP_ROWS 16
+
+typedef struct {
+    const void *raw;
+    const CMCaptureInfo *cinfo;
+    unsigned tiles_across;
+    unsigned bits;
+    std::vector<std::vector<uint8_t>> *tiles;
+    volatile int status;
+} TileJob;
+
+// n samples of row y from column x (even), as stored, i.e. 12 bit formats aren't scaled up
+static void read_row(const void *raw, const CMCaptureInfo *cinfo, unsigned y, unsigned x,
+        unsigned n, uint16_t *row)
+{
+    size_t offset = (size_t)y * cinfo->width + x;
+    if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P)
+        unpack12_16(row, (const uint8_t *)raw + offset / 2 * 3, n, false);
+    else
+        memcpy(row, (const uint16_t *)raw + offset, n * sizeof(uint16_t));
+}
+
+// full tiles, padded past the edges of the image with the nearest pixel of the same colour
+static void encode_tiles(void *arg, unsigned int start, unsigned int end)
+{
+    TileJob *job = (TileJob *)arg;
+    const unsigned width = job->cinfo->width;
+    const unsigned height = job->cinfo->height;
+    std::vector<uint16_t> tile(DNG_TILE_SIZE * DNG_TILE_SIZE);
+    std::vector<uint8_t> out(lj92_encode_bound(DNG_TILE_SIZE, DNG_TILE_SIZE));
+
+    for (unsigned t = start; t < end; t++) {
+        unsigned x0 = (t % job->tiles_across) * DNG_TILE_SIZE;
+        unsigned y0 = (t / job->tiles_across) * DNG_TILE_SIZE;
+        unsigned w = width - x0 < DNG_TILE_SIZE ? width - x0 : DNG_TILE_SIZE;
+        unsigned h = height - y0 < DNG_TILE_SIZE ? height - y0 : DNG_TILE_SIZE;
+
+        for (unsigned y = 0; y < DNG_TILE_SIZE; y++) {
+            uint16_t *row = tile.data() + y * DNG_TILE_SIZE;
+            if (y < h) {
+                read_row(job->raw, job->cinfo, y0 + y, x0, w, row);
+                for (unsigned x = w; x < DNG_TILE_SIZE; x++)
+                    row[x] = row[x - 2];
+            } else {
+                const uint16_t *src = row - (y >= 2 ? 2 : 1) * DNG_TILE_SIZE;
+                memcpy(row, src, DNG_TILE_SIZE * sizeof(uint16_t));
+            }
+        }
+
+        size_t len;
+        int status = lj92_encode(tile.data(), DNG_TILE_SIZE, DNG_TILE_SIZE, DNG_TILE_SIZE,
+                job->bits, out.data(), &len);
+        if (status)
+            job->status = status;
+        else
+            (*job->tiles)[t].assign(out.begin(), out.begin() + len);
+    }
+}
+
+/* TIFF packs samples MSB first whatever the byte order, where 12p is LSB first:
+ *  12p:  a[7:0]   b[3:0] a[11:8]   b[11:4]
+ *  TIFF: a[11:4]  a[3:0] b[11:8]   b[7:0]
+ */
+static void row_to_tiff12(const void *raw, const CMCaptureInfo *cinfo, unsigned y,
+        uint16_t *row, uint8_t *out)
+{
+    const unsigned width = cinfo->width;
+    if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P) {
+        const uint8_t *in = (const uint8_t *)raw + (size_t)y * width / 2 * 3;
+        for (unsigned x = 0; x < width; x += 2, in += 3, out += 3) {
+            out[0] = (in[0] >> 4) | (in[1] << 4);
+            out[1] = (in[0] << 4) | (in[2] >> 4);
+            out[2] = (in[2] << 4) | (in[1] >> 4);
+        }
+    } else {
+        read_row(raw, cinfo, y, 0, width, row);
+        for (unsigned x = 0; x < width; x += 2, out += 3) {
+            out[0] = row[x] >> 4;
+            out[1] = (row[x] << 4) | (row[x + 1] >> 8);
+            out[2] = row[x + 1];
+        }
+    }
+}
+
+static inline uint8_t to_bcd(unsigned v)
+{
+    return ((v / 10) << 4) | (v % 10);
+}
+
+/* SMPTE 12M time code, non drop frame
+ *  frames, seconds, minutes, hours in BCD, then 4 bytes of user bits
+ */
+static void frame_time_code(const CMDNGFrameInfo *frame, uint8_t *tc)
+{
+    unsigned fps = (frame->fps_num + frame->fps_den - 1) / frame->fps_den;
+    unsigned seconds = frame->timecode / fps;
+    memset(tc, 0, 8);
+    tc[0] = to_bcd(frame->timecode % fps);
+    tc[1] = to_bcd(seconds % 60);
+    tc[2] = to_bcd(seconds / 60 % 60);
+    tc[3] = to_bcd(seconds / 3600 % 24);
+}
+
+// tags of an uncompressed RGB image in a single strip
+static void set_rgb_tags(tinydngwriter::DNGImage *image, uint16_t bits, uint16_t width,
+        uint16_t height, bool reduced)
 {
+    image->SetBigEndian(false);
+    image->SetSubfileType(reduced, false, false);
+    image->SetImageWidth(width);
+    image->SetImageLength(height);
+    image->SetRowsPerStrip(height);
+
+    image->SetSamplesPerPixel(3);
+    const uint16_t bpp[3] = {bits, bits, bits};
+    image->SetBitsPerSample(3, bpp);
+    const uint16_t sf[1] = {tinydngwriter::SAMPLEFORMAT_UINT};
+    image->SetSampleFormat(1, sf);
+    image->SetCompression(tinydngwriter::COMPRESSION_NONE);
+    image->SetPlanarConfig(tinydngwriter::PLANARCONFIG_CONTIG);
+
+    image->SetXResolution(1.0);
+    image->SetYResolution(1.0);
+    image->SetResolutionUnit(tinydngwriter::RESUNIT_NONE);
+
+    image->SetPhotometric(tinydngwriter::PHOTOMETRIC_RGB);
+}
+
+static int write_dng(const void *raw, const CMRawHeader *cmrh, const char *dng_name,
+        CMDNGCompression compression, const CMDNGFrameInfo *frame, const CMRawThumbnail *thumb)
+{
+    const CMCaptureInfo *cinfo = &cmrh->cinfo;
+    const bool bits16 = cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG16;
+    if (cinfo->pixel_fmt != CM_PIXEL_FMT_BAYER_RG12P
+            && cinfo->pixel_fmt != CM_PIXEL_FMT_BAYER_RG12 && !bits16)
+        return -EINVAL;
+    if ((cinfo->width & 1) || (bits16 && compression == CMDNG_COMPRESSION_NONE_12BIT))
+        return -EINVAL;
+
     tinydngwriter::DNGImage dng_image;
     tinydngwriter::DNGWriter dng_writer(false); // little endian DNG
 
@@ -18,21 +162,37 @@ int bayer_rg12p_to_dng(const void *raw, const CMRawHeader *cmrh, const char *dng
 
     dng_image.SetBigEndian(false);
     dng_image.SetSubfileType(false, false, false);
-    dng_image.SetImageWidth(cmrh->cinfo.width);
-    dng_image.SetImageLength(cmrh->cinfo.height);
-    dng_image.SetRowsPerStrip(cmrh->cinfo.height);
+    dng_image.SetImageWidth(cinfo->width);
+    dng_image.SetImageLength(cinfo->height);
     dng_image.SetSamplesPerPixel(1);
-    const uint16_t bpp[1] = {16};
+    /* samples are written with these bits and scaled by
+     *  NONE:           16, 12 bit data scaled up by 16
+     *  LJ92:           as stored, 12 or 16
+     *  NONE_12BIT:     12
+     */
+    const unsigned bits = compression == CMDNG_COMPRESSION_NONE || bits16 ? 16 : 12;
+    const unsigned scale = compression == CMDNG_COMPRESSION_NONE && !bits16 ? 16 : 1;
+    const uint16_t bpp[1] = {(uint16_t)bits};
     dng_image.SetBitsPerSample(1, bpp);
     const uint16_t sf[1] = {tinydngwriter::SAMPLEFORMAT_UINT};
     dng_image.SetSampleFormat(1, sf);
-    dng_image.SetCompression(tinydngwriter::COMPRESSION_NONE);
+    if (compression == CMDNG_COMPRESSION_LJ92) {
+        dng_image.SetCompression(tinydngwriter::COMPRESSION_LOSSLESS_JPEG);
+    } else {
+        dng_image.SetRowsPerStrip(DNG_STRIP_ROWS);
+        dng_image.SetCompression(tinydngwriter::COMPRESSION_NONE);
+    }
     dng_image.SetPlanarConfig(tinydngwriter::PLANARCONFIG_CONTIG);
 
     dng_image.SetXResolution(1.0);
     dng_image.SetYResolution(1.0);
     dng_image.SetResolutionUnit(tinydngwriter::RESUNIT_NONE);
 
+    // otherwise the full range of the samples
+    if (cinfo->white_level != 0)
+        dng_image.SetCustomFieldULong(tinydngwriter::TIFFTAG_WHITE_LEVEL,
+                cinfo->white_level * scale);
+
     // Bayer pattern config
     dng_image.SetPhotometric(tinydngwriter::PHOTOMETRIC_CFA);
     dng_image.SetCFARepeatPatternDim(2, 2);
@@ -41,7 +201,7 @@ int bayer_rg12p_to_dng(const void *raw, const CMRawHeader *cmrh, const char *dng
 
     // Colour calibration
     ColourMatrix cam_to_XYZ, XYZ_to_cam;
-    colour_matmult33(&cam_to_XYZ, &CM_sRGB2XYZ, get_calibration(&cmrh->cinfo));
+    colour_matmult33(&cam_to_XYZ, &CM_sRGB2XYZ, get_calibration(cinfo));
     colour_matinv33(&XYZ_to_cam, &cam_to_XYZ);
     dng_image.SetCalibrationIlluminant1(17); // StdA
     dng_image.SetCalibrationIlluminant2(21); // D65
@@ -50,19 +210,85 @@ int bayer_rg12p_to_dng(const void *raw, const CMRawHeader *cmrh, const char *dng
 
     // White balance
     double r, b;
-    if (cmrh->cinfo.white_x > 0 || cmrh->cinfo.white_y > 0)
-        colour_illum_xy_to_rb_ratio(&cam_to_XYZ, cmrh->cinfo.white_x, cmrh->cinfo.white_y, &r, &b);
+    if (cinfo->white_x > 0 || cinfo->white_y > 0)
+        colour_illum_xy_to_rb_ratio(&cam_to_XYZ, cinfo->white_x, cinfo->white_y, &r, &b);
     else // default to D50 if no white point specified
         colour_temp_tint_to_rb_ratio(&cam_to_XYZ, 5000, 0, &r, &b);
     ColourPixel cam_neutral_RGB = {.p={1/r, 1, 1/b}};
     dng_image.SetAsShotNeutral(3, cam_neutral_RGB.p);
 
-    std::vector<uint16_t> unpacked;
-    unpacked.resize(cmrh->cinfo.width * cmrh->cinfo.height);
-    unpack12_16(unpacked.data(), raw, cmrh->cinfo.width * cmrh->cinfo.height, true);
-    dng_image.SetImageData((uint8_t *)unpacked.data(), unpacked.size() * sizeof(uint16_t));
+    if (frame != NULL) {
+        if (frame->fps_num == 0 || frame->fps_den == 0)
+            return -EINVAL;
+        uint8_t tc[8];
+        frame_time_code(frame, tc);
+        dng_image.SetTimeCodes(tc);
+        dng_image.SetFrameRate(frame->fps_num, frame->fps_den);
+        if (frame->reel_name != NULL && frame->reel_name[0] != '\0')
+            dng_image.SetReelName(frame->reel_name);
+    }
+
+    // uncompressed data is converted a strip at a time as the file is written
+    std::vector<std::vector<uint8_t>> tiles;
+    std::vector<uint16_t> row(cinfo->width);
+    std::vector<uint8_t> strip;
+    if (compression == CMDNG_COMPRESSION_LJ92) {
+        unsigned tiles_across = (cinfo->width + DNG_TILE_SIZE - 1) / DNG_TILE_SIZE;
+        unsigned tiles_down = (cinfo->height + DNG_TILE_SIZE - 1) / DNG_TILE_SIZE;
+        tiles.resize(tiles_across * tiles_down);
+        TileJob job = {raw, cinfo, tiles_across, bits, &tiles, 0};
+        parallel_for(tiles.size(), encode_tiles, &job);
+        if (job.status)
+            return job.status;
+
+        std::vector<const uint8_t *> tile_data;
+        std::vector<size_t> tile_bytes;
+        for (const std::vector<uint8_t> &tile : tiles) {
+            tile_data.push_back(tile.data());
+            tile_bytes.push_back(tile.size());
+        }
+        dng_image.SetTiledImageData(DNG_TILE_SIZE, DNG_TILE_SIZE, tiles.size(), tile_data.data(),
+                tile_bytes.data());
+    } else {
+        const size_t row_bytes = (size_t)cinfo->width * bits / 8;
+        const unsigned num_strips = (cinfo->height + DNG_STRIP_ROWS - 1) / DNG_STRIP_ROWS;
+        std::vector<size_t> strip_bytes(num_strips, row_bytes * DNG_STRIP_ROWS);
+        strip_bytes.back() = row_bytes * (cinfo->height - (num_strips - 1) * DNG_STRIP_ROWS);
+        strip.resize(row_bytes * DNG_STRIP_ROWS);
+
+        dng_image.SetStreamedImageData(num_strips, strip_bytes.data(),
+                [&, row_bytes](unsigned int s, std::ostream *ofs) {
+            unsigned y0 = s * DNG_STRIP_ROWS;
+            unsigned y1 = y0 + DNG_STRIP_ROWS < cinfo->height ? y0 + DNG_STRIP_ROWS : cinfo->height;
+            for (unsigned y = y0; y < y1; y++) {
+                uint8_t *out = strip.data() + (y - y0) * row_bytes;
+                if (bits == 12) {
+                    row_to_tiff12(raw, cinfo, y, row.data(), out);
+                } else {
+                    uint16_t *out16 = (uint16_t *)out;
+                    read_row(raw, cinfo, y, 0, cinfo->width, out16);
+                    if (scale != 1) {
+                        for (unsigned x = 0; x < cinfo->width; x++)
+                            out16[x] *= scale;
+                    }
+                }
+            }
+            ofs->write((const char *)strip.data(), (y1 - y0) * row_bytes);
+            return ofs->good();
+        });
+    }
     dng_writer.AddImage(&dng_image);
 
+    /* The preview goes in a second IFD, chained after the raw image rather than in IFD0 with
+     * the raw image in a SubIFD, so readers that only look at IFD0 still find the raw data.
+     */
+    tinydngwriter::DNGImage thumb_image;
+    if (thumb != NULL && thumb->rgb8 != NULL) {
+        set_rgb_tags(&thumb_image, 8, thumb->width, thumb->height, true);
+        thumb_image.SetImageData(thumb->rgb8, (size_t)thumb->width * thumb->height * 3);
+        dng_writer.AddImage(&thumb_image);
+    }
+
     std::string err;
     dng_writer.WriteToFile(dng_name, &err);
     if (!err.empty()) return -1;
@@ -70,32 +296,33 @@ int bayer_rg12p_to_dng(const void *raw, const CMRawHeader *cmrh, const char *dng
     return 0;
 }
 
-int rgb8_to_tiff(const uint8_t *img, uint16_t width, uint16_t height, const char *tiff_name)
+int bayer_to_dng(const void *raw, const CMRawHeader *cmrh, const char *dng_name,
+        CMDNGCompression compression)
 {
-    tinydngwriter::DNGImage dng_image;
-    tinydngwriter::DNGWriter dng_writer(false); // little endian DNG
-
-    dng_image.SetBigEndian(false);
-    dng_image.SetSubfileType(false, false, false);
-    dng_image.SetImageWidth(width);
-    dng_image.SetImageLength(height);
-    dng_image.SetRowsPerStrip(height);
+    return write_dng(raw, cmrh, dng_name, compression, NULL, NULL);
+}
 
-    dng_image.SetSamplesPerPixel(3);
-    const uint16_t bpp[3] = {8, 8, 8};
-    dng_image.SetBitsPerSample(3, bpp);
-    const uint16_t sf[1] = {tinydngwriter::SAMPLEFORMAT_UINT};
-    dng_image.SetSampleFormat(1, sf);
-    dng_image.SetCompression(tinydngwriter::COMPRESSION_NONE);
-    dng_image.SetPlanarConfig(tinydngwriter::PLANARCONFIG_CONTIG);
+int bayer_to_dng_with_thumbnail(const void *raw, const CMRawHeader *cmrh,
+        const CMRawThumbnail *thumb, const char *dng_name, CMDNGCompression compression)
+{
+    return write_dng(raw, cmrh, dng_name, compression, NULL, thumb);
+}
 
-    dng_image.SetXResolution(1.0);
-    dng_image.SetYResolution(1.0);
-    dng_image.SetResolutionUnit(tinydngwriter::RESUNIT_NONE);
+int bayer_to_cinema_dng(const void *raw, const CMRawHeader *cmrh, const char *dng_name,
+        CMDNGCompression compression, const CMDNGFrameInfo *frame)
+{
+    return write_dng(raw, cmrh, dng_name, compression, frame, NULL);
+}
 
-    dng_image.SetPhotometric(tinydngwriter::PHOTOMETRIC_RGB);
+// samples are written as is, so 16 bit data must already be in host (little endian) byte order
+static int rgb_to_tiff(const unsigned char *img, uint16_t bits, uint16_t width, uint16_t height,
+        const char *tiff_name)
+{
+    tinydngwriter::DNGImage dng_image;
+    tinydngwriter::DNGWriter dng_writer(false); // little endian DNG
 
-    dng_image.SetImageData(img, width * height * 3);
+    set_rgb_tags(&dng_image, bits, width, height, false);
+    dng_image.SetImageData(img, width * height * 3 * (bits / 8));
     dng_writer.AddImage(&dng_image);
 
     std::string err;
@@ -104,3 +331,13 @@ int rgb8_to_tiff(const uint8_t *img, uint16_t width, uint16_t height, const char
 
     return 0;
 }
+
+int rgb8_to_tiff(const uint8_t *img, uint16_t width, uint16_t height, const char *tiff_name)
+{
+    return rgb_to_tiff(img, 8, width, height, tiff_name);
+}
+
+int rgb16_to_tiff(const uint16_t *img, uint16_t width, uint16_t height, const char *tiff_name)
+{
+    return rgb_to_tiff(reinterpret_cast<const unsigned char *>(img), 16, width, height, tiff_name);
+}
@@ -8,11 +8,41 @@
 extern "C" {
 #endif
 
-int bayer_rg12p_to_dng(const void *raw, const CMRawHeader *cmrh, const char *dng_name);
+typedef enum {
+    CMDNG_COMPRESSION_NONE,         // 16 bit samples
+    CMDNG_COMPRESSION_LJ92,         // lossless JPEG tiles of the samples as stored, about half size
+    CMDNG_COMPRESSION_NONE_12BIT    // packed 12 bit samples, 3/4 the size of 16 bit
+} CMDNGCompression;
+
+/* Writes Bayer RG12P, RG12 or RG16 frames. Uncompressed data is converted in strips as it's
+ * written rather than all at once, LJ92 tiles are compressed in parallel.
+ * RG16 can't be written as 12 bit.
+ */
+int bayer_to_dng(const void *raw, const CMRawHeader *cmrh, const char *dng_name,
+        CMDNGCompression compression);
+
+// same as bayer_to_dng with an 8 bit RGB preview in a second IFD, thumb may be NULL
+int bayer_to_dng_with_thumbnail(const void *raw, const CMRawHeader *cmrh,
+        const CMRawThumbnail *thumb, const char *dng_name, CMDNGCompression compression);
+
+// CinemaDNG metadata of a frame in a sequence
+typedef struct {
+    uint32_t fps_num;       // frame rate is fps_num / fps_den, e.g. 30000 / 1001
+    uint32_t fps_den;
+    uint32_t timecode;      // frames since midnight, counting whole frames per second (NDF)
+    const char *reel_name;  // NULL for none
+} CMDNGFrameInfo;
+
+// same as bayer_to_dng with the frame rate, timecode and reel name of a CinemaDNG frame
+int bayer_to_cinema_dng(const void *raw, const CMRawHeader *cmrh, const char *dng_name,
+        CMDNGCompression compression, const CMDNGFrameInfo *frame);
 
 int rgb8_to_tiff(const uint8_t *img, uint16_t width, uint16_t height,
         const char *tiff_name);
 
+int rgb16_to_tiff(const uint16_t *img, uint16_t width, uint16_t height,
+        const char *tiff_name);
+
 #ifdef __cplusplus
 }
 #endif
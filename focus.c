@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "focus.h"
+#include "debayer.h"
+
+void focus_roi_at(const CMCaptureInfo *cinfo, uint16_t pos_x, uint16_t pos_y, CMFocusROI *roi)
+{
+    uint16_t width = cinfo->width >> 1;
+    uint16_t height = cinfo->height >> 1;
+    if (pos_x >= width || pos_y >= height) {
+        pos_x = width / 2;
+        pos_y = height / 2;
+    }
+
+    uint16_t size = height * FOCUS_ROI_SIZE;
+    if (size < 8) size = 8;
+    roi->x = pos_x > size / 2 ? pos_x - size / 2 : 0;
+    roi->y = pos_y > size / 2 ? pos_y - size / 2 : 0;
+    roi->width = size;
+    roi->height = size;
+}
+
+// sum of both greens of each 2x2 bin in row y, from column x for n bins
+static void green_row(const void *raw, bool packed, uint16_t width, unsigned y, unsigned x,
+        unsigned n, int32_t *out)
+{
+    size_t row = (size_t)y * 2 * width;
+    if (packed) {
+        for (unsigned i = 0; i < n; i++) {
+            size_t p = row + (x + i) * 2;
+            out[i] = packed12_pixel(raw, p + 1) + packed12_pixel(raw, p + width);
+        }
+    } else {
+        const uint16_t *raw16 = (const uint16_t *)raw;
+        for (unsigned i = 0; i < n; i++) {
+            size_t p = row + (x + i) * 2;
+            out[i] = raw16[p + 1] + raw16[p + width];
+        }
+    }
+}
+
+int focus_metric_raw(const void *raw, const CMCaptureInfo *cinfo, const CMFocusROI *roi,
+        double *metric)
+{
+    *metric = 0;
+    if (cinfo->pixel_fmt != CM_PIXEL_FMT_BAYER_RG12P
+            && cinfo->pixel_fmt != CM_PIXEL_FMT_BAYER_RG12
+            && cinfo->pixel_fmt != CM_PIXEL_FMT_BAYER_RG16)
+        return -EINVAL;
+
+    // clip to the binned image, leaving a border for the Laplacian's neighbours
+    const unsigned width = cinfo->width >> 1;
+    const unsigned height = cinfo->height >> 1;
+    if (width < 3 || height < 3)
+        return -EINVAL;
+    unsigned x0 = roi->x > 1 ? roi->x : 1;
+    unsigned y0 = roi->y > 1 ? roi->y : 1;
+    unsigned x1 = (unsigned)roi->x + roi->width;
+    unsigned y1 = (unsigned)roi->y + roi->height;
+    if (x1 > width - 1) x1 = width - 1;
+    if (y1 > height - 1) y1 = height - 1;
+    if (x0 >= x1 || y0 >= y1)
+        return -EINVAL;
+
+    // rolling buffer of 3 green rows, each with a border bin on both sides
+    const unsigned n = x1 - x0;
+    int32_t *rows = (int32_t *)malloc(3 * (n + 2) * sizeof(int32_t));
+    if (rows == NULL)
+        return -ENOMEM;
+
+    const bool packed = cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P;
+    green_row(raw, packed, cinfo->width, y0 - 1, x0 - 1, n + 2, rows);
+    green_row(raw, packed, cinfo->width, y0, x0 - 1, n + 2, rows + (n + 2));
+
+    /* 4 neighbour Laplacian, accumulating its first and second moments and the green sum:
+     *  metric = (E[L^2] - E[L]^2) / E[g]^2
+     */
+    double sum_g = 0;
+    double sum_l = 0;
+    double sum_l2 = 0;
+    for (unsigned y = y0; y < y1; y++) {
+        const int32_t *above = rows + ((y - y0) % 3) * (n + 2);
+        const int32_t *mid = rows + ((y - y0 + 1) % 3) * (n + 2);
+        int32_t *below = rows + ((y - y0 + 2) % 3) * (n + 2);
+        green_row(raw, packed, cinfo->width, y + 1, x0 - 1, n + 2, below);
+
+        int64_t row_g = 0;
+        int64_t row_l = 0;
+        double row_l2 = 0;
+        for (unsigned i = 1; i <= n; i++) {
+            int32_t l = above[i] + below[i] + mid[i - 1] + mid[i + 1] - 4 * mid[i];
+            row_g += mid[i];
+            row_l += l;
+            row_l2 += (double)l * l;
+        }
+        sum_g += row_g;
+        sum_l += row_l;
+        sum_l2 += row_l2;
+    }
+    free(rows);
+
+    double count = (double)n * (y1 - y0);
+    double mean_g = sum_g / count;
+    double mean_l = sum_l / count;
+    if (mean_g < 1)
+        mean_g = 1;
+    *metric = (sum_l2 / count - mean_l * mean_l) / (mean_g * mean_g);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef FOCUS_H
+#define FOCUS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmraw.h"
+
+// side of the default focus area as a fraction of the image height
+#define FOCUS_ROI_SIZE 0.2
+
+// area to measure focus in, in 2x2 binned image coordinates (as for spot metering)
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+} CMFocusROI;
+
+// default size focus area centred on pos_x, pos_y, or the image centre if that's outside it
+void focus_roi_at(const CMCaptureInfo *cinfo, uint16_t pos_x, uint16_t pos_y, CMFocusROI *roi);
+
+/* Contrast focus metric of a raw Bayer frame (RG12P, RG12 or RG16): the variance of the
+ * Laplacian of the 2x2 binned green channel in roi, divided by the squared mean green level so
+ * it doesn't change with exposure. Higher is sharper, it's only meaningful relative to other
+ * frames of the same scene and area.
+ *
+ * Only the green pixels of the area are read, roi is clipped to the image.
+ * Returns 0 on success or a negative error code
+ */
+int focus_metric_raw(const void *raw, const CMCaptureInfo *cinfo, const CMFocusROI *roi,
+        double *metric);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FOCUS_H
@@ -1,5 +1,6 @@
 #include <math.h>
 #include <assert.h>
+#include <stdbool.h>
 #include "gamma.h"
 
 // x is a luminance value between 0 and 1
@@ -13,24 +14,54 @@ static inline uint8_t gamma_encode_srgb(double x)
     return encoded * 255.1;
 }
 
-// generate lut for gamma encoding a linear space image
-// bit depth should be between 8 and 16
-// length of lut should be 1 << bit_depth
-void gamma_gen_lut(uint8_t *lut, uint8_t bit_depth)
+// same as above, but for 16 bit output
+static inline uint16_t gamma_encode_srgb16(double x)
+{
+    double encoded;
+    if (x <= 0.0031308)
+        encoded = 12.92 * x;
+    else
+        encoded = 1.055 * pow(x, 1/2.4) - 0.055;
+    if (encoded < 0) encoded = 0;
+    if (encoded > 1) encoded = 1;
+    return encoded * 65535 + 0.5;
+}
+
+// the LUT generators below fill either an 8 bit (uint8_t) or 16 bit (uint16_t) lut
+static inline void lut_set(void *lut, bool lut16, uint32_t i, double y)
+{
+    if (lut16)
+        ((uint16_t *)lut)[i] = gamma_encode_srgb16(y);
+    else
+        ((uint8_t *)lut)[i] = gamma_encode_srgb(y);
+}
+
+static void gen_lut(void *lut, bool lut16, uint8_t bit_depth)
 {
     double i_scale = 1.0 / ((1 << bit_depth) - 1);
 
     assert(bit_depth <= 16);
 
-    for (uint16_t i = 0; i < 1 << bit_depth; i++) {
+    for (uint32_t i = 0; i < 1U << bit_depth; i++) {
         double x = i * i_scale;
-        lut[i] = gamma_encode_srgb(x);
+        lut_set(lut, lut16, i, x);
     }
 }
 
-// apply cubic base curve before gamma encoding
-// suggested coefficients: shadow=0.3, black=0.2
-void gamma_gen_lut_cubic(uint8_t *lut, uint8_t bit_depth, double gamma, double black)
+// generate lut for gamma encoding a linear space image
+// bit depth should be between 8 and 16
+// length of lut should be 1 << bit_depth
+void gamma_gen_lut(uint8_t *lut, uint8_t bit_depth)
+{
+    gen_lut(lut, false, bit_depth);
+}
+
+void gamma_gen_lut16(uint16_t *lut, uint8_t bit_depth)
+{
+    gen_lut(lut, true, bit_depth);
+}
+
+static void gen_lut_cubic(void *lut, bool lut16, uint8_t bit_depth, double gamma, double black)
 {
     /* Cubic equation of the form:
      *  f(x) = Ax^3 + Bx^2 + Cx + D
@@ -69,18 +100,26 @@ void gamma_gen_lut_cubic(uint8_t *lut, uint8_t bit_depth, double gamma, double b
     double A = gamma + black - 2;
     double B = 3 - gamma - 2*black;
 
-    for (uint16_t i = 0; i < 1 << bit_depth; i++) {
+    for (uint32_t i = 0; i < 1U << bit_depth; i++) {
         double x = i * i_scale;
         double y = A*x*x*x + B*x*x + black*x;
-        lut[i] = gamma_encode_srgb(y);
+        lut_set(lut, lut16, i, y);
     }
 }
 
-// apply a filmic base curve before gamma encoding
-// gamma controls how midtones are boosted and highlights compressed
-// black is the slope at the black end
-// suggested coefficients: gamma=0.3, black=0.8
-void gamma_gen_lut_filmic(uint8_t *lut, uint8_t bit_depth, double gamma, double black)
+// apply cubic base curve before gamma encoding
+// suggested coefficients: shadow=0.3, black=0.2
+void gamma_gen_lut_cubic(uint8_t *lut, uint8_t bit_depth, double gamma, double black)
+{
+    gen_lut_cubic(lut, false, bit_depth, gamma, black);
+}
+
+void gamma_gen_lut16_cubic(uint16_t *lut, uint8_t bit_depth, double gamma, double black)
+{
+    gen_lut_cubic(lut, true, bit_depth, gamma, black);
+}
+
+static void gen_lut_filmic(void *lut, bool lut16, uint8_t bit_depth, double gamma, double black)
 {
     double i_scale = 1.0 / ((1 << bit_depth) - 1);
 
@@ -119,13 +158,27 @@ void gamma_gen_lut_filmic(uint8_t *lut, uint8_t bit_depth, double gamma, double
 
     assert(bit_depth <= 16);
 
-    for (uint16_t i = 0; i < 1 << bit_depth; i++) {
+    for (uint32_t i = 0; i < 1U << bit_depth; i++) {
         double x = i * i_scale;
         double y = a*pow(x, gamma/x) + b_black*(1 - pow(k, x));
-        lut[i] = gamma_encode_srgb(y);
+        lut_set(lut, lut16, i, y);
     }
 }
 
+// apply a filmic base curve before gamma encoding
+// gamma controls how midtones are boosted and highlights compressed
+// black is the slope at the black end
+// suggested coefficients: gamma=0.3, black=0.8
+void gamma_gen_lut_filmic(uint8_t *lut, uint8_t bit_depth, double gamma, double black)
+{
+    gen_lut_filmic(lut, false, bit_depth, gamma, black);
+}
+
+void gamma_gen_lut16_filmic(uint16_t *lut, uint8_t bit_depth, double gamma, double black)
+{
+    gen_lut_filmic(lut, true, bit_depth, gamma, black);
+}
+
 // numerically estimate k for (1 - k^x)/(1 - k) to get desired shadow slope at x=0+
 static double hdr_shadow_k(double shadow)
 {
@@ -160,11 +213,7 @@ static double hdr_shadow_k(double shadow)
     return exp(-y);
 }
 
-// apply the base curve x^gamma * (1 - k^x)/(1 - k) before gamma encoding
-// shadow slope is approximately 0.03^gamma * ln(1/k) / (1 - k)
-// allows extreme shadow boosting while preserving highlights
-// suggested values: gamma=0.1, shadow=[2 to 64] depending on dynamic range
-void gamma_gen_lut_hdr(uint8_t *lut, uint8_t bit_depth, double gamma, double shadow)
+static void gen_lut_hdr(void *lut, bool lut16, uint8_t bit_depth, double gamma, double shadow)
 {
     // bound gamma for reasonableness
     if (gamma < 0.001) gamma = 0.001;
@@ -174,26 +223,29 @@ void gamma_gen_lut_hdr(uint8_t *lut, uint8_t bit_depth, double gamma, double sha
     double G = 1.0 / (1.0 - k);
     double i_scale = 1.0 / ((1 << bit_depth) - 1);
 
-    for (uint16_t i = 0; i < 1 << bit_depth; i++) {
+    for (uint32_t i = 0; i < 1U << bit_depth; i++) {
         double x = i * i_scale;
         double y = G * (1.0 - pow(k, x)) * pow(x, gamma);
-        lut[i] = gamma_encode_srgb(y);
+        lut_set(lut, lut16, i, y);
     }
 }
 
-// compressed cubic curve with Reinhard tail for shadow boosting while preserving highlights
-// gamma is slope at white end
-// shadow is how much cubic is compressed to boost shadows
-// black is slope at black end before compression of cubic
-//
-// suggested coefficients:
-// gamma = 0.2 for shadow <= 7.5
-// gamma = 1.5/shadow for 7.5 < shadow < 37.5
-// gamma = 0.04 for shadow >= 37.5
-// shadow = 1 to 64
-// black = 0.3 for every setting
-void gamma_gen_lut_hdr_cubic(uint8_t *lut, uint8_t bit_depth, double gamma, double shadow,
-        double black)
+// apply the base curve x^gamma * (1 - k^x)/(1 - k) before gamma encoding
+// shadow slope is approximately 0.03^gamma * ln(1/k) / (1 - k)
+// allows extreme shadow boosting while preserving highlights
+// suggested values: gamma=0.1, shadow=[2 to 64] depending on dynamic range
+void gamma_gen_lut_hdr(uint8_t *lut, uint8_t bit_depth, double gamma, double shadow)
+{
+    gen_lut_hdr(lut, false, bit_depth, gamma, shadow);
+}
+
+void gamma_gen_lut16_hdr(uint16_t *lut, uint8_t bit_depth, double gamma, double shadow)
+{
+    gen_lut_hdr(lut, true, bit_depth, gamma, shadow);
+}
+
+static void gen_lut_hdr_cubic(void *lut, bool lut16, uint8_t bit_depth, double gamma,
+        double shadow, double black)
 {
     /* Let's call our HDR curve h(x)
      *
@@ -244,17 +296,40 @@ void gamma_gen_lut_hdr_cubic(uint8_t *lut, uint8_t bit_depth, double gamma, doub
     double B = Q * shadow*shadow * (3 - g - 2*black);
     double C = Q * shadow * black;
 
-    for (uint16_t i = 0; i < 1 << bit_depth; i++) {
+    for (uint32_t i = 0; i < 1U << bit_depth; i++) {
         double x = i * i_scale;
         double y;
         if (x < inv_shadow)
             y = A*x*x*x + B*x*x + C*x;
         else
             y = r_1 * x / (x + r);
-        lut[i] = gamma_encode_srgb(y);
+        lut_set(lut, lut16, i, y);
     }
 }
 
+// compressed cubic curve with Reinhard tail for shadow boosting while preserving highlights
+// gamma is slope at white end
+// shadow is how much cubic is compressed to boost shadows
+// black is slope at black end before compression of cubic
+//
+// suggested coefficients:
+// gamma = 0.2 for shadow <= 7.5
+// gamma = 1.5/shadow for 7.5 < shadow < 37.5
+// gamma = 0.04 for shadow >= 37.5
+// shadow = 1 to 64
+// black = 0.3 for every setting
+void gamma_gen_lut_hdr_cubic(uint8_t *lut, uint8_t bit_depth, double gamma, double shadow,
+        double black)
+{
+    gen_lut_hdr_cubic(lut, false, bit_depth, gamma, shadow, black);
+}
+
+void gamma_gen_lut16_hdr_cubic(uint16_t *lut, uint8_t bit_depth, double gamma, double shadow,
+        double black)
+{
+    gen_lut_hdr_cubic(lut, true, bit_depth, gamma, shadow, black);
+}
+
 // assumes length of lut >= highest value in img_in
 void gamma_encode(const uint16_t *img_in, uint8_t *img_out, uint16_t width, uint16_t height,
         const uint8_t *lut)
@@ -262,3 +337,30 @@ void gamma_encode(const uint16_t *img_in, uint8_t *img_out, uint16_t width, uint
     for (uint32_t i = 0; i < width * height * 3; i++)
         img_out[i] = lut[img_in[i]];
 }
+
+// scale a float value in [0, 1] to a LUT index, clamping anything outside that range
+static inline uint32_t lut_index_f(float x, float max)
+{
+    x *= max;
+    if (!(x > 0)) return 0;     // also catches NaN
+    if (x > max) x = max;
+    return x;
+}
+
+// lut has 1 << bit_depth entries
+void gamma_encode_f(const float *img_in, uint8_t *img_out, uint16_t width, uint16_t height,
+        const uint8_t *lut, uint8_t bit_depth)
+{
+    const float max = (1U << bit_depth) - 1;
+    for (uint32_t i = 0; i < width * height * 3; i++)
+        img_out[i] = lut[lut_index_f(img_in[i], max)];
+}
+
+// lut has 1 << bit_depth entries
+void gamma_encode16_f(const float *img_in, uint16_t *img_out, uint16_t width, uint16_t height,
+        const uint16_t *lut, uint8_t bit_depth)
+{
+    const float max = (1U << bit_depth) - 1;
+    for (uint32_t i = 0; i < width * height * 3; i++)
+        img_out[i] = lut[lut_index_f(img_in[i], max)];
+}
@@ -38,6 +38,23 @@ void gamma_gen_lut_hdr_cubic(uint8_t *lut, uint8_t bit_depth, double gamma, doub
 void gamma_encode(const uint16_t *img_in, uint8_t *img_out, uint16_t width, uint16_t height,
         const uint8_t *lut);
 
+// 16 bit output versions of the above
+void gamma_gen_lut16(uint16_t *lut, uint8_t bit_depth);
+void gamma_gen_lut16_cubic(uint16_t *lut, uint8_t bit_depth, double gamma, double black);
+void gamma_gen_lut16_filmic(uint16_t *lut, uint8_t bit_depth, double gamma, double black);
+void gamma_gen_lut16_hdr(uint16_t *lut, uint8_t bit_depth, double gamma, double shadow);
+void gamma_gen_lut16_hdr_cubic(uint16_t *lut, uint8_t bit_depth, double gamma, double shadow,
+        double black);
+
+// gamma encode a linear float image directly, values are clamped to [0, 1] and scaled to index
+// a lut with 1 << bit_depth entries
+// saves quantizing to an integer image first, and a finer lut than 12 bits improves shadow
+// gradation when the curve boosts shadows strongly
+void gamma_encode_f(const float *img_in, uint8_t *img_out, uint16_t width, uint16_t height,
+        const uint8_t *lut, uint8_t bit_depth);
+void gamma_encode16_f(const float *img_in, uint16_t *img_out, uint16_t width, uint16_t height,
+        const uint16_t *lut, uint8_t bit_depth);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+#include "hdr_merge.h"
+#include "debayer.h"
+#include "cm_parallel.h"
+
+// pixels are unpacked a chunk at a time, must be even for 12 bit packed data
+#define MERGE_CHUNK 256
+
+// values above this fraction of white are weighted down, reaching 0 at HDR_CLIP_END
+#define HDR_CLIP_START 0.8f
+#define HDR_CLIP_END 0.95f
+
+typedef struct {
+    CMHDRMerge *merge;
+    const void *raw;
+    uint8_t pixel_fmt;
+    float inv_white;
+    float exposure;     // relative to the first frame
+} MergeAddJob;
+
+typedef struct {
+    CMHDRMerge *merge;
+    uint16_t *bayer16;
+    float scale;
+    float white;
+} MergeFinishJob;
+
+int hdr_merge_init(CMHDRMerge *merge, uint16_t width, uint16_t height)
+{
+    memset(merge, 0, sizeof(CMHDRMerge));
+    if (width > CM_MAX_WIDTH || (width & 1) || height > CM_MAX_HEIGHT || (height & 1))
+        return -EINVAL;
+
+    merge->width = width;
+    merge->height = height;
+    merge->acc = (float *)calloc((size_t)width * height * 2, sizeof(float));
+    if (merge->acc == NULL)
+        return -ENOMEM;
+
+    return 0;
+}
+
+void hdr_merge_free(CMHDRMerge *merge)
+{
+    free(merge->acc);
+    merge->acc = NULL;
+}
+
+static inline float clip_weight(float x)
+{
+    if (x <= HDR_CLIP_START) return 1;
+    if (x >= HDR_CLIP_END) return 0;
+    return (HDR_CLIP_END - x) * (1 / (HDR_CLIP_END - HDR_CLIP_START));
+}
+
+static void merge_add_rows(void *arg, unsigned int start, unsigned int end)
+{
+    const MergeAddJob *job = (const MergeAddJob *)arg;
+    const unsigned int width = job->merge->width;
+    uint16_t vals[MERGE_CHUNK];
+
+    for (unsigned int y = start; y < end; y++) {
+        size_t row = (size_t)y * width;
+        float *acc = job->merge->acc + row * 2;
+        for (unsigned int x = 0; x < width; x += MERGE_CHUNK) {
+            unsigned int n = width - x < MERGE_CHUNK ? width - x : MERGE_CHUNK;
+            const uint16_t *px;
+            if (job->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P) {
+                unpack12_16(vals, (const uint8_t *)job->raw + (row + x) / 2 * 3, n, false);
+                px = vals;
+            } else {
+                px = (const uint16_t *)job->raw + row + x;
+            }
+
+            /* accumulate each frame's estimate of scene radiance, v / e, weighted by w * e:
+             *  radiance = sum(w * e * v / e) / sum(w * e) = sum(w * v) / sum(w * e)
+             */
+            for (unsigned int i = 0; i < n; i++) {
+                float v = px[i] * job->inv_white;
+                float w = clip_weight(v);
+                acc[2*(x + i)] += w * v;
+                acc[2*(x + i) + 1] += w * job->exposure;
+            }
+        }
+    }
+}
+
+int hdr_merge_add(CMHDRMerge *merge, const void *raw, const CMCaptureInfo *cinfo)
+{
+    if (cinfo->width != merge->width || cinfo->height != merge->height)
+        return -EINVAL;
+    if (cinfo->pixel_fmt != CM_PIXEL_FMT_BAYER_RG12P
+            && cinfo->pixel_fmt != CM_PIXEL_FMT_BAYER_RG12
+            && cinfo->pixel_fmt != CM_PIXEL_FMT_BAYER_RG16)
+        return -EINVAL;
+
+    double exposure = cinfo->shutter_us * pow(10, cinfo->gain_dB / 20);
+    if (!(exposure > 0))
+        return -EINVAL;
+
+    if (merge->num_frames == 0)
+        merge->first_exposure = exposure;
+    exposure /= merge->first_exposure;
+    if (merge->num_frames == 0 || exposure < merge->min_exposure) {
+        merge->min_exposure = exposure;
+        merge->cinfo = *cinfo;
+    }
+    if (merge->num_frames == 0 || exposure > merge->max_exposure)
+        merge->max_exposure = exposure;
+    uint16_t white = cmraw_white_level(cinfo);
+    if (merge->num_frames == 0 || white > merge->max_white)
+        merge->max_white = white;
+
+    MergeAddJob job = {
+        .merge = merge,
+        .raw = raw,
+        .pixel_fmt = cinfo->pixel_fmt,
+        .inv_white = 1.0f / white,
+        .exposure = exposure
+    };
+    parallel_for(merge->height, merge_add_rows, &job);
+    merge->num_frames++;
+
+    return 0;
+}
+
+static void merge_finish_rows(void *arg, unsigned int start, unsigned int end)
+{
+    const MergeFinishJob *job = (const MergeFinishJob *)arg;
+    const unsigned int width = job->merge->width;
+
+    for (unsigned int y = start; y < end; y++) {
+        size_t row = (size_t)y * width;
+        float *acc = job->merge->acc + row * 2;
+        uint16_t *out = job->bayer16 + row;
+        for (unsigned int x = 0; x < width; x++) {
+            // clipped in every frame, so it's at least as bright as white in the shortest
+            float v = job->white;
+            if (acc[2*x + 1] > 0)
+                v = acc[2*x] / acc[2*x + 1] * job->scale + 0.5f;
+            out[x] = v < job->white ? v : job->white;
+
+            // ready for the next bracket
+            acc[2*x] = 0;
+            acc[2*x + 1] = 0;
+        }
+    }
+}
+
+int hdr_merge_finish(CMHDRMerge *merge, uint16_t *bayer16, CMCaptureInfo *cinfo)
+{
+    if (merge->num_frames == 0)
+        return -EINVAL;
+
+    /* the longest frame's steps are white / max_white * min / max of the merged frame's, so the
+     * white level is the next 2^n - 1 that keeps them at least 1
+     */
+    double needed = (double)merge->max_white * merge->max_exposure / merge->min_exposure;
+    unsigned int white = HDR_MERGE_WHITE;
+    while (white < needed && white < UINT16_MAX)
+        white = white * 2 + 1;
+
+    MergeFinishJob job = {
+        .merge = merge,
+        .bayer16 = bayer16,
+        .scale = merge->min_exposure * white,
+        .white = white
+    };
+    parallel_for(merge->height, merge_finish_rows, &job);
+
+    *cinfo = merge->cinfo;
+    cinfo->pixel_fmt = CM_PIXEL_FMT_BAYER_RG16;
+    cinfo->white_level = white;
+
+    merge->num_frames = 0;
+
+    return 0;
+}
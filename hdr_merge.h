@@ -0,0 +1,60 @@
+#ifndef HDR_MERGE_H
+#define HDR_MERGE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmraw.h"
+
+/* lowest white level of merged frames, leaves headroom in debayering for 16 bit intermediates.
+ * Wider brackets raise it, up to the full 16 bit range, so each step of the longest frame stays
+ * at least one step in the merged one.
+ */
+#define HDR_MERGE_WHITE 16383
+
+/* Merges a bracket of raw frames of the same scene, taken at different exposures, into one
+ * extended range linear Bayer frame.
+ *
+ * Frames are accumulated as they arrive, so a bracket can be merged while it is captured. Each
+ * pixel is the exposure weighted average of the frames where it isn't close to clipping, which
+ * weights frames roughly by their signal to noise ratio. The merged frame is scaled to the
+ * shortest exposure in the bracket, so highlights are kept from that frame while shadows get
+ * the lower noise and finer steps of the longer ones.
+ *
+ * There is no alignment or deghosting, so moving subjects will show ghosting.
+ */
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    unsigned int num_frames;
+    double first_exposure;      // exposures are accumulated relative to the first frame
+    double min_exposure;        // relative exposure of the shortest frame
+    double max_exposure;        // and of the longest
+    uint16_t max_white;         // highest white level of the frames
+    CMCaptureInfo cinfo;        // capture info of the shortest frame
+
+    // for each pixel, weighted sum of normalized values and sum of weights times exposure
+    float *acc;
+} CMHDRMerge;
+
+// returns 0 on success or a negative error code, merge must be freed with hdr_merge_free
+int hdr_merge_init(CMHDRMerge *merge, uint16_t width, uint16_t height);
+
+void hdr_merge_free(CMHDRMerge *merge);
+
+// accumulate one frame of the bracket, work is split across threads
+// the frame must be Bayer RG12P, RG12 or RG16 with the size given to hdr_merge_init
+int hdr_merge_add(CMHDRMerge *merge, const void *raw, const CMCaptureInfo *cinfo);
+
+// write the merged frame to bayer16 (width * height values) and start a new bracket
+// cinfo is set to describe the merged frame: CM_PIXEL_FMT_BAYER_RG16 with the white level for
+// the bracket's span, at least HDR_MERGE_WHITE, and the exposure of the shortest frame
+int hdr_merge_finish(CMHDRMerge *merge, uint16_t *bayer16, CMCaptureInfo *cinfo);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HDR_MERGE_H
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lj92.h"
+
+// difference categories 0 to 16, plus the code reserved so no code is all 1 bits
+#define LJ92_SYMBOLS 17
+#define LJ92_MAX_CODE_LEN 16
+
+typedef struct {
+    uint8_t bits[LJ92_MAX_CODE_LEN + 1];    // number of codes of each length
+    uint8_t vals[LJ92_SYMBOLS];             // symbols in order of code length
+    uint16_t code[LJ92_SYMBOLS];
+    uint8_t len[LJ92_SYMBOLS];
+} HuffmanTable;
+
+typedef struct {
+    uint64_t acc;
+    unsigned n;
+    uint8_t *p;
+} BitWriter;
+
+size_t lj92_encode_bound(uint16_t width, uint16_t height)
+{
+    // at most 16 bits of code and 16 of difference per sample, every byte of which may be
+    // stuffed, plus the markers
+    return (size_t)width * height * 8 + 256;
+}
+
+static inline unsigned bit_length(uint32_t v)
+{
+    return v ? 32 - __builtin_clz(v) : 0;
+}
+
+static inline int32_t wrap_diff(int d)
+{
+    d &= 0xFFFF;
+    return d > 32768 ? d - 65536 : d;
+}
+
+/* differences from the prediction, modulo 2^16 into [-32767, 32768]:
+ *  Px = Ra (left) for every sample after the first of a row
+ *  Px = Rb (above) for the first sample of a row, 2^(P - 1) on the first row
+ */
+static void row_diffs(const uint16_t *row, const uint16_t *above, unsigned width,
+        unsigned bits, int32_t *diff)
+{
+    for (unsigned x = 0; x < 2; x++)
+        diff[x] = wrap_diff(row[x] - (above != NULL ? above[x] : 1 << (bits - 1)));
+    for (unsigned x = 2; x < width; x++)
+        diff[x] = wrap_diff(row[x] - row[x - 2]);
+}
+
+// optimal code lengths limited to 16 bits, as in ITU T.81 annex K.2
+static void huffman_build(const uint32_t *freq_in, HuffmanTable *ht)
+{
+    long freq[LJ92_SYMBOLS + 1];
+    int others[LJ92_SYMBOLS + 1];
+    unsigned code_size[LJ92_SYMBOLS + 1];
+    for (int i = 0; i < LJ92_SYMBOLS; i++)
+        freq[i] = freq_in[i];
+    freq[LJ92_SYMBOLS] = 1;
+    for (int i = 0; i <= LJ92_SYMBOLS; i++) {
+        others[i] = -1;
+        code_size[i] = 0;
+    }
+
+    for (;;) {
+        // the two least frequent, the higher symbol on ties
+        int v1 = -1;
+        int v2 = -1;
+        for (int i = 0; i <= LJ92_SYMBOLS; i++) {
+            if (freq[i] > 0 && (v1 < 0 || freq[i] <= freq[v1]))
+                v1 = i;
+        }
+        for (int i = 0; i <= LJ92_SYMBOLS; i++) {
+            if (freq[i] > 0 && i != v1 && (v2 < 0 || freq[i] <= freq[v2]))
+                v2 = i;
+        }
+        if (v2 < 0)
+            break;
+
+        freq[v1] += freq[v2];
+        freq[v2] = 0;
+        code_size[v1]++;
+        while (others[v1] >= 0) {
+            v1 = others[v1];
+            code_size[v1]++;
+        }
+        others[v1] = v2;
+        code_size[v2]++;
+        while (others[v2] >= 0) {
+            v2 = others[v2];
+            code_size[v2]++;
+        }
+    }
+
+    // count codes of each length, then shorten the longest ones (annex K.3)
+    unsigned bits[2 * LJ92_SYMBOLS + 2] = {0};
+    for (int i = 0; i <= LJ92_SYMBOLS; i++) {
+        if (code_size[i])
+            bits[code_size[i]]++;
+    }
+    for (int i = 2 * LJ92_SYMBOLS + 1; i > LJ92_MAX_CODE_LEN; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0)
+                j--;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+    // remove the reserved code, which is one of the longest
+    int longest = LJ92_MAX_CODE_LEN;
+    while (bits[longest] == 0)
+        longest--;
+    bits[longest]--;
+
+    // symbols sorted by code length, which assigns the lengths from bits in the same order
+    unsigned n = 0;
+    for (unsigned size = 1; size <= 2 * LJ92_SYMBOLS + 1; size++) {
+        for (int i = 0; i < LJ92_SYMBOLS; i++) {
+            if (code_size[i] == size)
+                ht->vals[n++] = i;
+        }
+    }
+
+    memset(ht->len, 0, sizeof(ht->len));
+    uint16_t code = 0;
+    unsigned k = 0;
+    ht->bits[0] = 0;
+    for (unsigned size = 1; size <= LJ92_MAX_CODE_LEN; size++) {
+        ht->bits[size] = bits[size];
+        for (unsigned i = 0; i < bits[size]; i++, k++) {
+            ht->code[ht->vals[k]] = code++;
+            ht->len[ht->vals[k]] = size;
+        }
+        code <<= 1;
+    }
+}
+
+static inline void put_byte(uint8_t **p, uint8_t v)
+{
+    *(*p)++ = v;
+}
+
+static inline void put_u16(uint8_t **p, uint16_t v)
+{
+    put_byte(p, v >> 8);
+    put_byte(p, v & 0xFF);
+}
+
+static inline void bw_byte(BitWriter *bw, uint8_t byte)
+{
+    *bw->p++ = byte;
+    if (byte == 0xFF)
+        *bw->p++ = 0;
+}
+
+/* appends len (up to 32) bits, stuffing a zero byte after every 0xFF in the entropy coded data
+ * bytes are written 4 at a time, one at a time only for words with an 0xFF byte:
+ *  (~w - 0x01010101) & w & 0x80808080 is non zero if a byte of w is 0xFF
+ */
+static inline void bw_put(BitWriter *bw, uint32_t bits, unsigned len)
+{
+    bw->acc = (bw->acc << len) | bits;
+    bw->n += len;
+    if (bw->n >= 32) {
+        bw->n -= 32;
+        uint32_t w = bw->acc >> bw->n;
+        if (((~w - 0x01010101) & w & 0x80808080) == 0) {
+            bw->p[0] = w >> 24;
+            bw->p[1] = w >> 16;
+            bw->p[2] = w >> 8;
+            bw->p[3] = w;
+            bw->p += 4;
+        } else {
+            bw_byte(bw, w >> 24);
+            bw_byte(bw, w >> 16);
+            bw_byte(bw, w >> 8);
+            bw_byte(bw, w);
+        }
+    }
+}
+
+// pads the last byte with 1 bits
+static void bw_flush(BitWriter *bw)
+{
+    unsigned pad = (8 - (bw->n & 7)) & 7;
+    bw->acc = (bw->acc << pad) | ((1u << pad) - 1);
+    bw->n += pad;
+    while (bw->n >= 8) {
+        bw->n -= 8;
+        bw_byte(bw, bw->acc >> bw->n);
+    }
+}
+
+int lj92_encode(const uint16_t *img, size_t stride, uint16_t width, uint16_t height,
+        unsigned bits, uint8_t *out, size_t *out_len)
+{
+    *out_len = 0;
+    if (width < 2 || (width & 1) || height < 1 || bits < 2 || bits > 16)
+        return -EINVAL;
+
+    // differences are kept for the second pass, which codes them with the table from the first
+    int32_t *diffs = (int32_t *)malloc((size_t)width * height * sizeof(int32_t));
+    if (diffs == NULL)
+        return -ENOMEM;
+    uint32_t freq[LJ92_SYMBOLS] = {0};
+    for (unsigned y = 0; y < height; y++) {
+        const uint16_t *row = img + y * stride;
+        int32_t *diff = diffs + (size_t)y * width;
+        row_diffs(row, y > 0 ? row - stride : NULL, width, bits, diff);
+        for (unsigned x = 0; x < width; x++)
+            freq[bit_length(diff[x] < 0 ? -diff[x] : diff[x])]++;
+    }
+    HuffmanTable ht;
+    huffman_build(freq, &ht);
+
+    uint8_t *p = out;
+    put_u16(&p, 0xFFD8);                // SOI
+
+    unsigned num_vals = 0;
+    for (unsigned i = 1; i <= LJ92_MAX_CODE_LEN; i++)
+        num_vals += ht.bits[i];
+    put_u16(&p, 0xFFC4);                // DHT
+    put_u16(&p, 2 + 1 + LJ92_MAX_CODE_LEN + num_vals);
+    put_byte(&p, 0x00);                 // DC table 0
+    for (unsigned i = 1; i <= LJ92_MAX_CODE_LEN; i++)
+        put_byte(&p, ht.bits[i]);
+    for (unsigned i = 0; i < num_vals; i++)
+        put_byte(&p, ht.vals[i]);
+
+    put_u16(&p, 0xFFC3);                // SOF3, lossless Huffman
+    put_u16(&p, 8 + 3 * 2);
+    put_byte(&p, bits);
+    put_u16(&p, height);
+    put_u16(&p, width / 2);
+    put_byte(&p, 2);                    // components
+    for (unsigned c = 0; c < 2; c++) {
+        put_byte(&p, c);
+        put_byte(&p, 0x11);             // no subsampling
+        put_byte(&p, 0);
+    }
+
+    put_u16(&p, 0xFFDA);                // SOS
+    put_u16(&p, 6 + 2 * 2);
+    put_byte(&p, 2);
+    for (unsigned c = 0; c < 2; c++) {
+        put_byte(&p, c);
+        put_byte(&p, 0x00);             // both use table 0
+    }
+    put_byte(&p, 1);                    // predictor 1, Ra
+    put_byte(&p, 0);
+    put_byte(&p, 0);                    // no point transform
+
+    BitWriter bw = {.acc = 0, .n = 0, .p = p};
+    const size_t num = (size_t)width * height;
+    for (size_t i = 0; i < num; i++) {
+        int32_t d = diffs[i];
+        unsigned ssss = bit_length(d < 0 ? -d : d);
+        // the code then ssss bits of the difference, negative ones sent as d - 1, except for
+        // 32768 which has none
+        unsigned extra = ssss < 16 ? ssss : 0;
+        uint32_t v = (d < 0 ? d - 1 : d) & ((1u << extra) - 1);
+        bw_put(&bw, ((uint32_t)ht.code[ssss] << extra) | v, ht.len[ssss] + extra);
+    }
+    bw_flush(&bw);
+    free(diffs);
+    p = bw.p;
+
+    put_u16(&p, 0xFFD9);                // EOI
+    *out_len = p - out;
+    return 0;
+}
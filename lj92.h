@@ -0,0 +1,32 @@
+#ifndef LJ92_H
+#define LJ92_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Lossless JPEG (ITU T.81 process 14) encoder for DNG compression 7
+ *
+ * A CFA image is coded as two components of half the width, so each row alternates the two
+ * colours on it and every sample is predicted from the same colour to its left (predictor 1).
+ * The Huffman table is built for each image from its own residuals.
+ */
+
+// largest encoded size of a width x height image
+size_t lj92_encode_bound(uint16_t width, uint16_t height);
+
+/* Encodes width x height samples of bits precision (2 to 16) read from img, stride samples
+ * apart between rows. width must be even. out must hold lj92_encode_bound bytes, *out_len is
+ * set to the bytes used. Returns 0 on success or a negative error code.
+ */
+int lj92_encode(const uint16_t *img, size_t stride, uint16_t width, uint16_t height,
+        unsigned bits, uint8_t *out, size_t *out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LJ92_H
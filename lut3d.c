@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "lut3d.h"
+#include "cm_parallel.h"
+
+// 4 wide float vector, lets the compiler do each interpolation step for r, g, b in one go
+typedef float v4f __attribute__((vector_size(16)));
+
+typedef struct {
+    const CMLut3D *lut;
+    void *img;
+    bool img16;
+    uint16_t width;
+    float pos8[3][256];     // LUT grid position of each 8 bit value, per channel
+
+    // for lut3d_apply_shaped, img is the 8 bit output
+    const uint16_t *src;
+    const float *shaper;
+} Lut3DJob;
+
+static atomic_uint lut3d_next_id = 1;
+
+static bool starts_with(const char *s, const char *prefix)
+{
+    return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+int lut3d_load(CMLut3D *lut, const char *fname)
+{
+    int status = 0;
+    unsigned int count = 0;
+    unsigned int total = 0;
+    char line[256];
+
+    lut->id = 0;
+    lut->size = 0;
+    lut->table = NULL;
+    for (int c = 0; c < 3; c++) {
+        lut->domain_min[c] = 0;
+        lut->domain_max[c] = 1;
+    }
+
+    FILE *fp = fopen(fname, "r");
+    if (fp == NULL)
+        return -errno;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        // keywords
+        if (isalpha((unsigned char)*p)) {
+            if (starts_with(p, "LUT_3D_SIZE")) {
+                unsigned int size;
+                if (lut->table != NULL || sscanf(p + 11, "%u", &size) != 1 || size < 2
+                        || size > LUT3D_MAX_SIZE) {
+                    status = -EINVAL;
+                    break;
+                }
+                total = size * size * size;
+                lut->size = size;
+                lut->table = (float *)malloc(total * 4 * sizeof(float));
+                if (lut->table == NULL) {
+                    status = -ENOMEM;
+                    break;
+                }
+            } else if (starts_with(p, "DOMAIN_MIN")) {
+                if (sscanf(p + 10, "%f %f %f", &lut->domain_min[0], &lut->domain_min[1],
+                            &lut->domain_min[2]) != 3) {
+                    status = -EINVAL;
+                    break;
+                }
+            } else if (starts_with(p, "DOMAIN_MAX")) {
+                if (sscanf(p + 10, "%f %f %f", &lut->domain_max[0], &lut->domain_max[1],
+                            &lut->domain_max[2]) != 3) {
+                    status = -EINVAL;
+                    break;
+                }
+            } else if (starts_with(p, "LUT_3D_INPUT_RANGE")) {
+                // the same domain for every channel, as written by Resolve
+                float min, max;
+                if (sscanf(p + 18, "%f %f", &min, &max) != 2) {
+                    status = -EINVAL;
+                    break;
+                }
+                for (int c = 0; c < 3; c++) {
+                    lut->domain_min[c] = min;
+                    lut->domain_max[c] = max;
+                }
+            } else if (starts_with(p, "LUT_1D_SIZE")) {
+                status = -ENOTSUP;
+                break;
+            }
+            // other keywords such as TITLE are ignored
+            continue;
+        }
+
+        // table entries
+        float r, g, b;
+        if (lut->table == NULL || count >= total || sscanf(p, "%f %f %f", &r, &g, &b) != 3) {
+            status = -EINVAL;
+            break;
+        }
+        float *entry = &lut->table[4 * count];
+        entry[0] = r;
+        entry[1] = g;
+        entry[2] = b;
+        entry[3] = 0;
+        count++;
+    }
+
+    if (status == 0 && (lut->table == NULL || count != total))
+        status = -EINVAL;
+    for (int c = 0; c < 3 && status == 0; c++) {
+        if (lut->domain_max[c] <= lut->domain_min[c])
+            status = -EINVAL;
+    }
+
+    fclose(fp);
+    if (status != 0)
+        lut3d_free(lut);
+    else
+        lut->id = atomic_fetch_add(&lut3d_next_id, 1);
+
+    return status;
+}
+
+void lut3d_free(CMLut3D *lut)
+{
+    free(lut->table);
+    lut->table = NULL;
+    lut->size = 0;
+}
+
+static inline v4f lut3d_entry(const float *table, unsigned int i)
+{
+    v4f v;
+    memcpy(&v, &table[4 * i], sizeof(v));
+    return v;
+}
+
+// r, g, b are positions in the LUT grid, each in [0, size - 1]
+static inline v4f lut3d_tetrahedral(const CMLut3D *lut, float r, float g, float b)
+{
+    /* The cube around the point is split into 6 tetrahedra sharing the diagonal from c000 to
+     * c111. The ordering of the fractional parts picks the tetrahedron, and the output is a
+     * weighted sum of its 4 corners. e.g. for fr > fg > fb:
+     *  out = (1 - fr)*c000 + (fr - fg)*c100 + (fg - fb)*c110 + fb*c111
+     *
+     * In general, with the fractions sorted as f_max >= f_mid >= f_min, the second corner steps
+     * along the f_max axis, the third along every axis except the f_min one, and the weights are:
+     *  1 - f_max, f_max - f_mid, f_mid - f_min, f_min
+     * This is written without branches since neighbouring pixels often fall in different
+     * tetrahedra, and the mispredictions dominated the cost. Ties only happen where the
+     * weights of the ambiguous corners are zero, so any consistent choice works.
+     */
+    const unsigned int n = lut->size;
+    // positions are never negative, and signed conversions are cheaper on x86
+    int ri = (int)r, gi = (int)g, bi = (int)b;
+    const int last = n - 2;
+    if (ri > last) ri = last;
+    if (gi > last) gi = last;
+    if (bi > last) bi = last;
+    float fr = r - ri, fg = g - gi, fb = b - bi;
+
+    const unsigned int dr = 1, dg = n, db = n * n;
+    unsigned int r_gt_g = fr > fg;
+    unsigned int g_gt_b = fg > fb;
+    unsigned int r_gt_b = fr > fb;
+
+    // masks rather than ternaries, which GCC turns back into branches
+    unsigned int r_max = r_gt_g & r_gt_b;
+    unsigned int g_max = ~r_gt_g & g_gt_b & 1;
+    unsigned int b_max = ~(r_max | g_max) & 1;
+    unsigned int b_min = r_gt_b & g_gt_b;
+    unsigned int r_min = ~(r_gt_g | r_gt_b) & 1;
+    unsigned int g_min = ~(b_min | r_min) & 1;
+    unsigned int off_max = (-r_max & dr) | (-g_max & dg) | (-b_max & db);
+    unsigned int off_min = (-r_min & dr) | (-g_min & dg) | (-b_min & db);
+
+    float f_max = fmaxf(fr, fmaxf(fg, fb));
+    float f_min = fminf(fr, fminf(fg, fb));
+    float f_mid = fr + fg + fb - f_max - f_min;
+
+    const float *t = lut->table;
+    unsigned int base = ri + n*(gi + n*bi);
+    v4f c000 = lut3d_entry(t, base);
+    v4f c1 = lut3d_entry(t, base + off_max);
+    v4f c2 = lut3d_entry(t, base + dr + dg + db - off_min);
+    v4f c111 = lut3d_entry(t, base + dr + dg + db);
+
+    return (1 - f_max)*c000 + (f_max - f_mid)*c1 + (f_mid - f_min)*c2 + f_min*c111;
+}
+
+// map a normalized [0, 1] value of channel c to its position in the LUT grid
+static inline float lut3d_pos(const CMLut3D *lut, int c, float x)
+{
+    float pos = (x - lut->domain_min[c]) / (lut->domain_max[c] - lut->domain_min[c])
+        * (lut->size - 1);
+    if (pos < 0) pos = 0;
+    else if (pos > lut->size - 1) pos = lut->size - 1;
+    return pos;
+}
+
+static inline float lut3d_clip(float x, float max)
+{
+    // fminf/fmaxf rather than branches, real images clip often and unpredictably
+    return fminf(fmaxf(x * max + 0.5f, 0), max);
+}
+
+static void lut3d_apply_rows(void *arg, unsigned int start, unsigned int end)
+{
+    const Lut3DJob *job = (const Lut3DJob *)arg;
+    const CMLut3D *lut = job->lut;
+    unsigned int row_len = 3 * job->width;
+
+    if (job->shaper) {
+        const float *shaper = job->shaper;
+        for (unsigned int y = start; y < end; y++) {
+            const uint16_t *px = job->src + y * row_len;
+            uint8_t *out_px = (uint8_t *)job->img + y * row_len;
+            for (unsigned int i = 0; i < row_len; i += 3) {
+                v4f out = lut3d_tetrahedral(lut, shaper[px[i]], shaper[px[i+1]],
+                        shaper[px[i+2]]);
+                out_px[i] = lut3d_clip(out[0], 255);
+                out_px[i+1] = lut3d_clip(out[1], 255);
+                out_px[i+2] = lut3d_clip(out[2], 255);
+            }
+        }
+    } else if (job->img16) {
+        const float scale = 1.0f / 65535;
+        for (unsigned int y = start; y < end; y++) {
+            uint16_t *px = (uint16_t *)job->img + y * row_len;
+            for (unsigned int i = 0; i < row_len; i += 3) {
+                v4f out = lut3d_tetrahedral(lut, lut3d_pos(lut, 0, px[i] * scale),
+                        lut3d_pos(lut, 1, px[i+1] * scale), lut3d_pos(lut, 2, px[i+2] * scale));
+                px[i] = lut3d_clip(out[0], 65535);
+                px[i+1] = lut3d_clip(out[1], 65535);
+                px[i+2] = lut3d_clip(out[2], 65535);
+            }
+        }
+    } else {
+        for (unsigned int y = start; y < end; y++) {
+            uint8_t *px = (uint8_t *)job->img + y * row_len;
+            for (unsigned int i = 0; i < row_len; i += 3) {
+                v4f out = lut3d_tetrahedral(lut, job->pos8[0][px[i]], job->pos8[1][px[i+1]],
+                        job->pos8[2][px[i+2]]);
+                px[i] = lut3d_clip(out[0], 255);
+                px[i+1] = lut3d_clip(out[1], 255);
+                px[i+2] = lut3d_clip(out[2], 255);
+            }
+        }
+    }
+}
+
+void lut3d_apply8(const CMLut3D *lut, uint8_t *rgb8, uint16_t width, uint16_t height)
+{
+    Lut3DJob job = {.lut = lut, .img = rgb8, .img16 = false, .width = width};
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++)
+            job.pos8[c][v] = lut3d_pos(lut, c, v / 255.0f);
+    }
+    parallel_for(height, lut3d_apply_rows, &job);
+}
+
+void lut3d_apply16(const CMLut3D *lut, uint16_t *rgb16, uint16_t width, uint16_t height)
+{
+    Lut3DJob job = {.lut = lut, .img = rgb16, .img16 = true, .width = width};
+    parallel_for(height, lut3d_apply_rows, &job);
+}
+
+void lut3d_apply_shaped(const CMLut3D *lut, const float *shaper, const uint16_t *rgb_in,
+        uint8_t *rgb8, uint16_t width, uint16_t height)
+{
+    Lut3DJob job = {.lut = lut, .img = rgb8, .img16 = false, .width = width,
+        .src = rgb_in, .shaper = shaper};
+    parallel_for(height, lut3d_apply_rows, &job);
+}
@@ -0,0 +1,43 @@
+#ifndef LUT3D_H
+#define LUT3D_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define LUT3D_MAX_SIZE 129
+
+typedef struct {
+    uint32_t id;            // unique to each load, so a cache can't mistake a LUT for a freed one
+    unsigned int size;      // entries along each axis
+    float domain_min[3];
+    float domain_max[3];
+
+    // size^3 entries of 4 floats (r, g, b, unused), red changing fastest like in .cube files
+    float *table;
+} CMLut3D;
+
+// load a 3D LUT from a .cube file, DOMAIN_MIN/MAX or LUT_3D_INPUT_RANGE set its domain
+// returns 0 on success or a negative error code, lut must be freed with lut3d_free
+int lut3d_load(CMLut3D *lut, const char *fname);
+
+void lut3d_free(CMLut3D *lut);
+
+// apply LUT in place to a gamma encoded RGB image using tetrahedral interpolation
+// work is split across threads
+void lut3d_apply8(const CMLut3D *lut, uint8_t *rgb8, uint16_t width, uint16_t height);
+void lut3d_apply16(const CMLut3D *lut, uint16_t *rgb16, uint16_t width, uint16_t height);
+
+// apply LUT to an integer RGB image, writing 8 bit output
+// shaper maps each input value to its position in the LUT grid and must cover the input range,
+// the same shaper is used for all channels and the domain is ignored
+void lut3d_apply_shaped(const CMLut3D *lut, const float *shaper, const uint16_t *rgb_in,
+        uint8_t *rgb8, uint16_t width, uint16_t height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LUT3D_H
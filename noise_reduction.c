@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 
 #include "noise_reduction.h"
 #include "convolve.h"
@@ -10,6 +11,133 @@
 #define KERNEL_SIZE 5
 #define KERNEL_VARIANCE 1.3
 
+// NR is decided per tile first, using the luminance range within each tile
+#define NR_TILE_SIZE 32
+
+#define WAVELET_SCALES 4
+
+// soft threshold for each wavelet scale, relative to the NR threshold
+// finer scales carry most of the noise energy, roughly following the decay of
+// white noise in B3-spline wavelet coefficients; chroma noise is coarser grained
+static const float wavelet_thresh_lum[WAVELET_SCALES] = {0.1, 0.04, 0.02, 0.01};
+static const float wavelet_thresh_chrom[WAVELET_SCALES] = {0.1, 0.06, 0.04, 0.03};
+
+// approximate sensor noise model in 12 bit DN at 0 dB analog gain
+// conversion gain and read noise both scale with analog gain, ADC noise does not
+#define BAYER_NR_CONV_GAIN 0.25
+#define BAYER_NR_READ_NOISE 0.6
+#define BAYER_NR_ADC_NOISE 0.5
+
+typedef enum {
+    NR_TILE_SKIP,   // all pixels at or above threshold, no NR needed
+    NR_TILE_MIXED,  // threshold must be checked for each pixel
+    NR_TILE_FULL    // all pixels below threshold
+} NRTileClass;
+
+typedef struct {
+    unsigned int tiles_x;
+    unsigned int tiles_y;
+    float *lum_min;
+    float *lum_max;
+} NRTileMap;
+
+// luminance is channel 0 (for YCbCr), or R+G+B if sum_rgb is set
+// returns false on allocation failure
+static bool nr_tile_map_init(NRTileMap *map, const float *img, unsigned int width,
+        unsigned int height, bool sum_rgb)
+{
+    map->tiles_x = (width + NR_TILE_SIZE - 1) / NR_TILE_SIZE;
+    map->tiles_y = (height + NR_TILE_SIZE - 1) / NR_TILE_SIZE;
+    map->lum_min = (float *)malloc(map->tiles_x * map->tiles_y * sizeof(float));
+    map->lum_max = (float *)malloc(map->tiles_x * map->tiles_y * sizeof(float));
+    if (map->lum_min == NULL || map->lum_max == NULL) {
+        free(map->lum_min);
+        free(map->lum_max);
+        return false;
+    }
+
+    for (unsigned int ty = 0; ty < map->tiles_y; ty++) {
+        unsigned int y_end = (ty + 1) * NR_TILE_SIZE;
+        if (y_end > height) y_end = height;
+
+        for (unsigned int tx = 0; tx < map->tiles_x; tx++) {
+            unsigned int x_end = (tx + 1) * NR_TILE_SIZE;
+            if (x_end > width) x_end = width;
+
+            float lmin = FLT_MAX;
+            float lmax = -FLT_MAX;
+            for (unsigned int y = ty * NR_TILE_SIZE; y < y_end; y++) {
+                for (unsigned int x = tx * NR_TILE_SIZE; x < x_end; x++) {
+                    unsigned int idx = image_idx(x, y, 0, width);
+                    // summed in the same order as the blends, so their weights classify alike
+                    float lum = sum_rgb ? img[idx] + img[idx + 1] + img[idx + 2] : img[idx];
+                    lmin = lum < lmin ? lum : lmin;
+                    lmax = lum > lmax ? lum : lmax;
+                }
+            }
+
+            map->lum_min[ty * map->tiles_x + tx] = lmin;
+            map->lum_max[ty * map->tiles_x + tx] = lmax;
+        }
+    }
+
+    return true;
+}
+
+static void nr_tile_map_free(NRTileMap *map)
+{
+    free(map->lum_min);
+    free(map->lum_max);
+}
+
+static inline NRTileClass nr_tile_class(const NRTileMap *map, unsigned int tx, unsigned int ty,
+        float thresh)
+{
+    unsigned int t = ty * map->tiles_x + tx;
+    if (map->lum_min[t] >= thresh)
+        return NR_TILE_SKIP;
+    if (map->lum_max[t] < thresh)
+        return NR_TILE_FULL;
+    return NR_TILE_MIXED;
+}
+
+/* classifies a tile for blends weighted by lum * inv_intensity clamped at 1, with the same
+ * expression as the blend: skipped tiles would have every weight clamped to 1, and full tiles
+ * none, so either gives the same result as blending each pixel with the clamp
+ */
+static inline NRTileClass nr_tile_class_blend(const NRTileMap *map, unsigned int tx,
+        unsigned int ty, float inv_intensity)
+{
+    unsigned int t = ty * map->tiles_x + tx;
+    if (map->lum_min[t] * inv_intensity >= 1)
+        return NR_TILE_SKIP;
+    if (map->lum_max[t] * inv_intensity <= 1)
+        return NR_TILE_FULL;
+    return NR_TILE_MIXED;
+}
+
+// blends original and smoothed pixels of one tile
+// weight clamping is only needed when the tile straddles the threshold
+static inline void nr_blend_tile_rgb(const float *img_in, const float *img_smooth, float *img_out,
+        unsigned int width, unsigned int x_start, unsigned int y_start, unsigned int x_end,
+        unsigned int y_end, float inv_intensity, bool clamp)
+{
+    for (unsigned int y = y_start; y < y_end; y++) {
+        for (unsigned int x = x_start; x < x_end; x++) {
+            unsigned int idx = image_idx(x, y, 0, width);
+            float luminance = img_in[idx] + img_in[idx + 1] + img_in[idx + 2];
+            float local_weight = luminance * inv_intensity;
+            if (clamp)
+                local_weight = local_weight > 1 ? 1 : local_weight;
+            float smooth_weight = 1 - local_weight;
+
+            for (unsigned int chan = 0; chan < 3; chan++)
+                img_out[idx + chan] = local_weight * img_in[idx + chan] +
+                    smooth_weight * img_smooth[idx + chan];
+        }
+    }
+}
+
 // convolves image using 5x5 gaussian kernel
 // outputs weighted average of original image and convolved image, weighted based on luminance
 // luminance is (R+G+B) / sqrt(3)
@@ -20,34 +148,47 @@ void noise_reduction_rgb(const float *img_in, float *img_out, unsigned int width
     float kernel[KERNEL_SIZE * KERNEL_SIZE];
     gaussian_kernel(kernel, KERNEL_SIZE, KERNEL_VARIANCE);
 
+    NRTileMap map;
     float *img_smooth = (float *)malloc(width * height * 3 * sizeof(float));
-    if (img_smooth == NULL) {
+    if (img_smooth == NULL || !nr_tile_map_init(&map, img_in, width, height, true)) {
         // fail by doing no NR
         memcpy(img_out, img_in, width * height * 3 * sizeof(float));
+        free(img_smooth);
         return;
     }
 
-    convolve_img(img_in, img_smooth, width, height, kernel, KERNEL_SIZE);
-
     float inv_intensity = 1 / (intensity * sqrt(3));
 
-    for (unsigned int y = 0; y < height; y++) {
-        for (unsigned int x = 0; x < width; x++) {
-            float luminance = img_in[image_idx(x, y, 0, width)] +
-                img_in[image_idx(x, y, 1, width)] +
-                img_in[image_idx(x, y, 2, width)];
-            float local_weight = luminance * inv_intensity;
-            local_weight = local_weight > 1 ? 1 : local_weight;
-            float smooth_weight = 1 - local_weight;
+    for (unsigned int ty = 0; ty < map.tiles_y; ty++) {
+        for (unsigned int tx = 0; tx < map.tiles_x; tx++) {
+            unsigned int x_start = tx * NR_TILE_SIZE;
+            unsigned int y_start = ty * NR_TILE_SIZE;
+            unsigned int x_end = x_start + NR_TILE_SIZE > width ? width : x_start + NR_TILE_SIZE;
+            unsigned int y_end = y_start + NR_TILE_SIZE > height ? height : y_start + NR_TILE_SIZE;
+            NRTileClass cls = nr_tile_class_blend(&map, tx, ty, inv_intensity);
+
+            if (cls == NR_TILE_SKIP) {
+                for (unsigned int y = y_start; y < y_end; y++) {
+                    unsigned int idx = image_idx(x_start, y, 0, width);
+                    memcpy(img_out + idx, img_in + idx, (x_end - x_start) * 3 * sizeof(float));
+                }
+                continue;
+            }
 
-            for (unsigned int chan = 0; chan < 3; chan++) {
-                unsigned int idx = image_idx(x, y, chan, width);
-                img_out[idx] = local_weight * img_in[idx] +
-                    smooth_weight * img_smooth[idx];
+            convolve_img_rect(img_in, img_smooth, width, height, kernel, KERNEL_SIZE,
+                    x_start, y_start, x_end, y_end);
+
+            if (cls == NR_TILE_FULL) {
+                nr_blend_tile_rgb(img_in, img_smooth, img_out, width, x_start, y_start, x_end,
+                        y_end, inv_intensity, false);
+            } else {
+                nr_blend_tile_rgb(img_in, img_smooth, img_out, width, x_start, y_start, x_end,
+                        y_end, inv_intensity, true);
             }
         }
     }
 
+    nr_tile_map_free(&map);
     free(img_smooth);
 }
 
@@ -72,6 +213,36 @@ void noise_reduction_rgb2(const float *img_in, float *img_out, unsigned int widt
     free(img_temp);
 }
 
+// blends original and smoothed pixels of one tile
+// weight clamping is only needed when the tile straddles a threshold
+static inline void nr_blend_tile_ycbcr(const float *img_in, const float *img_smooth, float *img_out,
+        unsigned int width, unsigned int x_start, unsigned int y_start, unsigned int x_end,
+        unsigned int y_end, float inv_intensity_lum, float inv_intensity_chrom, bool clamp)
+{
+    for (unsigned int y = y_start; y < y_end; y++) {
+        for (unsigned int x = x_start; x < x_end; x++) {
+            unsigned int idx = image_idx(x, y, 0, width);
+            float luminance = img_in[idx];
+
+            float local_weight_y = luminance * inv_intensity_lum;
+            float local_weight_cr = luminance * inv_intensity_chrom;
+            if (clamp) {
+                local_weight_y = local_weight_y > 1 ? 1 : local_weight_y;
+                local_weight_cr = local_weight_cr > 1 ? 1 : local_weight_cr;
+            }
+            float smooth_weight_y = 1 - local_weight_y;
+            float smooth_weight_cr = 1 - local_weight_cr;
+
+            img_out[idx] = local_weight_y * img_in[idx] +
+                smooth_weight_y * img_smooth[idx];
+            img_out[idx + 1] = local_weight_cr * img_in[idx + 1] +
+                smooth_weight_cr * img_smooth[idx + 1];
+            img_out[idx + 2] = local_weight_cr * img_in[idx + 2] +
+                smooth_weight_cr * img_smooth[idx + 2];
+        }
+    }
+}
+
 // similar to above, but faster since input and output image is YCbCr
 void noise_reduction_ycbcr(const float *img_in, float *img_out, unsigned int width, unsigned int height,
         float intensity_lum, float intensity_chrom)
@@ -79,79 +250,186 @@ void noise_reduction_ycbcr(const float *img_in, float *img_out, unsigned int wid
     float kernel[KERNEL_SIZE * KERNEL_SIZE];
     gaussian_kernel(kernel, KERNEL_SIZE, KERNEL_VARIANCE);
 
+    NRTileMap map;
     float *img_smooth = (float *)malloc(width * height * 3 * sizeof(float));
-    if (img_smooth == NULL) {
+    if (img_smooth == NULL || !nr_tile_map_init(&map, img_in, width, height, false)) {
         // fail by doing no NR
         memcpy(img_out, img_in, width * height * 3 * sizeof(float));
+        free(img_smooth);
         return;
     }
 
-    convolve_img(img_in, img_smooth, width, height, kernel, KERNEL_SIZE);
-
     float inv_intensity_lum = 1 / intensity_lum;
     float inv_intensity_chrom = 1 / intensity_chrom;
 
-    for (unsigned int y = 0; y < height; y++) {
-        for (unsigned int x = 0; x < width; x++) {
-            unsigned int idx = image_idx(x, y, 0, width);
-            float luminance = img_in[idx];
-
-            float local_weight_y = luminance * inv_intensity_lum;
-            local_weight_y = local_weight_y > 1 ? 1 : local_weight_y;
-            float smooth_weight_y = 1 - local_weight_y;
+    for (unsigned int ty = 0; ty < map.tiles_y; ty++) {
+        for (unsigned int tx = 0; tx < map.tiles_x; tx++) {
+            unsigned int x_start = tx * NR_TILE_SIZE;
+            unsigned int y_start = ty * NR_TILE_SIZE;
+            unsigned int x_end = x_start + NR_TILE_SIZE > width ? width : x_start + NR_TILE_SIZE;
+            unsigned int y_end = y_start + NR_TILE_SIZE > height ? height : y_start + NR_TILE_SIZE;
+            NRTileClass cls_lum = nr_tile_class_blend(&map, tx, ty, inv_intensity_lum);
+            NRTileClass cls_chrom = nr_tile_class_blend(&map, tx, ty, inv_intensity_chrom);
+
+            if (cls_lum == NR_TILE_SKIP && cls_chrom == NR_TILE_SKIP) {
+                for (unsigned int y = y_start; y < y_end; y++) {
+                    unsigned int idx = image_idx(x_start, y, 0, width);
+                    memcpy(img_out + idx, img_in + idx, (x_end - x_start) * 3 * sizeof(float));
+                }
+                continue;
+            }
 
-            float local_weight_cr = luminance * inv_intensity_chrom;
-            local_weight_cr = local_weight_cr > 1 ? 1 : local_weight_cr;
-            float smooth_weight_cr = 1 - local_weight_cr;
+            convolve_img_rect(img_in, img_smooth, width, height, kernel, KERNEL_SIZE,
+                    x_start, y_start, x_end, y_end);
 
-            img_out[idx] = local_weight_y * img_in[idx] +
-                smooth_weight_y * img_smooth[idx];
-            img_out[idx + 1] = local_weight_cr * img_in[idx + 1] +
-                smooth_weight_cr * img_smooth[idx + 1];
-            img_out[idx + 2] = local_weight_cr * img_in[idx + 2] +
-                smooth_weight_cr * img_smooth[idx + 2];
+            if (cls_lum == NR_TILE_FULL && cls_chrom == NR_TILE_FULL) {
+                nr_blend_tile_ycbcr(img_in, img_smooth, img_out, width, x_start, y_start, x_end, y_end,
+                        inv_intensity_lum, inv_intensity_chrom, false);
+            } else {
+                nr_blend_tile_ycbcr(img_in, img_smooth, img_out, width, x_start, y_start, x_end, y_end,
+                        inv_intensity_lum, inv_intensity_chrom, true);
+            }
         }
     }
 
+    nr_tile_map_free(&map);
     free(img_smooth);
 }
 
-// expects YCbCr or similar lum/chrom/chrom colour space
-// uses 3x3 window for luminance, 7x7 for chrominance
-static inline void nr_median_pixel(const float *img_in, float *img_out, unsigned int width,
-        unsigned int height, unsigned int x, unsigned int y, float thresh_lum, float thresh_chrom)
+typedef float (*NRMedianFn)(const float *img, unsigned int width, unsigned int height,
+        unsigned int x, unsigned int y, unsigned int chan);
+typedef float (*NRMedianEdgeFn)(const float *img, unsigned int width, unsigned int height,
+        unsigned int k, unsigned int x, unsigned int y, unsigned int chan);
+
+/* filters channels chan_start to chan_end - 1 of one tile
+ * expects YCbCr or similar lum/chrom/chrom colour space
+ * median works without bounds checking for k <= x < width - k, same for y, median_edge repeats
+ * edge pixels. Only called with constant medians from the per-size functions below, so once
+ * inlined into them the medians are called directly.
+ */
+static inline void nr_median_tile(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, unsigned int x_start, unsigned int y_start, unsigned int x_end,
+        unsigned int y_end, unsigned int chan_start, unsigned int chan_end,
+        NRTileClass cls, float thresh, NRMedianFn median, NRMedianEdgeFn median_edge,
+        unsigned int k)
 {
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_lum) {
-        img_out[image_idx(x, y, 0, width)] = img_in[image_idx(x, y, 0, width)];
+    bool inside = x_start >= k && y_start >= k && x_end + k <= width && y_end + k <= height;
+
+    if (cls == NR_TILE_SKIP) {
+        for (unsigned int y = y_start; y < y_end; y++) {
+            for (unsigned int x = x_start; x < x_end; x++) {
+                for (unsigned int chan = chan_start; chan < chan_end; chan++) {
+                    unsigned int idx = image_idx(x, y, chan, width);
+                    img_out[idx] = img_in[idx];
+                }
+            }
+        }
+    } else if (cls == NR_TILE_FULL && inside) {
+        for (unsigned int y = y_start; y < y_end; y++) {
+            for (unsigned int x = x_start; x < x_end; x++) {
+                for (unsigned int chan = chan_start; chan < chan_end; chan++) {
+                    img_out[image_idx(x, y, chan, width)] = median(img_in, width, height, x, y, chan);
+                }
+            }
+        }
     } else {
-        img_out[image_idx(x, y, 0, width)] = median_pixel_33(img_in, width, height, x, y, 0);
+        for (unsigned int y = y_start; y < y_end; y++) {
+            for (unsigned int x = x_start; x < x_end; x++) {
+                bool edge = x < k || y < k || x + k >= width || y + k >= height;
+                bool skip = img_in[image_idx(x, y, 0, width)] >= thresh;
+
+                for (unsigned int chan = chan_start; chan < chan_end; chan++) {
+                    unsigned int idx = image_idx(x, y, chan, width);
+                    if (skip)
+                        img_out[idx] = img_in[idx];
+                    else if (edge)
+                        img_out[idx] = median_edge(img_in, width, height, k, x, y, chan);
+                    else
+                        img_out[idx] = median(img_in, width, height, x, y, chan);
+                }
+            }
+        }
     }
+}
 
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_chrom) {
-        img_out[image_idx(x, y, 1, width)] = img_in[image_idx(x, y, 1, width)];
-        img_out[image_idx(x, y, 2, width)] = img_in[image_idx(x, y, 2, width)];
-    } else {
-        img_out[image_idx(x, y, 1, width)] = median_pixel_77(img_in, width, height, x, y, 1);
-        img_out[image_idx(x, y, 2, width)] = median_pixel_77(img_in, width, height, x, y, 2);
-    }
+// one tile for each median size, the luminance and chrominance filters are picked per tile
+typedef void (*NRMedianTileFn)(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, unsigned int x_start, unsigned int y_start, unsigned int x_end,
+        unsigned int y_end, unsigned int chan_start, unsigned int chan_end,
+        NRTileClass cls, float thresh);
+
+static void nr_median_tile_33(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, unsigned int x_start, unsigned int y_start, unsigned int x_end,
+        unsigned int y_end, unsigned int chan_start, unsigned int chan_end,
+        NRTileClass cls, float thresh)
+{
+    nr_median_tile(img_in, img_out, width, height, x_start, y_start, x_end, y_end,
+            chan_start, chan_end, cls, thresh, median_pixel_33, median_pixel_edge, 1);
 }
 
-static inline void nr_median_pixel_edge(const float *img_in, float *img_out, unsigned int width,
-        unsigned int height, unsigned int x, unsigned int y, float thresh_lum, float thresh_chrom)
+static void nr_median_tile_77(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, unsigned int x_start, unsigned int y_start, unsigned int x_end,
+        unsigned int y_end, unsigned int chan_start, unsigned int chan_end,
+        NRTileClass cls, float thresh)
 {
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_lum) {
-        img_out[image_idx(x, y, 0, width)] = img_in[image_idx(x, y, 0, width)];
-    } else {
-        img_out[image_idx(x, y, 0, width)] = median_pixel_edge(img_in, width, height, 1, x, y, 0);
+    nr_median_tile(img_in, img_out, width, height, x_start, y_start, x_end, y_end,
+            chan_start, chan_end, cls, thresh, median_pixel_77, median_pixel_edge, 3);
+}
+
+static void nr_median_tile_x_33(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, unsigned int x_start, unsigned int y_start, unsigned int x_end,
+        unsigned int y_end, unsigned int chan_start, unsigned int chan_end,
+        NRTileClass cls, float thresh)
+{
+    nr_median_tile(img_in, img_out, width, height, x_start, y_start, x_end, y_end,
+            chan_start, chan_end, cls, thresh, median_pixel_x_33, median_pixel_x_edge, 1);
+}
+
+static void nr_median_tile_x_77(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, unsigned int x_start, unsigned int y_start, unsigned int x_end,
+        unsigned int y_end, unsigned int chan_start, unsigned int chan_end,
+        NRTileClass cls, float thresh)
+{
+    nr_median_tile(img_in, img_out, width, height, x_start, y_start, x_end, y_end,
+            chan_start, chan_end, cls, thresh, median_pixel_x_77, median_pixel_x_edge, 3);
+}
+
+static void nr_median_tile_full_x_99(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, unsigned int x_start, unsigned int y_start, unsigned int x_end,
+        unsigned int y_end, unsigned int chan_start, unsigned int chan_end,
+        NRTileClass cls, float thresh)
+{
+    nr_median_tile(img_in, img_out, width, height, x_start, y_start, x_end, y_end,
+            chan_start, chan_end, cls, thresh, median_pixel_full_x_99, median_pixel_full_x_edge,
+            4);
+}
+
+static void nr_median_ycbcr_tiled(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, float thresh_lum, float thresh_chrom,
+        NRMedianTileFn tile_lum, NRMedianTileFn tile_chrom)
+{
+    NRTileMap map;
+    if (!nr_tile_map_init(&map, img_in, width, height, false)) {
+        // fail by doing no NR
+        memcpy(img_out, img_in, width * height * 3 * sizeof(float));
+        return;
     }
 
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_chrom) {
-        img_out[image_idx(x, y, 1, width)] = img_in[image_idx(x, y, 1, width)];
-        img_out[image_idx(x, y, 2, width)] = img_in[image_idx(x, y, 2, width)];
-    } else {
-        img_out[image_idx(x, y, 1, width)] = median_pixel_edge(img_in, width, height, 3, x, y, 1);
-        img_out[image_idx(x, y, 2, width)] = median_pixel_edge(img_in, width, height, 3, x, y, 2);
+    for (unsigned int ty = 0; ty < map.tiles_y; ty++) {
+        for (unsigned int tx = 0; tx < map.tiles_x; tx++) {
+            unsigned int x_start = tx * NR_TILE_SIZE;
+            unsigned int y_start = ty * NR_TILE_SIZE;
+            unsigned int x_end = x_start + NR_TILE_SIZE > width ? width : x_start + NR_TILE_SIZE;
+            unsigned int y_end = y_start + NR_TILE_SIZE > height ? height : y_start + NR_TILE_SIZE;
+
+            tile_lum(img_in, img_out, width, height, x_start, y_start, x_end, y_end, 0, 1,
+                    nr_tile_class(&map, tx, ty, thresh_lum), thresh_lum);
+            tile_chrom(img_in, img_out, width, height, x_start, y_start, x_end, y_end, 1, 3,
+                    nr_tile_class(&map, tx, ty, thresh_chrom), thresh_chrom);
+        }
     }
+
+    nr_tile_map_free(&map);
 }
 
 void noise_reduction_median_rgb(const float *img_in, float *img_out, unsigned int width,
@@ -173,83 +451,12 @@ void noise_reduction_median_rgb(const float *img_in, float *img_out, unsigned in
     free(img_temp);
 }
 
+// uses 3x3 window for luminance, 7x7 for chrominance
 void noise_reduction_median_ycbcr(const float *img_in, float *img_out, unsigned int width,
         unsigned int height, float thresh_lum, float thresh_chrom)
 {
-    const unsigned int k = 3; // 7x7 is the largest "kernel" (median box) we use
-
-    // top edge
-    for (unsigned int y = 0; y < k; y++) {
-        for (unsigned int x = 0; x < width; x++) {
-            nr_median_pixel_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
-    }
-
-    // left edge
-    for (unsigned int y = k; y < height - k; y++) {
-        for (unsigned int x = 0; x < k; x++) {
-            nr_median_pixel_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
-    }
-
-    // right edge
-    for (unsigned int y = k; y < height - k; y++) {
-        for (unsigned int x = width - k; x < width; x++) {
-            nr_median_pixel_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
-    }
-
-    // bottom edge
-    for (unsigned int y = height - k; y < height; y++) {
-        for (unsigned int x = 0; x < width; x++) {
-            nr_median_pixel_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
-    }
-
-    // inside
-    for (unsigned int y = k; y < height - k; y++) {
-        for (unsigned int x = k; x < width - k; x++) {
-            nr_median_pixel(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
-    }
-}
-
-// expects YCbCr or similar lum/chrom/chrom colour space
-// uses 3x3 window for luminance, 7x7 for chrominance
-static inline void nr_median_pixel_x(const float *img_in, float *img_out, unsigned int width,
-        unsigned int height, unsigned int x, unsigned int y, float thresh_lum, float thresh_chrom)
-{
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_lum) {
-        img_out[image_idx(x, y, 0, width)] = img_in[image_idx(x, y, 0, width)];
-    } else {
-        img_out[image_idx(x, y, 0, width)] = median_pixel_x_33(img_in, width, height, x, y, 0);
-    }
-
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_chrom) {
-        img_out[image_idx(x, y, 1, width)] = img_in[image_idx(x, y, 1, width)];
-        img_out[image_idx(x, y, 2, width)] = img_in[image_idx(x, y, 2, width)];
-    } else {
-        img_out[image_idx(x, y, 1, width)] = median_pixel_x_77(img_in, width, height, x, y, 1);
-        img_out[image_idx(x, y, 2, width)] = median_pixel_x_77(img_in, width, height, x, y, 2);
-    }
-}
-
-static inline void nr_median_pixel_x_edge(const float *img_in, float *img_out, unsigned int width,
-        unsigned int height, unsigned int x, unsigned int y, float thresh_lum, float thresh_chrom)
-{
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_lum) {
-        img_out[image_idx(x, y, 0, width)] = img_in[image_idx(x, y, 0, width)];
-    } else {
-        img_out[image_idx(x, y, 0, width)] = median_pixel_x_edge(img_in, width, height, 1, x, y, 0);
-    }
-
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_chrom) {
-        img_out[image_idx(x, y, 1, width)] = img_in[image_idx(x, y, 1, width)];
-        img_out[image_idx(x, y, 2, width)] = img_in[image_idx(x, y, 2, width)];
-    } else {
-        img_out[image_idx(x, y, 1, width)] = median_pixel_x_edge(img_in, width, height, 3, x, y, 1);
-        img_out[image_idx(x, y, 2, width)] = median_pixel_x_edge(img_in, width, height, 3, x, y, 2);
-    }
+    nr_median_ycbcr_tiled(img_in, img_out, width, height, thresh_lum, thresh_chrom,
+            nr_median_tile_33, nr_median_tile_77);
 }
 
 void noise_reduction_median_x_rgb(const float *img_in, float *img_out, unsigned int width,
@@ -271,86 +478,42 @@ void noise_reduction_median_x_rgb(const float *img_in, float *img_out, unsigned
     free(img_temp);
 }
 
+// uses 3x3 window for luminance, 7x7 for chrominance
 void noise_reduction_median_x_ycbcr(const float *img_in, float *img_out, unsigned int width,
         unsigned int height, float thresh_lum, float thresh_chrom)
 {
-    const unsigned int k = 3; // 7x7 is the largest "kernel" (median box) we use
-
-    // top edge
-    for (unsigned int y = 0; y < k; y++) {
-        for (unsigned int x = 0; x < width; x++) {
-            nr_median_pixel_x_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
-    }
-
-    // left edge
-    for (unsigned int y = k; y < height - k; y++) {
-        for (unsigned int x = 0; x < k; x++) {
-            nr_median_pixel_x_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
-    }
-
-    // right edge
-    for (unsigned int y = k; y < height - k; y++) {
-        for (unsigned int x = width - k; x < width; x++) {
-            nr_median_pixel_x_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
-    }
-
-    // bottom edge
-    for (unsigned int y = height - k; y < height; y++) {
-        for (unsigned int x = 0; x < width; x++) {
-            nr_median_pixel_x_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
-    }
-
-    // inside
-    for (unsigned int y = k; y < height - k; y++) {
-        for (unsigned int x = k; x < width - k; x++) {
-            nr_median_pixel_x(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
-    }
+    nr_median_ycbcr_tiled(img_in, img_out, width, height, thresh_lum, thresh_chrom,
+            nr_median_tile_x_33, nr_median_tile_x_77);
 }
 
-// expects YCbCr or similar lum/chrom/chrom colour space
-// uses 3x3 window for luminance, 9x9 for chrominance
-static inline void nr_median_pixel_full_x(const float *img_in, float *img_out, unsigned int width,
-        unsigned int height, unsigned int x, unsigned int y, float thresh_lum, float thresh_chrom)
+void noise_reduction_median_full_x_rgb(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, float thresh_lum, float thresh_chrom)
 {
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_lum) {
-        img_out[image_idx(x, y, 0, width)] = img_in[image_idx(x, y, 0, width)];
-    } else {
-        img_out[image_idx(x, y, 0, width)] = median_pixel_33(img_in, width, height, x, y, 0);
+    float *img_temp = (float *)malloc(width * height * 3 * sizeof(float));
+    if (img_temp == NULL) {
+        // fail by doing no NR
+        memcpy(img_out, img_in, width * height * 3 * sizeof(float));
+        return;
     }
 
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_chrom) {
-        img_out[image_idx(x, y, 1, width)] = img_in[image_idx(x, y, 1, width)];
-        img_out[image_idx(x, y, 2, width)] = img_in[image_idx(x, y, 2, width)];
-    } else {
-        img_out[image_idx(x, y, 1, width)] = median_pixel_full_x_99(img_in, width, height, x, y, 1);
-        img_out[image_idx(x, y, 2, width)] = median_pixel_full_x_99(img_in, width, height, x, y, 2);
-    }
+    // temporarily put YCbCr original in img_out
+    // img_temp will store YCbCr noise reduced image
+    colour_xfrm(img_in, img_out, width, height, &CMf_sRGB2YCbCr);
+    noise_reduction_median_full_x_ycbcr(img_out, img_temp, width, height, thresh_lum, thresh_chrom);
+    colour_xfrm(img_temp, img_out, width, height, &CMf_YCbCr2sRGB);
+
+    free(img_temp);
 }
 
-static inline void nr_median_pixel_full_x_edge(const float *img_in, float *img_out, unsigned int width,
-        unsigned int height, unsigned int x, unsigned int y, float thresh_lum, float thresh_chrom)
+// uses 3x3 window for luminance, 9x9 for chrominance
+void noise_reduction_median_full_x_ycbcr(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, float thresh_lum, float thresh_chrom)
 {
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_lum) {
-        img_out[image_idx(x, y, 0, width)] = img_in[image_idx(x, y, 0, width)];
-    } else {
-        img_out[image_idx(x, y, 0, width)] = median_pixel_edge(img_in, width, height, 1, x, y, 0);
-    }
-
-    if (img_in[image_idx(x, y, 0, width)] >= thresh_chrom) {
-        img_out[image_idx(x, y, 1, width)] = img_in[image_idx(x, y, 1, width)];
-        img_out[image_idx(x, y, 2, width)] = img_in[image_idx(x, y, 2, width)];
-    } else {
-        img_out[image_idx(x, y, 1, width)] = median_pixel_full_x_edge(img_in, width, height, 4, x, y, 1);
-        img_out[image_idx(x, y, 2, width)] = median_pixel_full_x_edge(img_in, width, height, 4, x, y, 2);
-    }
+    nr_median_ycbcr_tiled(img_in, img_out, width, height, thresh_lum, thresh_chrom,
+            nr_median_tile_33, nr_median_tile_full_x_99);
 }
 
-void noise_reduction_median_full_x_rgb(const float *img_in, float *img_out, unsigned int width,
+void noise_reduction_wavelet_rgb(const float *img_in, float *img_out, unsigned int width,
         unsigned int height, float thresh_lum, float thresh_chrom)
 {
     float *img_temp = (float *)malloc(width * height * 3 * sizeof(float));
@@ -363,49 +526,171 @@ void noise_reduction_median_full_x_rgb(const float *img_in, float *img_out, unsi
     // temporarily put YCbCr original in img_out
     // img_temp will store YCbCr noise reduced image
     colour_xfrm(img_in, img_out, width, height, &CMf_sRGB2YCbCr);
-    noise_reduction_median_full_x_ycbcr(img_out, img_temp, width, height, thresh_lum, thresh_chrom);
+    noise_reduction_wavelet_ycbcr(img_out, img_temp, width, height, thresh_lum, thresh_chrom);
     colour_xfrm(img_temp, img_out, width, height, &CMf_YCbCr2sRGB);
 
     free(img_temp);
 }
 
-void noise_reduction_median_full_x_ycbcr(const float *img_in, float *img_out, unsigned int width,
-        unsigned int height, float thresh_lum, float thresh_chrom)
+// shrinks x towards zero by t, zeroing it if |x| <= t
+static inline float soft_threshold(float x, float t)
 {
-    const unsigned int k = 4; // 9x9 is the largest "kernel" (median box) we use
+    float clipped = x > t ? t : x;
+    clipped = clipped < -t ? -t : clipped;
+    return x - clipped;
+}
 
-    // top edge
-    for (unsigned int y = 0; y < k; y++) {
-        for (unsigned int x = 0; x < width; x++) {
-            nr_median_pixel_full_x_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
+/* Each scale s splits the current approximation c_s into a smoother approximation
+ * c_(s+1) = B3 * c_s (taps spaced 2^s apart) and detail coefficients w_s = c_s - c_(s+1).
+ * The image is reconstructed as the sum of soft thresholded details plus the final
+ * approximation. Thresholds fall off linearly with luminance, reaching zero at the
+ * NR threshold, so that bright pixels are left untouched as in the other NR modes.
+ */
+void noise_reduction_wavelet_ycbcr(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, float thresh_lum, float thresh_chrom)
+{
+    size_t img_len = (size_t)width * height * 3;
+    float *img_a = (float *)malloc(img_len * sizeof(float));
+    float *img_b = (float *)malloc(img_len * sizeof(float));
+    float *img_temp = (float *)malloc(img_len * sizeof(float));
+    if (img_a == NULL || img_b == NULL || img_temp == NULL) {
+        // fail by doing no NR
+        memcpy(img_out, img_in, img_len * sizeof(float));
+        goto cleanup;
     }
 
-    // left edge
-    for (unsigned int y = k; y < height - k; y++) {
-        for (unsigned int x = 0; x < k; x++) {
-            nr_median_pixel_full_x_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
+    float inv_thresh_lum = 1 / thresh_lum;
+    float inv_thresh_chrom = 1 / thresh_chrom;
+    const float *img_coarse = img_in;
+    float *img_smooth = img_a;
+
+    for (unsigned int s = 0; s < WAVELET_SCALES; s++) {
+        convolve_atrous_b3(img_coarse, img_smooth, img_temp, width, height, 1 << s);
+
+        float t_lum = thresh_lum * wavelet_thresh_lum[s];
+        float t_chrom = thresh_chrom * wavelet_thresh_chrom[s];
+
+        for (size_t idx = 0; idx < img_len; idx += 3) {
+            float luminance = img_in[idx];
+
+            float weight_y = 1 - luminance * inv_thresh_lum;
+            weight_y = weight_y < 0 ? 0 : weight_y;
+            float weight_cr = 1 - luminance * inv_thresh_chrom;
+            weight_cr = weight_cr < 0 ? 0 : weight_cr;
+
+            float d_y = soft_threshold(img_coarse[idx] - img_smooth[idx], t_lum * weight_y);
+            float d_cb = soft_threshold(img_coarse[idx + 1] - img_smooth[idx + 1], t_chrom * weight_cr);
+            float d_cr = soft_threshold(img_coarse[idx + 2] - img_smooth[idx + 2], t_chrom * weight_cr);
+
+            if (s == 0) {
+                img_out[idx] = d_y;
+                img_out[idx + 1] = d_cb;
+                img_out[idx + 2] = d_cr;
+            } else {
+                img_out[idx] += d_y;
+                img_out[idx + 1] += d_cb;
+                img_out[idx + 2] += d_cr;
+            }
         }
+
+        // smoothed image becomes input to next scale
+        img_coarse = img_smooth;
+        img_smooth = (img_smooth == img_a) ? img_b : img_a;
     }
 
-    // right edge
-    for (unsigned int y = k; y < height - k; y++) {
-        for (unsigned int x = width - k; x < width; x++) {
-            nr_median_pixel_full_x_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
+    // add back the residual low frequency approximation
+    for (size_t i = 0; i < img_len; i++)
+        img_out[i] += img_coarse[i];
+
+cleanup:
+    free(img_a);
+    free(img_b);
+    free(img_temp);
+}
+
+/* Sensor output x in DN is modelled as Poisson photoelectrons scaled by conversion
+ * gain g, plus Gaussian read noise of variance s^2. The generalized Anscombe transform
+ *     f(x) = 2/g * sqrt(g*x + 3/8*g^2 + s^2)
+ * makes the noise approximately unit variance regardless of signal level, so a single
+ * edge threshold works in both shadows and highlights. After filtering, the
+ * asymptotically unbiased inverse x = ((g*f/2)^2 - 1/8*g^2 - s^2) / g maps back to DN.
+ */
+static inline float bayer_nr_weight(float d, float inv_h2)
+{
+    float w = 1 - d*d*inv_h2;
+    return w < 0 ? 0 : w;
+}
+
+// filter one pixel using the 8 nearest pixels of the same CFA colour
+// rows and columns of neighbours are passed in explicitly so that edges can be mirrored
+static inline float bayer_nr_pixel(const float *vst, unsigned int width, unsigned int x,
+        unsigned int xl, unsigned int xr, unsigned int yu, unsigned int y, unsigned int yd,
+        float inv_h2)
+{
+    const float *ru = vst + yu*width;
+    const float *rc = vst + y*width;
+    const float *rd = vst + yd*width;
+    float c = rc[x];
+    float neighbours[8] = {ru[xl], ru[x], ru[xr], rc[xl], rc[xr], rd[xl], rd[x], rd[xr]};
+    float sum = c;
+    float wsum = 1;
+
+    for (unsigned int i = 0; i < 8; i++) {
+        float w = bayer_nr_weight(neighbours[i] - c, inv_h2);
+        sum += w * neighbours[i];
+        wsum += w;
     }
 
-    // bottom edge
-    for (unsigned int y = height - k; y < height; y++) {
+    return sum / wsum;
+}
+
+void noise_reduction_bayer(uint16_t *bayer, unsigned int width, unsigned int height,
+        uint16_t white, float gain_dB, float strength)
+{
+    if (width < 4 || height < 4)
+        return;
+
+    // fail by doing no NR
+    float *vst = (float *)malloc(width * height * sizeof(float));
+    float *fwd = (float *)malloc((white + 1) * sizeof(float));
+    if (vst == NULL || fwd == NULL)
+        goto cleanup;
+
+    double lin_gain = pow(10, gain_dB / 20);
+    double g = BAYER_NR_CONV_GAIN * lin_gain * (white + 1) / 4096;
+    double read_noise = BAYER_NR_READ_NOISE * lin_gain * (white + 1) / 4096;
+    double adc_noise = BAYER_NR_ADC_NOISE * (white + 1) / 4096;
+    double s2 = read_noise*read_noise + adc_noise*adc_noise;
+    double offset = 0.375*g*g + s2;
+    double offset_inv = 0.125*g*g + s2;
+
+    for (unsigned int i = 0; i <= white; i++)
+        fwd[i] = 2 / g * sqrt(g*i + offset);
+    for (size_t i = 0; i < (size_t)width * height; i++)
+        vst[i] = fwd[bayer[i] > white ? white : bayer[i]];
+
+    float inv_h2 = 1 / (strength * strength);
+    float half_g = g / 2;
+    float inv_g = 1 / g;
+
+    for (unsigned int y = 0; y < height; y++) {
+        // mirror to the nearest row of the same colour at the edges
+        unsigned int yu = y < 2 ? y + 2 : y - 2;
+        unsigned int yd = y + 2 >= height ? y - 2 : y + 2;
+
         for (unsigned int x = 0; x < width; x++) {
-            nr_median_pixel_full_x_edge(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
+            unsigned int xl = x < 2 ? x + 2 : x - 2;
+            unsigned int xr = x + 2 >= width ? x - 2 : x + 2;
+
+            float f = bayer_nr_pixel(vst, width, x, xl, xr, yu, y, yd, inv_h2) * half_g;
+            float v = (f*f - offset_inv) * inv_g + 0.5f;
+            v = v < 0 ? 0 : v;
+            v = v > white ? white : v;
+            bayer[y*width + x] = (uint16_t)v;
         }
     }
 
-    // inside
-    for (unsigned int y = k; y < height - k; y++) {
-        for (unsigned int x = k; x < width - k; x++) {
-            nr_median_pixel_full_x(img_in, img_out, width, height, x, y, thresh_lum, thresh_chrom);
-        }
-    }
+cleanup:
+    free(vst);
+    free(fwd);
 }
@@ -5,6 +5,8 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 // convolves image using 7x7 gaussian kernel
 // outputs weighted average of original image and convolved image, weighted based on luminance
 // luminance is (R+G+B) / sqrt(3)
@@ -42,6 +44,22 @@ void noise_reduction_median_full_x_rgb(const float *img_in, float *img_out, unsi
 void noise_reduction_median_full_x_ycbcr(const float *img_in, float *img_out, unsigned int width,
         unsigned int height, float thresh_lum, float thresh_chrom);
 
+// a trous wavelet decomposition with B3-spline at dilations 1, 2, 4, 8
+// detail coefficients at each scale are soft thresholded, with thresholds
+// proportional to thresh_lum and thresh_chrom and no NR above those luminances
+void noise_reduction_wavelet_rgb(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, float thresh_lum, float thresh_chrom);
+
+void noise_reduction_wavelet_ycbcr(const float *img_in, float *img_out, unsigned int width,
+        unsigned int height, float thresh_lum, float thresh_chrom);
+
+// raw domain NR on an unpacked RGGB bayer mosaic, done in place before debayering
+// each CFA channel is filtered separately after a variance stabilizing transform
+// based on a sensor noise model at the given analog gain
+// strength is the edge preservation threshold in noise standard deviations
+void noise_reduction_bayer(uint16_t *bayer, unsigned int width, unsigned int height,
+        uint16_t white, float gain_dB, float strength);
+
 #ifdef __cplusplus
 }
 #endif
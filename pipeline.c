@@ -1,45 +1,224 @@
 #include <errno.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "pipeline.h"
 #include "cmraw.h"
 #include "debayer.h"
 #include "noise_reduction.h"
 #include "gamma.h"
+#include "tone_map.h"
 #include "auto_exposure.h"
 #include "cie_xyz.h"
 #include "cm_calibrations.h"
 
-static void pipeline_gen_lut(uint8_t *glut, CMLUTMode lut_mode, double gamma,
-        double shadow, double black)
+// Index size of the 8 bit output gamma LUTs. Finer than the 12 bit camera data since the tone
+// curves can boost shadows enough that 12 bit steps would show as banding.
+#define PIPELINE_LUT_BITS 14
+
+static void pipeline_gen_lut(uint8_t *glut, uint8_t bit_depth, CMLUTMode lut_mode,
+        double gamma, double shadow, double black)
 {
     switch (lut_mode) {
     case CMLUT_LINEAR:
     default:
-        gamma_gen_lut(glut, 12);
+        gamma_gen_lut(glut, bit_depth);
         break;
     case CMLUT_FILMIC:
-        gamma_gen_lut_filmic(glut, 12, gamma, black);
+        gamma_gen_lut_filmic(glut, bit_depth, gamma, black);
+        break;
+    case CMLUT_CUBIC:
+        gamma_gen_lut_cubic(glut, bit_depth, gamma, black);
+        break;
+    case CMLUT_HDR:
+        gamma_gen_lut_hdr(glut, bit_depth, gamma, shadow);
+        break;
+    case CMLUT_HDR_CUBIC:
+        gamma_gen_lut_hdr_cubic(glut, bit_depth, gamma, shadow, black);
         break;
+    }
+}
+
+static void pipeline_gen_lut16(uint16_t *glut, uint8_t bit_depth, CMLUTMode lut_mode,
+        double gamma, double shadow, double black)
+{
+    switch (lut_mode) {
+    case CMLUT_LINEAR:
+    default:
+        gamma_gen_lut16(glut, bit_depth);
+        break;
+    case CMLUT_FILMIC:
+        gamma_gen_lut16_filmic(glut, bit_depth, gamma, black);
+        break;
+    case CMLUT_CUBIC:
+        gamma_gen_lut16_cubic(glut, bit_depth, gamma, black);
+        break;
+    case CMLUT_HDR:
+        gamma_gen_lut16_hdr(glut, bit_depth, gamma, shadow);
+        break;
+    case CMLUT_HDR_CUBIC:
+        gamma_gen_lut16_hdr_cubic(glut, bit_depth, gamma, shadow, black);
+        break;
+    }
+}
+
+// Small LRU cache of generated LUTs, shared by all pipeline calls.
+// LUT generation evaluates pow() per entry, which is wasted work when the same curve is used for
+// every frame of a preview stream.
+#define LUT_CACHE_SIZE 8
+
+typedef struct {
+    void *lut;          // NULL for an empty entry
+    uint32_t last_used;
+    CMLUTMode lut_mode;
+    uint8_t bit_depth;
+    bool lut16;
+    double gamma;
+    double shadow;
+    double black;
+} LUTCacheEntry;
+
+static LUTCacheEntry lut_cache[LUT_CACHE_SIZE];
+static uint32_t lut_cache_clock = 0;
+static double lut_quant_step = 0.01;
+static pthread_mutex_t lut_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void pipeline_set_lut_quantization(double step)
+{
+    pthread_mutex_lock(&lut_cache_mutex);
+    lut_quant_step = step > 0 ? step : 0;
+    pthread_mutex_unlock(&lut_cache_mutex);
+}
+
+// round a positive parameter to the nearest power of (1 + step)
+static double lut_quantize(double x, double step)
+{
+    if (step <= 0 || x <= 0)
+        return x;
+    double log_step = log1p(step);
+    return exp(round(log(x) / log_step) * log_step);
+}
+
+static bool lut_cache_match(const LUTCacheEntry *entry, bool lut16, uint8_t bit_depth,
+        CMLUTMode lut_mode, double gamma, double shadow, double black)
+{
+    return entry->lut != NULL && entry->lut16 == lut16 && entry->bit_depth == bit_depth
+        && entry->lut_mode == lut_mode && entry->gamma == gamma && entry->shadow == shadow
+        && entry->black == black;
+}
+
+// must be called with lut_cache_mutex held
+static LUTCacheEntry *lut_cache_find(bool lut16, uint8_t bit_depth, CMLUTMode lut_mode,
+        double gamma, double shadow, double black)
+{
+    for (int i = 0; i < LUT_CACHE_SIZE; i++) {
+        LUTCacheEntry *entry = &lut_cache[i];
+        if (lut_cache_match(entry, lut16, bit_depth, lut_mode, gamma, shadow, black)) {
+            entry->last_used = ++lut_cache_clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// fill glut with the requested LUT, generating it only if it is not already cached
+// glut must hold 1 << bit_depth entries of uint8_t, or uint16_t if lut16 is set
+static void pipeline_get_lut(void *glut, bool lut16, uint8_t bit_depth, CMLUTMode lut_mode,
+        double gamma, double shadow, double black)
+{
+    size_t lut_size = ((size_t)1 << bit_depth) * (lut16 ? sizeof(uint16_t) : sizeof(uint8_t));
+
+    // zero out parameters the curve doesn't use so they can't cause cache misses
+    switch (lut_mode) {
+    case CMLUT_FILMIC:
     case CMLUT_CUBIC:
-        gamma_gen_lut_cubic(glut, 12, gamma, black);
+        shadow = 0;
         break;
     case CMLUT_HDR:
-        gamma_gen_lut_hdr(glut, 12, gamma, shadow);
+        black = 0;
         break;
     case CMLUT_HDR_CUBIC:
-        gamma_gen_lut_hdr_cubic(glut, 12, gamma, shadow, black);
+        break;
+    case CMLUT_LINEAR:
+    default:
+        lut_mode = CMLUT_LINEAR;
+        gamma = shadow = black = 0;
         break;
     }
+
+    pthread_mutex_lock(&lut_cache_mutex);
+    LUTCacheEntry *entry = lut_cache_find(lut16, bit_depth, lut_mode, gamma, shadow, black);
+    if (entry != NULL) {
+        memcpy(glut, entry->lut, lut_size);
+        pthread_mutex_unlock(&lut_cache_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&lut_cache_mutex);
+
+    // cache miss, generate outside the lock so other threads aren't held up
+    if (lut16)
+        pipeline_gen_lut16((uint16_t *)glut, bit_depth, lut_mode, gamma, shadow, black);
+    else
+        pipeline_gen_lut((uint8_t *)glut, bit_depth, lut_mode, gamma, shadow, black);
+
+    pthread_mutex_lock(&lut_cache_mutex);
+    // another thread may have inserted the same LUT in the meantime
+    if (lut_cache_find(lut16, bit_depth, lut_mode, gamma, shadow, black) == NULL) {
+        LUTCacheEntry *victim = &lut_cache[0];
+        for (int i = 0; i < LUT_CACHE_SIZE; i++) {
+            if (lut_cache[i].lut == NULL) {
+                victim = &lut_cache[i];
+                break;
+            }
+            if (lut_cache[i].last_used < victim->last_used)
+                victim = &lut_cache[i];
+        }
+
+        // failing to cache is harmless, the LUT is just generated again next time
+        free(victim->lut);
+        victim->lut = malloc(lut_size);
+        if (victim->lut != NULL) {
+            memcpy(victim->lut, glut, lut_size);
+            victim->last_used = ++lut_cache_clock;
+            victim->lut_mode = lut_mode;
+            victim->bit_depth = bit_depth;
+            victim->lut16 = lut16;
+            victim->gamma = gamma;
+            victim->shadow = shadow;
+            victim->black = black;
+        }
+    }
+    pthread_mutex_unlock(&lut_cache_mutex);
 }
 
-static void pipeline_auto_hdr(uint16_t *rgb12, uint16_t width, uint16_t height,
+// Unpack raw Bayer data to one uint16_t per pixel
+// returns the white level of the unpacked data, or a negative error code
+static int pipeline_unpack(const void *raw, uint16_t *bayer, const CMCaptureInfo *cinfo)
+{
+    size_t num_pixels = (size_t)cinfo->width * cinfo->height;
+    switch (cinfo->pixel_fmt) {
+    case CM_PIXEL_FMT_BAYER_RG12P:
+        unpack12_16(bayer, raw, num_pixels, false);
+        break;
+    case CM_PIXEL_FMT_BAYER_RG12:
+    case CM_PIXEL_FMT_BAYER_RG16:
+        memcpy(bayer, raw, num_pixels * sizeof(uint16_t));
+        break;
+    default:
+        return -EINVAL;
+    }
+    return cmraw_white_level(cinfo);
+}
+
+static void pipeline_auto_hdr(uint16_t *rgb12, uint16_t width, uint16_t height, int white,
         CMLUTMode *lut_mode, double *gamma, double *shadow, double *black)
 {
-    const double targ10 = 100;
-    const double targ90 = 1200;
+    // targets are for 12 bit data
+    const double targ10 = 100 * (white + 1) / 4096.0;
+    const double targ90 = 1200 * (white + 1) / 4096.0;
 
     if (*lut_mode == CMLUT_HDR_AUTO) {
         double boost = auto_hdr_shadow(rgb12, width, height, targ10, targ90);
@@ -72,7 +251,17 @@ static void pipeline_auto_hdr(uint16_t *rgb12, uint16_t width, uint16_t height,
         }
 
         *lut_mode = CMLUT_HDR_CUBIC;
+    } else {
+        return;
     }
+
+    // small frame to frame changes in the auto parameters would otherwise defeat the LUT cache
+    pthread_mutex_lock(&lut_cache_mutex);
+    double step = lut_quant_step;
+    pthread_mutex_unlock(&lut_cache_mutex);
+    *gamma = lut_quantize(*gamma, step);
+    *shadow = lut_quantize(*shadow, step);
+    *black = lut_quantize(*black, step);
 }
 
 static void gen_colour_matrix(const CMCaptureInfo *cinfo, const ImagePipelineParams *params,
@@ -97,8 +286,214 @@ static void gen_colour_matrix(const CMCaptureInfo *cinfo, const ImagePipelinePar
     colour_matrix_white_scale(cam_to_target, params->exposure);
 }
 
-int pipeline_process_image(const void *raw, uint8_t *rgb8, const CMCaptureInfo *cinfo,
-        const ImagePipelineParams *params)
+// The stages after debayering (pre-clip, black point, colour matrix, tone curve and creative
+// LUT) are a pure function of camera RGB once their parameters are fixed, so for previews they
+// can be baked into one 3D LUT. The grid is spaced by the square root of the camera value to
+// put more nodes in the shadows where the tone curve bends the most.
+typedef struct {
+    unsigned int size;
+    ColourMatrix cmat;
+    uint16_t min_green;     // sets the auto black point
+    CMLUTMode lut_mode;
+    double gamma;
+    double shadow;
+    double black;
+    const CMLut3D *lut3d;   // only used while building, LUTs are matched by id
+    uint32_t lut3d_id;
+} BakedLUTKey;
+
+typedef struct {
+    BakedLUTKey key;
+    unsigned int refs;      // the cache holds one reference while this is the current LUT
+    float shaper[4096];     // grid position of each 12 bit camera value
+    CMLut3D lut;
+} BakedLUT;
+
+static BakedLUT *baked_lut = NULL;
+static pthread_mutex_t baked_lut_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool baked_lut_match(const BakedLUTKey *a, const BakedLUTKey *b)
+{
+    return a->size == b->size && memcmp(&a->cmat, &b->cmat, sizeof(a->cmat)) == 0
+        && a->min_green == b->min_green && a->lut_mode == b->lut_mode && a->gamma == b->gamma
+        && a->shadow == b->shadow && a->black == b->black && a->lut3d_id == b->lut3d_id;
+}
+
+static void baked_lut_release(BakedLUT *bl)
+{
+    pthread_mutex_lock(&baked_lut_mutex);
+    bool last = --bl->refs == 0;
+    pthread_mutex_unlock(&baked_lut_mutex);
+    if (last) {
+        free(bl->lut.table);
+        free(bl);
+    }
+}
+
+// run the per pixel stages over the grid nodes, returns NULL on allocation failure
+static BakedLUT *baked_lut_build(const BakedLUTKey *key)
+{
+    const unsigned int n = key->size;
+    const unsigned int count = n * n * n;
+    BakedLUT *bl = (BakedLUT *)malloc(sizeof(BakedLUT));
+    uint16_t *nodes = (uint16_t *)malloc(count * 3 * sizeof(uint16_t));
+    float *nodes_f0 = (float *)malloc(count * 3 * sizeof(float));
+    float *nodes_f1 = (float *)malloc(count * 3 * sizeof(float));
+    uint16_t *glut16 = (uint16_t *)malloc((1 << PIPELINE_LUT_BITS) * sizeof(uint16_t));
+    uint16_t *out16 = (uint16_t *)malloc(count * 3 * sizeof(uint16_t));
+    float *table = (float *)malloc(count * 4 * sizeof(float));
+
+    if (bl == NULL || nodes == NULL || nodes_f0 == NULL || nodes_f1 == NULL || glut16 == NULL
+            || out16 == NULL || table == NULL) {
+        free(bl);
+        free(table);
+        bl = NULL;
+        goto cleanup;
+    }
+
+    bl->key = *key;
+    bl->refs = 1;
+    bl->lut.size = n;
+    bl->lut.table = table;
+    for (int c = 0; c < 3; c++) {
+        bl->lut.domain_min[c] = 0;
+        bl->lut.domain_max[c] = 1;
+    }
+
+    // node values, and the shaper mapping camera values back to (fractional) nodes
+    uint16_t node_val[LUT3D_MAX_SIZE];
+    for (unsigned int i = 0; i < n; i++) {
+        double x = (double)i / (n - 1);
+        node_val[i] = round(4095 * x * x);
+    }
+    for (unsigned int i = 0; i < n - 1; i++) {
+        // the first few nodes can round to the same value for very large LUTs
+        if (node_val[i + 1] == node_val[i])
+            continue;
+        for (unsigned int v = node_val[i]; v <= node_val[i + 1]; v++)
+            bl->shaper[v] = i + (float)(v - node_val[i]) / (node_val[i + 1] - node_val[i]);
+    }
+
+    uint16_t *px = nodes;
+    for (unsigned int b = 0; b < n; b++) {
+        for (unsigned int g = 0; g < n; g++) {
+            for (unsigned int r = 0; r < n; r++) {
+                *px++ = node_val[r];
+                *px++ = node_val[g];
+                *px++ = node_val[b];
+            }
+        }
+    }
+
+    // treat the nodes as an n*n by n image and process it exactly like pipeline_process_image_bin22
+    // but with 16 bit output so interpolating between nodes doesn't add 8 bit banding
+    ColourMatrix_f cmat_f;
+    cmat_d2f(&key->cmat, &cmat_f);
+    uint16_t width = n * n;
+    uint16_t height = n;
+    colour_pre_clip(nodes, width, height, 4095, &key->cmat);
+    colour_i2f(nodes, nodes_f0, width, height, 4095);
+    float black_point = key->min_green * (float)(1.0 / 4095);
+    if (black_point > 0.02f) black_point = 0.02f;
+    colour_black_point(nodes_f0, nodes_f1, width, height, &key->cmat, black_point);
+    colour_xfrm(nodes_f1, nodes_f0, width, height, &cmat_f);
+    pipeline_get_lut(glut16, true, PIPELINE_LUT_BITS, key->lut_mode, key->gamma, key->shadow,
+            key->black);
+    gamma_encode16_f(nodes_f0, out16, width, height, glut16, PIPELINE_LUT_BITS);
+    if (key->lut3d != NULL)
+        lut3d_apply16(key->lut3d, out16, width, height);
+
+    for (unsigned int i = 0; i < count; i++) {
+        for (int c = 0; c < 3; c++)
+            table[4*i + c] = out16[3*i + c] * (1.0f / 65535);
+        table[4*i + 3] = 0;
+    }
+
+cleanup:
+    free(nodes);
+    free(nodes_f0);
+    free(nodes_f1);
+    free(glut16);
+    free(out16);
+
+    return bl;
+}
+
+// returns a reference to a baked LUT for key, which must be released with baked_lut_release
+// only the most recent LUT is kept since parameters change one at a time while previewing
+static BakedLUT *baked_lut_get(const BakedLUTKey *key)
+{
+    pthread_mutex_lock(&baked_lut_mutex);
+    if (baked_lut != NULL && baked_lut_match(&baked_lut->key, key)) {
+        baked_lut->refs++;
+        pthread_mutex_unlock(&baked_lut_mutex);
+        return baked_lut;
+    }
+    pthread_mutex_unlock(&baked_lut_mutex);
+
+    BakedLUT *bl = baked_lut_build(key);
+    if (bl == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&baked_lut_mutex);
+    BakedLUT *old = baked_lut;
+    baked_lut = bl;
+    bl->refs++;
+    pthread_mutex_unlock(&baked_lut_mutex);
+    if (old != NULL)
+        baked_lut_release(old);
+
+    return bl;
+}
+
+void pipeline_free_buffers(ImagePipelineBuffers *buffers)
+{
+    free(buffers->bayer12);
+    free(buffers->rgb12);
+    free(buffers->rgbf_0);
+    free(buffers->rgbf_1);
+    free(buffers->glut);
+    free(buffers->glut16);
+    memset(buffers, 0, sizeof(ImagePipelineBuffers));
+}
+
+// grows the working images to at least pixels, and allocates the LUTs the outputs need
+static int pipeline_reserve_buffers(ImagePipelineBuffers *buffers, size_t pixels, bool rgb8,
+        bool rgb16)
+{
+    if (pixels > buffers->pixels) {
+        free(buffers->bayer12);
+        free(buffers->rgb12);
+        free(buffers->rgbf_0);
+        free(buffers->rgbf_1);
+        buffers->bayer12 = (uint16_t *)malloc(pixels * sizeof(uint16_t));
+        buffers->rgb12 = (uint16_t *)malloc(pixels * 3 * sizeof(uint16_t));
+        buffers->rgbf_0 = (float *)malloc(pixels * 3 * sizeof(float));
+        buffers->rgbf_1 = (float *)malloc(pixels * 3 * sizeof(float));
+        buffers->pixels = pixels;
+        if (buffers->bayer12 == NULL || buffers->rgb12 == NULL || buffers->rgbf_0 == NULL
+                || buffers->rgbf_1 == NULL) {
+            pipeline_free_buffers(buffers);
+            return -ENOMEM;
+        }
+    }
+
+    // sized for the largest, 16 bit, index so they never need to grow
+    if (rgb8 && buffers->glut == NULL)
+        buffers->glut = (uint8_t *)malloc(1U << 16);
+    if (rgb16 && buffers->glut16 == NULL)
+        buffers->glut16 = (uint16_t *)malloc((1U << 16) * sizeof(uint16_t));
+    if ((rgb8 && buffers->glut == NULL) || (rgb16 && buffers->glut16 == NULL))
+        return -ENOMEM;
+    return 0;
+}
+
+/* rgb8 and rgb16 are both optional, whichever are non-NULL are produced in a single pass.
+ * Without buffers to reuse, the working images are allocated for this call only.
+ */
+static int pipeline_process(const void *raw, uint8_t *rgb8, uint16_t *rgb16,
+        const CMCaptureInfo *cinfo, const ImagePipelineParams *params,
+        ImagePipelineBuffers *buffers)
 {
     int status = 0;
     uint16_t width = cinfo->width;
@@ -106,26 +501,42 @@ int pipeline_process_image(const void *raw, uint8_t *rgb8, const CMCaptureInfo *
     if (width > CM_MAX_WIDTH || (width & 1) || height > CM_MAX_HEIGHT || (height & 1))
         return -EINVAL;
 
-    uint16_t *bayer12 = (uint16_t *)malloc(width * height * sizeof(uint16_t));
-    uint16_t *rgb12 = (uint16_t *)malloc(width * height * 3 * sizeof(uint16_t));
-    float *rgbf_0 = (float *)malloc(width * height * 3 * sizeof(float));
-    float *rgbf_1 = (float *)malloc(width * height * 3 * sizeof(float));
-    uint8_t *glut = (uint8_t *)malloc(4096);
-
-    if (bayer12 == NULL || rgb12 == NULL || rgbf_0 == NULL || rgbf_1 == NULL || glut == NULL) {
-        status = -ENOMEM;
+    ImagePipelineBuffers one_off = {0};
+    const bool reuse = buffers != NULL;
+    if (!reuse)
+        buffers = &one_off;
+    status = pipeline_reserve_buffers(buffers, (size_t)width * height, rgb8 != NULL,
+            rgb16 != NULL);
+    if (status)
         goto cleanup;
-    }
 
-    // Step 1: Unpack and debayer the image
-    if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P)
-        unpack12_16(bayer12, raw, width * height, false);
-    else if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12)
-        memcpy(bayer12, raw, width * height * sizeof(uint16_t));
-    else {
-        status = -EINVAL;
+    uint16_t *bayer12 = buffers->bayer12;
+    uint16_t *rgb12 = buffers->rgb12;
+    float *rgbf_0 = buffers->rgbf_0;
+    float *rgbf_1 = buffers->rgbf_1;
+
+    // 16 bit output needs the full precision of the float image, so both LUTs are indexed by
+    // 16 bit values in that case instead of 14 bit
+    uint8_t lut_bits = rgb16 ? 16 : PIPELINE_LUT_BITS;
+    uint8_t *glut = buffers->glut;
+    uint16_t *glut16 = buffers->glut16;
+
+    // Step 1: Unpack, raw noise reduction and debayer the image
+    int white = pipeline_unpack(raw, bayer12, cinfo);
+    if (white < 0) {
+        status = white;
         goto cleanup;
     }
+    switch (params->raw_nr_mode) {
+    case CMRAWNR_NONE:
+        break;
+    case CMRAWNR_NORMAL:
+        noise_reduction_bayer(bayer12, width, height, white, cinfo->gain_dB, 2.0);
+        break;
+    case CMRAWNR_STRONG:
+        noise_reduction_bayer(bayer12, width, height, white, cinfo->gain_dB, 3.5);
+        break;
+    }
     switch (params->debayer_mode) {
     case CMBAYER_22:
         debayer22(bayer12, rgb12, width, height);
@@ -146,7 +557,7 @@ int pipeline_process_image(const void *raw, uint8_t *rgb8, const CMCaptureInfo *
     double gamma = params->gamma;
     double shadow = params->shadow;
     double black = params->black;
-    pipeline_auto_hdr(rgb12, width, height, &lut_mode, &gamma, &shadow, &black);
+    pipeline_auto_hdr(rgb12, width, height, white, &lut_mode, &gamma, &shadow, &black);
 
     // Compute red/blue ratios to correct from scene to D65 in cam space
     const ColourMatrix *calib = get_calibration(cinfo);
@@ -165,13 +576,18 @@ int pipeline_process_image(const void *raw, uint8_t *rgb8, const CMCaptureInfo *
     cmat_d2f(&cmat, &cmat_f);
 
     // Step 3: Pre-clip, convert to float, and colour correct
-    colour_pre_clip(rgb12, width, height, 4095, &cmat);
-    colour_i2f(rgb12, rgbf_0, width, height, 4095);
+    colour_pre_clip(rgb12, width, height, white, &cmat);
+    colour_i2f(rgb12, rgbf_0, width, height, white);
+    // the rest of the pipeline stays in float, so a one off call frees the integer image early
+    if (!reuse) {
+        free(buffers->rgb12);
+        buffers->rgb12 = NULL;
+    }
     float black_point = auto_black_point(rgbf_0, width, height);
     colour_black_point(rgbf_0, rgbf_1, width, height, &cmat, black_point);
     colour_xfrm(rgbf_1, rgbf_0, width, height, &cmat_f);
 
-    // Step 4: Noise reduction and convert back to integer
+    // Step 4: Noise reduction
     double nr_thresh_lum = pow(10, (cinfo->gain_dB + params->noise_lum_dB) / 20);
     double nr_thresh_chrom = pow(10, (cinfo->gain_dB + params->noise_chrom_dB) / 20);
     switch (params->nr_mode) {
@@ -187,23 +603,65 @@ int pipeline_process_image(const void *raw, uint8_t *rgb8, const CMCaptureInfo *
     case CMNR_MEDIAN_STRONG:
         noise_reduction_median_full_x_rgb(rgbf_0, rgbf_1, width, height, nr_thresh_lum, nr_thresh_chrom);
         break;
+    case CMNR_WAVELET:
+        noise_reduction_wavelet_rgb(rgbf_0, rgbf_1, width, height, nr_thresh_lum, nr_thresh_chrom);
+        break;
     }
-    colour_f2i(rgbf_1, rgb12, width, height, 4095);
 
-    // Step 5: Gamma encode
-    pipeline_gen_lut(glut, lut_mode, gamma, shadow, black);
-    gamma_encode(rgb12, rgb8, width, height, glut);
+    // Step 4.5: Local tone mapping, followed by a plain cubic curve
+    if (lut_mode == CMLUT_LOCAL) {
+        tone_map_local(rgbf_1, width, height, shadow);
+        lut_mode = CMLUT_CUBIC;
+    }
+
+    // Step 5: Gamma encode straight from float
+    if (rgb8) {
+        pipeline_get_lut(glut, false, lut_bits, lut_mode, gamma, shadow, black);
+        gamma_encode_f(rgbf_1, rgb8, width, height, glut, lut_bits);
+    }
+    if (rgb16) {
+        pipeline_get_lut(glut16, true, lut_bits, lut_mode, gamma, shadow, black);
+        gamma_encode16_f(rgbf_1, rgb16, width, height, glut16, lut_bits);
+    }
+
+    // Step 6: Creative 3D LUT
+    if (params->lut3d != NULL) {
+        if (rgb8)
+            lut3d_apply8(params->lut3d, rgb8, width, height);
+        if (rgb16)
+            lut3d_apply16(params->lut3d, rgb16, width, height);
+    }
 
 cleanup:
-    free(bayer12);
-    free(rgb12);
-    free(rgbf_0);
-    free(rgbf_1);
-    free(glut);
+    if (!reuse)
+        pipeline_free_buffers(buffers);
 
     return status;
 }
 
+int pipeline_process_image(const void *raw, uint8_t *rgb8, const CMCaptureInfo *cinfo,
+        const ImagePipelineParams *params)
+{
+    return pipeline_process(raw, rgb8, NULL, cinfo, params, NULL);
+}
+
+int pipeline_process_image16(const void *raw, uint16_t *rgb16, uint8_t *rgb8,
+        const CMCaptureInfo *cinfo, const ImagePipelineParams *params)
+{
+    if (rgb16 == NULL)
+        return -EINVAL;
+    return pipeline_process(raw, rgb8, rgb16, cinfo, params, NULL);
+}
+
+int pipeline_process_image_buffers(const void *raw, uint16_t *rgb16, uint8_t *rgb8,
+        const CMCaptureInfo *cinfo, const ImagePipelineParams *params,
+        ImagePipelineBuffers *buffers)
+{
+    if ((rgb16 == NULL && rgb8 == NULL) || buffers == NULL)
+        return -EINVAL;
+    return pipeline_process(raw, rgb8, rgb16, cinfo, params, buffers);
+}
+
 // use fast 2x2 binned debayering and skip noise reduction
 // output image is half height and half width
 int pipeline_process_image_bin22(const void *raw, uint8_t *rgb8, const CMCaptureInfo *cinfo,
@@ -221,7 +679,7 @@ int pipeline_process_image_bin22(const void *raw, uint8_t *rgb8, const CMCapture
     uint16_t *rgb12 = (uint16_t *)malloc(width_out * height_out * 3 * sizeof(uint16_t));
     float *rgbf_0 = (float *)malloc(width_out * height_out * 3 * sizeof(float));
     float *rgbf_1 = (float *)malloc(width_out * height_out * 3 * sizeof(float));
-    uint8_t *glut = (uint8_t *)malloc(4096);
+    uint8_t *glut = (uint8_t *)malloc(1 << PIPELINE_LUT_BITS);
 
     if (bayer12 == NULL || rgb12 == NULL || rgbf_0 == NULL || rgbf_1 == NULL || glut == NULL) {
         status = -ENOMEM;
@@ -229,12 +687,9 @@ int pipeline_process_image_bin22(const void *raw, uint8_t *rgb8, const CMCapture
     }
 
     // Step 1: Unpack and debayer the image
-    if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P)
-        unpack12_16(bayer12, raw, width * height, false);
-    else if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12)
-        memcpy(bayer12, raw, width * height * sizeof(uint16_t));
-    else {
-        status = -EINVAL;
+    int white = pipeline_unpack(raw, bayer12, cinfo);
+    if (white < 0) {
+        status = white;
         goto cleanup;
     }
     debayer22_binned(bayer12, rgb12, width, height);
@@ -248,7 +703,7 @@ int pipeline_process_image_bin22(const void *raw, uint8_t *rgb8, const CMCapture
     double gamma = params->gamma;
     double shadow = params->shadow;
     double black = params->black;
-    pipeline_auto_hdr(rgb12, width, height, &lut_mode, &gamma, &shadow, &black);
+    pipeline_auto_hdr(rgb12, width, height, white, &lut_mode, &gamma, &shadow, &black);
 
     // Step 2: Compute colour transformation matrix
     ColourMatrix cmat;
@@ -256,17 +711,53 @@ int pipeline_process_image_bin22(const void *raw, uint8_t *rgb8, const CMCapture
     ColourMatrix_f cmat_f;
     cmat_d2f(&cmat, &cmat_f);
 
-    // Step 3: Pre-clip, convert to float, colour correct, convert back to int
-    colour_pre_clip(rgb12, width, height, 4095, &cmat);
-    colour_i2f(rgb12, rgbf_0, width, height, 4095);
+    // Steps 3 to 5 in one lookup, if requested
+    if (params->bake_lut_size >= 2 && params->bake_lut_size <= LUT3D_MAX_SIZE
+            && lut_mode != CMLUT_LOCAL && white == 4095) {
+        BakedLUTKey key;
+        memset(&key, 0, sizeof(key));
+        key.size = params->bake_lut_size;
+        key.cmat = cmat;
+        key.min_green = 4095;
+        for (unsigned i = 1; i < (unsigned)width * height * 3; i += 3) {
+            if (rgb12[i] < key.min_green) key.min_green = rgb12[i];
+        }
+        // the auto black point is capped at 0.02, so all brighter minimums give the same LUT
+        if (key.min_green > 82) key.min_green = 82;
+        key.lut_mode = lut_mode;
+        key.gamma = gamma;
+        key.shadow = shadow;
+        key.black = black;
+        key.lut3d = params->lut3d;
+        key.lut3d_id = params->lut3d != NULL ? params->lut3d->id : 0;
+
+        BakedLUT *bl = baked_lut_get(&key);
+        if (bl != NULL) {
+            lut3d_apply_shaped(&bl->lut, bl->shaper, rgb12, rgb8, width, height);
+            baked_lut_release(bl);
+            goto cleanup;
+        }
+        // otherwise fall back to evaluating each stage
+    }
+
+    // Step 3: Pre-clip, convert to float, colour correct
+    colour_pre_clip(rgb12, width, height, white, &cmat);
+    colour_i2f(rgb12, rgbf_0, width, height, white);
     float black_point = auto_black_point(rgbf_0, width, height);
     colour_black_point(rgbf_0, rgbf_1, width, height, &cmat, black_point);
     colour_xfrm(rgbf_1, rgbf_0, width, height, &cmat_f);
-    colour_f2i(rgbf_0, rgb12, width, height, 4095);
+    if (lut_mode == CMLUT_LOCAL) {
+        tone_map_local(rgbf_0, width, height, shadow);
+        lut_mode = CMLUT_CUBIC;
+    }
 
-    // Step 4: Gamma encode
-    pipeline_gen_lut(glut, lut_mode, gamma, shadow, black);
-    gamma_encode(rgb12, rgb8, width, height, glut);
+    // Step 4: Gamma encode straight from float
+    pipeline_get_lut(glut, false, PIPELINE_LUT_BITS, lut_mode, gamma, shadow, black);
+    gamma_encode_f(rgbf_0, rgb8, width, height, glut, PIPELINE_LUT_BITS);
+
+    // Step 5: Creative 3D LUT
+    if (params->lut3d != NULL)
+        lut3d_apply8(params->lut3d, rgb8, width, height);
 
 cleanup:
     free(bayer12);
@@ -278,15 +769,13 @@ cleanup:
     return status;
 }
 
-int pipeline_auto_white_balance(const void *raw, const CMCaptureInfo *cinfo,
-        const CMAutoWhiteParams *params, double *temp_K, double *tint)
+// white balance modes that work on the whole 2x2 binned image
+static int binned_white_balance(const void *raw, const CMCaptureInfo *cinfo,
+        const CMAutoWhiteParams *params, const ColourMatrix_f *cmat_f, double *red, double *blue)
 {
     int status = 0;
     uint16_t width = cinfo->width;
     uint16_t height = cinfo->height;
-    if (width > CM_MAX_WIDTH || (width & 1) || height > CM_MAX_HEIGHT || (height & 1))
-        return -EINVAL;
-
     uint16_t width_out = width >> 1;
     uint16_t height_out = height >> 1;
     uint16_t *bayer12 = (uint16_t *)malloc(width * height * sizeof(uint16_t));
@@ -300,12 +789,9 @@ int pipeline_auto_white_balance(const void *raw, const CMCaptureInfo *cinfo,
     }
 
     // Step 1: Unpack and debayer the image
-    if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P)
-        unpack12_16(bayer12, raw, width * height, false);
-    else if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12)
-        memcpy(bayer12, raw, width * height * sizeof(uint16_t));
-    else {
-        status = -EINVAL;
+    int white = pipeline_unpack(raw, bayer12, cinfo);
+    if (white < 0) {
+        status = white;
         goto cleanup;
     }
     debayer22_binned(bayer12, rgb12, width, height);
@@ -314,41 +800,26 @@ int pipeline_auto_white_balance(const void *raw, const CMCaptureInfo *cinfo,
     width = width_out;
     height = height_out;
 
-    // Step 2: Compute colour transformation matrix
-    ColourMatrix cmat = *get_calibration(cinfo);
-    colour_matrix_white_scale(&cmat, 0.0);
-    ColourMatrix_f cmat_f;
-    cmat_d2f(&cmat, &cmat_f);
-
-    // Step 3: Convert to float, colour correct
-    colour_i2f(rgb12, rgbf_0, width, height, 4095);
-    colour_xfrm(rgbf_0, rgbf_1, width, height, &cmat_f);
+    // Step 2: Convert to float, colour correct
+    colour_i2f(rgb12, rgbf_0, width, height, white);
+    colour_xfrm(rgbf_0, rgbf_1, width, height, cmat_f);
 
-    // Step 4: find white balance adjustment in sRGB space
-    double red, blue;
+    // Step 3: find white balance adjustment in sRGB space
     switch (params->awb_mode) {
     case CMWHITE_BRIGHTS:
-        auto_white_balance_brights(rgbf_1, width, height, &red, &blue);
+        auto_white_balance_brights(rgbf_1, width, height, red, blue);
         break;
     case CMWHITE_GREY:
-        auto_white_balance_grey_world(rgbf_1, width, height, &red, &blue);
+        auto_white_balance_grey_world(rgbf_1, width, height, red, blue);
         break;
     case CMWHITE_ROBUST:
-        auto_white_balance_robust(rgbf_1, width, height, &red, &blue);
+        auto_white_balance_robust(rgbf_1, width, height, red, blue);
         break;
     case CMWHITE_SPOT:
-        auto_white_balance_spot(rgbf_1, width, height, params->pos_x, params->pos_y, &red, &blue);
+        auto_white_balance_spot(rgbf_1, width, height, params->pos_x, params->pos_y, red, blue);
         break;
     }
 
-    // Compute temperature and tint from sRGB white point
-    ColourPixel sRGB_grey = {.p={1/red, 1, 1/blue}};
-    ColourPixel XYZ_grey;
-    pixel_xfrm(&sRGB_grey, &XYZ_grey, &CM_sRGB2XYZ);
-    double x = XYZ_grey.p[0] / (XYZ_grey.p[0] + XYZ_grey.p[1] + XYZ_grey.p[2]);
-    double y = XYZ_grey.p[1] / (XYZ_grey.p[0] + XYZ_grey.p[1] + XYZ_grey.p[2]);
-    colour_xy_to_temp_tint(x, y, temp_K, tint);
-
 cleanup:
     free(bayer12);
     free(rgb12);
@@ -358,41 +829,52 @@ cleanup:
     return status;
 }
 
-int pipeline_auto_exposure(const void *raw, const CMCaptureInfo *cinfo,
-        const ImagePipelineParams *params, double *change_factor)
+int pipeline_auto_white_balance(const void *raw, const CMCaptureInfo *cinfo,
+        const CMAutoWhiteParams *params, double *temp_K, double *tint)
 {
-    int status = 0;
     uint16_t width = cinfo->width;
     uint16_t height = cinfo->height;
     if (width > CM_MAX_WIDTH || (width & 1) || height > CM_MAX_HEIGHT || (height & 1))
         return -EINVAL;
 
-    uint16_t width_out = width >> 1;
-    uint16_t height_out = height >> 1;
-    uint16_t *bayer12 = (uint16_t *)malloc(width * height * sizeof(uint16_t));
-    uint16_t *rgb12 = (uint16_t *)malloc(width_out * height_out * 3 * sizeof(uint16_t));
+    // Compute colour transformation matrix to sRGB without white balance
+    ColourMatrix cmat = *get_calibration(cinfo);
+    colour_matrix_white_scale(&cmat, 0.0);
+    ColourMatrix_f cmat_f;
+    cmat_d2f(&cmat, &cmat_f);
 
-    if (bayer12 == NULL || rgb12 == NULL) {
-        status = -ENOMEM;
-        goto cleanup;
-    }
+    // robust white balance only needs sparse samples, so take them straight from the raw data
+    // rather than converting the whole image
+    double red, blue;
+    int status;
+    if (params->awb_mode == CMWHITE_ROBUST)
+        status = auto_white_balance_robust_raw(raw, cinfo, &cmat_f, &red, &blue);
+    else
+        status = binned_white_balance(raw, cinfo, params, &cmat_f, &red, &blue);
+    if (status)
+        return status;
 
-    // Step 1: Unpack and debayer the image
-    if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12P)
-        unpack12_16(bayer12, raw, width * height, false);
-    else if (cinfo->pixel_fmt == CM_PIXEL_FMT_BAYER_RG12)
-        memcpy(bayer12, raw, width * height * sizeof(uint16_t));
-    else {
-        status = -EINVAL;
-        goto cleanup;
-    }
-    debayer22_binned(bayer12, rgb12, width, height);
+    // Compute temperature and tint from sRGB white point
+    ColourPixel sRGB_grey = {.p={1/red, 1, 1/blue}};
+    ColourPixel XYZ_grey;
+    pixel_xfrm(&sRGB_grey, &XYZ_grey, &CM_sRGB2XYZ);
+    double x = XYZ_grey.p[0] / (XYZ_grey.p[0] + XYZ_grey.p[1] + XYZ_grey.p[2]);
+    double y = XYZ_grey.p[1] / (XYZ_grey.p[0] + XYZ_grey.p[1] + XYZ_grey.p[2]);
+    colour_xy_to_temp_tint(x, y, temp_K, tint);
 
-    // For convenience's sake, repurpose width and height variables to match output from here on
-    width = width_out;
-    height = height_out;
+    return 0;
+}
 
-    // Step 2: Compute colour transformation matrix
+int pipeline_auto_exposure(const void *raw, const CMCaptureInfo *cinfo,
+        const ImagePipelineParams *params, const CMMeteringParams *metering,
+        double *change_factor)
+{
+    uint16_t width = cinfo->width;
+    uint16_t height = cinfo->height;
+    if (width > CM_MAX_WIDTH || (width & 1) || height > CM_MAX_HEIGHT || (height & 1))
+        return -EINVAL;
+
+    // Step 1: Compute colour transformation matrix
     ColourMatrix cam_to_target;
     gen_colour_matrix(cinfo, params, &cam_to_target);
 
@@ -403,12 +885,10 @@ int pipeline_auto_exposure(const void *raw, const CMCaptureInfo *cinfo,
     colour_matinv33(&target_to_cam, &cam_to_target);
     colour_white_in_cam(&target_to_cam, &cam_white);
 
-    // Step 3: compute exposure change factor
-    *change_factor = auto_exposure(rgb12, width, height, 1800, 3700, 4090, &cam_white);
-
-cleanup:
-    free(bayer12);
-    free(rgb12);
-
-    return status;
+    // Step 2: compute exposure change factor from sampled 2x2 bins of the raw image
+    // targets are for 12 bit data
+    uint16_t white = cmraw_white_level(cinfo);
+    double scale = (white + 1) / 4096.0;
+    return auto_exposure_raw(raw, cinfo, metering, 1800 * scale, 3700 * scale,
+            white - 5 * scale, &cam_white, change_factor);
 }
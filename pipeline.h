@@ -8,6 +8,8 @@ extern "C" {
 #include <stdint.h>
 #include "cmraw.h"
 #include "colour_xfrm.h"
+#include "lut3d.h"
+#include "auto_exposure.h"
 
 typedef enum {
     CMLUT_LINEAR,
@@ -16,16 +18,24 @@ typedef enum {
     CMLUT_HDR,
     CMLUT_HDR_AUTO,
     CMLUT_HDR_CUBIC,
-    CMLUT_HDR_CUBIC_AUTO
+    CMLUT_HDR_CUBIC_AUTO,
+    CMLUT_LOCAL
 } CMLUTMode;
 
 typedef enum {
     CMNR_NONE,
     CMNR_GAUSSIAN,
     CMNR_MEDIAN,
-    CMNR_MEDIAN_STRONG
+    CMNR_MEDIAN_STRONG,
+    CMNR_WAVELET
 } CMNoiseReductionMode;
 
+typedef enum {
+    CMRAWNR_NONE,
+    CMRAWNR_NORMAL,
+    CMRAWNR_STRONG
+} CMRawNoiseReductionMode;
+
 typedef enum {
     CMBAYER_22,
     CMBAYER_33,
@@ -46,17 +56,55 @@ typedef struct {
     double black;
     CMLUTMode lut_mode;
     CMNoiseReductionMode nr_mode;
+    CMRawNoiseReductionMode raw_nr_mode;
     CMDebayerMode debayer_mode;
+    const CMLut3D *lut3d;   // optional creative LUT applied after the tone curve, may be NULL
+
+    // bin22 only: if non-zero, every stage after debayering is baked into a single 3D LUT of
+    // this size (e.g. 33 or 65) which is rebuilt only when its inputs change
+    // not used with CMLUT_LOCAL, which needs the full image, or for input that isn't 12 bit
+    unsigned int bake_lut_size;
 } ImagePipelineParams;
 
 int pipeline_process_image(const void *raw, uint8_t *rgb8, const CMCaptureInfo *cinfo,
         const ImagePipelineParams *params);
 
+// same as above but with 16 bit output
+// if rgb8 is not NULL, an 8 bit image is also produced from the same pass
+int pipeline_process_image16(const void *raw, uint16_t *rgb16, uint8_t *rgb8,
+        const CMCaptureInfo *cinfo, const ImagePipelineParams *params);
+
+/* Working images of the full pipeline, kept between calls so processing a series of frames
+ * doesn't allocate and fault in about 30 bytes per pixel for each one. Zero initialise before
+ * the first call, free with pipeline_free_buffers, and use from one thread at a time.
+ */
+typedef struct {
+    uint16_t *bayer12;
+    uint16_t *rgb12;
+    float *rgbf_0;
+    float *rgbf_1;
+    uint8_t *glut;
+    uint16_t *glut16;
+    size_t pixels;          // the images have room for this many pixels
+} ImagePipelineBuffers;
+
+// same as pipeline_process_image16 with reused working images, either output may be NULL
+int pipeline_process_image_buffers(const void *raw, uint16_t *rgb16, uint8_t *rgb8,
+        const CMCaptureInfo *cinfo, const ImagePipelineParams *params,
+        ImagePipelineBuffers *buffers);
+
+void pipeline_free_buffers(ImagePipelineBuffers *buffers);
+
 // use fast 2x2 binned debayering and skip noise reduction
 // output image is half height and half width
 int pipeline_process_image_bin22(const void *raw, uint8_t *rgb8, const CMCaptureInfo *cinfo,
         const ImagePipelineParams *params);
 
+// Generated LUTs are cached between calls. The parameters chosen by the auto HDR LUT modes are
+// rounded to steps of this relative size (default 0.01) so frame to frame jitter doesn't cause
+// cache misses. A step of 0 disables rounding.
+void pipeline_set_lut_quantization(double step);
+
 typedef enum {
     CMWHITE_BRIGHTS,
     CMWHITE_GREY,
@@ -76,7 +124,8 @@ int pipeline_auto_white_balance(const void *raw, const CMCaptureInfo *cinfo,
         const CMAutoWhiteParams *params, double *temp_K, double *tint);
 
 int pipeline_auto_exposure(const void *raw, const CMCaptureInfo *cinfo,
-        const ImagePipelineParams *params, double *change_factor);
+        const ImagePipelineParams *params, const CMMeteringParams *metering,
+        double *change_factor);
 
 #ifdef __cplusplus
 }
@@ -7,6 +7,7 @@
 
 #include "cm_cli_helper.h"
 #include "cm_camera_helper.h"
+#include "cm_frame_writer.h"
 #include "cmraw.h"
 #include "auto_exposure.h"
 #include "debayer.h"
@@ -19,6 +20,7 @@ static int cinemavi_auto_exposure(ArvCamera *camera, const ExposureLimits *limit
     ExposureParams params = {.shutter_us = 1000, .gain_dB = 5};
     ExposureParams params2;
     double change_factor = 0.0;
+    const CMMeteringParams metering = {.mode = CMMETER_AVERAGE};
     int ret = 0;
     int iterations = 0;
 
@@ -48,7 +50,8 @@ static int cinemavi_auto_exposure(ArvCamera *camera, const ExposureLimits *limit
             break;
         }
 
-        ret = pipeline_auto_exposure(raw, &cmrh.cinfo, &default_pipeline_params, &change_factor);
+        ret = pipeline_auto_exposure(raw, &cmrh.cinfo, &default_pipeline_params, &metering,
+                &change_factor);
         if (ret) {
             g_clear_object(&buffer);
             break;
@@ -72,6 +75,8 @@ int main (int argc, char **argv)
     ArvCamera *camera;
     ArvBuffer *buffer;
     GError *error = NULL;
+    CMFrameWriter *writer = NULL;
+    int write_status = 0;
 
     // Connect to the first available camera
     camera = arv_camera_new(NULL, &error);
@@ -130,14 +135,34 @@ int main (int argc, char **argv)
                 cmrh.cinfo.white_x = white_x;
                 cmrh.cinfo.white_y = white_y;
 
-                if (endswith(argv[1], ".dng"))
-                    cinemavi_generate_dng(raw, &cmrh, argv[1]);
-                else if (endswith(argv[1], ".tiff"))
+                // raw files are written on the writer's thread while the camera is released
+                bool dng = endswith(argv[1], ".dng");
+                if (dng || endswith(argv[1], ".cmr")) {
+                    // embedded preview, from a quick binned render at the as-shot white balance
+                    CMRawThumbnail thumb = {0, 0, NULL};
+                    ImagePipelineParams pparams = default_pipeline_params;
+                    pparams.temp_K = temp_K;
+                    pparams.tint = tint;
+                    uint16_t preview_width = cmrh.cinfo.width / 2;
+                    uint16_t preview_height = cmrh.cinfo.height / 2;
+                    uint8_t *preview = (uint8_t *)malloc(preview_width * preview_height * 3);
+                    if (preview != NULL && !pipeline_process_image_bin22(raw, preview,
+                                &cmrh.cinfo, &pparams))
+                        cmraw_make_thumbnail(preview, preview_width, preview_height,
+                                preview_width * 3, &thumb);
+                    free(preview);
+
+                    write_status = cm_frame_writer_open(&writer, cmraw_data_size(&cmrh.cinfo)
+                            + sizeof(CMRawHeader) + cmraw_thumbnail_size(&thumb));
+                    if (!write_status)
+                        write_status = cm_frame_writer_add(writer, raw, &cmrh, &thumb, argv[1],
+                                dng ? CMFRAME_FORMAT_DNG : CMFRAME_FORMAT_CMRAW);
+                    cmraw_free_thumbnail(&thumb);
+                } else if (endswith(argv[1], ".tiff")) {
                     cinemavi_generate_tiff(raw, &cmrh, argv[1]);
-                else if (endswith(argv[1], ".cmr"))
-                    cinemavi_generate_cmr(raw, &cmrh, argv[1]);
-                else
+                } else {
                     printf("Unknown output file type.\n");
+                }
             }
 
             // Destroy the buffer
@@ -149,6 +174,16 @@ err:
         g_clear_object (&camera);
     }
 
+    if (writer != NULL) {
+        int status = cm_frame_writer_close(writer);
+        if (!write_status)
+            write_status = status;
+    }
+    if (write_status) {
+        printf("Error %d writing %s\n", write_status, argv[1]);
+        return EXIT_FAILURE;
+    }
+
     if (error != NULL) {
         /* En error happened, display the correspdonding message */
         printf("Error: %s\n", error->message);
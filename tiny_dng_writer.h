@@ -29,6 +29,7 @@ THE SOFTWARE.
 #ifndef TINY_DNG_WRITER_H_
 #define TINY_DNG_WRITER_H_
 
+#include <functional>
 #include <sstream>
 #include <vector>
 
@@ -63,6 +64,11 @@ typedef enum {
 
   TIFFTAG_SOFTWARE = 305,
 
+  TIFFTAG_TILE_WIDTH = 322,
+  TIFFTAG_TILE_LENGTH = 323,
+  TIFFTAG_TILE_OFFSETS = 324,
+  TIFFTAG_TILE_BYTE_COUNTS = 325,
+
   TIFFTAG_SAMPLEFORMAT = 339,
 
   // DNG extension
@@ -91,7 +97,12 @@ typedef enum {
   TIFFTAG_DEFAULT_BLACK_RENDER = 51110,
   TIFFTAG_ACTIVE_AREA = 50829,
   TIFFTAG_FORWARD_MATRIX1 = 50964,
-  TIFFTAG_FORWARD_MATRIX2 = 50965
+  TIFFTAG_FORWARD_MATRIX2 = 50965,
+
+  // CinemaDNG extension
+  TIFFTAG_TIME_CODES = 51043,
+  TIFFTAG_FRAME_RATE = 51044,
+  TIFFTAG_REEL_NAME = 51081
 } Tag;
 
 // SUBFILETYPE(bit field)
@@ -106,6 +117,7 @@ static const int PLANARCONFIG_SEPARATE = 2;
 // COMPRESSION
 // TODO(syoyo) more compressin types.
 static const int COMPRESSION_NONE = 1;
+static const int COMPRESSION_LOSSLESS_JPEG = 7;  // DNG ext, data is set per tile
 
 // ORIENTATION
 static const int ORIENTATION_TOPLEFT = 1;
@@ -244,23 +256,59 @@ class DNGImage {
   /// Specify the the selected white balance at time of capture, encoded as x-y chromaticity coordinates.
   bool SetAsShotWhiteXY(const double x, const double y);
 
+  /// Specify the SMPTE 12M time code of the frame, 8 bytes.
+  bool SetTimeCodes(const unsigned char *time_code);
+
+  /// Specify the frame rate of the sequence as `numerator / denominator` frames per second.
+  bool SetFrameRate(const int numerator, const int denominator);
+
+  /// Specify the name of the reel the frame belongs to.
+  bool SetReelName(const std::string &ascii);
+
   /// Set image data with packing (take 16-bit values and pack them to input_bpp values).
   bool SetImageDataPacked(const unsigned short *input_buffer, const int input_count, const unsigned int input_bpp, bool big_endian);
 
   /// Set image data.
   bool SetImageData(const unsigned char *data, const size_t data_len);
 
+  /// Set image data as tiles, in rows from the top left, e.g. compressed tiles.
+  /// Use instead of SetImageData and SetRowsPerStrip.
+  bool SetTiledImageData(const unsigned int tile_width,
+                         const unsigned int tile_length,
+                         const unsigned int num_tiles,
+                         const unsigned char *const *tiles,
+                         const size_t *tile_bytes);
+
+  /// Callback writing strip `strip` of the image data to `ofs`, exactly the
+  /// number of bytes given for it to SetStreamedImageData.
+  /// Returns false on error.
+  typedef std::function<bool(unsigned int strip, std::ostream *ofs)>
+      StripWriter;
+
+  /// Set image data that's written strip by strip by `writer` when the file
+  /// is written, so it never has to be held in memory. The data must already
+  /// be in the DNG's byte order.
+  /// Use instead of SetImageData, along with SetRowsPerStrip.
+  bool SetStreamedImageData(const unsigned int num_strips,
+                            const size_t *strip_bytes, StripWriter writer);
+
   /// Set custom field.
   bool SetCustomFieldLong(const unsigned short tag, const int value);
   bool SetCustomFieldULong(const unsigned short tag, const unsigned int value);
 
-  size_t GetDataSize() const { return data_os_.str().length(); }
+  size_t GetDataSize() const {
+    return data_os_.str().length() + streamed_bytes_;
+  }
 
   size_t GetStripOffset() const { return data_strip_offset_; }
   size_t GetStripBytes() const { return data_strip_bytes_; }
 
   /// Write aux IFD data and strip image data to stream.
-  bool WriteDataToStream(std::ostream *ofs) const;
+  ///
+  /// @param[in] data_base_offset : Byte offset to data
+  ///
+  bool WriteDataToStream(const unsigned int data_base_offset,
+                         std::ostream *ofs) const;
 
   ///
   /// Write IFD to stream.
@@ -287,6 +335,18 @@ class DNGImage {
   size_t data_strip_offset_{0};
   size_t data_strip_bytes_{0};
 
+  // Tile offsets are relative to data_os_ until the data is written.
+  bool tiled_{false};
+  unsigned int num_tiles_{0};
+  size_t tile_offsets_pos_{0};
+
+  // Streamed strips follow the other data, their offsets are relative to the
+  // first strip until the data is written.
+  StripWriter strip_writer_;
+  std::vector<size_t> streamed_strip_bytes_;
+  size_t streamed_bytes_{0};
+  size_t strip_offsets_pos_{0};
+
   mutable std::string err_;  // Error message
 
   std::vector<IFDTag> ifd_tags_;
@@ -564,6 +624,9 @@ static bool WriteTIFFTag(const unsigned short tag, const unsigned short type,
     } else if (len == 2) {
       unsigned short value = *(reinterpret_cast<const unsigned short *>(data));
       memcpy(&(ifd.offset_or_value), &value, sizeof(unsigned short));
+    } else if (len == 3) {
+      // e.g. a 2 character ASCII string
+      memcpy(&(ifd.offset_or_value), data, 3);
     } else if (len == 4) {
       unsigned int value = *(reinterpret_cast<const unsigned int *>(data));
       ifd.offset_or_value = value;
@@ -830,7 +893,7 @@ bool DNGImage::SetPlanarConfig(const unsigned short value) {
 bool DNGImage::SetCompression(const unsigned short value) {
   unsigned int count = 1;
 
-  if ((value == COMPRESSION_NONE)) {
+  if ((value == COMPRESSION_NONE) || (value == COMPRESSION_LOSSLESS_JPEG)) {
     // OK
   } else {
     return false;
@@ -1592,6 +1655,71 @@ bool DNGImage::SetAsShotWhiteXY(const double x, const double y) {
   return true;
 }
 
+bool DNGImage::SetTimeCodes(const unsigned char *time_code) {
+  bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_TIME_CODES),
+                          TIFF_BYTE, 8, time_code, &ifd_tags_, &data_os_);
+
+  if (!ret) {
+    return false;
+  }
+
+  num_fields_++;
+  return true;
+}
+
+bool DNGImage::SetFrameRate(const int numerator, const int denominator) {
+  if (denominator == 0) {
+    return false;
+  }
+
+  int vs[2] = {numerator, denominator};
+
+  // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
+  if (swap_endian_) {
+    swap4(reinterpret_cast<unsigned int *>(&vs[0]));
+    swap4(reinterpret_cast<unsigned int *>(&vs[1]));
+  }
+
+  bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_FRAME_RATE),
+                          TIFF_SRATIONAL, 1,
+                          reinterpret_cast<const unsigned char *>(vs),
+                          &ifd_tags_, &data_os_);
+
+  if (!ret) {
+    return false;
+  }
+
+  num_fields_++;
+  return true;
+}
+
+bool DNGImage::SetReelName(const std::string &ascii) {
+  unsigned int count =
+      static_cast<unsigned int>(ascii.length() + 1);  // +1 for '\0'
+
+  if (count < 2) {
+    // empty string
+    return false;
+  }
+
+  if (count > (1024 * 1024)) {
+    // too large
+    return false;
+  }
+
+  bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_REEL_NAME),
+                          TIFF_ASCII, count,
+                          reinterpret_cast<const unsigned char *>(ascii.data()),
+                          &ifd_tags_, &data_os_);
+
+  if (!ret) {
+    return false;
+  }
+
+  num_fields_++;
+  return true;
+}
+
 bool DNGImage::SetImageDataPacked(const unsigned short *input_buffer, const int input_count, const unsigned int input_bpp, bool big_endian)
 {
   if (input_count <= 0) {
@@ -1660,6 +1788,118 @@ bool DNGImage::SetImageData(const unsigned char *data, const size_t data_len) {
   return true;
 }
 
+bool DNGImage::SetTiledImageData(const unsigned int tile_width,
+                                 const unsigned int tile_length,
+                                 const unsigned int num_tiles,
+                                 const unsigned char *const *tiles,
+                                 const size_t *tile_bytes) {
+  if ((tiles == NULL) || (tile_bytes == NULL) || (num_tiles < 1)) {
+    return false;
+  }
+
+  if (tiled_ || (data_strip_bytes_ > 0)) {
+    err_ += "Image data is already set.\n";
+    return false;
+  }
+
+  {
+    bool ret = WriteTIFFTag(
+        static_cast<unsigned short>(TIFFTAG_TILE_WIDTH), TIFF_LONG, 1,
+        reinterpret_cast<const unsigned char *>(&tile_width), &ifd_tags_,
+        NULL);
+    ret = ret && WriteTIFFTag(
+        static_cast<unsigned short>(TIFFTAG_TILE_LENGTH), TIFF_LONG, 1,
+        reinterpret_cast<const unsigned char *>(&tile_length), &ifd_tags_,
+        NULL);
+    if (!ret) {
+      return false;
+    }
+
+    num_fields_ += 2;
+  }
+
+  std::vector<unsigned int> offsets(num_tiles);
+  std::vector<unsigned int> bytes(num_tiles);
+  for (unsigned int i = 0; i < num_tiles; i++) {
+    offsets[i] = static_cast<unsigned int>(data_os_.tellp()) + kHeaderSize;
+    bytes[i] = static_cast<unsigned int>(tile_bytes[i]);
+    data_os_.write(reinterpret_cast<const char *>(tiles[i]),
+                   static_cast<std::streamsize>(tile_bytes[i]));
+  }
+
+  {
+    bool ret = WriteTIFFTag(
+        static_cast<unsigned short>(TIFFTAG_TILE_BYTE_COUNTS), TIFF_LONG,
+        num_tiles, reinterpret_cast<const unsigned char *>(bytes.data()),
+        &ifd_tags_, &data_os_);
+
+    // NOTE: offsets are fixed up by `WriteDataToStream()` (or
+    // `WriteIFDToStream()` for a single tile) once the data's place in the
+    // file is known.
+    tile_offsets_pos_ = size_t(data_os_.tellp());
+    ret = ret && WriteTIFFTag(
+        static_cast<unsigned short>(TIFFTAG_TILE_OFFSETS), TIFF_LONG,
+        num_tiles, reinterpret_cast<const unsigned char *>(offsets.data()),
+        &ifd_tags_, &data_os_);
+    if (!ret) {
+      return false;
+    }
+
+    num_fields_ += 2;
+  }
+
+  tiled_ = true;
+  num_tiles_ = num_tiles;
+
+  return true;
+}
+
+bool DNGImage::SetStreamedImageData(const unsigned int num_strips,
+                                    const size_t *strip_bytes,
+                                    StripWriter writer) {
+  if ((strip_bytes == NULL) || (num_strips < 1) || !writer) {
+    return false;
+  }
+
+  if (tiled_ || (data_strip_bytes_ > 0) || strip_writer_) {
+    err_ += "Image data is already set.\n";
+    return false;
+  }
+
+  std::vector<unsigned int> offsets(num_strips);
+  std::vector<unsigned int> bytes(num_strips);
+  size_t offset = 0;
+  for (unsigned int i = 0; i < num_strips; i++) {
+    offsets[i] = static_cast<unsigned int>(offset);
+    bytes[i] = static_cast<unsigned int>(strip_bytes[i]);
+    offset += strip_bytes[i];
+  }
+
+  bool ret = WriteTIFFTag(
+      static_cast<unsigned short>(TIFFTAG_STRIP_BYTE_COUNTS), TIFF_LONG,
+      num_strips, reinterpret_cast<const unsigned char *>(bytes.data()),
+      &ifd_tags_, &data_os_);
+
+  // NOTE: offsets are fixed up by `WriteDataToStream()` (or
+  // `WriteIFDToStream()` for a single strip), when the size of the data
+  // before the strips is known.
+  strip_offsets_pos_ = size_t(data_os_.tellp());
+  ret = ret && WriteTIFFTag(
+      static_cast<unsigned short>(TIFFTAG_STRIP_OFFSET), TIFF_LONG,
+      num_strips, reinterpret_cast<const unsigned char *>(offsets.data()),
+      &ifd_tags_, &data_os_);
+  if (!ret) {
+    return false;
+  }
+
+  num_fields_ += 2;
+  strip_writer_ = writer;
+  streamed_strip_bytes_.assign(strip_bytes, strip_bytes + num_strips);
+  streamed_bytes_ = offset;
+
+  return true;
+}
+
 bool DNGImage::SetCustomFieldLong(const unsigned short tag, const int value) {
   unsigned int count = 1;
 
@@ -1697,11 +1937,22 @@ bool DNGImage::SetCustomFieldULong(const unsigned short tag,
   return true;
 }
 
+// Adds `base` to `count` offsets, which may be unaligned.
+static void FixupOffsets(uint8_t *ptr, size_t count, unsigned int base) {
+  for (size_t i = 0; i < count; i++, ptr += sizeof(unsigned int)) {
+    unsigned int offset;
+    memcpy(&offset, ptr, sizeof(unsigned int));
+    offset += base;
+    memcpy(ptr, &offset, sizeof(unsigned int));
+  }
+}
+
 static bool IFDComparator(const IFDTag &a, const IFDTag &b) {
   return (a.tag < b.tag);
 }
 
-bool DNGImage::WriteDataToStream(std::ostream *ofs) const {
+bool DNGImage::WriteDataToStream(const unsigned int data_base_offset,
+                                 std::ostream *ofs) const {
   if ((data_os_.str().length() == 0)) {
     err_ += "Empty IFD data and image data.\n";
     return false;
@@ -1727,6 +1978,18 @@ bool DNGImage::WriteDataToStream(std::ostream *ofs) const {
   std::vector<uint8_t> data(data_os_.str().length());
   memcpy(data.data(), data_os_.str().data(), data.size());
 
+  if (tiled_ && (num_tiles_ > 1)) {
+    FixupOffsets(data.data() + tile_offsets_pos_, num_tiles_,
+                 data_base_offset);
+  }
+
+  if (strip_writer_ && (streamed_strip_bytes_.size() > 1)) {
+    FixupOffsets(data.data() + strip_offsets_pos_,
+                 streamed_strip_bytes_.size(),
+                 data_base_offset + kHeaderSize +
+                     static_cast<unsigned int>(data.size()));
+  }
+
   if (data_strip_bytes_ == 0) {
     // May ok?.
   } else {
@@ -1768,6 +2031,17 @@ bool DNGImage::WriteDataToStream(std::ostream *ofs) const {
   ofs->write(reinterpret_cast<const char *>(data.data()),
              static_cast<std::streamsize>(data.size()));
 
+  if (strip_writer_) {
+    for (size_t i = 0; i < streamed_strip_bytes_.size(); i++) {
+      std::streampos start = ofs->tellp();
+      if (!strip_writer_(static_cast<unsigned int>(i), ofs) ||
+          (size_t(ofs->tellp() - start) != streamed_strip_bytes_[i])) {
+        err_ += "Failed to write strip " + std::to_string(i) + "\n";
+        return false;
+      }
+    }
+  }
+
   return true;
 }
 
@@ -1781,7 +2055,22 @@ bool DNGImage::WriteIFDToStream(const unsigned int data_base_offset,
 
   // add STRIP_OFFSET tag and sort IFD tags.
   std::vector<IFDTag> tags = ifd_tags_;
-  {
+  if (tiled_) {
+    // A single tile offset is stored in the tag itself.
+    for (size_t i = 0; i < tags.size(); i++) {
+      if ((tags[i].tag == TIFFTAG_TILE_OFFSETS) && (tags[i].count == 1)) {
+        tags[i].offset_or_value += data_base_offset;
+      }
+    }
+  } else if (strip_writer_) {
+    // So is a single strip offset.
+    for (size_t i = 0; i < tags.size(); i++) {
+      if ((tags[i].tag == TIFFTAG_STRIP_OFFSET) && (tags[i].count == 1)) {
+        tags[i].offset_or_value += data_base_offset + kHeaderSize +
+            static_cast<unsigned int>(data_os_.str().length());
+      }
+    }
+  } else {
     // For STRIP_OFFSET we need the actual offset value to data(image),
     // thus write STRIP_OFFSET here.
     unsigned int offset = strip_offset + kHeaderSize;
@@ -1834,6 +2123,14 @@ bool DNGImage::WriteIFDToStream(const unsigned int data_base_offset,
           Write2(value, &ifd_os, swap_endian_);
           const unsigned short pad = 0;
           Write2(pad, &ifd_os, swap_endian_);
+        } else if (len == 3) {
+          const unsigned char *bytes =
+              reinterpret_cast<const unsigned char *>(&ifd.offset_or_value);
+          Write1(bytes[0], &ifd_os);
+          Write1(bytes[1], &ifd_os);
+          Write1(bytes[2], &ifd_os);
+          unsigned char pad = 0;
+          Write1(pad, &ifd_os);
         } else if (len == 4) {
           const unsigned int value =
               *(reinterpret_cast<const unsigned int *>(&ifd.offset_or_value));
@@ -1916,7 +2213,8 @@ bool DNGWriter::WriteToFile(const char *filename, std::string *err) const {
   // 4. Write image and meta data
   // TODO(syoyo): Write IFD first, then image/meta data
   for (size_t i = 0; i < images_.size(); i++) {
-    bool ok = images_[i]->WriteDataToStream(&ofs);
+    bool ok = images_[i]->WriteDataToStream(
+        static_cast<unsigned int>(data_offset_table[i]), &ofs);
     if (!ok) {
       if (err) {
         std::stringstream ss;
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "tone_map.h"
+#include "convolve.h"
+
+#define TM_GRID_CELLS 64    // grid cells along the long side of the image
+#define TM_LUM_BINS 16      // grid cells along the luminance axis
+#define TM_LOG_MIN -12.0f   // log2 luminance range covered by the grid
+#define TM_LOG_MAX 0.0f
+
+// approximate log2 for normal x > 0, max error about 0.0015
+// libm log2f/exp2f dominated the cost of the per pixel loops
+static inline float tm_log2(float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    float e = (int)((bits >> 23) & 0xff) - 127;
+    bits = (bits & 0x007fffff) | 0x3f800000;
+    float m; // mantissa in [1, 2)
+    memcpy(&m, &bits, sizeof(m));
+    float t = m - 1;
+    return e + t*(1.43f + t*(-0.602f + t*0.172f));
+}
+
+// approximate 2^x for 0 <= x < 128, max relative error about 1e-4
+static inline float tm_exp2(float x)
+{
+    int xi = x;
+    float f = x - xi;
+    uint32_t bits = (uint32_t)(xi + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return scale * (1 + f*(0.6958f + f*(0.2251f + f*0.0791f)));
+}
+
+// log2 of Rec. 709 luminance, clamped to the range of the grid
+static inline float tm_log_lum(const float *pixel)
+{
+    float Y = 0.2126f*pixel[0] + 0.7152f*pixel[1] + 0.0722f*pixel[2];
+    if (Y < 1.0f / 4096) Y = 1.0f / 4096;
+    float L = tm_log2(Y);
+    return L > TM_LOG_MAX ? TM_LOG_MAX : L;
+}
+
+// [1 2 1] / 4 blur along one axis of the grid, repeating edge cells
+// stride is the distance between neighbours along the axis, n is the number of cells on the axis
+static void tm_blur_axis(float *grid, float *temp, unsigned size, unsigned stride, unsigned n)
+{
+    memcpy(temp, grid, size * sizeof(float));
+    unsigned span = stride * n;
+    for (unsigned base = 0; base < size; base += span) {
+        for (unsigned pos = 0; pos < n; pos++) {
+            const float *t = &temp[base + pos*stride];
+            const float *prev = pos > 0 ? t - stride : t;
+            const float *next = pos < n - 1 ? t + stride : t;
+            float *g = &grid[base + pos*stride];
+            for (unsigned i = 0; i < stride; i++)
+                g[i] = 0.25f * (prev[i] + 2*t[i] + next[i]);
+        }
+    }
+}
+
+void tone_map_local(float *img, uint16_t width, uint16_t height, float shadow)
+{
+    /* Let L be the log2 luminance of a pixel and B the base log2 luminance around it
+     * (bilateral filtered L). With B <= 0, the output log luminance is:
+     *  L' = c*B + (L - B) = L + (c - 1)*B
+     * so each pixel is multiplied by 2^((c - 1)*B), which is >= 1 for c <= 1.
+     *
+     * Choosing c so regions 8 stops below white get a gain of shadow:
+     *  c = 1 - log2(shadow) / 8
+     */
+    if (shadow <= 1)
+        return;
+    float c = 1 - log2f(shadow) / 8;
+    if (c < 0.2f) c = 0.2f;
+
+    unsigned long_side = width > height ? width : height;
+    unsigned cell = (long_side + TM_GRID_CELLS - 1) / TM_GRID_CELLS;
+    unsigned gw = (width - 1) / cell + 2;
+    unsigned gh = (height - 1) / cell + 2;
+    unsigned gd = TM_LUM_BINS;
+    unsigned size = gw * gh * gd;
+    float z_scale = (gd - 1) / (TM_LOG_MAX - TM_LOG_MIN);
+    float inv_cell = 1.0f / cell;
+
+    // grid cell (x, y, z) is at index z + gd*(x + gw*y)
+    float *grid_sum = (float *)calloc(size, sizeof(float));
+    float *grid_weight = (float *)calloc(size, sizeof(float));
+    float *temp = (float *)malloc(size * sizeof(float));
+    float *row_sum = (float *)malloc(gw * gd * sizeof(float));
+    float *row_weight = (float *)malloc(gw * gd * sizeof(float));
+    float *row_lum = (float *)malloc(width * sizeof(float));  // log luminance, then gain
+    if (grid_sum == NULL || grid_weight == NULL || temp == NULL || row_sum == NULL
+            || row_weight == NULL || row_lum == NULL)
+        goto cleanup; // fail by doing no tone mapping
+
+    // Step 1: splat log luminance into the nearest grid cell
+    // cells are many pixels wide, so sampling every other row and column is plenty
+    for (unsigned y = 0; y < height; y += 2) {
+        unsigned gy = (y + cell/2) / cell;
+        for (unsigned x = 0; x < width; x += 2) {
+            float L = tm_log_lum(&img[image_idx(x, y, 0, width)]);
+            unsigned gx = (x + cell/2) / cell;
+            unsigned gz = (L - TM_LOG_MIN) * z_scale + 0.5f;
+            unsigned i = gz + gd*(gx + gw*gy);
+            grid_sum[i] += L;
+            grid_weight[i] += 1;
+        }
+    }
+
+    // Step 2: blur the grid, twice spatially and once in luminance
+    for (int pass = 0; pass < 2; pass++) {
+        tm_blur_axis(grid_sum, temp, size, gd, gw);
+        tm_blur_axis(grid_weight, temp, size, gd, gw);
+        tm_blur_axis(grid_sum, temp, size, gd*gw, gh);
+        tm_blur_axis(grid_weight, temp, size, gd*gw, gh);
+    }
+    tm_blur_axis(grid_sum, temp, size, 1, gd);
+    tm_blur_axis(grid_weight, temp, size, 1, gd);
+
+    // Step 3: slice the grid with trilinear interpolation to get the base B of each pixel, then
+    // apply a gain of 2^((c - 1)*B)
+    // the interpolation along y is shared by every pixel in a row
+    for (unsigned y = 0; y < height; y++) {
+        float fy = y * inv_cell;
+        unsigned y0 = fy;
+        float wy = fy - y0;
+        unsigned offset0 = gd*gw*y0;
+        unsigned offset1 = gd*gw*(y0 + 1);
+        for (unsigned i = 0; i < gw * gd; i++) {
+            row_sum[i] = (1 - wy)*grid_sum[offset0 + i] + wy*grid_sum[offset1 + i];
+            row_weight[i] = (1 - wy)*grid_weight[offset0 + i] + wy*grid_weight[offset1 + i];
+        }
+
+        float *row = &img[image_idx(0, y, 0, width)];
+        for (unsigned x = 0; x < width; x++)
+            row_lum[x] = tm_log_lum(&row[3*x]);
+
+        for (unsigned x = 0; x < width; x++) {
+            float L = row_lum[x];
+            float fx = x * inv_cell;
+            float fz = (L - TM_LOG_MIN) * z_scale;
+            int x0 = fx;
+            int z0 = fz;
+            if (z0 > (int)gd - 2) z0 = gd - 2;
+            float wx = fx - x0;
+            float wz = fz - z0;
+
+            unsigned i = z0 + gd*x0;
+            const float *s = &row_sum[i];
+            const float *w = &row_weight[i];
+            float sum = (1 - wx)*((1 - wz)*s[0] + wz*s[1]) + wx*((1 - wz)*s[gd] + wz*s[gd + 1]);
+            float weight = (1 - wx)*((1 - wz)*w[0] + wz*w[1]) + wx*((1 - wz)*w[gd] + wz*w[gd + 1]);
+            float B = weight > 1e-6f ? sum / weight : L;
+            row_lum[x] = tm_exp2((c - 1) * B);
+        }
+
+        for (unsigned x = 0; x < width; x++) {
+            float gain = row_lum[x];
+            row[3*x] *= gain;
+            row[3*x + 1] *= gain;
+            row[3*x + 2] *= gain;
+        }
+    }
+
+cleanup:
+    free(grid_sum);
+    free(grid_weight);
+    free(temp);
+    free(row_sum);
+    free(row_weight);
+    free(row_lum);
+}
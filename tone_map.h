@@ -0,0 +1,25 @@
+#ifndef TONE_MAP_H
+#define TONE_MAP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Local tone mapping using a bilateral grid
+ *
+ * The base (large scale) log luminance of the image is estimated with a downsampled bilateral
+ * grid and compressed, while detail (log luminance minus base) is left alone. Only dark regions
+ * are brightened, so highlights are preserved.
+ *
+ * img is linear RGB in [0, 1], modified in place
+ * shadow is the approximate gain applied to regions 8 stops below white, 1 to 64
+ */
+void tone_map_local(float *img, uint16_t width, uint16_t height, float shadow);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TONE_MAP_H